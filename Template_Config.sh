@@ -45,6 +45,8 @@
 #HYDRO_MESHLESS_FINITE_MASS     # solve hydro using the mesh-free Lagrangian (fixed-mass) finite-volume Godunov method
 #HYDRO_MESHLESS_FINITE_VOLUME   # solve hydro using the mesh-free (quasi-Lagrangian) finite-volume Godunov method (control mesh motion with HYDRO_FIX_MESH_MOTION)
 #HYDRO_REGULAR_GRID             # solve hydro equations on a regular (recti-linear) Cartesian mesh (grid) with a finite-volume Godunov method
+#HYDRO_RIEMANN_BATCH            # MFM/MFV: collect the face states of each block of neighbors and solve their Riemann problems together (vectorized HLLC estimate, full solver only for the faces where it fails). pure hydro only (ignored with MHD, EOS_GENERAL, shearing boxes, or conduction/viscosity/turbulent-diffusion/explicit-RT-diffusion)
+#HYDRO_REUSE_GRADIENT_NGBLIST   # keep the neighbor lists found in the (last) gradient sweep and re-use them in the hydro flux loop for all particles whose search did not require an export, skipping the second tree walk (costs ~4 bytes per neighbor per active gas particle, limited by the free memory)
 ## -----------------------------------------------------------------------------------------------------
 # --------------------------------------- Options to explicitly control the mesh motion (for use with the MFV or grid solvers): only set for non-standard behavior
 #HYDRO_FIX_MESH_MOTION=0        # mesh with arbitrarily-defined mesh-generating velocities: (0=non-moving, 1=fixed-v [set in ICs] cartesian, 2=fixed-v [ICs] cylindrical, 3=fixed-v [ICs] spherical, 4=analytic function, 5=smoothed-Lagrangian, 6=glass-generating, 7=fully-Lagrangian)
@@ -60,6 +62,7 @@
 # --------------------------------------- Kernel Options
 #KERNEL_FUNCTION=3              # Choose the kernel function (2=quadratic peak, 3=cubic spline [default], 4=quartic spline, 5=quintic spline, 6=Wendland C2, 7=Wendland C4, 8=2-part quadratic)
 #KERNEL_CRK_FACES               # Use the consistent reproducing kernel [higher-order tensor corrections to kernel above, compared to our usual matrix formalism] from Frontiere, Raskin, and Owen to define the faces in MFM/MFV methods. can give more accurate closure, potentially improved accuracy in MHD problems. remains experimental for now.
+#KERNEL_TABLE                   # evaluate the hydro and softened-gravity kernels by linear interpolation in high-resolution lookup tables (built at startup from the exact expressions) instead of the polynomials: faster on most machines, agrees with the exact kernel to ~1e-6 (~1e-3 in dW/du at the break of KERNEL_FUNCTION=8)
 ####################################################################################################
 
 
@@ -101,6 +104,9 @@
 #COOLING                        # enables radiative cooling and heating: if GALSF, also external UV background read from file "TREECOOL" (included in the cooling folder)
 #COOL_LOW_TEMPERATURES          # allow fine-structure and molecular cooling to ~10 K; account for optical thickness and line-trapping effects with proper opacities
 #COOL_METAL_LINES_BY_SPECIES    # use full multi-species-dependent cooling tables ( http://www.tapir.caltech.edu/~phopkins/public/spcool_tables.tgz, or the Bitbucket site); requires METALS on; cite Wiersma et al. 2009 (MNRAS, 393, 99) in addition to Hopkins et al. 2017 (arXiv:1702.06148)
+#COOLING_SUBCYCLE               # integrate the cooling with a few explicit sub-steps when the rate is slow, else a Newton solve of the implicit step seeded by the per-element rate derivative cached from its last step (bisection only as fall-back); caches the cooling time in SphP
+#COOL_METAL_LINES_SHARED_TABLES # hold the COOL_METAL_LINES_BY_SPECIES tables once per node in MPI-3 shared memory (one task reads them, and pre-fetches the next redshift slice in a background thread)
+#COOL_EQUILIBRIUM_TABLE         # interpolate the equilibrium H+He ionization states from a (T,nH) table (rebuilt as the UV background evolves) instead of iterating for them in every rate evaluation (no effect with RT_CHEM_PHOTOION or COOL_GRACKLE)
 #COOL_GRACKLE                   # enable Grackle: cooling+chemistry package (requires COOLING above; https://grackle.readthedocs.org/en/latest ); see Grackle code for their required citations
 #COOL_GRACKLE_CHEMISTRY=1       # choose Grackle cooling chemistry: (0)=tabular, (1)=Atomic, (2)=(1)+H2+H2I+H2II, (3)=(2)+DI+DII+HD
 #METALS                         # enable metallicities (with multiple species optional) for gas and stars [must be included in ICs or injected via dynamical feedback; needed for some routines]
@@ -186,6 +192,8 @@
 #FOF_SECONDARY_LINK_TYPES=1+16+32   # 2^type for the types linked to nearest primaries
 #FOF_DENSITY_SPLIT_TYPES=1+2+16+32  # 2^type for whch the densities should be calculated seperately
 #FOF_GROUP_MIN_LEN=32               # default is 32
+#FOF_SUBHALOS                       # in-situ subhalo finder (density peaks, saddle points, and gravitational unbinding) run on the FoF groups of every group catalogue; writes subhalo_tab files next to the group_tab files
+#FOF_SUBHALOS_MIN_LEN=20            # minimum number of bound particles of a subhalo (default 20)
 ####################################################################################################
 
 
@@ -350,12 +358,22 @@
 #OUTPUT_LINEOFSIGHT				# enables on-the-fly output of Ly-alpha absorption spectra
 #OUTPUT_LINEOFSIGHT_SPECTRUM    # computes power spectrum of these (requires additional code integration)
 #OUTPUT_LINEOFSIGHT_PARTICLES   # computes power spectrum of these (requires additional code integration)
+#OUTPUT_LINEOFSIGHT_NLOS=1000   # number of random sightlines per line-of-sight output (default 10); they are processed in batches, walking the tree once per bundle of rays
 #OUTPUT_POWERSPEC               # compute and output power spectra (not used)
+#OUTPUT_POWERSPEC_EACH_TYPE     # (with OUTPUT_POWERSPEC) also output the power spectrum of each particle type separately
+#OUTPUT_POWERSPEC_CROSS         # (with OUTPUT_POWERSPEC) also output gas/dark matter/star auto- and cross-spectra (interlaced TSC: one extra PM-size grid at output time, no forcegrid)
+#POWERSPEC_FOLD_LEVELS=2        # (with OUTPUT_POWERSPEC) number of folding levels measured per spectrum: factors 1,POWERSPEC_FOLDFAC,... (default 2, POWERSPEC_FOLDFAC=32)
 #OUTPUT_RECOMPUTE_POTENTIAL     # update potential every output even it EVALPOTENTIAL is set
+#OUTPUT_STREAMS                 # write additional lightweight outputs every N timesteps (selected fields+particle types, within a region and/or a random ID-based subsample), defined in the file OutputStreamsFile set in the parameterfile
+#IO_PARALLEL_IC_READ            # for HDF5 ICs (ICFormat=3): every task opens its file and reads its own hyperslab of each block directly, instead of one task per file reading and scattering via MPI (may need HDF5_USE_FILE_LOCKING=FALSE on some filesystems)
 #INPUT_READ_HSML                # force reading hsml from IC file (instead of re-computing them; in general this is redundant but useful if special guesses needed)
 #OUTPUT_TWOPOINT_ENABLED        # allows user to calculate mass 2-point function by enabling and setting restartflag=5
+#OUTPUT_TWOPOINT_MULTIPOLES     # (with OUTPUT_TWOPOINT_ENABLED) also compute the redshift-space monopole/quadrupole/hexadecapole (line-of-sight along z) in the same pass
 #IO_DISABLE_HDF5                # disable HDF5 I/O support (for both reading/writing; use only if HDF5 not install-able)
 #IO_COMPRESS_HDF5     		    # write HDF5 in compressed form (will slow down snapshot I/O and may cause issues on old machines, but reduce snapshots 2x)
+#IO_COMPRESS_HDF5_LOSSY         # (implies IO_COMPRESS_HDF5) additionally quantize snapshot positions/velocities to the absolute tolerances SnapCompressionPosTolerance/SnapCompressionVelTolerance set in the parameterfile (lossy!)
+#IO_RESTART_MPIIO               # write restart files as a single shared file with MPI-IO (with checksums); these can be read back on a different number of MPI tasks
+#IO_ASYNC_OUTPUT                # stage snapshot+restart files in memory and write them to disk from a background thread while the run continues (needs enough memory on each writing task to hold its full file; increase NumFilesPerSnapshot if needed)
 ####################################################################################################
 
 
@@ -412,6 +430,7 @@
                                 #   chosen as default at compile of fftw). Otherwise, the type prefix 'd' for double is used.
 #USE_FFTW3                      # enables FFTW3 (can be used with DOUBLEPRECISION_FFTW) 
 #DOUBLEPRECISION_FFTW           # FFTW in double precision to match libraries
+#USE_FFTW_WISDOM                # create FFTW plans with FFTW_MEASURE and cache the wisdom in OutputDir (per FFTW version/precision/task count), so only the first job of a campaign pays for the planning
 # --------------------
 # ----- Load-Balancing
 #ALLOW_IMBALANCED_GASPARTICLELOAD # increases All.MaxPartSph to All.MaxPart: can allow better load-balancing in some cases, but uses more memory. But use me if you run into errors where it can't fit the domain (where you would increase PartAllocFac, but can't for some reason)
@@ -46,6 +46,11 @@ MyDouble Shearing_Box_Vel_Offset;
 MyDouble Shearing_Box_Pos_Offset;
 #endif
 
+#ifdef KERNEL_TABLE
+double Kernel_Table[KERNEL_TABLE_N+1][2];
+double Kernel_Table_Grav[KERNEL_TABLE_N+1][3];
+#endif
+
 
 #ifdef FIX_PATHSCALE_MPI_STATUS_IGNORE_BUG
 MPI_Status mpistat;
@@ -85,6 +90,8 @@ int TakeLevel;
 
 int FirstActiveParticle;
 int *NextActiveParticle;
+int NumActiveParticle;
+int *ActiveParticleList;
 unsigned char *ProcessedFlag;
 
 int TimeBinCount[TIMEBINS];
@@ -146,6 +153,9 @@ int Flag_FullStep;		/*!< Flag used to signal that the current step involves all
 
 
 int TreeReconstructFlag;
+#ifdef WAKEUP
+int WakeupFlagsPending = 1;
+#endif
 int GlobFlag;
 
 
@@ -171,6 +181,13 @@ int *Ngblist;			/*!< Buffer to hold indices of neighbours retrieved by the neigh
 				   routines */
 double *R2ngblist;
 
+#ifdef HYDRO_REUSE_GRADIENT_NGBLIST
+int *HydroNgbCache_Num = NULL;
+int *HydroNgbCache_Offset;
+int *HydroNgbCache_List;
+long long HydroNgbCache_Used, HydroNgbCache_Size;
+#endif
+
 double DomainCorner[3], DomainCenter[3], DomainLen, DomainFac;
 int *DomainStartList, *DomainEndList;
 
@@ -51,6 +51,12 @@
 #define HAVE_HDF5
 #include <hdf5.h>
 #endif
+#if defined(IO_COMPRESS_HDF5_LOSSY) && !defined(IO_COMPRESS_HDF5)
+#define IO_COMPRESS_HDF5        /* lossy quantization of positions/velocities is built on top of the lossless per-block compression */
+#endif
+#ifdef IO_COMPRESS_HDF5
+#define IO_COMPRESS_HDF5_CHUNKSIZE 65536 /* maximum number of particles per compressed HDF5 chunk */
+#endif
 
 
 
@@ -97,6 +103,18 @@
 
 
 
+/* planner rigor for all FFTW plans: measured plans only pay off if their wisdom is cached across jobs (USE_FFTW_WISDOM) */
+#ifdef USE_FFTW_WISDOM
+#ifdef USE_FFTW3
+#define FFTW_PLAN_RIGOR FFTW_MEASURE
+#else
+#define FFTW_PLAN_RIGOR (FFTW_MEASURE | FFTW_USE_WISDOM)
+#endif
+#else
+#define FFTW_PLAN_RIGOR FFTW_ESTIMATE
+#endif
+
+
 #ifdef PMGRID
 #define PM_ENLARGEREGION 1.1    /* enlarges PMGRID region as the simulation evolves */
 /*
@@ -1035,6 +1053,12 @@ extern MyDouble Shearing_Box_Vel_Offset;
 extern MyDouble Shearing_Box_Pos_Offset;
 #endif
 
+#ifdef KERNEL_TABLE
+#define KERNEL_TABLE_N 2048 /* number of intervals in u=[0,1] for the tabulated kernels (power of 2; tables are filled by kernel_table_init in kernel.h) */
+extern double Kernel_Table[KERNEL_TABLE_N+1][2]; /* w(u), dw/du of the (un-normalized) hydro kernel */
+extern double Kernel_Table_Grav[KERNEL_TABLE_N+1][3]; /* softened gravity kernel for modes +1, -1, 0 */
+#endif
+
 
 /****************************************************************************************************************************/
 /* Here we define the box-wrapping macros NEAREST_XYZ and NGB_PERIODIC_BOX_LONG_X,NGB_PERIODIC_BOX_LONG_Y,NGB_PERIODIC_BOX_LONG_Z. 
@@ -1107,6 +1131,8 @@ z=((z)>boxHalf_Z)?((z)-boxSize_Z):(((z)<-boxHalf_Z)?((z)+boxSize_Z):(z)))
 
 extern int FirstActiveParticle;
 extern int *NextActiveParticle;
+extern int NumActiveParticle;       /*!< number of entries in ActiveParticleList */
+extern int *ActiveParticleList;     /*!< indices of the active particles (the same set, in the same order, as the FirstActiveParticle/NextActiveParticle chain) */
 extern unsigned char *ProcessedFlag;
 
 extern int TimeBinCount[TIMEBINS];
@@ -1186,6 +1212,9 @@ extern size_t HighMark_turbpower;
 #endif
 
 extern int TreeReconstructFlag;
+#ifdef WAKEUP
+extern int WakeupFlagsPending;      /*!< set whenever a local particle is flagged for wake-up; process_wake_ups only sweeps the particles while this is set */
+#endif
 extern int GlobFlag;
 
 extern char DumpFlag;
@@ -1214,6 +1243,13 @@ extern int *Ngblist;		/*!< Buffer to hold indices of neighbours retrieved by the
 
 extern double *R2ngblist;
 
+#ifdef HYDRO_REUSE_GRADIENT_NGBLIST
+extern int *HydroNgbCache_Num;      /*!< number of cached neighbors of each gas particle (-1 if not cached, -2 if the search needed an export) */
+extern int *HydroNgbCache_Offset;   /*!< start of the cached neighbor list of each gas particle in HydroNgbCache_List */
+extern int *HydroNgbCache_List;     /*!< neighbor lists from the last gradient sweep, re-used by the hydro loop */
+extern long long HydroNgbCache_Used, HydroNgbCache_Size;
+#endif
+
 extern double DomainCorner[3], DomainCenter[3], DomainLen, DomainFac;
 extern int *DomainStartList, *DomainEndList;
 
@@ -1358,6 +1394,13 @@ extern struct global_data_all_processes
   int NumFilesWrittenInParallel;	/*!< maximum number of files that may be written simultaneously when
                                      writing/reading restart-files, or when writing snapshot files */
   double BufferSize;		/*!< size of communication buffer in MB */
+#ifdef IO_COMPRESS_HDF5_LOSSY
+  double SnapCompressionPosTolerance;	/*!< absolute error tolerance for quantized snapshot positions (code units; 0=lossless) */
+  double SnapCompressionVelTolerance;	/*!< absolute error tolerance for quantized snapshot velocities (snapshot units; 0=lossless) */
+#endif
+#ifdef OUTPUT_STREAMS
+  char OutputStreamsFile[100];	/*!< file defining the lightweight (field-selected/subsampled) output streams */
+#endif
   int BunchSize;     	        /*!< number of particles fitting into the buffer in the parallel tree algorithm  */
 
   double PartAllocFactor;	/*!< in order to maintain work-load balance, the particle load will usually
@@ -2132,6 +2175,12 @@ extern struct sph_particle_data
   MyFloat Ne;  /*!< electron fraction, expressed as local electron number
 		    density normalized to the hydrogen number density. Gives
 		    indirectly ionization state and mean molecular weight. */
+#ifdef COOLING_SUBCYCLE
+  MyFloat CoolingTime;              /*!< cooling time at the end of the last cooling step (0 if net heating) */
+  MyFloat CoolingJacobian;          /*!< d(du/dt)/du (physical cgs) at the end of the last cooling step: seeds the next solve */
+  MyFloat CoolingCache_u;           /*!< specific internal energy (code units) at which CoolingTime was evaluated */
+  integertime CoolingCache_Ti;      /*!< time (integer timeline) at which the cooling state above was cached */
+#endif
 #endif
 #ifdef GALSF
   MyFloat Sfr;                      /*!< particle star formation rate */
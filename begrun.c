@@ -103,6 +103,10 @@ void begrun(void)
   set_units();
   set_cosmo_factors_for_current_time();
   All.Time = All.TimeBegin;
+
+#ifdef KERNEL_TABLE
+  kernel_table_init();
+#endif
     
 #ifdef COOLING
   InitCool();
@@ -204,6 +208,13 @@ void begrun(void)
       All.TimeLimitCPU = all.TimeLimitCPU;
       All.ResubmitOn = all.ResubmitOn;
       All.SnapFormat = all.SnapFormat;
+#ifdef IO_COMPRESS_HDF5_LOSSY
+      All.SnapCompressionPosTolerance = all.SnapCompressionPosTolerance;
+      All.SnapCompressionVelTolerance = all.SnapCompressionVelTolerance;
+#endif
+#ifdef OUTPUT_STREAMS
+      strcpy(All.OutputStreamsFile, all.OutputStreamsFile);
+#endif
       All.TimeBetSnapshot = all.TimeBetSnapshot;
       All.TimeBetStatistics = all.TimeBetStatistics;
       All.CpuTimeBetRestartFile = all.CpuTimeBetRestartFile;
@@ -1069,6 +1080,22 @@ void read_parameter_file(char *fname)
       addr[nt] = &All.SnapFormat;
       id[nt++] = INT;
 
+#ifdef IO_COMPRESS_HDF5_LOSSY
+      strcpy(tag[nt], "SnapCompressionPosTolerance");
+      addr[nt] = &All.SnapCompressionPosTolerance;
+      id[nt++] = REAL;
+
+      strcpy(tag[nt], "SnapCompressionVelTolerance");
+      addr[nt] = &All.SnapCompressionVelTolerance;
+      id[nt++] = REAL;
+#endif
+
+#ifdef OUTPUT_STREAMS
+      strcpy(tag[nt], "OutputStreamsFile");
+      addr[nt] = All.OutputStreamsFile;
+      id[nt++] = STRING;
+#endif
+
       strcpy(tag[nt], "NumFilesPerSnapshot");
       addr[nt] = &All.NumFilesPerSnapshot;
       id[nt++] = INT;
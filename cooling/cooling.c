@@ -6,6 +6,9 @@
 
 #include "../allvars.h"
 #include "../proto.h"
+#ifdef COOL_METAL_LINES_SHARED_TABLES
+#include <pthread.h>
+#endif
 
 #include "./cooling.h"
 
@@ -35,47 +38,72 @@ static double *BetaH0, *BetaHep, *Betaff, *AlphaHp, *AlphaHep, *Alphad, *AlphaHe
 /* if this is enabled, the cooling table files should be in a folder named 'spcool_tables' in the run directory.
  cooling tables can be downloaded at: http://www.tapir.caltech.edu/~phopkins/public/spcool_tables.tgz or on the Bitbucket site (downloads section) */
 static float *SpCoolTable0, *SpCoolTable1;
+static int SpCoolTable0_iT = -1, SpCoolTable1_iT = -1; /* redshift slices currently held in the two tables (-1=none) */
+#define SPCOOL_N_NH 41 /* dimensions of each species table: density and temperature bins */
+#define SPCOOL_N_T 176
+#define SPCOOL_TABLE_SIZE ((long)(NUM_METAL_SPECIES-1) * SPCOOL_N_NH * SPCOOL_N_T)
+#ifdef COOL_METAL_LINES_SHARED_TABLES
+/* the tables are held once per node in MPI shared-memory windows; one task (task 0) reads the files, and pre-fetches the next
+    redshift slice in a background thread so it is available from memory when the run reaches it */
+static MPI_Comm SpCool_NodeComm, SpCool_LeaderComm;
+static MPI_Win SpCool_Win[2];
+static pthread_t SpCool_PrefetchThread;
+static float *SpCool_PrefetchBuf = NULL;
+static int SpCool_Prefetch_iT = -1, SpCool_Prefetch_ok = 0, SpCool_NWin = 0;
+static char SpCool_Prefetch_fname[100];
+#endif
 #endif
 /* these are constants of the UV background at a given redshift: they are interpolated from TREECOOL but then not modified particle-by-particle */
 static double J_UV = 0, gJH0 = 0, gJHep = 0, gJHe0 = 0, epsH0 = 0, epsHep = 0, epsHe0 = 0;
+/* particle-independent terms which depend only on the UV background and redshift: set once per timestep in set_cooling_redshift_terms() */
+static double NH_SS_UV = NH_SS, Compton_prefac = 0, T_CMB_z = 0;
+
+#if defined(COOL_EQUILIBRIUM_TABLE) && !defined(RT_CHEM_PHOTOION) && !defined(COOL_GRACKLE)
+#define COOL_EQTAB_ACTIVE /* the table is only meaningful if the ionization states are in equilibrium and set only by (T, nH) and the UV background */
+/* table of equilibrium ionization states on a grid in (log T, log nH), for the current UV background. rebuilt (locally on each task)
+    whenever the photo-ionization rates have changed appreciably; the exact iteration is used outside the table */
+#define COOL_EQTAB_DLOGT        0.025   /* grid spacing in log10(T/K): the grid starts at Tmin and extends past Tmax */
+#define COOL_EQTAB_LOGNH_MIN    (-9.0)  /* range and spacing of the grid in log10(nH/cm^-3) */
+#define COOL_EQTAB_LOGNH_MAX    4.0
+#define COOL_EQTAB_DLOGNH       0.05
+#define COOL_EQTAB_NVAR         5       /* tabulated: n_elec, nH0, nHe0, nHep, nHepp (all in units of nH, for primordial helium abundance) */
+#define COOL_EQTAB_REBUILD_TOL  0.005   /* rebuild when any photo-ionization rate has changed by more than this fraction */
+#define COOL_EQTAB_MAX_DYHE     0.05    /* helium abundances are rescaled if within this fraction of primordial; otherwise use the exact iteration */
+static double *CoolEqTab = NULL, CoolEqTab_gJH0 = -1, CoolEqTab_gJHe0 = -1, CoolEqTab_gJHep = -1;
+static int CoolEqTab_NT = 0, CoolEqTab_NnH = 0, CoolEqTab_ready = 0;
+#endif
 
 
 
-/* this is just a simple loop to do the particle cooling. this is now openmp-parallelized, since the cooling iteration can be a non-negligible cost */
+/* this is the parent loop for the particle cooling. the active gas elements which need to be cooled are first gathered into a list,
+    then the (independent, and often expensive) per-element cooling solves are done as one batch; with OpenMP this batch is shared
+    dynamically among the threads. everything particle-independent (the UV background and other redshift-dependent terms) is set
+    once per timestep in IonizeParams(), so these are only read inside the loop, and all per-element state lives in local variables */
 void cooling_parent_routine(void)
 {
-    NextParticle = FirstActiveParticle;
-/*
-#ifdef _OPENMP
-#pragma omp parallel // static variables above causing problems with openmp shared memory (getting swapped) on some compilers: demote for now
-#endif
-*/
+    int i, n, N_cool = 0, *CoolList;
+    CoolList = (int *) mymalloc("CoolList", NumPart * sizeof(int));
+    for(n = 0; n < NumActiveParticle; n++)
     {
-        while(1)
-        {
-            int i, exitFlag = 0;
-/*
-#ifdef _OPENMP
-#pragma omp critical(_nexport_)
-#endif
-*/
-            {
-                if(NextParticle<0) {exitFlag = 1;} else {i=NextParticle; NextParticle=NextActiveParticle[NextParticle];}
-            }
-            if(exitFlag) {break;}
-
-            /* here apply any conditional statements about whether we should or should not enter the cooling loop */
-            if(P[i].Type != 0) {continue;} /* only gas cools */
-            if(P[i].Mass <= 0) {continue;} /* only non-zero mass particles cool */
+        i = ActiveParticleList[n];
+        /* here apply any conditional statements about whether we should or should not enter the cooling loop */
+        if(P[i].Type != 0) {continue;} /* only gas cools */
+        if(P[i].Mass <= 0) {continue;} /* only non-zero mass particles cool */
 #ifdef GALSF_EFFECTIVE_EQS
-            if((SphP[i].Density*All.cf_a3inv > All.PhysDensThresh) && ((All.ComovingIntegrationOn==0) || (SphP[i].Density>=All.OverDensThresh))) {continue;} /* no cooling for effective-eos star-forming particles */
+        if((SphP[i].Density*All.cf_a3inv > All.PhysDensThresh) && ((All.ComovingIntegrationOn==0) || (SphP[i].Density>=All.OverDensThresh))) {continue;} /* no cooling for effective-eos star-forming particles */
 #endif
 #ifdef GALSF_FB_TURNOFF_COOLING
-            if(SphP[i].DelayTimeCoolingSNe > 0) {continue;} /* no cooling for particles marked in delayed cooling */
+        if(SphP[i].DelayTimeCoolingSNe > 0) {continue;} /* no cooling for particles marked in delayed cooling */
 #endif
-            do_the_cooling_for_particle(i);
-        } /* while bracket */
-    } /* omp bracket */
+        CoolList[N_cool++] = i;
+    }
+
+#if defined(_OPENMP) && !defined(COOL_GRACKLE) /* grackle keeps its own (non-thread-safe) internal state */
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+    for(n = 0; n < N_cool; n++) {do_the_cooling_for_particle(CoolList[n]);}
+
+    myfree(CoolList);
 }
 
 /* subroutine which actually sends the particle data to the cooling routine and updates the entropies */
@@ -159,35 +187,12 @@ void do_the_cooling_for_particle(int i)
 
 
 
-/* returns new internal energy per unit mass. 
- * Arguments are passed in code units, density is proper density.
- */
-double DoCooling(double u_old, double rho, double dt, double ne_guess, int target)
+/* solves the implicit (backward-Euler) energy equation u = u_old + ratefact*Lambda(u)*dt for u by bracketing and bisection.
+    all quantities in physical cgs units */
+static double cooling_solve_implicit_bisection(double u_old, double rho, double dt, double ne_guess, int target, double ratefact)
 {
-    double u, du, u_lower, u_upper, ratefact, LambdaNet;
+    double u, du, u_lower, u_upper, LambdaNet;
     int iter=0, iter_upper=0, iter_lower=0;
-    
-#ifdef COOL_GRACKLE
-#ifndef COOLING_OPERATOR_SPLIT
-    /* call grackle with hydro heating */
-    double udot = SphP[target].DtInternalEnergy / (All.HubbleParam * All.UnitEnergy_in_cgs / (All.UnitMass_in_g * All.UnitTime_in_s) * (PROTONMASS/HYDROGEN_MASSFRAC)); // in erg/s/g as required by Grackle specific_heating_rate
-    u = CallGrackle(u_old, rho, dt, ne_guess, udot, target, 0);
-#else
-    /* with full operator splitting we just call grackle without hydro heating. note this is usually fine,
-     but can lead to artificial noise at high densities and low temperatures, especially if something
-     like artificial pressure (but not temperature) floors are used such that the temperature gets
-     'contaminated' by the pressure terms */
-    u = CallGrackle(u_old, rho, dt, ne_guess, 0.0, target, 0);
-#endif
-    return DMAX(u,All.MinEgySpec);
-#endif
-
-    rho *= All.UnitDensity_in_cgs * All.HubbleParam * All.HubbleParam;	/* convert to physical cgs units */
-    u_old *= All.UnitPressure_in_cgs / All.UnitDensity_in_cgs;
-    dt *= All.UnitTime_in_s / All.HubbleParam;
-    double nHcgs = HYDROGEN_MASSFRAC * rho / PROTONMASS;	/* hydrogen number dens in cgs units */
-    ratefact = nHcgs * nHcgs / rho;
-
     u = u_old; u_lower = u; u_upper = u; /* initialize values */
     LambdaNet = CoolingRateFromU(u, rho, ne_guess, target);
 
@@ -224,6 +229,118 @@ double DoCooling(double u_old, double rho, double dt, double ne_guess, int targe
     while(((fabs(du/u) > 3.0e-2)||((fabs(du/u) > 3.0e-4)&&(iter < 10))) && (iter < MAXITER)); /* iteration condition */
     /* crash condition */
     if(iter >= MAXITER) {printf("failed to converge in DoCooling(): u_in=%g rho_in=%g dt=%g ne_in=%g target=%d \n",u_old,rho,dt,ne_guess,target); endrun(10);}
+    return u;
+}
+
+
+#ifdef COOLING_SUBCYCLE
+#define COOL_SUBCYCLE_DU_EXPLICIT   0.02    /* maximum fractional change of u in one explicit sub-step */
+#define COOL_SUBCYCLE_MAX_EXPLICIT  4       /* maximum number of explicit sub-steps: beyond this the (rest of the) step is done implicitly */
+#define COOL_SUBCYCLE_NEWTON_TOL    1.0e-3  /* fractional convergence tolerance in u of the Newton iteration */
+#define COOL_SUBCYCLE_NEWTON_MAXITER 30
+
+/* integrates du/dt = ratefact*Lambda(u) over dt. if the rate is slow compared to dt, this takes up to a few explicit
+    (linearly-implicit in the Jacobian) sub-steps; otherwise the remainder of the step is done with the same backward-Euler
+    equation as the bisection above, but solved by a Newton iteration with secant updates of the Jacobian, which is seeded
+    with the value cached from this element's previous cooling step. the rate, Jacobian, and cooling time at the end of the
+    step are cached in SphP. returns the new u, or -1 if the Newton iteration failed (then the bisection is used instead).
+    all quantities in physical cgs units */
+static double cooling_subcycle_integrate(double u_old, double rho, double dt, double ne_guess, int target, double ratefact)
+{
+    int n_sub = 0, iter = 0;
+    double u = u_old, t_left = dt, J = 0, f, f_prev, u_prev, u_start, dt_sub, g, du, denom;
+    if(target >= 0) {if(SphP[target].CoolingCache_Ti >= 0) {J = SphP[target].CoolingJacobian;}}
+    f = ratefact * CoolingRateFromU(u, rho, ne_guess, target);
+
+    /* explicit sub-steps, as long as the whole step can be covered by a few of them */
+    while(t_left > 0)
+    {
+        dt_sub = COOL_SUBCYCLE_DU_EXPLICIT * u / (fabs(f) + MIN_REAL_NUMBER);
+        if(dt_sub * (COOL_SUBCYCLE_MAX_EXPLICIT - n_sub) < t_left) {break;} /* would need too many sub-steps */
+        if(dt_sub > t_left) {dt_sub = t_left;}
+        u_prev = u; f_prev = f;
+        u += dt_sub * f / (1. - dt_sub * DMIN(J, 0));
+        t_left -= dt_sub; n_sub++;
+        f = ratefact * CoolingRateFromU(u, rho, ne_guess, target);
+        if(u != u_prev) {J = (f - f_prev) / (u - u_prev);}
+    }
+
+    /* implicit (backward-Euler) step for the remainder */
+    if(t_left > 0)
+    {
+        u_start = u; u_prev = u; f_prev = f;
+        u = u_start + t_left * f / (1. - t_left * DMIN(J, 0)); /* first guess: linearized step with the current Jacobian */
+        if(u < 0.1 * u_start) {u = 0.1 * u_start;}
+        if(u > 10. * u_start) {u = 10. * u_start;}
+        for(iter = 0; iter < COOL_SUBCYCLE_NEWTON_MAXITER; iter++)
+        {
+            f = ratefact * CoolingRateFromU(u, rho, ne_guess, target);
+            if(u != u_prev) {J = (f - f_prev) / (u - u_prev);}
+            g = u - u_start - t_left * f;
+            denom = 1. - t_left * J;
+            if(!(denom > 0) || !isfinite(g)) {return -1;} /* rate rising steeply with u (thermally unstable): the root may not be unique, use the bisection */
+            du = -g / denom;
+            if(du < -0.5 * u) {du = -0.5 * u;}
+            if(du > u) {du = u;}
+            u_prev = u; f_prev = f;
+            u += du;
+            if(fabs(du) < COOL_SUBCYCLE_NEWTON_TOL * u) {break;}
+        }
+        if(iter >= COOL_SUBCYCLE_NEWTON_MAXITER) {return -1;}
+        f = f_prev;
+    }
+
+    if(target >= 0)
+    {
+        double f_rad = f; /* radiative part of the rate only, for the cooling time */
+#ifndef COOLING_OPERATOR_SPLIT
+        f_rad -= ratefact * SphP[target].DtInternalEnergy / (HYDROGEN_MASSFRAC * rho / PROTONMASS);
+#endif
+        SphP[target].CoolingJacobian = J;
+        SphP[target].CoolingTime = (f_rad < 0) ? (u / (-f_rad)) * All.HubbleParam / All.UnitTime_in_s : 0;
+        SphP[target].CoolingCache_u = u * All.UnitDensity_in_cgs / All.UnitPressure_in_cgs;
+        SphP[target].CoolingCache_Ti = All.Ti_Current;
+    }
+    return u;
+}
+#endif
+
+
+/* returns new internal energy per unit mass. 
+ * Arguments are passed in code units, density is proper density.
+ */
+double DoCooling(double u_old, double rho, double dt, double ne_guess, int target)
+{
+    double u, ratefact;
+    
+#ifdef COOL_GRACKLE
+#ifndef COOLING_OPERATOR_SPLIT
+    /* call grackle with hydro heating */
+    double udot = SphP[target].DtInternalEnergy / (All.HubbleParam * All.UnitEnergy_in_cgs / (All.UnitMass_in_g * All.UnitTime_in_s) * (PROTONMASS/HYDROGEN_MASSFRAC)); // in erg/s/g as required by Grackle specific_heating_rate
+    u = CallGrackle(u_old, rho, dt, ne_guess, udot, target, 0);
+#else
+    /* with full operator splitting we just call grackle without hydro heating. note this is usually fine,
+     but can lead to artificial noise at high densities and low temperatures, especially if something
+     like artificial pressure (but not temperature) floors are used such that the temperature gets
+     'contaminated' by the pressure terms */
+    u = CallGrackle(u_old, rho, dt, ne_guess, 0.0, target, 0);
+#endif
+    return DMAX(u,All.MinEgySpec);
+#endif
+
+    rho *= All.UnitDensity_in_cgs * All.HubbleParam * All.HubbleParam;	/* convert to physical cgs units */
+    u_old *= All.UnitPressure_in_cgs / All.UnitDensity_in_cgs;
+    dt *= All.UnitTime_in_s / All.HubbleParam;
+    double nHcgs = HYDROGEN_MASSFRAC * rho / PROTONMASS;	/* hydrogen number dens in cgs units */
+    ratefact = nHcgs * nHcgs / rho;
+
+#ifdef COOLING_SUBCYCLE
+    /* explicit sub-steps or a Newton iteration seeded with this element's cached rate and Jacobian; the bracketed bisection is only needed if that fails */
+    u = cooling_subcycle_integrate(u_old, rho, dt, ne_guess, target, ratefact);
+    if(u <= 0) {u = cooling_solve_implicit_bisection(u_old, rho, dt, ne_guess, target, ratefact);}
+#else
+    u = cooling_solve_implicit_bisection(u_old, rho, dt, ne_guess, target, ratefact);
+#endif
     double specific_energy_codeunits_toreturn = u * All.UnitDensity_in_cgs / All.UnitPressure_in_cgs;    /* in internal units */
     
 #ifdef RT_CHEM_PHOTOION
@@ -252,6 +369,10 @@ double GetCoolingTime(double u_old, double rho, double ne_guess, int target)
     if(LambdaNet >= 0) LambdaNet = 0.0;
     return LambdaNet * All.HubbleParam / All.UnitTime_in_s;
 #else
+#ifdef COOLING_SUBCYCLE
+    /* re-use the cooling time cached in the last cooling step, if this is the same element in the same state */
+    if(target >= 0) {if((SphP[target].CoolingCache_Ti == All.Ti_Current) && (fabs(u_old - SphP[target].CoolingCache_u) <= 1.0e-6 * u_old)) {return SphP[target].CoolingTime;}}
+#endif
     rho *= All.UnitDensity_in_cgs * All.HubbleParam * All.HubbleParam;	/* convert to physical cgs units */
     u_old *= All.UnitPressure_in_cgs / All.UnitDensity_in_cgs;
     double nHcgs = HYDROGEN_MASSFRAC * rho / PROTONMASS;	/* hydrogen number dens in cgs units */
@@ -387,6 +508,32 @@ double convert_u_to_temp(double u, double rho, int target, double *ne_guess, dou
     return temp;
 }
 
+#ifdef COOL_EQTAB_ACTIVE
+/* bilinear interpolation of the equilibrium ionization states in the (log T, log nH) table. returns 0 (and the caller
+    falls back to the exact iteration) if the point is outside the table, or the table does not apply to this element */
+static int cooling_eqtab_lookup(double logT, double nHcgs, double shieldfac_input, int target, double *ne, double *nH0, double *nHp, double *nHe0, double *nHep, double *nHepp)
+{
+    int k, ix, iy;
+    double x, y, fx, fy, v[COOL_EQTAB_NVAR], *t00, *t01, *t10, *t11, fHe;
+    if(!CoolEqTab_ready || !(nHcgs > 0)) {return 0;}
+#ifdef COOL_LOW_TEMPERATURES
+    if((shieldfac_input >= 0) && (logT < Tmin+1)) {return 0;} /* the self-shielding factor passed in differs from the tabulated one here */
+#endif
+    fHe = yhelium(target) / YHELIUM_0;
+    if(fabs(fHe - 1) > COOL_EQTAB_MAX_DYHE) {return 0;}
+    x = (logT - Tmin) / COOL_EQTAB_DLOGT;
+    y = (log10(nHcgs) - COOL_EQTAB_LOGNH_MIN) / COOL_EQTAB_DLOGNH;
+    if((x < 0) || (y < 0) || (x >= CoolEqTab_NT - 1) || (y >= CoolEqTab_NnH - 1)) {return 0;}
+    ix = (int) x; iy = (int) y; fx = x - ix; fy = y - iy;
+    t00 = &CoolEqTab[COOL_EQTAB_NVAR * (ix * CoolEqTab_NnH + iy)]; t01 = t00 + COOL_EQTAB_NVAR;
+    t10 = t00 + COOL_EQTAB_NVAR * CoolEqTab_NnH; t11 = t10 + COOL_EQTAB_NVAR;
+    for(k = 0; k < COOL_EQTAB_NVAR; k++) {v[k] = (1-fx) * ((1-fy) * t00[k] + fy * t01[k]) + fx * ((1-fy) * t10[k] + fy * t11[k]);}
+    *nH0 = v[1]; *nHp = 1. - v[1]; *nHe0 = fHe * v[2]; *nHep = fHe * v[3]; *nHepp = fHe * v[4];
+    *ne = v[0] + (fHe - 1) * (v[3] + 2. * v[4]); /* correct the electron abundance for the (slightly) different helium abundance */
+    return 1;
+}
+#endif
+
 /* this function computes the actual ionization states, relative abundances, and returns the ionization/recombination rates if needed */
 double find_abundances_and_rates(double logT, double rho, int target, double shieldfac, int return_cooling_mode,
                                  double *ne_guess, double *nH0_guess, double *nHp_guess, double *nHe0_guess, double *nHep_guess, double *nHepp_guess)
@@ -395,6 +542,7 @@ double find_abundances_and_rates(double logT, double rho, int target, double shi
     double Tlow, Thi, flow, fhi, t, gJH0ne, gJHe0ne, gJHepne, logT_input, rho_input, ne_input, neold, nenew;
     double bH0, bHep, bff, aHp, aHep, aHepp, ad, geH0, geHe0, geHep;
     double n_elec, nH0, nHe0, nHp, nHep, nHepp; /* ionization states */
+    double shieldfac_input = shieldfac;
     logT_input = logT; rho_input = rho; ne_input = *ne_guess; /* save inputs (in case of failed convergence below) */
     if(!isfinite(logT)) logT=Tmin;    /* nan trap (just in case) */
     if(!isfinite(rho)) logT=Tmin;
@@ -439,11 +587,7 @@ double find_abundances_and_rates(double logT, double rho, int target, double shi
     double nHcgs = HYDROGEN_MASSFRAC * rho / PROTONMASS;	/* hydrogen number dens in cgs units */
     if(shieldfac < 0)
     {
-        double NH_SS_z;
-        if(gJH0>0)
-            NH_SS_z = NH_SS*pow(local_gammamultiplier*gJH0/1.0e-12,0.66)*pow(10.,0.173*(logT-4.));
-        else
-            NH_SS_z = NH_SS*pow(10.,0.173*(logT-4.));
+        double NH_SS_z = NH_SS_UV*pow(10.,0.173*(logT-4.)); /* NH_SS_UV includes the (pre-computed) UV background scaling */
         double q_SS = nHcgs/NH_SS_z;
         shieldfac = 1./(1.+q_SS*(1.+q_SS/2.*(1.+q_SS/3.*(1.+q_SS/4.*(1.+q_SS/5.*(1.+q_SS/6.*q_SS))))));
 #ifdef COOL_LOW_TEMPERATURES
@@ -473,27 +617,32 @@ double find_abundances_and_rates(double logT, double rho, int target, double shi
     }
 #endif
     
+    /* interpolate the recombination and collisional ionization rates (these do not change during the iteration below) */
+    aHp = flow * AlphaHp[j] + fhi * AlphaHp[j + 1];
+    aHep = flow * AlphaHep[j] + fhi * AlphaHep[j + 1];
+    aHepp = flow * AlphaHepp[j] + fhi * AlphaHepp[j + 1];
+    ad = flow * Alphad[j] + fhi * Alphad[j + 1];
+    geH0 = flow * GammaeH0[j] + fhi * GammaeH0[j + 1];
+    geHe0 = flow * GammaeHe0[j] + fhi * GammaeHe0[j + 1];
+    geHep = flow * GammaeHep[j] + fhi * GammaeHep[j + 1];
+#ifdef COOL_LOW_TEMPERATURES
+    // make cutoff towards Tmin more continuous //
+    if(logT < Tmin+1) {
+        geH0 *= (logT-Tmin);
+        geHe0 *= (logT-Tmin);
+        geHep *= (logT-Tmin);
+    }
+#endif
+    
+#ifdef COOL_EQTAB_ACTIVE
+    /* if the point lies within the pre-computed equilibrium table, interpolate the ionization states instead of iterating */
+    if(cooling_eqtab_lookup(logT, nHcgs, shieldfac_input, target, &n_elec, &nH0, &nHp, &nHe0, &nHep, &nHepp)) {niter = 0;} else
+#endif
     /* evaluate number densities iteratively (cf KWH eqns 33-38) in units of nH */
     do
     {
         niter++;
         
-        aHp = flow * AlphaHp[j] + fhi * AlphaHp[j + 1];
-        aHep = flow * AlphaHep[j] + fhi * AlphaHep[j + 1];
-        aHepp = flow * AlphaHepp[j] + fhi * AlphaHepp[j + 1];
-        ad = flow * Alphad[j] + fhi * Alphad[j + 1];
-        geH0 = flow * GammaeH0[j] + fhi * GammaeH0[j + 1];
-        geHe0 = flow * GammaeHe0[j] + fhi * GammaeHe0[j + 1];
-        geHep = flow * GammaeHep[j] + fhi * GammaeHep[j + 1];
-#ifdef COOL_LOW_TEMPERATURES
-        // make cutoff towards Tmin more continuous //
-        if(logT < Tmin+1) {
-            geH0 *= (logT-Tmin);
-            geHe0 *= (logT-Tmin);
-            geHep *= (logT-Tmin);
-        }
-#endif
-        
         fac_noneq_cgs = (dt * All.UnitTime_in_s / All.HubbleParam) * necgs; // factor needed below to asses whether timestep is larger/smaller than recombination time
         if(necgs <= 1.e-25 || J_UV == 0)
         {
@@ -678,7 +827,7 @@ double CoolingRate(double logT, double rho, double n_elec_guess, int target)
 {
     double n_elec=n_elec_guess, nH0, nHe0, nHp, nHep, nHepp; /* ionization states [computed below] */
     double Lambda, Heat, LambdaFF, LambdaCmptn, LambdaExcH0, LambdaExcHep, LambdaIonH0, LambdaIonHe0, LambdaIonHep;
-    double LambdaRecHp, LambdaRecHep, LambdaRecHepp, LambdaRecHepd, redshift, T, NH_SS_z, shieldfac, LambdaMol, LambdaMetal;
+    double LambdaRecHp, LambdaRecHep, LambdaRecHepp, LambdaRecHepd, T, NH_SS_z, shieldfac, LambdaMol, LambdaMetal;
     double nHcgs = HYDROGEN_MASSFRAC * rho / PROTONMASS;	/* hydrogen number dens in cgs units */
     LambdaMol=0; LambdaMetal=0; LambdaCmptn=0; NH_SS_z=NH_SS;
     if(logT <= Tmin) {logT = Tmin + 0.5 * deltaT;}	/* floor at Tmin */
@@ -700,10 +849,7 @@ double CoolingRate(double logT, double rho, double n_elec_guess, int target)
     double local_gammamultiplier=1;
     
     /* CAFG: if density exceeds NH_SS, ignore ionizing background. */
-    if(J_UV != 0)
-        NH_SS_z=NH_SS*pow(local_gammamultiplier*gJH0/1.0e-12,0.66)*pow(10.,0.173*(logT-4.));
-    else
-        NH_SS_z=NH_SS*pow(10.,0.173*(logT-4.));
+    NH_SS_z=NH_SS_UV*pow(10.,0.173*(logT-4.));
     double q_SS = nHcgs/NH_SS_z;
     shieldfac = 1./(1.+q_SS*(1.+q_SS/2.*(1.+q_SS/3.*(1.+q_SS/4.*(1.+q_SS/5.*(1.+q_SS/6.*q_SS))))));
 #ifdef GALSF_EFFECTIVE_EQS
@@ -771,8 +917,7 @@ double CoolingRate(double logT, double rho, double n_elec_guess, int target)
         
         if(All.ComovingIntegrationOn)
         {
-            redshift = 1 / All.Time - 1;
-            LambdaCmptn = 5.65e-36 * n_elec * (T - 2.73 * (1. + redshift)) * pow(1. + redshift, 4.) / nHcgs;
+            LambdaCmptn = Compton_prefac * n_elec * (T - T_CMB_z) / nHcgs;
             Lambda += LambdaCmptn;
         }
         else {LambdaCmptn = 0;}
@@ -896,8 +1041,8 @@ double CoolingRate(double logT, double rho, double n_elec_guess, int target)
 
       if(All.ComovingIntegrationOn)
       {
-          redshift = 1 / All.Time - 1; /* add inverse Compton cooling off the microwave background */
-          LambdaCmptn = 5.65e-36 * n_elec * (T - 2.73 * (1. + redshift)) * pow(1. + redshift, 4.) / nHcgs;
+          /* add inverse Compton cooling off the microwave background */
+          LambdaCmptn = Compton_prefac * n_elec * (T - T_CMB_z) / nHcgs;
       }
       else {LambdaCmptn = 0;}
 
@@ -983,10 +1128,27 @@ void InitCoolMemory(void)
     Betaff = (double *) mymalloc("Betaff", (NCOOLTAB + 1) * sizeof(double));
     
 #ifdef COOL_METAL_LINES_BY_SPECIES
-    long i_nH=41; long i_T=176; long kspecies=(long)NUM_METAL_SPECIES-1;
-    SpCoolTable0 = (float *) mymalloc("SpCoolTable0",(kspecies*i_nH*i_T)*sizeof(float));
+#ifdef COOL_METAL_LINES_SHARED_TABLES
+    int k, node_rank;
+    float *base[2];
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, ThisTask, MPI_INFO_NULL, &SpCool_NodeComm);
+    MPI_Comm_rank(SpCool_NodeComm, &node_rank);
+    MPI_Comm_split(MPI_COMM_WORLD, (node_rank == 0) ? 0 : MPI_UNDEFINED, ThisTask, &SpCool_LeaderComm); /* task 0 is the first leader */
+    SpCool_NWin = (All.ComovingIntegrationOn ? 2 : 1);
+    for(k = 0; k < SpCool_NWin; k++)
+    {
+        MPI_Aint winsize; int dispunit;
+        MPI_Win_allocate_shared((node_rank == 0) ? SPCOOL_TABLE_SIZE * sizeof(float) : 0, sizeof(float), MPI_INFO_NULL, SpCool_NodeComm, &base[k], &SpCool_Win[k]);
+        MPI_Win_shared_query(SpCool_Win[k], 0, &winsize, &dispunit, &base[k]);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, SpCool_Win[k]);
+    }
+    SpCoolTable0 = base[0];
+    if(All.ComovingIntegrationOn) {SpCoolTable1 = base[1];}
+#else
+    SpCoolTable0 = (float *) mymalloc("SpCoolTable0", SPCOOL_TABLE_SIZE * sizeof(float));
     if(All.ComovingIntegrationOn)
-        SpCoolTable1 = (float *) mymalloc("SpCoolTable1",(kspecies*i_nH*i_T)*sizeof(float));
+        SpCoolTable1 = (float *) mymalloc("SpCoolTable1", SPCOOL_TABLE_SIZE * sizeof(float));
+#endif
 #endif
 }
 
@@ -1042,71 +1204,97 @@ void LoadMultiSpeciesTables(void)
         }
         z=log10(1/All.Time)*48;
         i=(int)z;
-        if(i<48) {
-            if(i<All.SpeciesTableInUse) {
-                All.SpeciesTableInUse=i;
-                ReadMultiSpeciesTables(All.SpeciesTableInUse);
-            }}
+        if((i<48)&&(i<All.SpeciesTableInUse)) {All.SpeciesTableInUse=i;}
+        if(All.SpeciesTableInUse != SpCoolTable0_iT) {ReadMultiSpeciesTables(All.SpeciesTableInUse);} /* (also re-loads the right slice after a restart) */
     } else {
         if(All.Time==All.TimeBegin) ReadMultiSpeciesTables(0);
     }
 }
 
-void ReadMultiSpeciesTables(int iT)
+/* reads one redshift slice of the species tables (file 'fname') into 'table' with a single bulk read; returns 0 on success */
+static int read_multispecies_table_file(char *fname, float *table)
 {
-    /* read table w n,T for each species */
-    long i_nH=41; long i_Temp=176; long kspecies=(long)NUM_METAL_SPECIES-1; long i,j,k,r;
-    /* int i_He=7;  int l; */
-    FILE *fdcool; char *fname;
-    
-    fname=GetMultiSpeciesFilename(iT,0);
-    if(ThisTask == 0) printf("Opening Cooling Table %s \n",fname);
-    if(!(fdcool = fopen(fname, "r"))) {
-        printf(" Cannot read species cooling table in file `%s'\n", fname); endrun(456);}
-    for(i=0;i<kspecies;i++) {
-        for(j=0;j<i_nH;j++) {
-            for(k=0;k<i_Temp;k++) {
-                r=fread(&SpCoolTable0[i*i_nH*i_Temp + j*i_Temp + k],sizeof(float),1,fdcool);
-                if(r!=1) {printf(" Reached Cooling EOF! \n"); 
-                }
-            }}}
+    FILE *fdcool; size_t r;
+    if(!(fdcool = fopen(fname, "r"))) {return 1;}
+    r = fread(table, sizeof(float), SPCOOL_TABLE_SIZE, fdcool); /* tables are stored species-by-species, then in nH, then T: same order as in memory */
+    if(r != SPCOOL_TABLE_SIZE) {printf(" Reached Cooling EOF! \n");}
     fclose(fdcool);
-    /*
-     GetMultiSpeciesFilename(iT,&fname,1);
-     if(!(fdcool = fopen(fname, "r"))) {
-     printf(" Cannot read species (He) cooling table in file `%s'\n", fname); endrun(456);}
-     for(i=0;i<2;i++)
-     for(j=0;j<i_nH;j++)
-     for(k=0;k<i_Temp;k++)
-     for(l=0;l<i_He;l++)
-     fread(&SpCoolTable0_He[i][j][k][l],sizeof(float),1,fdcool);
-     fclose(fdcool);
-     */
-    if (All.ComovingIntegrationOn && i<48) {
-        fname=GetMultiSpeciesFilename(iT+1,0);
-        if(ThisTask == 0) printf("Opening (z+) Cooling Table %s \n",fname);
-        if(!(fdcool = fopen(fname, "r"))) {
-            printf(" Cannot read species 1 cooling table in file `%s'\n", fname); endrun(456);}
-        for(i=0;i<kspecies;i++) {
-            for(j=0;j<i_nH;j++) {
-                for(k=0;k<i_Temp;k++) {
-                    r=fread(&SpCoolTable1[i*i_nH*i_Temp + j*i_Temp + k],sizeof(float),1,fdcool);
-                    if(r!=1) {printf(" Reached Cooling EOF! \n");
-                    }
-                }}}
-        fclose(fdcool);
-        /*
-         GetMultiSpeciesFilename(iT+1,&fname,1);
-         if(!(fdcool = fopen(fname, "r"))) {
-         printf(" Cannot read species 1 (He) cooling table in file `%s'\n", fname); endrun(456);}
-         for(i=0;i<2;i++)
-         for(j=0;j<i_nH;j++)
-         for(k=0;k<i_Temp;k++)
-         for(l=0;l<i_He;l++)
-         fread(&SpCoolTable1_He[i][j][k][l],sizeof(float),1,fdcool);
-         fclose(fdcool);
-         */
+    return 0;
+}
+
+
+#ifdef COOL_METAL_LINES_SHARED_TABLES
+/* background thread (on task 0 only, no MPI calls): reads the next redshift slice into the pre-fetch buffer */
+static void *prefetch_multispecies_table(void *arg)
+{
+    SpCool_Prefetch_ok = (read_multispecies_table_file(SpCool_Prefetch_fname, SpCool_PrefetchBuf) == 0);
+    return NULL;
+}
+#endif
+
+
+/* loads redshift slice iT into 'table' on all tasks: task 0 reads the file (or takes it from the pre-fetch buffer), then it is broadcast
+    (with COOL_METAL_LINES_SHARED_TABLES only to one task per node, which holds the single copy for all tasks on that node) */
+static void load_multispecies_table(int iT, float *table)
+{
+    int read_failed = 0;
+    if(ThisTask == 0)
+    {
+        printf("Opening Cooling Table %s \n", GetMultiSpeciesFilename(iT,0));
+#ifdef COOL_METAL_LINES_SHARED_TABLES
+        if(SpCool_Prefetch_iT >= 0)
+        {
+            pthread_join(SpCool_PrefetchThread, NULL);
+            if(SpCool_Prefetch_iT == iT && SpCool_Prefetch_ok) {memcpy(table, SpCool_PrefetchBuf, SPCOOL_TABLE_SIZE * sizeof(float));} else {read_failed = read_multispecies_table_file(GetMultiSpeciesFilename(iT,0), table);}
+            SpCool_Prefetch_iT = -1;
+        } else
+#endif
+        read_failed = read_multispecies_table_file(GetMultiSpeciesFilename(iT,0), table);
+        if(read_failed) {printf(" Cannot read species cooling table in file `%s'\n", GetMultiSpeciesFilename(iT,0)); endrun(456);}
     }
+#ifdef COOL_METAL_LINES_SHARED_TABLES
+    int k;
+    if(SpCool_LeaderComm != MPI_COMM_NULL) {MPI_Bcast(table, SPCOOL_TABLE_SIZE, MPI_FLOAT, 0, SpCool_LeaderComm);}
+    for(k = 0; k < SpCool_NWin; k++) {MPI_Win_sync(SpCool_Win[k]);}
+    MPI_Barrier(SpCool_NodeComm); /* table is complete on the node before anyone uses it */
+    for(k = 0; k < SpCool_NWin; k++) {MPI_Win_sync(SpCool_Win[k]);}
+#else
+    MPI_Bcast(table, SPCOOL_TABLE_SIZE, MPI_FLOAT, 0, MPI_COMM_WORLD);
+#endif
+}
+
+
+/* makes sure SpCoolTable0 holds redshift slice iT and (for cosmological runs) SpCoolTable1 holds slice iT+1. as the run moves
+    to lower redshift the old slice iT becomes the new slice iT+1, so its table is re-used rather than read again */
+void ReadMultiSpeciesTables(int iT)
+{
+    float *tmp; int tmp_iT;
+    if(All.ComovingIntegrationOn && iT < 48 && SpCoolTable1_iT != iT+1)
+    {
+        if(SpCoolTable0_iT == iT+1)
+        {
+            tmp = SpCoolTable1; SpCoolTable1 = SpCoolTable0; SpCoolTable0 = tmp;
+            tmp_iT = SpCoolTable1_iT; SpCoolTable1_iT = SpCoolTable0_iT; SpCoolTable0_iT = tmp_iT;
+        } else {
+            load_multispecies_table(iT+1, SpCoolTable1);
+            SpCoolTable1_iT = iT+1;
+        }
+    }
+    if(SpCoolTable0_iT != iT)
+    {
+        load_multispecies_table(iT, SpCoolTable0);
+        SpCoolTable0_iT = iT;
+    }
+#ifdef COOL_METAL_LINES_SHARED_TABLES
+    /* start reading the slice which will be needed next while the run continues */
+    if(ThisTask == 0 && All.ComovingIntegrationOn && iT > 0 && SpCool_Prefetch_iT < 0)
+    {
+        if(!SpCool_PrefetchBuf) {SpCool_PrefetchBuf = (float *) malloc(SPCOOL_TABLE_SIZE * sizeof(float));}
+        SpCool_Prefetch_iT = iT-1;
+        strcpy(SpCool_Prefetch_fname, GetMultiSpeciesFilename(iT-1,0));
+        if(!SpCool_PrefetchBuf || pthread_create(&SpCool_PrefetchThread, NULL, prefetch_multispecies_table, NULL) != 0) {SpCool_Prefetch_iT = -1;}
+    }
+#endif
 }
 
 char *GetMultiSpeciesFilename(int i, int hk)
@@ -1174,6 +1362,53 @@ void ReadIonizeParams(char *fname)
 void IonizeParams(void)
 {
     IonizeParamsTable();
+    set_cooling_redshift_terms();
+}
+
+
+#ifdef COOL_EQTAB_ACTIVE
+/* fills the equilibrium ionization table for the current UV background, using the exact iteration */
+static void build_cooling_equilibrium_table(void)
+{
+    int i, k;
+    double logT, rho, ne, nH0, nHp, nHe0, nHep, nHepp, *t;
+    CoolEqTab_ready = 0; /* make sure the exact iteration is used while filling the table */
+    for(i = 0; i < CoolEqTab_NT; i++)
+    {
+        logT = Tmin + i * COOL_EQTAB_DLOGT;
+        for(k = 0, ne = 0; k < CoolEqTab_NnH; k++) /* ne=0 starts from the default guess; afterwards start from the neighboring solution */
+        {
+            rho = pow(10., COOL_EQTAB_LOGNH_MIN + k * COOL_EQTAB_DLOGNH) * PROTONMASS / HYDROGEN_MASSFRAC;
+            find_abundances_and_rates(logT, rho, -1, -1, 0, &ne, &nH0, &nHp, &nHe0, &nHep, &nHepp);
+            t = &CoolEqTab[COOL_EQTAB_NVAR * (i * CoolEqTab_NnH + k)];
+            t[0] = ne; t[1] = nH0; t[2] = nHe0; t[3] = nHep; t[4] = nHepp;
+        }
+    }
+    CoolEqTab_gJH0 = gJH0; CoolEqTab_gJHe0 = gJHe0; CoolEqTab_gJHep = gJHep;
+    CoolEqTab_ready = 1;
+}
+#endif
+
+
+/* sets the terms of the cooling/heating rates which depend only on the UV background and redshift, so these
+    are evaluated once per timestep rather than in every rate evaluation of every particle */
+void set_cooling_redshift_terms(void)
+{
+    double local_gammamultiplier=1;
+    if(gJH0 > 0) {NH_SS_UV = NH_SS*pow(local_gammamultiplier*gJH0/1.0e-12,0.66);} else {NH_SS_UV = NH_SS;}
+    Compton_prefac = 0; T_CMB_z = 0;
+    if(All.ComovingIntegrationOn)
+    {
+        double redshift = 1 / All.Time - 1;
+        Compton_prefac = 5.65e-36 * pow(1. + redshift, 4.);
+        T_CMB_z = 2.73 * (1. + redshift);
+    }
+#ifdef COOL_EQTAB_ACTIVE
+    if(CoolEqTab && (!CoolEqTab_ready || (fabs(gJH0 - CoolEqTab_gJH0) > COOL_EQTAB_REBUILD_TOL * DMAX(gJH0, CoolEqTab_gJH0)) ||
+                     (fabs(gJHe0 - CoolEqTab_gJHe0) > COOL_EQTAB_REBUILD_TOL * DMAX(gJHe0, CoolEqTab_gJHe0)) ||
+                     (fabs(gJHep - CoolEqTab_gJHep) > COOL_EQTAB_REBUILD_TOL * DMAX(gJHep, CoolEqTab_gJHep))))
+        {build_cooling_equilibrium_table();}
+#endif
 }
 
 
@@ -1235,6 +1470,7 @@ void SetZeroIonization(void)
     gJHe0 = gJHep = gJH0 = 0;
     epsHe0 = epsHep = epsH0 = 0;
     J_UV = 0;
+    set_cooling_redshift_terms();
 }
 
 
@@ -1348,6 +1584,11 @@ void InitCool(void)
     
     InitCoolMemory();
     MakeCoolingTable();
+#ifdef COOL_EQTAB_ACTIVE
+    CoolEqTab_NT = (int) ceil((Tmax - Tmin) / COOL_EQTAB_DLOGT) + 2;
+    CoolEqTab_NnH = (int) ((COOL_EQTAB_LOGNH_MAX - COOL_EQTAB_LOGNH_MIN) / COOL_EQTAB_DLOGNH + 0.5) + 1;
+    CoolEqTab = (double *) mymalloc("CoolEqTab", COOL_EQTAB_NVAR * CoolEqTab_NT * CoolEqTab_NnH * sizeof(double));
+#endif
     ReadIonizeParams("TREECOOL");
     IonizeParams();
 #ifdef COOL_METAL_LINES_BY_SPECIES
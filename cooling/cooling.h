@@ -24,6 +24,7 @@ void   IonizeParamsTable(void);
 void   MakeCoolingTable(void);
 void   ReadIonizeParams(char *fname);
 void   SetZeroIonization(void);
+void   set_cooling_redshift_terms(void);
 void   TestCool(void);
 
 double find_abundances_and_rates(double logT, double rho, int target, double shieldfac, int return_cooling_mode,
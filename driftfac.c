@@ -103,6 +103,9 @@ double get_drift_factor(integertime time0, integertime time1)
   int i1, i2;
   static integertime last_time0 = -1, last_time1 = -1;
   static double last_value;
+#ifdef _OPENMP
+#pragma omp threadprivate(last_time0, last_time1, last_value) /* the kicks are done in threaded loops */
+#endif
 
   if(time0 == last_time0 && time1 == last_time1)
     return last_value;
@@ -151,6 +154,9 @@ double get_gravkick_factor(integertime time0, integertime time1)
   int i1, i2;
   static integertime last_time0 = -1, last_time1 = -1;
   static double last_value;
+#ifdef _OPENMP
+#pragma omp threadprivate(last_time0, last_time1, last_value) /* the kicks are done in threaded loops */
+#endif
 
   if(time0 == last_time0 && time1 == last_time1)
     return last_value;
@@ -705,7 +705,7 @@ int blackhole_spawn_particle_wind_shell( int i, int dummy_sph_i_to_clone )
 
         /* now we need to make sure everything is correctly placed in timebins for the tree */
         P[j].TimeBin = bin; P[j].dt_step = bin ? (((integertime) 1) << bin) : 0; // put this particle on the lowest active time bin
-        NextActiveParticle[j] = FirstActiveParticle; FirstActiveParticle = j; NumForceUpdate++; /* the particle needs to be 'born active' and added to the active set */
+        NextActiveParticle[j] = FirstActiveParticle; FirstActiveParticle = j; ActiveParticleList[NumActiveParticle++] = j; NumForceUpdate++; /* the particle needs to be 'born active' and added to the active set */
         TimeBinCount[bin]++; TimeBinCountSph[bin]++; PrevInTimeBin[j] = i; /* likewise add it to the counters that register how many particles are in each timebin */
         if(FirstInTimeBin[bin] < 0){  // only particle in this time bin on this task
             FirstInTimeBin[bin] = j; LastInTimeBin[bin] = j; NextInTimeBin[j] = -1; PrevInTimeBin[j] = -1;
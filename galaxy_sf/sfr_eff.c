@@ -577,6 +577,7 @@ void star_formation_parent_routine(void)
 #endif
 		      NextActiveParticle[NumPart + stars_spawned] = FirstActiveParticle;
 		      FirstActiveParticle = NumPart + stars_spawned;
+		      ActiveParticleList[NumActiveParticle++] = NumPart + stars_spawned;
 		      NumForceUpdate++;
 
 		      TimeBinCount[P[NumPart + stars_spawned].TimeBin]++;
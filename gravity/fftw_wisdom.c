@@ -0,0 +1,154 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*! \file fftw_wisdom.c
+ *  \brief keeps FFTW planner wisdom in the output directory, so measured plans survive restarts
+ *
+ *  With USE_FFTW_WISDOM the PM and turbulence-spectrum plans are created with FFTW_MEASURE
+ *  (FFTW_PLAN_RIGOR in allvars.h) instead of FFTW_ESTIMATE. The expensive measurement is only
+ *  done by the first job of a campaign: task 0 reads the wisdom file before any plan is made and
+ *  broadcasts it, so later jobs obtain the same plans immediately; after planning the (possibly
+ *  extended) wisdom is written back. The file name encodes the FFTW version, precision and the
+ *  number of MPI tasks, since the slab decomposition (and with it the optimal plan) depends on them.
+ */
+
+#include "../allvars.h"
+#include "../proto.h"
+
+#ifdef USE_FFTW_WISDOM
+
+#ifndef USE_FFTW3
+#ifdef NOTYPEPREFIX_FFTW
+#include        <rfftw_mpi.h>
+#else
+#ifdef DOUBLEPRECISION_FFTW
+#include     <drfftw_mpi.h>	/* double precision FFTW */
+#else
+#include     <srfftw_mpi.h>
+#endif
+#endif
+#else
+#include "myfftw3.h"
+#endif
+
+
+static int fftw_wisdom_imported;
+
+
+static void fftw_wisdom_filename(char *fname)
+{
+#ifdef USE_FFTW3
+  char *version = "fftw3";
+#else
+  char *version = "fftw2";
+#endif
+#ifdef DOUBLEPRECISION_FFTW
+  char *precision = "double";
+#else
+  char *precision = "single";
+#endif
+
+  sprintf(fname, "%sfftw_wisdom_%s_%s_ntask%d.dat", All.OutputDir, version, precision, NTask);
+}
+
+
+/*! Reads the wisdom file on task 0 and makes it known on all tasks. Must be called (collectively)
+ *  before the plans are created; repeated calls do nothing.
+ */
+void fftw_wisdom_import(void)
+{
+  char fname[1000];
+  int ok = 0;
+
+  if(fftw_wisdom_imported)
+    return;
+  fftw_wisdom_imported = 1;
+
+  fftw_wisdom_filename(fname);
+
+#ifdef USE_FFTW3
+  if(ThisTask == 0)
+    ok = fftw_import_wisdom_from_filename(fname);
+  fftw_mpi_broadcast_wisdom(MPI_COMM_WORLD);
+#else
+  /* FFTW2 has no MPI wisdom functions: ship the file contents as a string */
+  FILE *fd = NULL;
+  char *buf;
+  long len = 0, n;
+
+  if(ThisTask == 0)
+    if((fd = fopen(fname, "r")))
+      {
+	fseek(fd, 0, SEEK_END);
+	len = ftell(fd);
+	rewind(fd);
+      }
+
+  MPI_Bcast(&len, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+
+  if(len > 0)
+    {
+      buf = (char *) mymalloc("buf", len + 1);
+      if(ThisTask == 0)
+	{
+	  n = fread(buf, 1, len, fd);
+	  buf[n] = 0;
+	}
+      MPI_Bcast(buf, len + 1, MPI_BYTE, 0, MPI_COMM_WORLD);
+      ok = (fftw_import_wisdom_from_string(buf) == FFTW_SUCCESS);
+      myfree(buf);
+    }
+
+  if(fd)
+    fclose(fd);
+#endif
+
+  if(ThisTask == 0)
+    {
+      if(ok)
+	printf("FFTW: imported wisdom from '%s'\n", fname);
+      else
+	printf("FFTW: no usable wisdom in '%s', plans will be measured (this takes a while once)\n", fname);
+    }
+}
+
+
+/*! Writes the accumulated wisdom to the output directory; called (collectively) after new plans
+ *  have been made, so that wisdom for every grid used by the run ends up in the file.
+ */
+void fftw_wisdom_export(void)
+{
+  char fname[1000];
+
+  fftw_wisdom_filename(fname);
+
+#ifdef USE_FFTW3
+  fftw_mpi_gather_wisdom(MPI_COMM_WORLD);
+#endif
+
+  if(ThisTask == 0)
+    {
+      mkdir(All.OutputDir, 02755);
+#ifdef USE_FFTW3
+      if(!fftw_export_wisdom_to_filename(fname))
+	printf("FFTW: could not write wisdom to '%s'\n", fname);
+#else
+      FILE *fd;
+
+      if((fd = fopen(fname, "w")))
+	{
+	  fftw_export_wisdom_to_file(fd);
+	  fclose(fd);
+	}
+      else
+	printf("FFTW: could not write wisdom to '%s'\n", fname);
+#endif
+    }
+}
+
+#endif
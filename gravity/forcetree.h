@@ -97,7 +97,7 @@ void   ngb_update_nodes(void);
 void   ngb_treesearch_notsee(int no);
 
 int ngb_treefind_fof_primary(MyDouble searchcenter[3], MyFloat hsml, int target, int *startnode, int mode,
-			    int *nexport, int *nsend_local, int MyFOF_PRIMARY_LINK_TYPES);
+			    int *nexport, int *nsend_local, int MyFOF_PRIMARY_LINK_TYPES, int *ngblist);
 int ngb_clear_buf(MyDouble searchcenter[3], MyFloat hguess, int numngb);
 void ngb_treefind_flagexport(MyDouble searchcenter[3], MyFloat hguess);
 
@@ -33,6 +33,9 @@ void long_range_init(void)
 #ifdef USE_FFTW3
   fftw_mpi_init(); 
 #endif
+#ifdef USE_FFTW_WISDOM
+  fftw_wisdom_import();
+#endif
 #ifdef BOX_PERIODIC
   pm_init_periodic();
 #ifdef PM_PLACEHIGHRESREGION
@@ -41,6 +44,9 @@ void long_range_init(void)
 #else
   pm_init_nonperiodic();
 #endif
+#ifdef USE_FFTW_WISDOM
+  fftw_wisdom_export();
+#endif
 }
 
 
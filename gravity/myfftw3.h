@@ -20,7 +20,12 @@
   #define fftw_mpi_plan_dft_r2c_3d	    fftwf_mpi_plan_dft_r2c_3d 
   #define fftw_mpi_plan_dft_c2r_3d	    fftwf_mpi_plan_dft_c2r_3d 
   #define fftw_execute			    fftwf_execute 
+  #define fftw_mpi_execute_dft_r2c	    fftwf_mpi_execute_dft_r2c
   #define fftw_destroy_plan		    fftwf_destroy_plan
+  #define fftw_import_wisdom_from_filename  fftwf_import_wisdom_from_filename
+  #define fftw_export_wisdom_to_filename    fftwf_export_wisdom_to_filename
+  #define fftw_mpi_broadcast_wisdom	    fftwf_mpi_broadcast_wisdom
+  #define fftw_mpi_gather_wisdom	    fftwf_mpi_gather_wisdom
 #endif
 
 #endif
@@ -257,9 +257,9 @@ void pm_init_nonperiodic(void)
   /* Set up the FFTW plan files. */
 
   fft_forward_plan = rfftw3d_mpi_create_plan(MPI_COMM_WORLD, GRID, GRID, GRID,
-					     FFTW_REAL_TO_COMPLEX, FFTW_ESTIMATE | FFTW_IN_PLACE);
+					     FFTW_REAL_TO_COMPLEX, FFTW_PLAN_RIGOR | FFTW_IN_PLACE);
   fft_inverse_plan = rfftw3d_mpi_create_plan(MPI_COMM_WORLD, GRID, GRID, GRID,
-					     FFTW_COMPLEX_TO_REAL, FFTW_ESTIMATE | FFTW_IN_PLACE);
+					     FFTW_COMPLEX_TO_REAL, FFTW_PLAN_RIGOR | FFTW_IN_PLACE);
 
   /* Workspace out the ranges on each processor. */
 
@@ -322,7 +322,7 @@ void pm_init_nonperiodic(void)
 
 #ifdef USE_FFTW3 
   fft_forward_kernel0_plan = fftw_mpi_plan_dft_r2c_3d(GRID, GRID, GRID, kernel[0], fft_of_kernel[0], 
-	  MPI_COMM_WORLD, FFTW_ESTIMATE | FFTW_MPI_TRANSPOSED_OUT); 
+	  MPI_COMM_WORLD, FFTW_PLAN_RIGOR | FFTW_MPI_TRANSPOSED_OUT); 
 #endif
 #ifdef DM_SCALARFIELD_SCREENING
   if(!
@@ -339,7 +339,7 @@ void pm_init_nonperiodic(void)
 #ifdef USE_FFTW3 
   fft_forward_kernel_scalarfield0_plan = fftw_mpi_plan_dft_r2c_3d(GRID, GRID, GRID, 
 	  kernel_scalarfield[0], fft_of_kernel_scalarfield[0], 
-	  MPI_COMM_WORLD, FFTW_ESTIMATE | FFTW_MPI_TRANSPOSED_OUT); 
+	  MPI_COMM_WORLD, FFTW_PLAN_RIGOR | FFTW_MPI_TRANSPOSED_OUT); 
 #endif
 #endif
 #endif
@@ -355,7 +355,7 @@ void pm_init_nonperiodic(void)
 
 #ifdef USE_FFTW3 
   fft_forward_kernel1_plan = fftw_mpi_plan_dft_r2c_3d(GRID, GRID, GRID, kernel[1], fft_of_kernel[1], 
-	  MPI_COMM_WORLD, FFTW_ESTIMATE | FFTW_MPI_TRANSPOSED_OUT); 
+	  MPI_COMM_WORLD, FFTW_PLAN_RIGOR | FFTW_MPI_TRANSPOSED_OUT); 
 #endif
  
 #ifdef DM_SCALARFIELD_SCREENING
@@ -373,7 +373,7 @@ void pm_init_nonperiodic(void)
 #ifdef USE_FFTW3 
   fft_forward_kernel_scalarfield1_plan = fftw_mpi_plan_dft_r2c_3d(GRID, GRID, GRID, 
 	  kernel_scalarfield[1], fft_of_kernel_scalarfield[1], 
-	  MPI_COMM_WORLD, FFTW_ESTIMATE | FFTW_MPI_TRANSPOSED_OUT); 
+	  MPI_COMM_WORLD, FFTW_PLAN_RIGOR | FFTW_MPI_TRANSPOSED_OUT); 
 #endif
 #endif
 #endif
@@ -397,10 +397,10 @@ void pm_init_nonperiodic(void)
   fft_of_rhogrid = (fftw_complex *) rhogrid;
 
   fft_forward_plan = fftw_mpi_plan_dft_r2c_3d(GRID, GRID, GRID, rhogrid, fft_of_rhogrid, 
-	  MPI_COMM_WORLD, FFTW_ESTIMATE | FFTW_MPI_TRANSPOSED_OUT); 
+	  MPI_COMM_WORLD, FFTW_PLAN_RIGOR | FFTW_MPI_TRANSPOSED_OUT); 
 
   fft_inverse_plan = fftw_mpi_plan_dft_c2r_3d(GRID, GRID, GRID, fft_of_rhogrid, rhogrid, 
-	  MPI_COMM_WORLD, FFTW_ESTIMATE | FFTW_MPI_TRANSPOSED_IN); 
+	  MPI_COMM_WORLD, FFTW_PLAN_RIGOR | FFTW_MPI_TRANSPOSED_IN); 
 #endif
 
 }
@@ -115,9 +115,9 @@ void pm_init_periodic(void)
   /* Set up the FFTW plan files. */
 
   fft_forward_plan = rfftw3d_mpi_create_plan(MPI_COMM_WORLD, PMGRID, PMGRID, PMGRID,
-					     FFTW_REAL_TO_COMPLEX, FFTW_ESTIMATE | FFTW_IN_PLACE);
+					     FFTW_REAL_TO_COMPLEX, FFTW_PLAN_RIGOR | FFTW_IN_PLACE);
   fft_inverse_plan = rfftw3d_mpi_create_plan(MPI_COMM_WORLD, PMGRID, PMGRID, PMGRID,
-					     FFTW_COMPLEX_TO_REAL, FFTW_ESTIMATE | FFTW_IN_PLACE);
+					     FFTW_COMPLEX_TO_REAL, FFTW_PLAN_RIGOR | FFTW_IN_PLACE);
 
   /* Workspace out the ranges on each processor. */
 
@@ -188,10 +188,10 @@ void pm_init_periodic(void)
   fft_of_rhogrid = (fftw_complex *) rhogrid;
 
   fft_forward_plan = fftw_mpi_plan_dft_r2c_3d(PMGRID, PMGRID, PMGRID, rhogrid, fft_of_rhogrid, 
-	  MPI_COMM_WORLD, FFTW_ESTIMATE | FFTW_MPI_TRANSPOSED_OUT); 
+	  MPI_COMM_WORLD, FFTW_PLAN_RIGOR | FFTW_MPI_TRANSPOSED_OUT); 
 
   fft_inverse_plan = fftw_mpi_plan_dft_c2r_3d(PMGRID, PMGRID, PMGRID, fft_of_rhogrid, rhogrid, 
-	  MPI_COMM_WORLD, FFTW_ESTIMATE | FFTW_MPI_TRANSPOSED_IN); 
+	  MPI_COMM_WORLD, FFTW_PLAN_RIGOR | FFTW_MPI_TRANSPOSED_IN); 
 
 #endif
 
@@ -302,7 +302,8 @@ void pm_init_periodic_free(void)
  *  decomposition that is used for the FFT. Instead, overlapping patches
  *  between local domains and FFT slabs are communicated as needed.
  *
- *  For mode=0, normal force calculation, mode=1, only PS calculation.
+ *  For mode=0, normal force calculation; mode=1 only bins and transforms the particles
+ *  selected in typelist (the power spectra have their own routine, calculate_power_spectra).
  */
 void pmforce_periodic(int mode, int *typelist)
 {
@@ -481,12 +482,6 @@ void pmforce_periodic(int mode, int *typelist)
       for(i = 1, localfield_offset[0] = 0; i < NTask; i++)
 	localfield_offset[i] = localfield_offset[i - 1] + localfield_count[i - 1];
 
-      if(mode != 0)
-	{
-	  foldonitself(typelist);
-	  powerspec(0, typelist);
-	}
-
       /* now bin the local particle data onto the mesh list */
 
       for(i = 0; i < num_field_points; i++)
@@ -608,11 +603,6 @@ void pmforce_periodic(int mode, int *typelist)
       fftw_execute(fft_forward_plan); 
 #endif
 
-      if(mode != 0)
-	{
-	  powerspec(1, typelist);
-	}
-
       if(mode == 0)		/* only carry out this part for the ordinary force calculation */
 	{
 	  /* multiply with Green's function for the potential */
@@ -1617,245 +1607,349 @@ void pm_periodic_transposeB(fftw_real * field, fftw_real * scratch)
 
 
 /*           Here comes code for the power-sepctrum computation.
+ *
+ *  The spectra are measured on the PM slab decomposition, re-using the FFT plans of the
+ *  PM solver and (for FFTW3) its persistent density grid; only one additional grid is
+ *  needed, so an output costs less memory than a PM force step. The particles are sent
+ *  to the tasks holding the slabs they touch and deposited with a TSC kernel onto two
+ *  grids offset by half a cell (interlacing), which cancels the leading aliasing terms.
+ *  Several folding levels (1, POWERSPEC_FOLDFAC, POWERSPEC_FOLDFAC^2, ...) are computed
+ *  back-to-back with the same buffers. Cross-spectra between two sets of particle types
+ *  are obtained from the spectrum of the summed field, P_AB = (P_{A+B} - P_A - P_B) / 2,
+ *  which is exact mode-by-mode and again needs just one field at a time.
  */
 #define BINS_PS  2000		/* number of bins for power spectrum computation */
+#ifndef POWERSPEC_FOLDFAC
 #define POWERSPEC_FOLDFAC 32
-static long long CountModes[2][BINS_PS];
-static double SumPower[2][BINS_PS];
-static double SumPowerUncorrected[2][BINS_PS];	/* without binning correction (as for shot noise) */
-static double Power[2][BINS_PS];
-static double PowerUncorrected[2][BINS_PS];	/* without binning correction */
-static double Delta[2][BINS_PS];
-static double DeltaUncorrected[2][BINS_PS];	/* without binning correction */
-static double ShotLimit[2][BINS_PS];
+#endif
+#ifndef POWERSPEC_FOLD_LEVELS
+#define POWERSPEC_FOLD_LEVELS 2	/* folding factors 1, POWERSPEC_FOLDFAC, ..., POWERSPEC_FOLDFAC^(POWERSPEC_FOLD_LEVELS-1) */
+#endif
+
+struct powerspec_result
+{
+  long long CountModes[POWERSPEC_FOLD_LEVELS][BINS_PS];
+  double SumPower[POWERSPEC_FOLD_LEVELS][BINS_PS];
+  double SumPowerUncorrected[POWERSPEC_FOLD_LEVELS][BINS_PS];	/* without binning correction (as for shot noise) */
+  double Power[POWERSPEC_FOLD_LEVELS][BINS_PS];
+  double PowerUncorrected[POWERSPEC_FOLD_LEVELS][BINS_PS];	/* without binning correction */
+  double totmass;
+  long long totnumpart;
+};
+
+struct powerspec_particle
+{
+  float u[3];			/* folded position in grid units, in [0,PMGRID) */
+  float w;			/* weight (mass over total mass of its component) */
+};
+
 static double Kbin[BINS_PS];
 static double K0, K1;
 static double binfac;
-static char power_spec_fname[500];
-static long long power_spec_totnumpart;
-static double power_spec_totmass;
-
-
-void powerspec(int flag, int *typeflag)
-{
-  int i, n, x, y, z, kx, ky, kz, bin, ip, rep, zz;
-  double k, k2, po, ponorm, smth, fac;
-  double fx, fy, fz, ff, mass;
-  double *powerbuf;
-  long long *countbuf;
-  double tstart, tend;
+static fftw_real *powerspec_grid2;	/* FFT of the interlaced (shifted) density field */
 
-#ifndef IO_REDUCED_MODE
-  if(ThisTask == 0)
-    {
-      printf("begin power spectrum. (step=%d)  POWERSPEC_FOLDFAC=%d\n", flag, POWERSPEC_FOLDFAC);
-      fflush(stdout);
-    }
+static void powerspec_save(char *fname, struct powerspec_result *res);
+#ifdef OUTPUT_POWERSPEC_CROSS
+static void powerspec_save_cross(char *fname, struct powerspec_result *a, struct powerspec_result *b,
+				 struct powerspec_result *sum);
 #endif
 
-  tstart = my_second();
 
-  for(i = 0, mass = 0; i < NumPart; i++)
-    if(typeflag[P[i].Type] && (P[i].Mass>0))
-      mass += P[i].Mass;
+/* sends the particles selected by typeweight (weight per type, 0 = not used) to the tasks holding
+   the slabs they touch, and deposits them with a TSC kernel at folding factor 'fold' onto rhogrid;
+   the grid nodes are at integer positions (shift=0) or displaced by half a cell (shift=1) */
+static void powerspec_deposit(double *typeweight, double fold, int shift)
+{
+  int i, j, k, n, ix, iy, iz, slab, task, ngrp, recvTask, count, rest, istart, nbuf, buf_capacity;
+  int ntask_p, tasks_p[4], *nsend_local, *nsend_offset, *nsend, *nrecv;
+  double u[3], d, wx[3], wy[3], wz[3], fac = PMGRID / All.BoxSize * fold, off = shift ? 0.5 : 0;
+  struct powerspec_particle *sendbuf, *recvbuf, *pp;
 
-  MPI_Allreduce(&mass, &power_spec_totmass, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  nsend_local = (int *) mymalloc("nsend_local", NTask * sizeof(int));
+  nsend_offset = (int *) mymalloc("nsend_offset", NTask * sizeof(int));
+  nsend = (int *) mymalloc("nsend", NTask * sizeof(int));
+  nrecv = (int *) mymalloc("nrecv", NTask * sizeof(int));
 
-  fac = 1.0 / power_spec_totmass;
+  buf_capacity = (int) ((All.BufferSize * 1024.0 * 1024.0) / (2 * sizeof(struct powerspec_particle)));
+  sendbuf = (struct powerspec_particle *) mymalloc("sendbuf", buf_capacity * sizeof(struct powerspec_particle));
+  recvbuf = (struct powerspec_particle *) mymalloc("recvbuf", buf_capacity * sizeof(struct powerspec_particle));
 
-  K0 = 2 * M_PI / All.BoxSize;	/* minimum k */
-  K1 = K0 * All.BoxSize / All.SofteningTable[1];	/* maximum k */
-  binfac = BINS_PS / (log(K1) - log(K0));
+  for(i = 0; i < fftsize; i++)	/* clear local density field */
+    rhogrid[i] = 0;
 
-  if(flag == 0)
+  istart = 0;
+  do
     {
-      for(rep = 0; rep < 2; rep++)
-	for(i = 0; i < BINS_PS; i++)
-	  {
-	    SumPower[rep][i] = 0;
-	    SumPowerUncorrected[rep][i] = 0;
-	    CountModes[rep][i] = 0;
-	  }
-    }
-
-  for(y = slabstart_y; y < slabstart_y + nslab_y; y++)
-    for(x = 0; x < PMGRID; x++)
-      for(z = 0; z < PMGRID; z++)
+      /* two passes over the particles: first count per target task, then fill the buffer */
+      for(k = 0; k < 2; k++)
 	{
-	  zz = z;
-	  if(z >= PMGRID / 2 + 1)
-	    zz = PMGRID - z;
+	  for(j = 0; j < NTask; j++)
+	    nsend_local[j] = 0;
 
-	  if(x > PMGRID / 2)
-	    kx = x - PMGRID;
-	  else
-	    kx = x;
-	  if(y > PMGRID / 2)
-	    ky = y - PMGRID;
-	  else
-	    ky = y;
-	  if(z > PMGRID / 2)
-	    kz = z - PMGRID;
-	  else
-	    kz = z;
+	  for(i = istart, nbuf = 0; i < NumPart; i++)
+	    {
+	      if(typeweight[P[i].Type] == 0 || P[i].Mass <= 0)
+		continue;
 
-	  k2 = kx * kx + ky * ky + kz * kz;
+	      if(nbuf + 4 > buf_capacity)
+		break;
 
-	  if(k2 > 0)
-	    {
-	      if(k2 < (PMGRID / 2.0) * (PMGRID / 2.0))
+	      for(j = 0; j < 3; j++)
 		{
-		  /* do deconvolution */
+		  u[j] = fmod(WRAP_POSITION_UNIFORM_BOX(P[i].Pos[j]) * fac, (double) PMGRID);
+		  if(u[j] < 0)
+		    u[j] += PMGRID;
+		}
 
-		  fx = fy = fz = 1;
-		  if(kx != 0)
-		    {
-		      fx = (M_PI * kx) / PMGRID;
-		      fx = sin(fx) / fx;
-		    }
-		  if(ky != 0)
-		    {
-		      fy = (M_PI * ky) / PMGRID;
-		      fy = sin(fy) / fy;
-		    }
-		  if(kz != 0)
+	      /* slabs floor(u)-1 .. floor(u)+2 cover the TSC stencils of both interlaced grids */
+	      for(ix = (int) u[0] - 1, ntask_p = 0; ix <= (int) u[0] + 2; ix++)
+		{
+		  task = slab_to_task[(ix + PMGRID) % PMGRID];
+		  for(j = 0; j < ntask_p; j++)
+		    if(tasks_p[j] == task)
+		      break;
+		  if(j == ntask_p)
+		    tasks_p[ntask_p++] = task;
+		}
+
+	      for(j = 0; j < ntask_p; j++)
+		{
+		  if(k == 1)
 		    {
-		      fz = (M_PI * kz) / PMGRID;
-		      fz = sin(fz) / fz;
+		      pp = &sendbuf[nsend_offset[tasks_p[j]] + nsend_local[tasks_p[j]]];
+		      for(n = 0; n < 3; n++)
+			pp->u[n] = u[n];
+		      pp->w = P[i].Mass * typeweight[P[i].Type];
 		    }
-		  ff = 1 / (fx * fy * fz);
-		  smth = ff * ff * ff * ff;
-
-		  /* end deconvolution */
-
-		  ip = PMGRID * (PMGRID / 2 + 1) * (y - slabstart_y) + (PMGRID / 2 + 1) * x + zz;
+		  nsend_local[tasks_p[j]]++;
+		  nbuf++;
+		}
+	    }
 
-		  po = (cmplx_re(fft_of_rhogrid[ip]) * cmplx_re(fft_of_rhogrid[ip])
-			+ cmplx_im(fft_of_rhogrid[ip]) * cmplx_im(fft_of_rhogrid[ip]));
+	  if(k == 0)
+	    for(j = 1, nsend_offset[0] = 0; j < NTask; j++)
+	      nsend_offset[j] = nsend_offset[j - 1] + nsend_local[j - 1];
+	}
 
-		  po *= fac * fac * smth;
+      istart = i;
 
-		  k = sqrt(k2) * 2 * M_PI / All.BoxSize;
+      MPI_Alltoall(nsend_local, 1, MPI_INT, nrecv, 1, MPI_INT, MPI_COMM_WORLD);
 
-		  if(flag == 0)
-		    k *= POWERSPEC_FOLDFAC;
+      for(ngrp = 0; ngrp < (1 << PTask); ngrp++)	/* note: for ngrp=0, target is the same task */
+	{
+	  recvTask = ThisTask ^ ngrp;
 
-		  if(k >= K0 && k < K1)
-		    {
-		      bin = log(k / K0) * binfac;
+	  if(recvTask >= NTask)
+	    continue;
 
-		      ponorm = po / PowerSpec_Efstathiou(k);
+	  if(recvTask != ThisTask)
+	    {
+	      MPI_Sendrecv(&sendbuf[nsend_offset[recvTask]], nsend_local[recvTask] * sizeof(struct powerspec_particle), MPI_BYTE,
+			   recvTask, TAG_PM_FOLD,
+			   recvbuf, nrecv[recvTask] * sizeof(struct powerspec_particle), MPI_BYTE,
+			   recvTask, TAG_PM_FOLD, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	      pp = recvbuf;
+	      count = nrecv[recvTask];
+	    }
+	  else
+	    {
+	      pp = &sendbuf[nsend_offset[ThisTask]];
+	      count = nsend_local[ThisTask];
+	    }
 
-		      SumPower[flag][bin] += ponorm;
-		      SumPowerUncorrected[flag][bin] += po;
+	  for(n = 0; n < count; n++, pp++)
+	    {
+	      /* TSC weights around the nearest node */
+	      u[0] = pp->u[0] - off;
+	      u[1] = pp->u[1] - off;
+	      u[2] = pp->u[2] - off;
+
+	      ix = (int) floor(u[0] + 0.5);
+	      d = u[0] - ix;
+	      wx[0] = 0.5 * (0.5 - d) * (0.5 - d);
+	      wx[1] = 0.75 - d * d;
+	      wx[2] = 0.5 * (0.5 + d) * (0.5 + d);
+	      iy = (int) floor(u[1] + 0.5);
+	      d = u[1] - iy;
+	      wy[0] = 0.5 * (0.5 - d) * (0.5 - d);
+	      wy[1] = 0.75 - d * d;
+	      wy[2] = 0.5 * (0.5 + d) * (0.5 + d);
+	      iz = (int) floor(u[2] + 0.5);
+	      d = u[2] - iz;
+	      wz[0] = 0.5 * (0.5 - d) * (0.5 - d);
+	      wz[1] = 0.75 - d * d;
+	      wz[2] = 0.5 * (0.5 + d) * (0.5 + d);
+
+	      for(i = 0; i < 3; i++)
+		{
+		  slab = (ix - 1 + i + 2 * PMGRID) % PMGRID;
+		  if(slab_to_task[slab] != ThisTask)
+		    continue;
+		  slab -= first_slab_of_task[ThisTask];
 
+		  for(j = 0; j < 3; j++)
+		    for(k = 0; k < 3; k++)
+		      rhogrid[(slab * PMGRID + (iy - 1 + j + 2 * PMGRID) % PMGRID) * PMGRID2 + (iz - 1 + k + 2 * PMGRID) % PMGRID] +=
+			pp->w * wx[i] * wy[j] * wz[k];
+		}
+	    }
+	}
 
-		      CountModes[flag][bin] += 1;
+      count = NumPart - istart;	/* local remaining particles */
+      MPI_Allreduce(&count, &rest, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    }
+  while(rest > 0);
 
-#ifdef RAYLEIGH_BINS
-		      if(flag == 1)	/* only for course grid */
-			{
-			  ratio = sqrt(ponorm * RayleighFactor[bin]);
+  myfree(recvbuf);
+  myfree(sendbuf);
+  myfree(nrecv);
+  myfree(nsend);
+  myfree(nsend_offset);
+  myfree(nsend_local);
+}
 
-			  if(ratio > RayleighMax[bin])
-			    RayleighMax[bin] = ratio;
 
-			  if(ratio >= 10.0)
-			    RayleighCountAbove[bin]++;
-			  else
-			    {
-			      i = RAYLEIGH_BINS * ratio / 10.0;
-			      RayleighCountModes[bin][i]++;
-			    }
-			}
+static void powerspec_fft(void)
+{
+#ifndef USE_FFTW3
+  rfftwnd_mpi(fft_forward_plan, 1, rhogrid, NULL, FFTW_TRANSPOSED_ORDER);
+#else
+  fftw_execute(fft_forward_plan);
 #endif
-		    }
-		}
-	    }
-	}
+}
 
-  /* Now compute the power spectrum */
 
-  countbuf = (long long int *) mymalloc("countbuf", NTask * BINS_PS * sizeof(long long));
-  powerbuf = (double *) mymalloc("powerbuf", NTask * BINS_PS * sizeof(double));
+/* measures the (interlaced, TSC-deconvolved) power spectrum of the field defined by typeweight
+   at all folding levels, and adds it to the mode sums in 'res' (which are reduced over the tasks) */
+static void powerspec_measure(double *typeweight, struct powerspec_result *res)
+{
+  int lev, x, y, z, kx, ky, kz, bin, ip;
+  long long nmodes;
+  double fold, k, k2, po, smth, fx, fy, fz, ff, re, im, re2, im2, phase, cph, sph;
 
-  MPI_Allgather(CountModes[flag], BINS_PS * sizeof(long long), MPI_BYTE,
-		countbuf, BINS_PS * sizeof(long long), MPI_BYTE, MPI_COMM_WORLD);
+  memset(res->CountModes, 0, sizeof(res->CountModes));
+  memset(res->SumPower, 0, sizeof(res->SumPower));
+  memset(res->SumPowerUncorrected, 0, sizeof(res->SumPowerUncorrected));
 
-  for(i = 0; i < BINS_PS; i++)
+  for(lev = 0, fold = 1; lev < POWERSPEC_FOLD_LEVELS; lev++, fold *= POWERSPEC_FOLDFAC)
     {
-      CountModes[flag][i] = 0;
-      for(n = 0; n < NTask; n++)
-	CountModes[flag][i] += countbuf[n * BINS_PS + i];
-    }
+      /* shifted grid first; its transform is parked in the second buffer */
+      powerspec_deposit(typeweight, fold, 1);
+      powerspec_fft();
+      memcpy(powerspec_grid2, rhogrid, fftsize * sizeof(fftw_real));
+
+      powerspec_deposit(typeweight, fold, 0);
+      powerspec_fft();
+
+      /* only the stored half (z <= PMGRID/2) is visited; the other modes are their complex conjugates */
+      for(y = slabstart_y; y < slabstart_y + nslab_y; y++)
+	for(x = 0; x < PMGRID; x++)
+	  for(z = 0; z < PMGRID / 2 + 1; z++)
+	    {
+	      kx = (x > PMGRID / 2) ? x - PMGRID : x;
+	      ky = (y > PMGRID / 2) ? y - PMGRID : y;
+	      kz = z;
 
-  MPI_Allgather(SumPower[flag], BINS_PS * sizeof(double), MPI_BYTE,
-		powerbuf, BINS_PS * sizeof(double), MPI_BYTE, MPI_COMM_WORLD);
+	      k2 = kx * kx + ky * ky + kz * kz;
 
-  for(i = 0; i < BINS_PS; i++)
-    {
-      SumPower[flag][i] = 0;
-      for(n = 0; n < NTask; n++)
-	SumPower[flag][i] += powerbuf[n * BINS_PS + i];
-    }
+	      if(k2 <= 0 || k2 >= (PMGRID / 2.0) * (PMGRID / 2.0))
+		continue;
 
-  MPI_Allgather(SumPowerUncorrected[flag], BINS_PS * sizeof(double), MPI_BYTE,
-		powerbuf, BINS_PS * sizeof(double), MPI_BYTE, MPI_COMM_WORLD);
+	      k = sqrt(k2) * 2 * M_PI / All.BoxSize * fold;
+	      if(k < K0 || k >= K1)
+		continue;
 
-  for(i = 0; i < BINS_PS; i++)
-    {
-      SumPowerUncorrected[flag][i] = 0;
-      for(n = 0; n < NTask; n++)
-	SumPowerUncorrected[flag][i] += powerbuf[n * BINS_PS + i];
-    }
+	      ip = PMGRID * (PMGRID / 2 + 1) * (y - slabstart_y) + (PMGRID / 2 + 1) * x + z;
 
-  myfree(powerbuf);
-  myfree(countbuf);
+	      /* the shifted grid has its nodes at u-1/2: undo the phase e^{+i pi (kx+ky+kz)/N} and average */
+	      phase = M_PI * (kx + ky + kz) / PMGRID;
+	      cph = cos(phase);
+	      sph = sin(phase);
+	      re2 = cmplx_re(((fftw_complex *) powerspec_grid2)[ip]);
+	      im2 = cmplx_im(((fftw_complex *) powerspec_grid2)[ip]);
+	      re = 0.5 * (cmplx_re(fft_of_rhogrid[ip]) + re2 * cph + im2 * sph);
+	      im = 0.5 * (cmplx_im(fft_of_rhogrid[ip]) + im2 * cph - re2 * sph);
 
+	      /* TSC deconvolution: W(k) = prod sinc^3 */
+	      fx = fy = fz = 1;
+	      if(kx != 0)
+		{
+		  fx = (M_PI * kx) / PMGRID;
+		  fx = sin(fx) / fx;
+		}
+	      if(ky != 0)
+		{
+		  fy = (M_PI * ky) / PMGRID;
+		  fy = sin(fy) / fy;
+		}
+	      if(kz != 0)
+		{
+		  fz = (M_PI * kz) / PMGRID;
+		  fz = sin(fz) / fz;
+		}
+	      ff = 1 / (fx * fy * fz);
+	      smth = ff * ff * ff * ff * ff * ff;
 
-  for(i = 0; i < BINS_PS; i++)
-    {
-      Kbin[i] = exp((i + 0.5) / binfac + log(K0));
+	      po = (re * re + im * im) * smth;
 
-      if(CountModes[flag][i] > 0)
-	{
-	  Power[flag][i] = PowerSpec_Efstathiou(Kbin[i]) * SumPower[flag][i] / CountModes[flag][i];
-	  PowerUncorrected[flag][i] = SumPowerUncorrected[flag][i] / CountModes[flag][i];
-	}
-      else
-	{
-	  Power[flag][i] = 0;
-	  PowerUncorrected[flag][i] = 0;
-	}
+	      nmodes = (z == 0 || z == PMGRID / 2) ? 1 : 2;
+	      bin = log(k / K0) * binfac;
 
-      Delta[flag][i] = 4 * M_PI * pow(Kbin[i], 3) / pow(2 * M_PI / All.BoxSize, 3) * Power[flag][i];
+	      res->SumPower[lev][bin] += nmodes * po / PowerSpec_Efstathiou(k);
+	      res->SumPowerUncorrected[lev][bin] += nmodes * po;
+	      res->CountModes[lev][bin] += nmodes;
+	    }
+    }
 
-      DeltaUncorrected[flag][i] = 4 * M_PI * pow(Kbin[i], 3) /
-	pow(2 * M_PI / All.BoxSize, 3) * PowerUncorrected[flag][i];
+  MPI_Allreduce(MPI_IN_PLACE, res->CountModes, POWERSPEC_FOLD_LEVELS * BINS_PS, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE, res->SumPower, POWERSPEC_FOLD_LEVELS * BINS_PS, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE, res->SumPowerUncorrected, POWERSPEC_FOLD_LEVELS * BINS_PS, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
 
-      ShotLimit[flag][i] = 4 * M_PI * pow(Kbin[i], 3) /
-	pow(2 * M_PI / All.BoxSize, 3) * (1.0 / power_spec_totnumpart);
-    }
+  for(lev = 0; lev < POWERSPEC_FOLD_LEVELS; lev++)
+    for(bin = 0; bin < BINS_PS; bin++)
+      {
+	if(res->CountModes[lev][bin] > 0)
+	  {
+	    res->Power[lev][bin] = PowerSpec_Efstathiou(Kbin[bin]) * res->SumPower[lev][bin] / res->CountModes[lev][bin];
+	    res->PowerUncorrected[lev][bin] = res->SumPowerUncorrected[lev][bin] / res->CountModes[lev][bin];
+	  }
+	else
+	  {
+	    res->Power[lev][bin] = 0;
+	    res->PowerUncorrected[lev][bin] = 0;
+	  }
+      }
+}
 
-  if(flag == 1)
-    {
-      powerspec_save();
-#ifdef RAYLEIGH_BINS
-      rayleigh_save();
-#endif
-    }
 
-  tend = my_second();
+/* auto-spectrum of the particle types with typeflag set; returns 0 if there is no such mass */
+static int powerspec_auto(int *typeflag, struct powerspec_result *res)
+{
+  int i;
+  double typeweight[6], mass = 0;
+  long long npart = 0;
 
-#ifndef IO_REDUCED_MODE
-  if(ThisTask == 0)
-    {
-      printf("end power spectrum. (step=%d) took %g seconds\n", flag, timediff(tstart, tend));
-      fflush(stdout);
-    }
-#endif
+  for(i = 0; i < NumPart; i++)
+    if(typeflag[P[i].Type] && P[i].Mass > 0)
+      {
+	mass += P[i].Mass;
+	npart++;
+      }
+  MPI_Allreduce(&mass, &res->totmass, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+  MPI_Allreduce(&npart, &res->totnumpart, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+  if(res->totmass <= 0)
+    return 0;
+
+  for(i = 0; i < 6; i++)
+    typeweight[i] = typeflag[i] ? 1 / res->totmass : 0;
+
+  powerspec_measure(typeweight, res);
+
+  return 1;
 }
 
+
 double PowerSpec_Efstathiou(double k)
 {
   double AA, BB, CC, nu, ShapeGamma;
@@ -1875,18 +1969,44 @@ double PowerSpec_Efstathiou(double k)
 void calculate_power_spectra(int num, long long *ntot_type_all)
 {
   int i, typeflag[6];
+  char fname[500];
+  double tstart, tend;
+  struct powerspec_result *res;
+#ifdef OUTPUT_POWERSPEC_CROSS
+  int c, c2, compflag[3][6] = { {1, 0, 0, 0, 0, 0}, {0, 1, 1, 1, 0, 0}, {0, 0, 0, 0, 1, 1} };	/* gas, dark matter, stars (+BHs) */
+  double typeweight[6];
+  struct powerspec_result *comp, *sum;
+#endif
 
-  power_spec_totnumpart = 0;
-
-  for(i = 0; i < 6; i++)
+#ifndef IO_REDUCED_MODE
+  if(ThisTask == 0)
     {
-      typeflag[i] = 1;
-      power_spec_totnumpart += ntot_type_all[i];
+      printf("begin power spectrum. POWERSPEC_FOLDFAC=%d, POWERSPEC_FOLD_LEVELS=%d\n", POWERSPEC_FOLDFAC, POWERSPEC_FOLD_LEVELS);
+      fflush(stdout);
     }
+#endif
+  tstart = my_second();
 
-  sprintf(power_spec_fname, "%s/powerspec_%03d.txt", All.OutputDir, num);
+  K0 = 2 * M_PI / All.BoxSize;	/* minimum k */
+  K1 = K0 * All.BoxSize / All.SofteningTable[1];	/* maximum k */
+  binfac = BINS_PS / (log(K1) - log(K0));
+  for(i = 0; i < BINS_PS; i++)
+    Kbin[i] = exp((i + 0.5) / binfac + log(K0));
 
-  pmforce_periodic(1, typeflag);	/* calculate power spectrum for all particle types */
+#ifndef USE_FFTW3
+  rhogrid = (fftw_real *) mymalloc("rhogrid", maxfftsize * sizeof(d_fftw_real));
+  fft_of_rhogrid = (fftw_complex *) rhogrid;
+#endif
+  powerspec_grid2 = (fftw_real *) mymalloc("powerspec_grid2", maxfftsize * sizeof(d_fftw_real));
+  res = (struct powerspec_result *) mymalloc("res", sizeof(struct powerspec_result));
+
+  for(i = 0; i < 6; i++)
+    typeflag[i] = 1;
+  if(powerspec_auto(typeflag, res))	/* power spectrum for all particle types */
+    {
+      sprintf(fname, "%s/powerspec_%03d.txt", All.OutputDir, num);
+      powerspec_save(fname, res);
+    }
 
 #ifdef OUTPUT_POWERSPEC_EACH_TYPE
   if(ntot_type_all)
@@ -1899,45 +2019,91 @@ void calculate_power_spectra(int num, long long *ntot_type_all)
 	      typeflag[j] = 0;
 
 	    typeflag[i] = 1;
-	    power_spec_totnumpart = ntot_type_all[i];
-
-	    sprintf(power_spec_fname, "%s/powerspec_type%d_%03d.txt", All.OutputDir, i, num);
 
-	    pmforce_periodic(1, typeflag);	/* calculate power spectrum for type i */
+	    if(powerspec_auto(typeflag, res))	/* calculate power spectrum for type i */
+	      {
+		sprintf(fname, "%s/powerspec_type%d_%03d.txt", All.OutputDir, i, num);
+		powerspec_save(fname, res);
+	      }
 	  }
       }
 #endif
+
+#ifdef OUTPUT_POWERSPEC_CROSS
+  /* auto-spectra of gas, dark matter and stars, then their cross-spectra from the summed fields */
+  comp = (struct powerspec_result *) mymalloc("comp", 3 * sizeof(struct powerspec_result));
+  sum = (struct powerspec_result *) mymalloc("sum", sizeof(struct powerspec_result));
+
+  for(c = 0; c < 3; c++)
+    powerspec_auto(compflag[c], &comp[c]);
+
+  for(c = 0; c < 3; c++)
+    for(c2 = c + 1; c2 < 3; c2++)
+      {
+	if(comp[c].totmass <= 0 || comp[c2].totmass <= 0)
+	  continue;
+
+	for(i = 0; i < 6; i++)
+	  typeweight[i] = compflag[c][i] / comp[c].totmass + compflag[c2][i] / comp[c2].totmass;
+
+	powerspec_measure(typeweight, sum);
+
+	sprintf(fname, "%s/powerspec_cross_%d%d_%03d.txt", All.OutputDir, c, c2, num);
+	powerspec_save_cross(fname, &comp[c], &comp[c2], sum);
+      }
+
+  myfree(sum);
+  myfree(comp);
+#endif
+
+  myfree(res);
+  myfree(powerspec_grid2);
+#ifndef USE_FFTW3
+  myfree(rhogrid);
+#endif
+
+  tend = my_second();
+
+#ifndef IO_REDUCED_MODE
+  if(ThisTask == 0)
+    {
+      printf("end power spectrum. took %g seconds\n", timediff(tstart, tend));
+      fflush(stdout);
+    }
+#endif
 }
 
-void powerspec_save(void)
+
+/* writes one block per folding level, from the most folded one down to the unfolded one */
+static void powerspec_save(char *fname, struct powerspec_result *res)
 {
   FILE *fd;
   char buf[500];
-  int i, flag;
+  int i, lev;
+  double kfac;
 
   if(ThisTask == 0)
     {
-      if(!(fd = fopen(power_spec_fname, "w")))
+      if(!(fd = fopen(fname, "w")))
 	{
-	  sprintf(buf, "can't open file `%s`\n", power_spec_fname);
+	  sprintf(buf, "can't open file `%s`\n", fname);
 	  terminate(buf);
 	}
 
-      for(flag = 0; flag < 2; flag++)
+      for(lev = POWERSPEC_FOLD_LEVELS - 1; lev >= 0; lev--)
 	{
 	  fprintf(fd, "%g\n", All.Time);
 	  i = BINS_PS;
 	  fprintf(fd, "%d\n", i);
-	  fprintf(fd, "%g\n", power_spec_totmass);
-	  fprintf(fd, "%d%09d\n", (int) (power_spec_totnumpart / 1000000000),
-		  (int) (power_spec_totnumpart % 1000000000));
+	  fprintf(fd, "%g\n", res->totmass);
+	  fprintf(fd, "%d%09d\n", (int) (res->totnumpart / 1000000000), (int) (res->totnumpart % 1000000000));
 
 	  for(i = 0; i < BINS_PS; i++)
 	    {
-	      fprintf(fd, "%g %g %g %g %g %g %g %g %g %g\n", Kbin[i], Delta[flag][i], ShotLimit[flag][i],
-		      Power[flag][i], (double) CountModes[flag][i], DeltaUncorrected[flag][i],
-		      PowerUncorrected[flag][i], PowerSpec_Efstathiou(Kbin[i]), SumPower[flag][i],
-		      4 * M_PI * pow(Kbin[i], 3) / pow(2 * M_PI / All.BoxSize, 3));
+	      kfac = 4 * M_PI * pow(Kbin[i], 3) / pow(2 * M_PI / All.BoxSize, 3);
+	      fprintf(fd, "%g %g %g %g %g %g %g %g %g %g\n", Kbin[i], kfac * res->Power[lev][i], kfac / res->totnumpart,
+		      res->Power[lev][i], (double) res->CountModes[lev][i], kfac * res->PowerUncorrected[lev][i],
+		      res->PowerUncorrected[lev][i], PowerSpec_Efstathiou(Kbin[i]), res->SumPower[lev][i], kfac);
 	    }
 	}
       fclose(fd);
@@ -1945,273 +2111,40 @@ void powerspec_save(void)
 }
 
 
-
-void foldonitself(int *typelist)
+#ifdef OUTPUT_POWERSPEC_CROSS
+/* cross-spectrum of components a and b, given the spectrum of their summed overdensity field */
+static void powerspec_save_cross(char *fname, struct powerspec_result *a, struct powerspec_result *b, struct powerspec_result *sum)
 {
-  int i, j, level, sendTask, recvTask, istart, nbuf, n, rest, iter = 0;
-  int slab_x, slab_xx, slab_y, slab_yy, slab_z, slab_zz;
-  int *nsend_local, *nsend_offset, *nsend, count, buf_capacity;
-  double to_slab_fac_folded, dx, dy, dz;
-  double tstart0, tstart, tend, t0, t1;
-  MyDouble pp[3];
-  MyFloat *pos_sendbuf, *pos_recvbuf, *pos;
-  MPI_Status status;
+  FILE *fd;
+  char buf[500];
+  int i, lev;
+  double kfac, pab;
 
-#ifndef IO_REDUCED_MODE
   if(ThisTask == 0)
     {
-      printf("begin folding for power spectrum estimation...\n");
-      fflush(stdout);
-    }
-#endif
-  tstart0 = tstart = my_second();
-
-  nsend_local = (int *) mymalloc("nsend_local", NTask * sizeof(int));
-  nsend_offset = (int *) mymalloc("nsend_offset", NTask * sizeof(int));
-  nsend = (int *) mymalloc("nsend", NTask * NTask * sizeof(int));
-
-  buf_capacity = (maxfftsize * sizeof(d_fftw_real)) / (4 * sizeof(MyFloat));
-  buf_capacity /= 2;
-
-  pos_sendbuf = (MyFloat *) forcegrid;
-  pos_recvbuf = pos_sendbuf + 4 * buf_capacity;
-
-  to_slab_fac_folded = to_slab_fac * POWERSPEC_FOLDFAC;
-
-  for(i = 0; i < fftsize; i++)	/* clear local density field */
-    rhogrid[i] = 0;
-
-  istart = 0;
-
-  do
-    {
-      t0 = my_second();
-
-      for(i = 0; i < NTask; i++)
-	nsend_local[i] = 0;
-
-      for(i = istart, nbuf = 0; i < NumPart; i++)
-	{
-	  if(typelist[P[i].Type] == 0)
-	    continue;
-
-	  if(nbuf + 1 >= buf_capacity)
-	    break;
-
-
-	  /* make sure that particles are properly box-wrapped */
-	  pp[0] = P[i].Pos[0]; 
-	  pp[0] = WRAP_POSITION_UNIFORM_BOX(pp[0]);
-
-	  slab_x = to_slab_fac_folded * pp[0];
-	  slab_xx = slab_x + 1;
-	  slab_x %= PMGRID;
-	  slab_xx %= PMGRID;
-
-	  nsend_local[slab_to_task[slab_x]]++;
-	  nbuf++;
-
-	  if(slab_to_task[slab_x] != slab_to_task[slab_xx])
-	    {
-	      nsend_local[slab_to_task[slab_xx]]++;
-	      nbuf++;
-	    }
-	}
-
-      for(i = 1, nsend_offset[0] = 0; i < NTask; i++)
-	nsend_offset[i] = nsend_offset[i - 1] + nsend_local[i - 1];
-
-      for(i = 0; i < NTask; i++)
-	nsend_local[i] = 0;
-
-      for(i = istart, nbuf = 0; i < NumPart; i++)
+      if(!(fd = fopen(fname, "w")))
 	{
-	  if(typelist[P[i].Type] == 0) continue;
-        if(P[i].Mass <= 0) continue;
-
-	  if(nbuf + 1 >= buf_capacity)
-	    break;
-
-	  /* make sure that particles are properly box-wrapped */
-	  pp[0] = P[i].Pos[0]; 
-	  pp[0] = WRAP_POSITION_UNIFORM_BOX(pp[0]);
-
-	  slab_x = to_slab_fac_folded * pp[0];
-	  slab_xx = slab_x + 1;
-	  slab_x %= PMGRID;
-	  slab_xx %= PMGRID;
-
-	  for(j = 0; j < 3; j++)
-	    pos_sendbuf[4 * (nsend_offset[slab_to_task[slab_x]] + nsend_local[slab_to_task[slab_x]]) + j] =
-	      P[i].Pos[j];
-
-	  pos_sendbuf[4 * (nsend_offset[slab_to_task[slab_x]] + nsend_local[slab_to_task[slab_x]]) + 3] =
-	    P[i].Mass;
-
-	  nsend_local[slab_to_task[slab_x]]++;
-	  nbuf++;
-
-	  if(slab_to_task[slab_x] != slab_to_task[slab_xx])
-	    {
-	      for(j = 0; j < 3; j++)
-		pos_sendbuf[4 * (nsend_offset[slab_to_task[slab_xx]] + nsend_local[slab_to_task[slab_xx]]) +
-			    j] = P[i].Pos[j];
-
-	      pos_sendbuf[4 * (nsend_offset[slab_to_task[slab_xx]] + nsend_local[slab_to_task[slab_xx]]) +
-			  3] = P[i].Mass;
-
-
-	      nsend_local[slab_to_task[slab_xx]]++;
-	      nbuf++;
-	    }
+	  sprintf(buf, "can't open file `%s`\n", fname);
+	  terminate(buf);
 	}
 
-      istart = i;
-
-
-      MPI_Allgather(nsend_local, NTask, MPI_INT, nsend, NTask, MPI_INT, MPI_COMM_WORLD);
-
-      t1 = my_second();
-#ifndef IO_REDUCED_MODE
-      if(ThisTask == 0)
+      for(lev = POWERSPEC_FOLD_LEVELS - 1; lev >= 0; lev--)
 	{
-	  printf("buffer filled (took %g sec)\n", timediff(t0, t1));
-	  fflush(stdout);
-	}
-#endif
-      t0 = my_second();
-      for(level = 0; level < (1 << PTask); level++)	/* note: for level=0, target is the same task */
-	{
-	  sendTask = ThisTask;
-	  recvTask = ThisTask ^ level;
+	  fprintf(fd, "%g\n", All.Time);
+	  i = BINS_PS;
+	  fprintf(fd, "%d\n", i);
 
-	  if(recvTask < NTask)
+	  for(i = 0; i < BINS_PS; i++)
 	    {
-	      if(recvTask != sendTask)
-		{
-		  MPI_Sendrecv(&pos_sendbuf[4 * nsend_offset[recvTask]],
-			       4 * nsend_local[recvTask] * sizeof(MyFloat), MPI_BYTE,
-			       recvTask, TAG_PM_FOLD,
-			       &pos_recvbuf[0],
-			       4 * nsend[recvTask * NTask + ThisTask] * sizeof(MyFloat), MPI_BYTE,
-			       recvTask, TAG_PM_FOLD, MPI_COMM_WORLD, &status);
-
-		  pos = &pos_recvbuf[0];
-		  count = nsend[recvTask * NTask + ThisTask];
-		}
-	      else
-		{
-		  pos = &pos_sendbuf[4 * nsend_offset[ThisTask]];
-		  count = nsend_local[ThisTask];
-		}
-
-	      for(n = 0; n < count; n++, pos += 4)
-		{
-		  /* make sure that particles are properly box-wrapped */
-		  for(j = 0; j < 3; j++)
-		    {
-		      pp[j] = pos[j]; 
-		      pp[j] = WRAP_POSITION_UNIFORM_BOX(pp[j]);
-		    }
-
-		  slab_x = to_slab_fac_folded * pp[0];
-		  dx = to_slab_fac_folded * pp[0] - slab_x;
-		  slab_xx = slab_x + 1;
-		  slab_x %= PMGRID;
-		  slab_xx %= PMGRID;
-
-		  slab_y = to_slab_fac_folded * pp[1];
-		  dy = to_slab_fac_folded * pp[1] - slab_y;
-		  slab_yy = slab_y + 1;
-		  slab_y %= PMGRID;
-		  slab_yy %= PMGRID;
-
-		  slab_z = to_slab_fac_folded * pp[2];
-		  dz = to_slab_fac_folded * pp[2] - slab_z;
-		  slab_zz = slab_z + 1;
-		  slab_z %= PMGRID;
-		  slab_zz %= PMGRID;
-
-		  float mass = pos[3];
-
-		  if(slab_to_task[slab_x] == ThisTask)
-		    {
-		      slab_x -= first_slab_of_task[ThisTask];
-
-		      rhogrid[(slab_x * PMGRID + slab_y) * PMGRID2 + slab_z] +=
-			mass * (1.0 - dx) * (1.0 - dy) * (1.0 - dz);
-		      rhogrid[(slab_x * PMGRID + slab_yy) * PMGRID2 + slab_z] +=
-			mass * (1.0 - dx) * dy * (1.0 - dz);
-		      rhogrid[(slab_x * PMGRID + slab_y) * PMGRID2 + slab_zz] +=
-			mass * (1.0 - dx) * (1.0 - dy) * dz;
-		      rhogrid[(slab_x * PMGRID + slab_yy) * PMGRID2 + slab_zz] += mass * (1.0 - dx) * dy * dz;
-		    }
-
-		  if(slab_to_task[slab_xx] == ThisTask)
-		    {
-		      slab_xx -= first_slab_of_task[ThisTask];
-
-		      rhogrid[(slab_xx * PMGRID + slab_y) * PMGRID2 + slab_z] +=
-			mass * (dx) * (1.0 - dy) * (1.0 - dz);
-		      rhogrid[(slab_xx * PMGRID + slab_yy) * PMGRID2 + slab_z] +=
-			mass * (dx) * dy * (1.0 - dz);
-		      rhogrid[(slab_xx * PMGRID + slab_y) * PMGRID2 + slab_zz] +=
-			mass * (dx) * (1.0 - dy) * dz;
-		      rhogrid[(slab_xx * PMGRID + slab_yy) * PMGRID2 + slab_zz] += mass * (dx) * dy * dz;
-		    }
-
-		}
+	      kfac = 4 * M_PI * pow(Kbin[i], 3) / pow(2 * M_PI / All.BoxSize, 3);
+	      pab = 0.5 * (sum->Power[lev][i] - a->Power[lev][i] - b->Power[lev][i]);
+	      fprintf(fd, "%g %g %g %g\n", Kbin[i], kfac * pab, pab, (double) sum->CountModes[lev][i]);
 	    }
 	}
-
-      count = NumPart - istart;	/* local remaining particles */
-      MPI_Allreduce(&count, &rest, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
-      iter++;
-
-      t1 = my_second();
-#ifndef IO_REDUCED_MODE
-      if(ThisTask == 0)
-	{
-	  printf("particles exchanged and binned. (took %g sec) max-rest=%d\n", timediff(t0, t1), rest);
-	  fflush(stdout);
-	}
-#endif
-    }
-  while(rest > 0);
-
-  tend = my_second();
-
-#ifndef IO_REDUCED_MODE
-  if(ThisTask == 0)
-    {
-      printf("folded density field assembled (took %g seconds, iter=%d)\n", timediff(tstart, tend), iter);
-      fflush(stdout);
-    }
-#endif
-  tstart = my_second();
-
-  /* Do the FFT of the self-folded density field */
-#ifndef USE_FFTW3
-  rfftwnd_mpi(fft_forward_plan, 1, rhogrid, workspace, FFTW_TRANSPOSED_ORDER);
-#else 
-  fftw_execute(fft_forward_plan);
-#endif
-
-  tend = my_second();
-
-#ifndef IO_REDUCED_MODE
-  if(ThisTask == 0)
-    {
-      printf("FFT for folded density done (took %g seconds)\n", timediff(tstart, tend));
-      fflush(stdout);
+      fclose(fd);
     }
-#endif
-  myfree(nsend);
-  myfree(nsend_offset);
-  myfree(nsend_local);
-
-  tend = my_second();
 }
+#endif
 
 
 #ifdef OUTPUT_LONGRANGE_POTENTIAL
@@ -77,7 +77,7 @@
                 cmag = MINMOD(dmet,cmag); // limiter based on mass exchange from MFV HLLC solver //
 #endif
                 out.ChimesIonsYield[k_species] += cmag;
-                SphP[j].ChimesNIons[k_species] -= cmag;
+                HYDRO_PAIR_ADD(SphP[j].ChimesNIons[k_species], -cmag);
             }
         }
     } 
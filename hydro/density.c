@@ -1182,9 +1182,11 @@ void density(void)
 int density_evaluate(int target, int mode, int *exportflag, int *exportnodecount, int *exportindex,
                      int *ngblist)
 {
-    int j, n;
+    int j, n, n0, n1, nb, k;
     int startnode, numngb_inbox, listindex = 0;
     double r2, h2, u, mass_j, wk;
+    int batch_j[KERNEL_BATCH_SIZE];
+    double batch_dp[KERNEL_BATCH_SIZE][3], batch_r[KERNEL_BATCH_SIZE], batch_u[KERNEL_BATCH_SIZE], batch_wk[KERNEL_BATCH_SIZE], batch_dwk[KERNEL_BATCH_SIZE];
     struct kernel_density kernel;
     struct densdata_in local;
     struct densdata_out out;
@@ -1221,29 +1223,47 @@ int density_evaluate(int target, int mode, int *exportflag, int *exportnodecount
             
             if(numngb_inbox < 0) return -1;
             
-            for(n = 0; n < numngb_inbox; n++)
+            for(n0 = 0; n0 < numngb_inbox; n0 += KERNEL_BATCH_SIZE)
             {
-                j = ngblist[n];
+                /* first pass over this block of the neighbor list: collect the particles inside the kernel, so
+                    the kernel can be evaluated for all of them in one (vectorized) call below */
+                n1 = n0 + KERNEL_BATCH_SIZE; if(n1 > numngb_inbox) {n1 = numngb_inbox;}
+                for(n = n0, nb = 0; n < n1; n++)
+                {
+                    j = ngblist[n];
 #ifdef GALSF_SUBGRID_WINDS
-                if(SphP[j].DelayTime > 0)	/* partner is a wind particle */
-                    if(!(local.DelayTime > 0))	/* if I'm not wind, then ignore the wind particle */
-                        continue;
+                    if(SphP[j].DelayTime > 0)	/* partner is a wind particle */
+                        if(!(local.DelayTime > 0))	/* if I'm not wind, then ignore the wind particle */
+                            continue;
 #endif
-                if(P[j].Mass <= 0) continue;
-                
-                kernel.dp[0] = local.Pos[0] - P[j].Pos[0];
-                kernel.dp[1] = local.Pos[1] - P[j].Pos[1];
-                kernel.dp[2] = local.Pos[2] - P[j].Pos[2];
+                    if(P[j].Mass <= 0) continue;
+                    
+                    kernel.dp[0] = local.Pos[0] - P[j].Pos[0];
+                    kernel.dp[1] = local.Pos[1] - P[j].Pos[1];
+                    kernel.dp[2] = local.Pos[2] - P[j].Pos[2];
 #ifdef BOX_PERIODIC
-                NEAREST_XYZ(kernel.dp[0],kernel.dp[1],kernel.dp[2],1);
+                    NEAREST_XYZ(kernel.dp[0],kernel.dp[1],kernel.dp[2],1);
 #endif
-                r2 = kernel.dp[0] * kernel.dp[0] + kernel.dp[1] * kernel.dp[1] + kernel.dp[2] * kernel.dp[2];
+                    r2 = kernel.dp[0] * kernel.dp[0] + kernel.dp[1] * kernel.dp[1] + kernel.dp[2] * kernel.dp[2];
+                    if(r2 < h2)
+                    {
+                        batch_j[nb] = j;
+                        batch_dp[nb][0] = kernel.dp[0]; batch_dp[nb][1] = kernel.dp[1]; batch_dp[nb][2] = kernel.dp[2];
+                        batch_r[nb] = sqrt(r2);
+                        batch_u[nb] = batch_r[nb] * kernel.hinv;
+                        nb++;
+                    }
+                }
+                kernel_main_batch(nb, batch_u, kernel.hinv3, kernel.hinv4, batch_wk, batch_dwk);
                 
-                if(r2 < h2)
+                for(k = 0; k < nb; k++)
                 {
-                    kernel.r = sqrt(r2);
-                    u = kernel.r * kernel.hinv;
-                    kernel_main(u, kernel.hinv3, kernel.hinv4, &kernel.wk, &kernel.dwk, 0);
+                    j = batch_j[k];
+                    kernel.dp[0] = batch_dp[k][0]; kernel.dp[1] = batch_dp[k][1]; kernel.dp[2] = batch_dp[k][2];
+                    kernel.r = batch_r[k];
+                    u = batch_u[k];
+                    kernel.wk = batch_wk[k];
+                    kernel.dwk = batch_dwk[k];
                     mass_j = P[j].Mass;
                     kernel.mj_wk = FLT(mass_j * kernel.wk);
                     
@@ -1299,7 +1319,7 @@ int density_evaluate(int target, int mode, int *exportflag, int *exportnodecount
                         
                         density_evaluate_extra_physics_gas(&local, &out, &kernel, j);
                     } // kernel.r > 0 //
-                }
+                } // for(k = 0; k < nb; k++)
             }
         }
         
@@ -543,6 +543,58 @@ void construct_gradient(double *grad, int i)
 }
 
 
+#ifdef HYDRO_REUSE_GRADIENT_NGBLIST
+/* the hydro loop searches for exactly the same neighbors as the gradient loop (same positions, kernel lengths, and
+    tree, since nothing in between changes them), so the lists found in the last gradient sweep are kept and handed to
+    the hydro loop. only particles whose search was entirely local are cached: the others still need their tree walk
+    in the hydro loop to build the export list. the cache is allocated here and freed at the end of hydro_force, so
+    it is never used outside of the gradient->hydro sequence it was built in. */
+void hydro_ngblist_cache_allocate(void)
+{
+    int i; long long n_active = 0, n_budget;
+    for(i = FirstActiveParticle; i >= 0; i = NextActiveParticle[i]) {if(P[i].Type==0) {n_active++;}}
+    HydroNgbCache_Num = (int *) mymalloc("HydroNgbCache_Num", N_gas * sizeof(int));
+    HydroNgbCache_Offset = (int *) mymalloc("HydroNgbCache_Offset", N_gas * sizeof(int));
+    /* leave room for everything the gradient and hydro loops still allocate on top of the cache; particles that
+        don't fit in the remaining space simply aren't cached */
+    n_budget = ((long long) FreeBytes - (long long) maxThreads * NumPart * sizeof(int) - (long long) N_gas * sizeof(struct temporary_data_topass)
+                - (long long) 3 * All.BufferSize * 1024 * 1024) / (long long) sizeof(int);
+    HydroNgbCache_Size = (long long) DMIN((double) n_active * 4 * All.DesNumNgb, (double) n_budget);
+    if(HydroNgbCache_Size > 2147483647LL) {HydroNgbCache_Size = 2147483647LL;} /* offsets are stored as int */
+    if(HydroNgbCache_Size < 0) {HydroNgbCache_Size = 0;}
+    HydroNgbCache_List = (int *) mymalloc("HydroNgbCache_List", (HydroNgbCache_Size + 1) * sizeof(int));
+    for(i = 0; i < N_gas; i++) {HydroNgbCache_Num[i] = -1;}
+    HydroNgbCache_Used = 0;
+}
+
+void hydro_ngblist_cache_free(void)
+{
+    myfree(HydroNgbCache_List);
+    myfree(HydroNgbCache_Offset);
+    myfree(HydroNgbCache_Num);
+    HydroNgbCache_Num = NULL;
+}
+
+/* stores the (complete, local) neighbor list of particle 'i', if there is still room for it */
+static inline void hydro_ngblist_cache_store(int i, int numngb, int *ngblist)
+{
+    long long offset = -1;
+    LOCK_NEXPORT;
+#ifdef _OPENMP
+#pragma omp critical(_nexport_)
+#endif
+    {
+        if(HydroNgbCache_Used + numngb <= HydroNgbCache_Size) {offset = HydroNgbCache_Used; HydroNgbCache_Used += numngb;}
+    }
+    UNLOCK_NEXPORT;
+    if(offset < 0) return;
+    memcpy(HydroNgbCache_List + offset, ngblist, numngb * sizeof(int));
+    HydroNgbCache_Offset[i] = (int) offset;
+    HydroNgbCache_Num[i] = numngb;
+}
+#endif
+
+
 
 
 void hydro_gradient_calc(void)
@@ -562,6 +614,9 @@ void hydro_gradient_calc(void)
  
     /* allocate buffers to arrange communication */
     long long NTaskTimesNumPart;
+#ifdef HYDRO_REUSE_GRADIENT_NGBLIST
+    hydro_ngblist_cache_allocate(); /* must come first: this is freed at the end of hydro_force */
+#endif
     GasGradDataPasser = (struct temporary_data_topass *) mymalloc("GasGradDataPasser",N_gas * sizeof(struct temporary_data_topass));
     NTaskTimesNumPart = maxThreads * NumPart;
     size_t MyBufferSize = All.BufferSize;
@@ -1788,9 +1843,10 @@ int GasGrad_evaluate(int target, int mode, int *exportflag, int *exportnodecount
 {
     int startnode, numngb, listindex = 0;
     int j, k, k2, n, swap_to_j;
-    double hinv, hinv3, hinv4, r2, u, hinv_j, hinv3_j, hinv4_j;
+    double hinv, hinv3, hinv4, r2;
+    struct kernel_pair_block kb; /* kernels of the current block of the neighbor list, evaluated together */
 #ifdef TURB_DIFF_DYNAMIC
-    double hhat_i, hhat_j, hhatinv_i, hhatinv3_i, hhatinv4_i, hhatinv_j, hhatinv3_j, hhatinv4_j, wkhat_i, wkhat_j, dwkhat_i, dwkhat_j;
+    double hhat_i, hhat_j, hhatinv_i, hhatinv3_i, hhatinv4_i, hhatinv_j, hhatinv3_j, hhatinv4_j, wkhat_i, wkhat_j, dwkhat_i, dwkhat_j, u;
     double tstart, tend;
 #endif
     struct kernel_GasGrad kernel;
@@ -1826,12 +1882,6 @@ int GasGrad_evaluate(int target, int mode, int *exportflag, int *exportnodecount
     double V_i;
     V_i = local.Mass / local.GQuant.Density;
     
-    int kernel_mode_i = -1; // only need to calculate wk, by default
-    if(sph_gradients_flag_i) kernel_mode_i = 0; // for sph, only need dwk
-#if defined(HYDRO_SPH) || defined(KERNEL_CRK_FACES)
-    kernel_mode_i = 0; // for some circumstances, we require both wk and dwk //
-#endif
-    
     
     /* Now start the actual neighbor computation for this particle */
     
@@ -1854,14 +1904,22 @@ int GasGrad_evaluate(int target, int mode, int *exportflag, int *exportnodecount
                 numngb = ngb_treefind_pairs_threads(local.Pos, All.TurbDynamicDiffFac * kernel.h_i, target, &startnode, mode, exportflag, exportnodecount, exportindex, ngblist);
             }
             else {
+#endif
+#ifdef HYDRO_REUSE_GRADIENT_NGBLIST
+            /* reset the cache entry (this particle may be re-processed after the export buffer filled up), the walk sets it to -2 if anything is exported */
+            if(mode == 0 && gradient_iteration == NUMBER_OF_GRADIENT_ITERATIONS-1) {HydroNgbCache_Num[target] = -1;}
 #endif
             numngb = ngb_treefind_pairs_threads(local.Pos, kernel.h_i, target, &startnode, mode, exportflag, exportnodecount, exportindex, ngblist);
+#ifdef HYDRO_REUSE_GRADIENT_NGBLIST
+            if(numngb >= 0 && mode == 0 && gradient_iteration == NUMBER_OF_GRADIENT_ITERATIONS-1 && HydroNgbCache_Num[target] == -1) {hydro_ngblist_cache_store(target, numngb, ngblist);}
+#endif
 #ifdef TURB_DIFF_DYNAMIC
             }
 #endif
             
             if(numngb < 0)
                 return -1;
+            kb.n0 = kb.n1 = 0; /* new neighbor list */
             
             for(n = 0; n < numngb; n++)
             {
@@ -1920,10 +1978,11 @@ int GasGrad_evaluate(int target, int mode, int *exportflag, int *exportnodecount
                 if((r2 >= h2_i) && (r2 >= h_j * h_j)) continue;
                 
                 kernel.r = sqrt(r2);
+                if(n >= kb.n1) {kernel_pair_block_fill(&kb, n, numngb, ngblist, local.Pos, kernel.h_i, hinv, hinv3, hinv4);}
                 if(kernel.r < kernel.h_i)
                 {
-                    u = kernel.r * hinv;
-                    kernel_main(u, hinv3, hinv4, &kernel.wk_i, &kernel.dwk_i, kernel_mode_i);
+                    kernel.wk_i = kb.wk_i[n - kb.n0];
+                    kernel.dwk_i = kb.dwk_i[n - kb.n0];
                 }
                 else
                 {
@@ -1935,17 +1994,11 @@ int GasGrad_evaluate(int target, int mode, int *exportflag, int *exportnodecount
                 if((kernel.r < h_j) && (swap_to_j))
 #endif
                 {
-                    /* ok, we need the j-particle weights, but first check what kind of gradient we are calculating */
+                    /* ok, we need the j-particle weights, but first check what kind of gradient we are calculating
+                        (the block evaluation gives both wk and dwk, whichever of them the gradient below uses) */
                     sph_gradients_flag_j = SHOULD_I_USE_SPH_GRADIENTS(SphP[j].ConditionNumber);
-                    int kernel_mode_j;
-#if defined(HYDRO_SPH) || defined(KERNEL_CRK_FACES)
-                    kernel_mode_j = 0; // for some circumstances, we require both wk and dwk //
-#else
-                    if(sph_gradients_flag_j) {kernel_mode_j=0;} else {kernel_mode_j=-1;}
-#endif
-                    kernel_hinv(h_j, &hinv_j, &hinv3_j, &hinv4_j);
-                    u = kernel.r * hinv_j;
-                    kernel_main(u, hinv3_j, hinv4_j, &kernel.wk_j, &kernel.dwk_j, kernel_mode_j);
+                    kernel.wk_j = kb.wk_j[n - kb.n0];
+                    kernel.dwk_j = kb.dwk_j[n - kb.n0];
                 }
                 else
                 {
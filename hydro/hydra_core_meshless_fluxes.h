@@ -0,0 +1,209 @@
+/* --------------------------------------------------------------------------------- */
+/* this is the second half of the meshless 'core': given the solution of the pair-wise
+    Riemann problem set up in hydra_core_meshless.h (in Riemann_out), check it, re-try
+    with lower-order states if needed, and compute the fluxes for the equations of motion */
+/*
+ * This file was written by Phil Hopkins (phopkins@caltech.edu) for GIZMO.
+ */
+/* --------------------------------------------------------------------------------- */
+{
+    if(Face_Area_Norm == 0)
+    {
+        memset(&Fluxes, 0, sizeof(struct Conserved_var_Riemann));
+#ifdef DIVBCLEANING_DEDNER
+        Riemann_out.phi_normal_mean=Riemann_out.phi_normal_db=0;
+#endif
+    } else {
+        /* before going on, check to make sure we have a valid Riemann solution */
+        if((Riemann_out.P_M<0)||(isnan(Riemann_out.P_M))||(Riemann_out.P_M>1.4*press_tot_limiter))
+        {
+            /* go to a linear reconstruction of P, rho, and v, and re-try */
+            Riemann_vec.R.p = Pressure_i; Riemann_vec.L.p = Pressure_j;
+            Riemann_vec.R.rho = local.Density; Riemann_vec.L.rho = SphP[j].Density;
+            for(k=0;k<3;k++) {Riemann_vec.R.v[k]=local.Vel[k]-v_frame[k]; Riemann_vec.L.v[k]=VelPred_j[k]-v_frame[k];}
+#ifdef MAGNETIC
+            for(k=0;k<3;k++) {Riemann_vec.R.B[k]=local.BPred[k]; Riemann_vec.L.B[k]=BPred_j[k];}
+#ifdef DIVBCLEANING_DEDNER
+            Riemann_vec.R.phi = local.PhiPred; Riemann_vec.L.phi = PhiPred_j;
+#endif
+#endif
+#ifdef EOS_GENERAL
+            Riemann_vec.R.u = local.InternalEnergyPred; Riemann_vec.L.u = SphP[j].InternalEnergyPred;
+            Riemann_vec.R.cs = kernel.sound_i; Riemann_vec.L.cs = kernel.sound_j;
+#endif
+            Riemann_solver(Riemann_vec, &Riemann_out, n_unit, 1.4*press_tot_limiter);
+            if((Riemann_out.P_M<0)||(isnan(Riemann_out.P_M)))
+            {
+                /* ignore any velocity difference between the particles: this should gaurantee we have a positive pressure! */
+                Riemann_vec.R.p = Pressure_i; Riemann_vec.L.p = Pressure_j;
+                Riemann_vec.R.rho = local.Density; Riemann_vec.L.rho = SphP[j].Density;
+                for(k=0;k<3;k++) {Riemann_vec.R.v[k]=0; Riemann_vec.L.v[k]=0;}
+#ifdef MAGNETIC
+                for(k=0;k<3;k++) {Riemann_vec.R.B[k]=local.BPred[k]; Riemann_vec.L.B[k]=BPred_j[k];}
+#ifdef DIVBCLEANING_DEDNER
+                Riemann_vec.R.phi = local.PhiPred; Riemann_vec.L.phi = PhiPred_j;
+#endif
+#endif
+#ifdef EOS_GENERAL
+                Riemann_vec.R.u = local.InternalEnergyPred; Riemann_vec.L.u = SphP[j].InternalEnergyPred;
+                Riemann_vec.R.cs = kernel.sound_i; Riemann_vec.L.cs = kernel.sound_j;
+#endif
+                Riemann_solver(Riemann_vec, &Riemann_out, n_unit, 2.0*press_tot_limiter);
+                if((Riemann_out.P_M<0)||(isnan(Riemann_out.P_M)))
+                {
+#if defined(MAGNETIC) && defined(DIVBCLEANING_DEDNER)
+                    printf("Riemann Solver Failed to Find Positive Pressure!: Pmax=%g PL/M/R=%g/%g/%g Mi/j=%g/%g rhoL/R=%g/%g H_ij=%g/%g vL=%g/%g/%g vR=%g/%g/%g n_unit=%g/%g/%g BL=%g/%g/%g BR=%g/%g/%g phiL/R=%g/%g \n",
+                           press_tot_limiter,Riemann_vec.L.p,Riemann_out.P_M,Riemann_vec.R.p,local.Mass,P[j].Mass,Riemann_vec.L.rho,Riemann_vec.R.rho,local.Hsml,PPP[j].Hsml,
+                           local.Vel[0]-v_frame[0],local.Vel[1]-v_frame[1],local.Vel[2]-v_frame[2],
+                           VelPred_j[0]-v_frame[0],VelPred_j[1]-v_frame[1],VelPred_j[2]-v_frame[2],
+                           n_unit[0],n_unit[1],n_unit[2],
+                           Riemann_vec.L.B[0],Riemann_vec.L.B[1],Riemann_vec.L.B[2],
+                           Riemann_vec.R.B[0],Riemann_vec.R.B[1],Riemann_vec.R.B[2],
+                           Riemann_vec.L.phi,Riemann_vec.R.phi);
+#else
+                    printf("Riemann Solver Failed to Find Positive Pressure!: Pmax=%g PL/M/R=%g/%g/%g Mi/j=%g/%g rhoL/R=%g/%g vL=%g/%g/%g vR=%g/%g/%g n_unit=%g/%g/%g \n",
+                           press_tot_limiter,Riemann_vec.L.p,Riemann_out.P_M,Riemann_vec.R.p,local.Mass,P[j].Mass,Riemann_vec.L.rho,Riemann_vec.R.rho,
+                           Riemann_vec.L.v[0],Riemann_vec.L.v[1],Riemann_vec.L.v[2],
+                           Riemann_vec.R.v[0],Riemann_vec.R.v[1],Riemann_vec.R.v[2],n_unit[0],n_unit[1],n_unit[2]);
+#endif
+                    exit(1234);
+                }
+            }
+        } // closes loop of alternative reconstructions if invalid pressures are found //
+        
+        /* --------------------------------------------------------------------------------- */
+        /* Calculate the fluxes (EQUATION OF MOTION) -- all in physical units -- */
+        /* --------------------------------------------------------------------------------- */
+        if((Riemann_out.P_M>0)&&(!isnan(Riemann_out.P_M)))
+        {
+            if(All.ComovingIntegrationOn) {for(k=0;k<3;k++) v_frame[k] /= All.cf_atime;}
+#ifdef TURB_DIFF_METALS
+            mdot_estimated = Riemann_out.Mdot_estimated * Face_Area_Norm;
+#endif            
+            
+#if defined(HYDRO_MESHLESS_FINITE_MASS) && !defined(MAGNETIC)
+            Riemann_out.P_M -= dummy_pressure; // correct back to (allowed) negative pressures //
+            double facenorm_pm = Face_Area_Norm * Riemann_out.P_M;
+            for(k=0;k<3;k++) {Fluxes.v[k] = facenorm_pm * n_unit[k];} /* total momentum flux */
+            Fluxes.p = facenorm_pm * (Riemann_out.S_M + face_area_dot_vel); // default: total energy flux = v_frame.dot.mom_flux //
+            
+#if (SLOPE_LIMITER_TOLERANCE < 2) && !(defined(EOS_TILLOTSON) || defined(EOS_ELASTIC)) // below is defined for adiabatic ideal fluids, don't use for materials
+            /* for MFM, do the face correction for adiabatic flows here */
+            int use_entropic_energy_equation = 0;
+            double du_new = 0;
+            double SM_over_ceff = fabs(Riemann_out.S_M) / DMIN(kernel.sound_i,kernel.sound_j);
+            if(SM_over_ceff < epsilon_entropic_eos_big)
+            {
+                use_entropic_energy_equation = 1;
+                double PdV_fac = Riemann_out.P_M * vdotr2_phys / All.cf_a2inv;
+                double PdV_i = kernel.dwk_i * V_i*V_i * local.DhsmlNgbFactor * PdV_fac;
+                double PdV_j = kernel.dwk_j * V_j*V_j * PPP[j].DhsmlNgbFactor * PdV_fac;
+                du_new = 0.5 * (PdV_i - PdV_j + facenorm_pm * (face_vel_i+face_vel_j));
+                // check if, for the (weakly) diffusive case, heat is (correctly) flowing from hot to cold after particle averaging (flux-limit) //
+                double cnum2 = SphP[j].ConditionNumber*SphP[j].ConditionNumber;
+                if(SM_over_ceff > epsilon_entropic_eos_small && cnum2 < cnumcrit2)
+                {
+                    double du_old = facenorm_pm * (Riemann_out.S_M + face_area_dot_vel);
+                    if(Pressure_i/local.Density > Pressure_j/SphP[j].Density)
+                    {
+                        double dtoj = -du_old + facenorm_pm * face_vel_j;
+                        if(dtoj > 0) {use_entropic_energy_equation=0;} else {
+                            if(dtoj > -du_new+facenorm_pm*face_vel_j) {use_entropic_energy_equation=0;}}
+                    } else {
+                        double dtoi = du_old - facenorm_pm * face_vel_i;
+                        if(dtoi > 0) {use_entropic_energy_equation=0;} else {
+                            if(dtoi > du_new-facenorm_pm*face_vel_i) {use_entropic_energy_equation=0;}}
+                    }
+                }
+                if(cnum2 >= cnumcrit2) {use_entropic_energy_equation=1;}
+                // alright, if we've come this far, we need to subtract -off- the thermal energy part of the flux, and replace it //
+                if(use_entropic_energy_equation) {Fluxes.p = du_new;}
+            }
+#endif
+            
+#else
+            
+            /* the fluxes have been calculated in the rest frame of the interface: we need to de-boost to the 'simulation frame'
+             which we do following Pakmor et al. 2011 */
+            for(k=0;k<3;k++)
+            {
+                Riemann_out.Fluxes.p += v_frame[k] * Riemann_out.Fluxes.v[k];
+#if defined(HYDRO_MESHLESS_FINITE_VOLUME)
+                /* Riemann_out->Fluxes.rho is un-modified */
+                Riemann_out.Fluxes.p += (0.5*v_frame[k]*v_frame[k])*Riemann_out.Fluxes.rho;
+                Riemann_out.Fluxes.v[k] += v_frame[k] * Riemann_out.Fluxes.rho; /* just boost by frame vel (as we would in non-moving frame) */
+#endif
+            }
+#ifdef MAGNETIC
+            for(k=0;k<3;k++) {Riemann_out.Fluxes.B[k] += -v_frame[k] * Riemann_out.B_normal_corrected;} /* v dotted into B along the normal to the face (careful of sign here) */
+#endif
+            
+            /* ok now we can actually apply this to the EOM */
+#if defined(HYDRO_MESHLESS_FINITE_VOLUME)
+            Fluxes.rho = Face_Area_Norm * Riemann_out.Fluxes.rho;
+#endif
+            Fluxes.p = Face_Area_Norm * Riemann_out.Fluxes.p; // this is really Dt of --total-- energy, need to subtract KE component for e */
+            for(k=0;k<3;k++) {Fluxes.v[k] = Face_Area_Norm * Riemann_out.Fluxes.v[k];} // momentum flux (need to divide by mass) //
+#ifdef MAGNETIC
+            for(k=0;k<3;k++) {Fluxes.B[k] = Face_Area_Norm * Riemann_out.Fluxes.B[k];} // magnetic flux (B*V) //
+            Fluxes.B_normal_corrected = -Riemann_out.B_normal_corrected * Face_Area_Norm;
+#if defined(DIVBCLEANING_DEDNER) && defined(HYDRO_MESHLESS_FINITE_VOLUME)
+            //Fluxes.phi = Riemann_out.Fluxes.phi * Face_Area_Norm; // after testing, we now prefer the mass-based fluxes, now //
+            if(Fluxes.rho < 0)
+            {
+                Fluxes.phi = Fluxes.rho * Riemann_vec.R.phi;
+            } else {
+                Fluxes.phi = Fluxes.rho * Riemann_vec.L.phi; // phi_ij, phi_L/R, or midpoint phi?
+            }
+#endif
+#endif // MAGNETIC
+
+#if defined(HYDRO_MESHLESS_FINITE_MASS) && (SLOPE_LIMITER_TOLERANCE < 2)
+            /* for MFM, do the face correction for adiabatic flows here */
+            double SM_over_ceff = fabs(Riemann_out.S_M) / DMIN(kernel.sound_i,kernel.sound_j); // for now use sound speed here (more conservative) vs magnetosonic speed //
+            /* if SM is sufficiently large, we do nothing to the equations */
+            if(SM_over_ceff < epsilon_entropic_eos_big)
+            {
+                /* ok SM is small, we should use adiabatic equations instead */
+#ifdef MAGNETIC
+                // convert the face pressure P_M to a gas pressure alone (subtract the magnetic term) //
+                for(k=0;k<3;k++) {Riemann_out.P_M -= 0.5*Riemann_out.Face_B[k]*Riemann_out.Face_B[k];}
+#endif
+                int use_entropic_energy_equation = 1;
+                double facenorm_pm = Riemann_out.P_M * Face_Area_Norm;
+                double PdV_fac = Riemann_out.P_M * vdotr2_phys / All.cf_a2inv;
+                double PdV_i = kernel.dwk_i * V_i*V_i * local.DhsmlNgbFactor * PdV_fac;
+                double PdV_j = kernel.dwk_j * V_j*V_j * PPP[j].DhsmlNgbFactor * PdV_fac;
+                double du_old = facenorm_pm * (Riemann_out.S_M + face_area_dot_vel);
+                double du_new = 0.5 * (PdV_i - PdV_j + facenorm_pm * (face_vel_i+face_vel_j));
+                // more detailed check for intermediate cases //
+                double cnum2 = SphP[j].ConditionNumber*SphP[j].ConditionNumber;
+                if(SM_over_ceff > epsilon_entropic_eos_small && cnum2 < cnumcrit2)
+                {
+                    if(Pressure_i/local.Density > Pressure_j/SphP[j].Density)
+                    {
+                        double dtoj = -du_old + facenorm_pm * face_vel_j;
+                        if(dtoj > 0) {use_entropic_energy_equation=0;} else {
+                            if(dtoj > -du_new+facenorm_pm*face_vel_j) {use_entropic_energy_equation=0;}}
+                    } else {
+                        double dtoi = du_old - facenorm_pm * face_vel_i;
+                        if(dtoi > 0) {use_entropic_energy_equation=0;} else {
+                            if(dtoi > du_new-facenorm_pm*face_vel_i) {use_entropic_energy_equation=0;}}
+                    }
+                }
+                if(cnum2 >= cnumcrit2) {use_entropic_energy_equation=1;}
+                // alright, if we've come this far, we need to subtract -off- the thermal energy part of the flux, and replace it //
+                if(use_entropic_energy_equation) {Fluxes.p += du_new - du_old;}
+            }
+#endif // closes MFM check // 
+
+#endif // endif for clause opening full fluxes (mfv or magnetic)
+        } else {
+            /* nothing but bad riemann solutions found! */
+            memset(&Fluxes, 0, sizeof(struct Conserved_var_Riemann));
+#ifdef DIVBCLEANING_DEDNER
+            Riemann_out.phi_normal_mean=Riemann_out.phi_normal_db=0;
+#endif
+        }
+    } // Face_Area_Norm != 0
+}
@@ -13,8 +13,9 @@
 /* --------------------------------------------------------------------------------- */
 int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount, int *exportindex, int *ngblist)
 {
-    int j, k, n, startnode, numngb, kernel_mode, listindex;
-    double hinv_i,hinv3_i,hinv4_i,hinv_j,hinv3_j,hinv4_j,V_i,V_j,dt_hydrostep,r2,rinv,rinv_soft,u,Particle_Size_i;
+    int j, k, n, startnode, numngb, listindex;
+    double hinv_i,hinv3_i,hinv4_i,V_i,V_j,dt_hydrostep,r2,rinv,rinv_soft,Particle_Size_i;
+    struct kernel_pair_block kb; /* kernels of the current block of the neighbor list, evaluated together */
     double v_hll,k_hll,b_hll; v_hll=k_hll=0,b_hll=1;
     struct kernel_hydra kernel;
     struct hydrodata_in local;
@@ -27,8 +28,15 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
 #ifndef HYDRO_SPH
     struct Input_vec_Riemann Riemann_vec;
     struct Riemann_outputs Riemann_out;
-    double face_area_dot_vel;
-    face_area_dot_vel = 0;
+    double face_area_dot_vel, v_frame[3], n_unit[3], dummy_pressure, Pressure_i, Pressure_j, vdotr2_phys, press_tot_limiter;
+    face_area_dot_vel = dummy_pressure = Pressure_i = Pressure_j = vdotr2_phys = press_tot_limiter = 0;
+#endif
+#ifdef HYDRO_RIEMANN_BATCH_ACTIVE
+    int n0, n1, nf, nfaces, nsolve;
+    struct hydro_face_batch face_batch[HYDRO_RIEMANN_BATCH_SIZE];
+    struct Input_vec_Riemann batch_Riemann_vec[HYDRO_RIEMANN_BATCH_SIZE];
+    struct Riemann_outputs batch_Riemann_out[HYDRO_RIEMANN_BATCH_SIZE];
+    double batch_n_unit[HYDRO_RIEMANN_BATCH_SIZE][3], batch_press_tot_limiter[HYDRO_RIEMANN_BATCH_SIZE];
 #endif
     double face_vel_i=0, face_vel_j=0, Face_Area_Norm=0, Face_Area_Vec[3];
 
@@ -64,7 +72,6 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
     kernel.spec_egy_u_i = local.InternalEnergyPred;
     kernel.h_i = local.Hsml;
     kernel_hinv(kernel.h_i, &hinv_i, &hinv3_i, &hinv4_i);
-    hinv_j=hinv3_j=hinv4_j=0;
     V_i = local.Mass / local.Density;
     Particle_Size_i = pow(V_i,1./NUMDIMS) * All.cf_atime; // in physical, used below in some routines //
     double Amax_i = MAX_REAL_NUMBER;
@@ -76,7 +83,6 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
 #endif    
     dt_hydrostep = local.Timestep * All.Timebase_interval / All.cf_hubble_a; /* (physical) timestep */
     out.MaxSignalVel = kernel.sound_i;
-    kernel_mode = 0; /* need dwk and wk */
     double cnumcrit2 = ((double)CONDITION_NUMBER_DANGER)*((double)CONDITION_NUMBER_DANGER) - local.ConditionNumber*local.ConditionNumber;
 #if defined(HYDRO_SPH)
 #ifdef HYDRO_PRESSURE_SPH
@@ -141,16 +147,36 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
             /* --------------------------------------------------------------------------------- */
             /* get the neighbor list */
             /* --------------------------------------------------------------------------------- */
+#ifdef HYDRO_REUSE_GRADIENT_NGBLIST
+            if(mode == 0 && HydroNgbCache_Num[target] >= 0)
+            {
+                /* same (purely local) search as in the last gradient sweep: take the list found there */
+                numngb = HydroNgbCache_Num[target];
+                ngblist = HydroNgbCache_List + HydroNgbCache_Offset[target];
+                startnode = -1;
+            } else
+#endif
             numngb = ngb_treefind_pairs_threads(local.Pos, kernel.h_i, target, &startnode, mode, exportflag,
                                        exportnodecount, exportindex, ngblist);
             if(numngb < 0) return -1;
+            kb.n0 = kb.n1 = 0; /* new neighbor list */
             
+#ifdef HYDRO_RIEMANN_BATCH_ACTIVE
+            /* the neighbor list is processed in blocks: a first pass sets up the face states for all the interacting pairs
+                in the block, their Riemann problems are solved together, then a second pass computes and applies the fluxes */
+            for(n0 = 0; n0 < numngb; n0 += HYDRO_RIEMANN_BATCH_SIZE)
+            {
+            n1 = n0 + HYDRO_RIEMANN_BATCH_SIZE; if(n1 > numngb) {n1 = numngb;}
+            for(n = n0, nfaces = nsolve = 0; n < n1; n++)
+#else
             for(n = 0; n < numngb; n++)
+#endif
             {
                 j = ngblist[n];
                 
                 /* check if I need to compute this pair-wise interaction from "i" to "j", or skip it and 
-                    let it be computed from "j" to "i" */
+                    let it be computed from "j" to "i". this only uses the timesteps and positions, so the decision 
+                    is the same on whichever task evaluates the pair: each face is computed exactly once */
                 integertime TimeStep_J = (P[j].TimeBin ? (((integertime) 1) << P[j].TimeBin) : 0);
                 int j_is_active_for_fluxes = 0;
 #ifndef BOX_SHEARING // (shearing box means the fluxes at the boundaries are not actually symmetric, so can't do this) //
@@ -255,7 +281,7 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
 #ifdef ENERGY_ENTROPY_SWITCH_IS_ACTIVE
                 double KE = kernel.dv[0]*kernel.dv[0] + kernel.dv[1]*kernel.dv[1] + kernel.dv[2]*kernel.dv[2];
                 if(KE > out.MaxKineticEnergyNgb) out.MaxKineticEnergyNgb = KE;
-                if(j_is_active_for_fluxes) {if(KE > SphP[j].MaxKineticEnergyNgb) SphP[j].MaxKineticEnergyNgb = KE;}
+                if(j_is_active_for_fluxes) {HYDRO_PAIR_MAX(SphP[j].MaxKineticEnergyNgb, KE);}
 #endif
 #ifdef TURB_DIFF_METALS
                 double mdot_estimated = 0;
@@ -265,11 +291,13 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
 #endif
                 
                 /* --------------------------------------------------------------------------------- */
-                /* calculate the kernel functions (centered on both 'i' and 'j') */
+                /* calculate the kernel functions (centered on both 'i' and 'j'): these are evaluated for a block of
+                    the neighbor list at a time, when the first interacting pair of the block gets here */
+                if(n >= kb.n1) {kernel_pair_block_fill(&kb, n, numngb, ngblist, local.Pos, kernel.h_i, hinv_i, hinv3_i, hinv4_i);}
                 if(kernel.r < kernel.h_i)
                 {
-                    u = kernel.r * hinv_i;
-                    kernel_main(u, hinv3_i, hinv4_i, &kernel.wk_i, &kernel.dwk_i, kernel_mode);
+                    kernel.wk_i = kb.wk_i[n - kb.n0];
+                    kernel.dwk_i = kb.dwk_i[n - kb.n0];
                 }
                 else
                 {
@@ -278,9 +306,8 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
                 }
                 if(kernel.r < kernel.h_j)
                 {
-                    kernel_hinv(kernel.h_j, &hinv_j, &hinv3_j, &hinv4_j);
-                    u = kernel.r * hinv_j;
-                    kernel_main(u, hinv3_j, hinv4_j, &kernel.wk_j, &kernel.dwk_j, kernel_mode);
+                    kernel.wk_j = kb.wk_j[n - kb.n0];
+                    kernel.dwk_j = kb.dwk_j[n - kb.n0];
                 }
                 else
                 {
@@ -298,6 +325,50 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
 #include "hydra_core_sph.h"
 #else
 #include "hydra_core_meshless.h"
+#ifdef HYDRO_RIEMANN_BATCH_ACTIVE
+                /* save the state of this pair for the second pass, and queue its Riemann problem */
+                face_batch[nfaces].j = j; face_batch[nfaces].j_is_active_for_fluxes = j_is_active_for_fluxes;
+                face_batch[nfaces].r2 = r2; face_batch[nfaces].rinv = rinv; face_batch[nfaces].V_j = V_j; face_batch[nfaces].kernel = kernel;
+                face_batch[nfaces].Face_Area_Norm = Face_Area_Norm; face_batch[nfaces].face_vel_i = face_vel_i; face_batch[nfaces].face_vel_j = face_vel_j;
+                face_batch[nfaces].face_area_dot_vel = face_area_dot_vel; face_batch[nfaces].dummy_pressure = dummy_pressure;
+                face_batch[nfaces].Pressure_i = Pressure_i; face_batch[nfaces].Pressure_j = Pressure_j;
+                face_batch[nfaces].vdotr2_phys = vdotr2_phys; face_batch[nfaces].press_tot_limiter = press_tot_limiter;
+                for(k=0;k<3;k++) {face_batch[nfaces].Face_Area_Vec[k] = Face_Area_Vec[k]; face_batch[nfaces].n_unit[k] = n_unit[k]; face_batch[nfaces].v_frame[k] = v_frame[k];}
+                face_batch[nfaces].i_solve = -1;
+                if(Face_Area_Norm != 0)
+                {
+                    face_batch[nfaces].i_solve = nsolve;
+                    batch_Riemann_vec[nsolve] = Riemann_vec;
+                    for(k=0;k<3;k++) {batch_n_unit[nsolve][k] = n_unit[k];}
+                    batch_press_tot_limiter[nsolve] = press_tot_limiter;
+                    nsolve++;
+                }
+                nfaces++;
+            } // first pass: for(n = n0; n < n1; n++) //
+            
+            Riemann_solver_batch(nsolve, batch_Riemann_vec, batch_Riemann_out, batch_n_unit, batch_press_tot_limiter);
+            
+            for(nf = 0; nf < nfaces; nf++)
+            {
+                /* second pass: restore the state of the pair, and pick up the solution of its Riemann problem */
+                j = face_batch[nf].j;
+                int j_is_active_for_fluxes = face_batch[nf].j_is_active_for_fluxes;
+                MyDouble *VelPred_j = SphP[j].VelPred;
+#if defined(WAKEUP) && (SLOPE_LIMITER_TOLERANCE <= 0)
+                integertime TimeStep_J = (P[j].TimeBin ? (((integertime) 1) << P[j].TimeBin) : 0); /* only needed for the wakeup check below */
+#endif
+                r2 = face_batch[nf].r2; rinv = face_batch[nf].rinv; V_j = face_batch[nf].V_j; kernel = face_batch[nf].kernel;
+                Face_Area_Norm = face_batch[nf].Face_Area_Norm; face_vel_i = face_batch[nf].face_vel_i; face_vel_j = face_batch[nf].face_vel_j;
+                face_area_dot_vel = face_batch[nf].face_area_dot_vel; dummy_pressure = face_batch[nf].dummy_pressure;
+                Pressure_i = face_batch[nf].Pressure_i; Pressure_j = face_batch[nf].Pressure_j;
+                vdotr2_phys = face_batch[nf].vdotr2_phys; press_tot_limiter = face_batch[nf].press_tot_limiter;
+                for(k=0;k<3;k++) {Face_Area_Vec[k] = face_batch[nf].Face_Area_Vec[k]; n_unit[k] = face_batch[nf].n_unit[k]; v_frame[k] = face_batch[nf].v_frame[k];}
+                if(face_batch[nf].i_solve >= 0) {Riemann_out = batch_Riemann_out[face_batch[nf].i_solve];}
+#else
+                /* solve the Riemann problem at the face */
+                if(Face_Area_Norm != 0) {Riemann_solver(Riemann_vec, &Riemann_out, n_unit, press_tot_limiter);}
+#endif
+#include "hydra_core_meshless_fluxes.h"
 #endif
                 
 #ifdef FREEZE_HYDRO
@@ -391,7 +462,7 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
                 out.dMass += dmass_holder;
                 out.DtMass += Fluxes.rho;
 #ifndef BOX_SHEARING
-                SphP[j].dMass -= dmass_holder;
+                HYDRO_PAIR_ADD(SphP[j].dMass, -dmass_holder);
 #endif
                 double gravwork[3]; gravwork[0]=Fluxes.rho*kernel.dp[0]; gravwork[1]=Fluxes.rho*kernel.dp[1]; gravwork[2]=Fluxes.rho*kernel.dp[2];
                 for(k=0;k<3;k++) {out.GravWorkTerm[k] += gravwork[k];}
@@ -433,37 +504,37 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
                 if(j_is_active_for_fluxes)
                 {
 #ifdef HYDRO_MESHLESS_FINITE_VOLUME
-                    SphP[j].DtMass -= Fluxes.rho;
-                    for(k=0;k<3;k++) {SphP[j].GravWorkTerm[k] -= gravwork[k];}
+                    HYDRO_PAIR_ADD(SphP[j].DtMass, -Fluxes.rho);
+                    for(k=0;k<3;k++) {HYDRO_PAIR_ADD(SphP[j].GravWorkTerm[k], -gravwork[k]);}
 #endif
-                    for(k=0;k<3;k++) {SphP[j].HydroAccel[k] -= Fluxes.v[k];}
-                    SphP[j].DtInternalEnergy -= Fluxes.p;
+                    for(k=0;k<3;k++) {HYDRO_PAIR_ADD(SphP[j].HydroAccel[k], -Fluxes.v[k]);}
+                    HYDRO_PAIR_ADD(SphP[j].DtInternalEnergy, -Fluxes.p);
 #ifdef MAGNETIC
 #ifndef HYDRO_SPH
-                    for(k=0;k<3;k++) {SphP[j].Face_Area[k] -= Face_Area_Vec[k];}
+                    for(k=0;k<3;k++) {HYDRO_PAIR_ADD(SphP[j].Face_Area[k], -Face_Area_Vec[k]);}
 #endif
 #ifndef FREEZE_HYDRO
-                    for(k=0;k<3;k++) {SphP[j].DtB[k]-=Fluxes.B[k];}
-                    SphP[j].divB -= Fluxes.B_normal_corrected;
+                    for(k=0;k<3;k++) {HYDRO_PAIR_ADD(SphP[j].DtB[k], -Fluxes.B[k]);}
+                    HYDRO_PAIR_ADD(SphP[j].divB, -Fluxes.B_normal_corrected);
 #if defined(DIVBCLEANING_DEDNER) && defined(HYDRO_MESHLESS_FINITE_VOLUME) // mass-based phi-flux
-                    SphP[j].DtPhi -= Fluxes.phi;
+                    HYDRO_PAIR_ADD(SphP[j].DtPhi, -Fluxes.phi);
 #endif
 #ifdef HYDRO_SPH
-                    for(k=0;k<3;k++) {SphP[j].DtInternalEnergy-=magfluxv[k]*VelPred_j[k]/All.cf_atime;}
-                    SphP[j].DtInternalEnergy += resistivity_heatflux;
+                    for(k=0;k<3;k++) {HYDRO_PAIR_ADD(SphP[j].DtInternalEnergy, -magfluxv[k]*VelPred_j[k]/All.cf_atime);}
+                    HYDRO_PAIR_ADD(SphP[j].DtInternalEnergy, resistivity_heatflux);
 #else
                     double wt_face_sum = Face_Area_Norm * (-face_area_dot_vel+face_vel_j);
-                    SphP[j].DtInternalEnergy -= 0.5 * kernel.b2_j*All.cf_a2inv*All.cf_a2inv * wt_face_sum;
+                    HYDRO_PAIR_ADD(SphP[j].DtInternalEnergy, -0.5 * kernel.b2_j*All.cf_a2inv*All.cf_a2inv * wt_face_sum);
 #ifdef DIVBCLEANING_DEDNER
                     for(k=0; k<3; k++)
                     {
-                        SphP[j].DtB_PhiCorr[k] -= Riemann_out.phi_normal_db * Face_Area_Vec[k];
-                        SphP[j].DtB[k] -= Riemann_out.phi_normal_mean * Face_Area_Vec[k];
-                        SphP[j].DtInternalEnergy -= Riemann_out.phi_normal_mean * Face_Area_Vec[k] * BPred_j[k]*All.cf_a2inv;
+                        HYDRO_PAIR_ADD(SphP[j].DtB_PhiCorr[k], -Riemann_out.phi_normal_db * Face_Area_Vec[k]);
+                        HYDRO_PAIR_ADD(SphP[j].DtB[k], -Riemann_out.phi_normal_mean * Face_Area_Vec[k]);
+                        HYDRO_PAIR_ADD(SphP[j].DtInternalEnergy, -Riemann_out.phi_normal_mean * Face_Area_Vec[k] * BPred_j[k]*All.cf_a2inv);
                     }
 #endif
 #ifdef MHD_NON_IDEAL
-                    for(k=0;k<3;k++) {SphP[j].DtInternalEnergy -= BPred_j[k]*All.cf_a2inv*bflux_from_nonideal_effects[k];}
+                    for(k=0;k<3;k++) {HYDRO_PAIR_ADD(SphP[j].DtInternalEnergy, -BPred_j[k]*All.cf_a2inv*bflux_from_nonideal_effects[k]);}
 #endif
 #endif
 #endif
@@ -485,7 +556,7 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
                         /* particle j gains mass from particle i */
                         dmass_holder /= -P[j].Mass;
                         for(k=0;k<NUM_METAL_SPECIES;k++)
-                            P[j].Metallicity[k] += (local.Metallicity[k] - P[j].Metallicity[k]) * dmass_holder;
+                            HYDRO_PAIR_UPDATE(P[j].Metallicity[k], x_old_ + (local.Metallicity[k] - x_old_) * dmass_holder);
                     }
 #endif
                 }
@@ -495,19 +566,22 @@ int hydro_evaluate(int target, int mode, int *exportflag, int *exportnodecount,
                 /* don't forget to save the signal velocity for time-stepping! */
                 /* --------------------------------------------------------------------------------- */
                 if(kernel.vsig > out.MaxSignalVel) out.MaxSignalVel = kernel.vsig;
-                if(j_is_active_for_fluxes) {if(kernel.vsig > SphP[j].MaxSignalVel) SphP[j].MaxSignalVel = kernel.vsig;}
+                if(j_is_active_for_fluxes) {HYDRO_PAIR_MAX(SphP[j].MaxSignalVel, kernel.vsig);}
 #ifdef WAKEUP
                 if(!(TimeBinActive[P[j].TimeBin]))
                 {
-                    if(kernel.vsig > WAKEUP*SphP[j].MaxSignalVel) PPPZ[j].wakeup = 1;
+                    if(kernel.vsig > WAKEUP*SphP[j].MaxSignalVel) {PPPZ[j].wakeup = 1; WakeupFlagsPending = 1;}
 #if (SLOPE_LIMITER_TOLERANCE <= 0)
-                    if(local.Timestep*WAKEUP < TimeStep_J) PPPZ[j].wakeup = 1;
+                    if(local.Timestep*WAKEUP < TimeStep_J) {PPPZ[j].wakeup = 1; WakeupFlagsPending = 1;}
 #endif
                 }
 #endif
                 
                 
             } // for(n = 0; n < numngb; n++) //
+#ifdef HYDRO_RIEMANN_BATCH_ACTIVE
+            } // for(n0 = 0; n0 < numngb; n0 += HYDRO_RIEMANN_BATCH_SIZE) //
+#endif
         } // while(startnode >= 0) //
 #ifndef DONOTUSENODELIST
         if(mode == 1)
@@ -22,6 +22,19 @@ extern pthread_mutex_t mutex_partnodedrift;
 #define UNLOCK_NEXPORT
 #endif
 
+/* each face is evaluated only once (by the particle with the smaller timestep, see hydra_evaluate.h), and the 
+    equal-and-opposite flux is written directly to the neighbor 'j'. with threads, the same particle can receive 
+    fluxes from several threads at once (as the neighbor of different particles, or while collecting its own fluxes), 
+    so these updates go through a compare-and-swap loop. 'x_old_' in new_value refers to the current value of x */
+#if defined(PTHREADS_NUM_THREADS) || defined(_OPENMP)
+#define HYDRO_PAIR_UPDATE(x,new_value) {__typeof__(x) *x_ptr_ = &(x); __typeof__(x) x_old_, x_new_; __atomic_load(x_ptr_, &x_old_, __ATOMIC_RELAXED); \
+    do {x_new_ = (new_value);} while(!__atomic_compare_exchange(x_ptr_, &x_old_, &x_new_, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));}
+#else
+#define HYDRO_PAIR_UPDATE(x,new_value) {__typeof__(x) x_old_ = (x); (x) = (new_value);}
+#endif
+#define HYDRO_PAIR_ADD(x,dx) HYDRO_PAIR_UPDATE(x, x_old_ + (dx))
+#define HYDRO_PAIR_MAX(x,y) {if((y) > (x)) HYDRO_PAIR_UPDATE(x, DMAX(x_old_, (y)))}
+
 /*! \file hydra_master.c
  *  \brief This contains the "second hydro loop", where the hydro fluxes are computed.
  */
@@ -162,10 +175,28 @@ struct kernel_hydra
 #endif
 #endif // MAGNETIC //
 };
+#if defined(HYDRO_RIEMANN_BATCH) && !defined(HYDRO_SPH) && !defined(MAGNETIC) && !defined(EOS_GENERAL) && !defined(BOX_SHEARING) && !defined(TURB_DIFFUSION) && !defined(CONDUCTION) && !defined(VISCOSITY) && !defined(RT_DIFFUSION_EXPLICIT) && !defined(CHIMES_TURB_DIFF_IONS)
+#define HYDRO_RIEMANN_BATCH_ACTIVE /* the face-batched loop is only set up for pure (non-MHD, polytropic-eos) hydro, without the additional diffusion operators which act on each pair */
+#define HYDRO_RIEMANN_BATCH_SIZE 32 /* number of neighbors in each block of the neighbor list: the faces of the interacting pairs in a block are solved together */
+#endif
 #ifndef HYDRO_SPH
 #include "reimann.h"
 #endif
 
+#ifdef HYDRO_RIEMANN_BATCH_ACTIVE
+/* state of one interacting pair, saved in the first pass of the face-batched hydro loop (face states and
+    geometry) for use in the second pass (fluxes and their assignment), after the Riemann problems are solved */
+struct hydro_face_batch
+{
+    int j, j_is_active_for_fluxes, i_solve;
+    double r2, rinv, V_j;
+    struct kernel_hydra kernel;
+    double Face_Area_Norm, Face_Area_Vec[3], n_unit[3], v_frame[3];
+    double face_vel_i, face_vel_j, face_area_dot_vel;
+    double dummy_pressure, Pressure_i, Pressure_j, vdotr2_phys, press_tot_limiter;
+};
+#endif
+
 
 /* --------------------------------------------------------------------------------- */
 /* inputs to the routine: put here what's needed to do the calculation! */
@@ -512,45 +543,41 @@ static inline void out2particle_hydra(struct hydrodata_out *out, int i, int mode
     /* these are zero-d out at beginning of hydro loop so should always be added */
     for(k = 0; k < 3; k++)
     {
-        SphP[i].HydroAccel[k] += out->Acc[k];
+        HYDRO_PAIR_ADD(SphP[i].HydroAccel[k], out->Acc[k]);
         //SphP[i].dMomentum[k] += out->dMomentum[k]; //manifest-indiv-timestep-debug//
     }
-    SphP[i].DtInternalEnergy += out->DtInternalEnergy;
+    HYDRO_PAIR_ADD(SphP[i].DtInternalEnergy, out->DtInternalEnergy);
     //SphP[i].dInternalEnergy += out->dInternalEnergy; //manifest-indiv-timestep-debug//
 
 #ifdef HYDRO_MESHLESS_FINITE_VOLUME
-    SphP[i].DtMass += out->DtMass;
-    SphP[i].dMass += out->dMass;
-    for(k=0;k<3;k++) {SphP[i].GravWorkTerm[k] += out->GravWorkTerm[k];}
+    HYDRO_PAIR_ADD(SphP[i].DtMass, out->DtMass);
+    HYDRO_PAIR_ADD(SphP[i].dMass, out->dMass);
+    for(k=0;k<3;k++) {HYDRO_PAIR_ADD(SphP[i].GravWorkTerm[k], out->GravWorkTerm[k]);}
 #endif
-    if(SphP[i].MaxSignalVel < out->MaxSignalVel)
-        SphP[i].MaxSignalVel = out->MaxSignalVel;
+    HYDRO_PAIR_MAX(SphP[i].MaxSignalVel, out->MaxSignalVel);
 #ifdef ENERGY_ENTROPY_SWITCH_IS_ACTIVE
-    if(SphP[i].MaxKineticEnergyNgb < out->MaxKineticEnergyNgb)
-        SphP[i].MaxKineticEnergyNgb = out->MaxKineticEnergyNgb;
+    HYDRO_PAIR_MAX(SphP[i].MaxKineticEnergyNgb, out->MaxKineticEnergyNgb);
 #endif
 #if defined(TURB_DIFF_METALS) || (defined(METALS) && defined(HYDRO_MESHLESS_FINITE_VOLUME))
     for(k=0;k<NUM_METAL_SPECIES;k++)
     {
-        double z_tmp = P[i].Metallicity[k] + out->Dyield[k] / P[i].Mass;
-        z_tmp = DMAX(z_tmp , 0.5 * P[i].Metallicity[k]);
-        P[i].Metallicity[k] = z_tmp;
+        HYDRO_PAIR_UPDATE(P[i].Metallicity[k], DMAX(x_old_ + out->Dyield[k] / P[i].Mass, 0.5 * x_old_));
     }
 #endif
 
 #ifdef CHIMES_TURB_DIFF_IONS  
     for (k = 0; k < ChimesGlobalVars.totalNumberOfSpecies; k++) 
-      SphP[i].ChimesNIons[k] = DMAX(SphP[i].ChimesNIons[k] + out->ChimesIonsYield[k], 0.5 * SphP[i].ChimesNIons[k]); 
+      HYDRO_PAIR_UPDATE(SphP[i].ChimesNIons[k], DMAX(x_old_ + out->ChimesIonsYield[k], 0.5 * x_old_)); 
 #endif 
     
 #if defined(RT_EVOLVE_NGAMMA_IN_HYDRO)
-    for(k=0;k<N_RT_FREQ_BINS;k++) {SphP[i].Dt_E_gamma[k] += out->Dt_E_gamma[k];}
+    for(k=0;k<N_RT_FREQ_BINS;k++) {HYDRO_PAIR_ADD(SphP[i].Dt_E_gamma[k], out->Dt_E_gamma[k]);}
 #if defined(RT_INFRARED)
-    SphP[i].Dt_E_gamma_T_weighted_IR += out->Dt_E_gamma_T_weighted_IR;
+    HYDRO_PAIR_ADD(SphP[i].Dt_E_gamma_T_weighted_IR, out->Dt_E_gamma_T_weighted_IR);
 #endif
 #endif
 #if defined(RT_EVOLVE_FLUX)
-    for(k=0;k<N_RT_FREQ_BINS;k++) {int k_dir; for(k_dir=0;k_dir<3;k_dir++) {SphP[i].Dt_Flux[k][k_dir] += out->Dt_Flux[k][k_dir];}}
+    for(k=0;k<N_RT_FREQ_BINS;k++) {int k_dir; for(k_dir=0;k_dir<3;k_dir++) {HYDRO_PAIR_ADD(SphP[i].Dt_Flux[k][k_dir], out->Dt_Flux[k][k_dir]);}}
 #endif
 
     
@@ -558,15 +585,15 @@ static inline void out2particle_hydra(struct hydrodata_out *out, int i, int mode
     /* can't just do DtB += out-> DtB, because for SPH methods, the induction equation is solved in the density loop; need to simply add it here */
     for(k=0;k<3;k++)
     {
-        SphP[i].DtB[k] += out->DtB[k];
-        SphP[i].Face_Area[k] += out->Face_Area[k];
+        HYDRO_PAIR_ADD(SphP[i].DtB[k], out->DtB[k]);
+        HYDRO_PAIR_ADD(SphP[i].Face_Area[k], out->Face_Area[k]);
     }
-    SphP[i].divB += out->divB;
+    HYDRO_PAIR_ADD(SphP[i].divB, out->divB);
 #if defined(DIVBCLEANING_DEDNER)
 #ifdef HYDRO_MESHLESS_FINITE_VOLUME // mass-based phi-flux
-    SphP[i].DtPhi += out->DtPhi;
+    HYDRO_PAIR_ADD(SphP[i].DtPhi, out->DtPhi);
 #endif
-    for(k=0;k<3;k++) {SphP[i].DtB_PhiCorr[k] += out->DtB_PhiCorr[k];}
+    for(k=0;k<3;k++) {HYDRO_PAIR_ADD(SphP[i].DtB_PhiCorr[k], out->DtB_PhiCorr[k]);}
 #endif // Dedner //
 #endif // MAGNETIC //
 
@@ -1139,6 +1166,9 @@ void hydro_force(void)
     myfree(DataNodeList);
     myfree(DataIndexTable);
     myfree(Ngblist);
+#ifdef HYDRO_REUSE_GRADIENT_NGBLIST
+    hydro_ngblist_cache_free(); /* allocated at the beginning of hydro_gradient_calc */
+#endif
     
     
     /* --------------------------------------------------------------------------------- */
@@ -86,6 +86,9 @@ struct rotation_matrix
 static inline double actual_slopelimiter(double dQ_1, double dQ_2);
 static inline double get_dQ_from_slopelimiter(double dQ_1, MyFloat grad[3], struct kernel_hydra kernel, double rinv);
 void Riemann_solver(struct Input_vec_Riemann Riemann_vec, struct Riemann_outputs *Riemann_out, double n_unit[3], double press_tot_limiter);
+#ifdef HYDRO_RIEMANN_BATCH_ACTIVE
+void Riemann_solver_batch(int n, struct Input_vec_Riemann *Riemann_vec, struct Riemann_outputs *Riemann_out, double (*n_unit)[3], double *press_tot_limiter);
+#endif
 double guess_for_pressure(struct Input_vec_Riemann Riemann_vec, struct Riemann_outputs *Riemann_out,
                           double v_line_L, double v_line_R, double cs_L, double cs_R);
 void sample_reimann_standard(double S, struct Input_vec_Riemann Riemann_vec, struct Riemann_outputs *Riemann_out,
@@ -278,19 +281,11 @@ static inline double get_dQ_from_slopelimiter(double dQ_1, MyFloat grad[3], stru
 
 
 /* --------------------------------------------------------------------------------- */
-/* Master Riemann solver routine: call this, it will call sub-routines */
-/*  (written by P. Hopkins, this is just a wrapper though for the various sub-routines) */
+/* convert the face states to -PHYSICAL- units, and (unless they were reconstructed explicitly)
+    set the sound speeds and internal energies from the pressure and density */
 /* --------------------------------------------------------------------------------- */
-void Riemann_solver(struct Input_vec_Riemann Riemann_vec, struct Riemann_outputs *Riemann_out, double n_unit[3], double press_tot_limiter)
+static inline void Riemann_vec_to_physical(struct Input_vec_Riemann *Riemann_vec)
 {
-    if((Riemann_vec.L.p < 0 && Riemann_vec.R.p < 0)||(Riemann_vec.L.rho < 0)||(Riemann_vec.R.rho < 0))
-    {
-        printf("FAILURE: Unphysical Inputs to Reimann Solver: Left P/rho=%g/%g, Right P/rho=%g/%g \n",
-               Riemann_vec.L.p,Riemann_vec.L.rho,Riemann_vec.R.p,Riemann_vec.R.rho); fflush(stdout);
-        Riemann_out->P_M = 0;
-        return;
-    }
-    
     if(All.ComovingIntegrationOn)
     {
         /* first convert the input variables to -PHYSICAL- units so the answer makes sense:
@@ -298,35 +293,53 @@ void Riemann_solver(struct Input_vec_Riemann Riemann_vec, struct Riemann_outputs
         int k;
         for(k=0;k<3;k++)
         {
-            Riemann_vec.L.v[k] /= All.cf_atime;
-            Riemann_vec.R.v[k] /= All.cf_atime;
+            Riemann_vec->L.v[k] /= All.cf_atime;
+            Riemann_vec->R.v[k] /= All.cf_atime;
 #ifdef MAGNETIC
-            Riemann_vec.L.B[k] *= All.cf_a2inv;
-            Riemann_vec.R.B[k] *= All.cf_a2inv;
+            Riemann_vec->L.B[k] *= All.cf_a2inv;
+            Riemann_vec->R.B[k] *= All.cf_a2inv;
 #endif
         }
-        Riemann_vec.L.rho *= All.cf_a3inv;
-        Riemann_vec.R.rho *= All.cf_a3inv;
-        Riemann_vec.L.p *= All.cf_a3inv / All.cf_afac1;
-        Riemann_vec.R.p *= All.cf_a3inv / All.cf_afac1;
+        Riemann_vec->L.rho *= All.cf_a3inv;
+        Riemann_vec->R.rho *= All.cf_a3inv;
+        Riemann_vec->L.p *= All.cf_a3inv / All.cf_afac1;
+        Riemann_vec->R.p *= All.cf_a3inv / All.cf_afac1;
 #ifdef DIVBCLEANING_DEDNER
-        Riemann_vec.L.phi *= All.cf_a3inv;
-        Riemann_vec.R.phi *= All.cf_a3inv;
+        Riemann_vec->L.phi *= All.cf_a3inv;
+        Riemann_vec->R.phi *= All.cf_a3inv;
 #endif
 #ifdef EOS_GENERAL
-        Riemann_vec.L.cs *= All.cf_afac3;
-        Riemann_vec.R.cs *= All.cf_afac3;
-        Riemann_vec.L.u /= All.cf_afac1;
-        Riemann_vec.R.u /= All.cf_afac1;
+        Riemann_vec->L.cs *= All.cf_afac3;
+        Riemann_vec->R.cs *= All.cf_afac3;
+        Riemann_vec->L.u /= All.cf_afac1;
+        Riemann_vec->R.u /= All.cf_afac1;
 #endif
     }
 #ifndef EOS_GENERAL
     /* here we haven't reconstructed the sound speeds and internal energies explicitly, so need to do it from pressure, density */
-    Riemann_vec.L.cs = sqrt(GAMMA * Riemann_vec.L.p / Riemann_vec.L.rho);
-    Riemann_vec.R.cs = sqrt(GAMMA * Riemann_vec.R.p / Riemann_vec.R.rho);
-    Riemann_vec.L.u  = Riemann_vec.L.p / (GAMMA_MINUS1 * Riemann_vec.L.rho);
-    Riemann_vec.R.u  = Riemann_vec.R.p / (GAMMA_MINUS1 * Riemann_vec.R.rho);
+    Riemann_vec->L.cs = sqrt(GAMMA * Riemann_vec->L.p / Riemann_vec->L.rho);
+    Riemann_vec->R.cs = sqrt(GAMMA * Riemann_vec->R.p / Riemann_vec->R.rho);
+    Riemann_vec->L.u  = Riemann_vec->L.p / (GAMMA_MINUS1 * Riemann_vec->L.rho);
+    Riemann_vec->R.u  = Riemann_vec->R.p / (GAMMA_MINUS1 * Riemann_vec->R.rho);
 #endif
+}
+
+
+/* --------------------------------------------------------------------------------- */
+/* Master Riemann solver routine: call this, it will call sub-routines */
+/*  (written by P. Hopkins, this is just a wrapper though for the various sub-routines) */
+/* --------------------------------------------------------------------------------- */
+void Riemann_solver(struct Input_vec_Riemann Riemann_vec, struct Riemann_outputs *Riemann_out, double n_unit[3], double press_tot_limiter)
+{
+    if((Riemann_vec.L.p < 0 && Riemann_vec.R.p < 0)||(Riemann_vec.L.rho < 0)||(Riemann_vec.R.rho < 0))
+    {
+        printf("FAILURE: Unphysical Inputs to Reimann Solver: Left P/rho=%g/%g, Right P/rho=%g/%g \n",
+               Riemann_vec.L.p,Riemann_vec.L.rho,Riemann_vec.R.p,Riemann_vec.R.rho); fflush(stdout);
+        Riemann_out->P_M = 0;
+        return;
+    }
+    
+    Riemann_vec_to_physical(&Riemann_vec);
     
 #ifdef MAGNETIC
     struct rotation_matrix rot_matrix;
@@ -383,6 +396,73 @@ void Riemann_solver(struct Input_vec_Riemann Riemann_vec, struct Riemann_outputs
 
 
 
+#ifdef HYDRO_RIEMANN_BATCH_ACTIVE
+/* --------------------------------------------------------------------------------- */
+/* batched version of Riemann_solver for n faces (hydro only): the states are copied to 
+    structure-of-arrays buffers, and the HLLC wave-speed and star-state estimate is evaluated 
+    for all faces at once in a branch-free (vectorizable) loop. Faces where this first estimate 
+    is not valid (bad inputs, vacuum, star pressure non-positive or above the limiter) are 
+    flagged, and re-solved individually with Riemann_solver (which then goes through the 
+    Roe-averaged and primitive-variable estimates, or the exact solver). The result for every 
+    face is the same as calling Riemann_solver for it.  (written for the face-batched 
+    hydro loop in hydra_evaluate.h) */
+/* --------------------------------------------------------------------------------- */
+void Riemann_solver_batch(int n, struct Input_vec_Riemann *Riemann_vec, struct Riemann_outputs *Riemann_out,
+                          double (*n_unit)[3], double *press_tot_limiter)
+{
+    struct Input_vec_Riemann phys[HYDRO_RIEMANN_BATCH_SIZE];
+    double rho_L[HYDRO_RIEMANN_BATCH_SIZE], rho_R[HYDRO_RIEMANN_BATCH_SIZE], p_L[HYDRO_RIEMANN_BATCH_SIZE], p_R[HYDRO_RIEMANN_BATCH_SIZE];
+    double cs_L[HYDRO_RIEMANN_BATCH_SIZE], cs_R[HYDRO_RIEMANN_BATCH_SIZE], v_line_L[HYDRO_RIEMANN_BATCH_SIZE], v_line_R[HYDRO_RIEMANN_BATCH_SIZE];
+    double P_M[HYDRO_RIEMANN_BATCH_SIZE], S_M[HYDRO_RIEMANN_BATCH_SIZE], S_L[HYDRO_RIEMANN_BATCH_SIZE], S_R[HYDRO_RIEMANN_BATCH_SIZE];
+    int k, flagged[HYDRO_RIEMANN_BATCH_SIZE];
+    
+    /* gather: convert to physical units and fill the buffers */
+    for(k=0;k<n;k++)
+    {
+        phys[k] = Riemann_vec[k];
+        Riemann_vec_to_physical(&phys[k]);
+        rho_L[k] = phys[k].L.rho; rho_R[k] = phys[k].R.rho;
+        p_L[k] = phys[k].L.p; p_R[k] = phys[k].R.p;
+        cs_L[k] = phys[k].L.cs; cs_R[k] = phys[k].R.cs;
+        v_line_L[k] = phys[k].L.v[0]*n_unit[k][0] + phys[k].L.v[1]*n_unit[k][1] + phys[k].L.v[2]*n_unit[k][2];
+        v_line_R[k] = phys[k].R.v[0]*n_unit[k][0] + phys[k].R.v[1]*n_unit[k][1] + phys[k].R.v[2]*n_unit[k][2];
+    }
+    
+    /* HLLC estimate (Gaburov weighting, as the first attempt in get_wavespeeds_and_pressure_star) for all faces */
+#if defined(_OPENMP) && (_OPENMP >= 201307)
+#pragma omp simd
+#endif
+    for(k=0;k<n;k++)
+    {
+        double cs_max = DMAX(cs_L[k],cs_R[k]);
+        S_L[k] = DMIN(v_line_L[k],v_line_R[k]) - cs_max;
+        S_R[k] = DMAX(v_line_L[k],v_line_R[k]) + cs_max;
+        double rho_wt_L = rho_L[k]*(S_L[k]-v_line_L[k]);
+        double rho_wt_R = rho_R[k]*(S_R[k]-v_line_R[k]);
+        S_M[k] = ((p_R[k]-p_L[k]) + rho_wt_L*v_line_L[k] - rho_wt_R*v_line_R[k]) / (rho_wt_L - rho_wt_R);
+        P_M[k] = (p_L[k]*rho_wt_R - p_R[k]*rho_wt_L + rho_wt_L*rho_wt_R*(v_line_R[k] - v_line_L[k])) / (rho_wt_R - rho_wt_L);
+        flagged[k] = ((p_L[k] < 0 && p_R[k] < 0) || (rho_L[k] < 0) || (rho_R[k] < 0) /* unphysical inputs */
+                      || ((v_line_R[k] - v_line_L[k]) > cs_max) /* vacuum */
+                      || !(P_M[k] > MIN_REAL_NUMBER) || (P_M[k] > press_tot_limiter[k])); /* (also catches nan) */
+    }
+    
+    /* scatter the valid solutions; fall back to the full solver for the flagged faces */
+    for(k=0;k<n;k++)
+    {
+        if(flagged[k]) {Riemann_solver(Riemann_vec[k], &Riemann_out[k], n_unit[k], press_tot_limiter[k]); continue;}
+        Riemann_out[k].P_M = P_M[k];
+        Riemann_out[k].S_M = S_M[k];
+#ifdef HYDRO_MESHLESS_FINITE_VOLUME
+        double h_L = phys[k].L.p/phys[k].L.rho + phys[k].L.u + 0.5*(phys[k].L.v[0]*phys[k].L.v[0]+phys[k].L.v[1]*phys[k].L.v[1]+phys[k].L.v[2]*phys[k].L.v[2]);
+        double h_R = phys[k].R.p/phys[k].R.rho + phys[k].R.u + 0.5*(phys[k].R.v[0]*phys[k].R.v[0]+phys[k].R.v[1]*phys[k].R.v[1]+phys[k].R.v[2]*phys[k].R.v[2]);
+        HLLC_fluxes(phys[k], &Riemann_out[k], n_unit[k], v_line_L[k], v_line_R[k], cs_L[k], cs_R[k], h_L, h_R, S_L[k], S_R[k]);
+#endif
+    }
+}
+#endif
+
+
+
 /* -------------------------------------------------------------------------------------------------------------- */
 /* the HLLC Riemann solver: try this first - it's approximate, but fast, and accurate for our purposes */
 /*  (wrapper for sub-routines to evaluate hydro reimann problem) */
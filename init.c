@@ -481,6 +481,9 @@ void init(void)
             SphP[i].Density = -1;
 #ifdef COOLING
             SphP[i].Ne = 1.0;
+#ifdef COOLING_SUBCYCLE
+            SphP[i].CoolingTime = 0; SphP[i].CoolingJacobian = 0; SphP[i].CoolingCache_u = 0; SphP[i].CoolingCache_Ti = -1;
+#endif
 #endif
 #ifdef CHIMES_STELLAR_FLUXES 
 	    int kc; 
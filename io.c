@@ -25,6 +25,27 @@ static long long ntot_type_all[6];
 
 static int n_info;
 
+#ifdef OUTPUT_STREAMS
+#define OUTPUT_STREAMS_MAX 32
+static struct output_stream_data
+{
+    char name[50];              /* label used in the file names */
+    int every_n_steps;          /* written every this many timesteps (sync points) */
+    int typemask;               /* bitmask of particle types written (sum of 2^type) */
+    double fraction;            /* fraction of particles written, chosen by a hash of their ID (1=all) */
+    double region_min[3], region_max[3]; /* only particles inside this box are written (ignored if min>=max in x) */
+    int all_fields;             /* write all blocks which would be written to a snapshot */
+    unsigned char field[IO_LASTENTRY]; /* otherwise: flags which blocks are written */
+}
+OutputStream[OUTPUT_STREAMS_MAX];
+static int N_OutputStreams = -1;
+static struct output_stream_data *IoStreamActive = NULL; /* stream currently being written (NULL for normal snapshots) */
+static unsigned char *IoStreamSelected = NULL; /* flags particles written to the currently-active stream */
+#define IO_WRITE_PARTICLE(i, type) ((P[i].Type == (type)) && (!IoStreamSelected || IoStreamSelected[i]))
+#else
+#define IO_WRITE_PARTICLE(i, type) (P[i].Type == (type))
+#endif
+
 /*! This function writes a snapshot of the particle distribution to one or
  * several files using Gadget's default file format.  If
  * NumFilesPerSnapshot>1, the snapshot is distributed into several files,
@@ -39,6 +60,10 @@ void savepositions(int num)
     
     CPU_Step[CPU_MISC] += measure_time();
 
+#ifdef IO_ASYNC_OUTPUT
+    io_async_fence(); /* previous snapshot/restart files must be on disk before we stage new ones */
+#endif
+
 #ifdef CHIMES_REDUCED_OUTPUT 
     if (num % N_chimes_full_output_freq == 0)
       Chimes_incl_full_output = 1; 
@@ -172,6 +197,208 @@ void savepositions(int num)
 }
 
 
+#ifdef OUTPUT_STREAMS
+/*! This function reads the definitions of the output streams from the file
+ *  All.OutputStreamsFile. Each (non-comment) line defines one stream:
+ *    name  every_n_steps  typemask  fraction  xmin ymin zmin  xmax ymax zmax  fields
+ *  where typemask is the sum of 2^type for the particle types written, fraction is
+ *  the fraction of particles (chosen by a hash of their ID, so the same particles
+ *  are followed from one output to the next) written, the region is ignored if
+ *  xmin>=xmax, and fields is a comma-separated list of HDF5 dataset names (as in
+ *  the snapshots, e.g. Coordinates,Velocities,Density) or 'ALL'.
+ */
+static void read_output_streams_file(void)
+{
+    FILE *fd;
+    char buf[2000], name[2000], fields[2000], fieldlist[2000], dname[1000], *tok;
+    int k, nread, bnr, every_n, typemask, nfound;
+    double fraction, rmin[3], rmax[3];
+    struct output_stream_data *os;
+
+    N_OutputStreams = 0;
+    if(ThisTask == 0)
+    {
+        if(!(fd = fopen(All.OutputStreamsFile, "r")))
+        {
+            printf("can't read output stream definitions in file '%s'\n", All.OutputStreamsFile);
+            endrun(3480);
+        }
+        while(fgets(buf, 2000, fd))
+        {
+            if(buf[0] == '%' || buf[0] == '#')
+                continue;
+            nread = sscanf(buf, "%s %d %d %lg %lg %lg %lg %lg %lg %lg %s", name, &every_n, &typemask, &fraction,
+                           &rmin[0], &rmin[1], &rmin[2], &rmax[0], &rmax[1], &rmax[2], fields);
+            if(nread <= 0)
+                continue;
+            if(nread != 11 || every_n <= 0 || typemask <= 0 || fraction <= 0 || strlen(name) >= 50)
+            {
+                printf("malformed output stream definition in file '%s':\n%s\n", All.OutputStreamsFile, buf);
+                endrun(3481);
+            }
+            if(N_OutputStreams >= OUTPUT_STREAMS_MAX)
+            {
+                printf("too many output streams in file '%s' (maximum is %d)\n", All.OutputStreamsFile, OUTPUT_STREAMS_MAX);
+                endrun(3482);
+            }
+            os = &OutputStream[N_OutputStreams];
+            memset(os, 0, sizeof(struct output_stream_data));
+            strcpy(os->name, name);
+            os->every_n_steps = every_n;
+            os->typemask = typemask;
+            os->fraction = fraction;
+            for(k = 0; k < 3; k++) {os->region_min[k] = rmin[k]; os->region_max[k] = rmax[k];}
+
+            strcpy(fieldlist, fields);
+            if(strcmp(fields, "ALL") == 0)
+                os->all_fields = 1;
+            else
+            {
+                for(tok = strtok(fields, ","); tok; tok = strtok(NULL, ","))
+                {
+                    for(bnr = 0, nfound = 0; bnr < IO_LASTENTRY; bnr++)
+                    {
+                        get_dataset_name((enum iofields) bnr, dname);
+                        if(strcmp(dname, tok) == 0) {os->field[bnr] = 1; nfound++;}
+                    }
+                    if(nfound == 0)
+                    {
+                        printf("unknown field '%s' requested for output stream '%s'\n", tok, name);
+                        endrun(3483);
+                    }
+                }
+            }
+            printf("output stream '%s': every %d steps, types %d, fraction %g, fields %s\n", name, every_n, typemask, fraction, fieldlist);
+            N_OutputStreams++;
+        }
+        fclose(fd);
+    }
+    MPI_Bcast(&N_OutputStreams, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(OutputStream, N_OutputStreams * sizeof(struct output_stream_data), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+
+/*! uniform deviate in [0,1) from the particle ID (and child number, for split particles),
+ *  so the same subsample of particles is selected for every output of a stream */
+static double output_stream_id_hash(int i)
+{
+    unsigned long long x = (unsigned long long) P[i].ID;
+    x ^= ((unsigned long long) P[i].ID_child_number) * 0x9E3779B97F4A7C15ULL;
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x = x ^ (x >> 31);
+    return (x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/*! This function writes the lightweight output streams due at the current timestep.
+ *  Particles are selected by type, ID-hash subsample and region, only the requested
+ *  blocks are written, and the files go through the same write_file/fill_write_buffer
+ *  path (and file format) as the normal snapshots. Unlike savepositions, the particle
+ *  order is left untouched and no new domain decomposition is forced, so this can be
+ *  called at high cadence; only the candidate particles are drifted to the current time.
+ */
+void output_streams(void)
+{
+    size_t bytes;
+    char buf[500];
+    int n, k, s, i, filenr, gr, ngroups, masterTask, lastTask, in_region;
+    double x;
+
+    if(N_OutputStreams < 0)
+        read_output_streams_file();
+
+    for(s = 0; s < N_OutputStreams; s++)
+    {
+        if(All.NumCurrentTiStep % OutputStream[s].every_n_steps)
+            continue;
+
+        CPU_Step[CPU_MISC] += measure_time();
+#ifdef IO_ASYNC_OUTPUT
+        io_async_fence();
+#endif
+        if(ThisTask == 0)
+            printf("writing output stream '%s' for step %d...\n", OutputStream[s].name, All.NumCurrentTiStep);
+
+        IoStreamSelected = (unsigned char *) mymalloc("IoStreamSelected", NumPart * sizeof(unsigned char));
+        for(n = 0; n < 6; n++)
+            n_type[n] = 0;
+        for(i = 0; i < NumPart; i++)
+        {
+            IoStreamSelected[i] = 0;
+            if(P[i].Mass <= 0 || !((1 << P[i].Type) & OutputStream[s].typemask))
+                continue;
+            if(OutputStream[s].fraction < 1 && output_stream_id_hash(i) >= OutputStream[s].fraction)
+                continue;
+            drift_particle(i, All.Ti_Current);
+            if(OutputStream[s].region_min[0] < OutputStream[s].region_max[0])
+            {
+                for(k = 0, in_region = 1; k < 3; k++)
+                {
+                    x = P[i].Pos[k];
+#ifdef BOX_PERIODIC
+                    double boxSize = All.BoxSize;
+                    if(k==0) {boxSize = boxSize_X;}
+                    if(k==1) {boxSize = boxSize_Y;}
+                    if(k==2) {boxSize = boxSize_Z;}
+                    while(x < 0) {x += boxSize;}
+                    while(x >= boxSize) {x -= boxSize;}
+#endif
+                    if(x < OutputStream[s].region_min[k] || x >= OutputStream[s].region_max[k]) {in_region = 0;}
+                }
+                if(!in_region)
+                    continue;
+            }
+            IoStreamSelected[i] = 1;
+            n_type[P[i].Type]++;
+        }
+        sumup_large_ints(6, n_type, ntot_type_all);
+        CPU_Step[CPU_DRIFT] += measure_time();
+
+        if(!(CommBuffer = mymalloc("CommBuffer", bytes = ((size_t) All.BufferSize) * 1024 * 1024)))
+        {
+            printf("failed to allocate memory for `CommBuffer' (%g MB).\n", bytes / (1024.0 * 1024.0));
+            endrun(2);
+        }
+        IoStreamActive = &OutputStream[s];
+
+        distribute_file(All.NumFilesPerSnapshot, 0, 0, NTask - 1, &filenr, &masterTask, &lastTask);
+        if(All.NumFilesPerSnapshot > 1)
+        {
+            if(ThisTask == 0)
+            {
+                sprintf(buf, "%s/streamdir_%s_%06d", All.OutputDir, OutputStream[s].name, All.NumCurrentTiStep);
+                mkdir(buf, 02755);
+            }
+            MPI_Barrier(MPI_COMM_WORLD);
+            sprintf(buf, "%s/streamdir_%s_%06d/stream_%s_%06d.%d", All.OutputDir, OutputStream[s].name, All.NumCurrentTiStep,
+                    OutputStream[s].name, All.NumCurrentTiStep, filenr);
+        }
+        else
+            sprintf(buf, "%sstream_%s_%06d", All.OutputDir, OutputStream[s].name, All.NumCurrentTiStep);
+
+        ngroups = All.NumFilesPerSnapshot / All.NumFilesWrittenInParallel;
+        if((All.NumFilesPerSnapshot % All.NumFilesWrittenInParallel))
+            ngroups++;
+        for(gr = 0; gr < ngroups; gr++)
+        {
+            if((filenr / All.NumFilesWrittenInParallel) == gr)
+                write_file(buf, masterTask, lastTask);
+            MPI_Barrier(MPI_COMM_WORLD);
+        }
+
+        IoStreamActive = NULL;
+        myfree(CommBuffer);
+        myfree(IoStreamSelected);
+        IoStreamSelected = NULL;
+
+        CPU_Step[CPU_SNAPSHOT] += measure_time();
+    }
+}
+#endif
+
+
 
 /*! This function fills the write buffer with particle data. New output blocks can in
  *  principle be added here.
@@ -235,7 +462,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
     {
         case IO_POS:		/* positions */
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < 3; k++)
                     {
@@ -256,7 +483,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
             
         case IO_VEL:		/* velocities */
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     dt_step = (P[pindex].TimeBin ? (((integertime) 1) << P[pindex].TimeBin) : 0);
                     
@@ -296,7 +523,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
             
         case IO_ID:		/* particle ID */
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *ip++ = P[pindex].ID;
                     n++;
@@ -305,7 +532,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
 
         case IO_CHILD_ID:		/* particle 'child' ID (for splits/mergers) */
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *ip++ = P[pindex].ID_child_number;
                     n++;
@@ -314,7 +541,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
 
         case IO_GENERATION_ID:	/* particle ID generation (for splits/mergers) */
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *ip++ = P[pindex].ID_generation;
                     n++;
@@ -323,7 +550,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
 
         case IO_MASS:		/* particle mass */
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = P[pindex].Mass;
                     n++;
@@ -332,7 +559,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
             
         case IO_U:			/* internal energy */
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = DMAX(All.MinEgySpec, SphP[pindex].InternalEnergyPred);
                     n++;
@@ -341,7 +568,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
             
         case IO_RHO:		/* density */
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].Density;
                     n++;
@@ -351,7 +578,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_NE:		/* electron abundance */
 #if defined(COOLING) || defined(RT_CHEM_PHOTOION)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].Ne;
                     n++;
@@ -362,7 +589,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_NH:		/* neutral hydrogen fraction */
 #if defined(COOLING) || defined(RT_CHEM_PHOTOION)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
 #if defined(RT_CHEM_PHOTOION)
                     *fp++ = SphP[pindex].HI;
@@ -383,7 +610,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_HII:		/* ionized hydrogen abundance */
 #if defined(RT_CHEM_PHOTOION)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].HII;
                     n++;
@@ -394,7 +621,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_HeI:		/* neutral Helium */
 #if defined(RT_CHEM_PHOTOION_HE)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].HeI;
                     n++;
@@ -405,7 +632,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_HeII:		/* ionized Helium */
 #if defined(RT_CHEM_PHOTOION_HE)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].HeII;
                     n++;
@@ -434,7 +661,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
             
         case IO_HSML:		/* gas kernel length */
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = PPP[pindex].Hsml;
                     n++;
@@ -444,7 +671,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_SFR:		/* star formation rate */
 #ifdef GALSF
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     /* units convert to solar masses per yr */
                     *fp++ = get_starformation_rate(pindex) * ((All.UnitMass_in_g / SOLAR_MASS) / (All.UnitTime_in_s / SEC_PER_YEAR));
@@ -456,7 +683,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_AGE:		/* stellar formation time */
 #ifdef GALSF
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = P[pindex].StellarAge;
                     n++;
@@ -467,7 +694,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_OSTAR:
 #ifdef GALSF_SFR_IMF_SAMPLING
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = P[pindex].IMF_NumMassiveStars;
                     n++;
@@ -478,7 +705,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_GRAINSIZE:		/* grain size */
 #ifdef GRAIN_FLUID
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = P[pindex].Grain_Size;
                     n++;
@@ -490,7 +717,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_VSTURB_DISS:
 #if defined(TURB_DRIVING)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].DuDt_diss;
                     n++;
@@ -501,7 +728,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_VSTURB_DRIVE:
 #if defined(TURB_DRIVING)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].DuDt_drive;
                     n++;
@@ -515,7 +742,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_Z:			/* gas and star metallicity */
 #ifdef METALS
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < NUM_METAL_SPECIES; k++)
                     {
@@ -531,7 +758,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_POT:		/* gravitational potential */
 #if defined(OUTPUT_POTENTIAL)  || defined(FLAG_NOT_IN_PUBLIC_CODE_RESHUFFLE_AND_POTENTIAL)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = P[pindex].Potential;
                     n++;
@@ -542,7 +769,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_BH_DIST:
 #ifdef BH_CALC_DISTANCES
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = P[pindex].min_dist_to_bh;
                     n++;
@@ -553,7 +780,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_ACCEL:		/* acceleration */
 #ifdef OUTPUT_ACCELERATION
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < 3; k++)
                         fp[k] = All.cf_a2inv * P[pindex].GravAccel[k];
@@ -573,7 +800,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_DTENTR:		/* rate of change of internal energy */
 #ifdef OUTPUT_CHANGEOFENERGY
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].DtInternalEnergy;
                     n++;
@@ -593,7 +820,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_DELAYTIME:
 #ifdef GALSF_SUBGRID_WINDS
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].DelayTime;
                     n++;
@@ -608,7 +835,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
 #ifdef OUTPUT_TIMESTEP
             
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = (P[pindex].TimeBin ? (((integertime) 1) << P[pindex].TimeBin) : 0) * All.Timebase_interval;
                     n++;
@@ -619,7 +846,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_BFLD:		/* magnetic field  */
 #ifdef MAGNETIC
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < 3; k++)
                         *fp++ = (Get_Particle_BField(pindex,k) * a2_inv * gizmo2gauss);
@@ -657,7 +884,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_VORT:		/* Vorticity */
 #if defined(TURB_DRIVING) || defined(OUTPUT_VORTICITY)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].Vorticity[0];
                     *fp++ = SphP[pindex].Vorticity[1];
@@ -671,7 +898,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_IMF:		/* parameters describing the IMF  */
 #ifdef GALSF_SFR_IMF_VARIATION
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < N_IMF_FORMPROPS; k++)
                         fp[k] = P[pindex].IMF_FormProps[k];
@@ -690,7 +917,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_COSMICRAY_ALFVEN:    /* energy in the resonant (~gyro-radii) Alfven modes field, in the +/- (with respect to B) fields  */
 #ifdef COSMIC_RAYS_ALFVEN
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < 2; k++)
                         *fp++ = SphP[pindex].CosmicRayAlfvenEnergyPred[k];
@@ -703,7 +930,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_DIVB:		/* divergence of magnetic field  */
 #ifdef MAGNETIC
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     /* divB is saved in physical units */
                     *fp++ = (SphP[pindex].divB * gizmo2gauss * (SphP[pindex].Density*All.cf_a3inv / P[pindex].Mass));
@@ -715,7 +942,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_ABVC:		/* artificial viscosity of particle  */
 #if defined(SPHAV_CD10_VISCOSITY_SWITCH)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].alpha * SphP[pindex].alpha_limiter;
                     n++;
@@ -727,7 +954,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_AMDC:		/* artificial magnetic dissipation of particle  */
 #if defined(SPH_TP12_ARTIFICIAL_RESISTIVITY)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].Balpha;
                     n++;
@@ -738,7 +965,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_PHI:		/* divBcleaning fuction of particle  */
 #ifdef DIVBCLEANING_DEDNER
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = (Get_Particle_PhiField(pindex) * All.cf_a3inv * gizmo2gauss);
                     n++;
@@ -749,7 +976,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_GRADPHI:		/* divBcleaning fuction of particle  */
 #ifdef DIVBCLEANING_DEDNER
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < 3; k++)
                         *fp++ = (SphP[pindex].Gradients.Phi[k] * a2_inv*a2_inv * gizmo2gauss);
@@ -764,7 +991,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_COOLRATE:		/* current cooling rate of particle  */
 #ifdef OUTPUT_COOLRATE
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     double ne = SphP[pindex].Ne;
                     /* get cooling time */
@@ -790,7 +1017,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_BHMASS:
 #ifdef BLACK_HOLES
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = BPP(pindex).BH_Mass;
                     n++;
@@ -801,7 +1028,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_BHMASSALPHA:
 #ifdef BH_ALPHADISK_ACCRETION
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = BPP(pindex).BH_Mass_AlphaDisk;
                     n++;
@@ -812,7 +1039,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_BHMDOT:
 #ifdef BLACK_HOLES
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = BPP(pindex).BH_Mdot;
                     n++;
@@ -823,7 +1050,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_BHPROGS:
 #ifdef BH_COUNTPROGS
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *ip_int++ = BPP(pindex).BH_CountProgs;
                     n++;
@@ -834,7 +1061,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_ACRB:
 #ifdef BLACK_HOLES
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = P[pindex].Hsml;
                     n++;
@@ -890,7 +1117,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_EOSABAR:
 #ifdef EOS_CARRIES_ABAR
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].Abar;
                     n++;
@@ -901,7 +1128,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_TURB_DYNAMIC_COEFF:
 #ifdef TURB_DIFF_DYNAMIC
             for (n = 0; n < pc; pindex++) {
-                if (P[pindex].Type == type) {
+                if (IO_WRITE_PARTICLE(pindex, type)) {
                     *fp++ = SphP[pindex].TD_DynDiffCoeff;
                     n++;
                 }
@@ -912,7 +1139,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_EOSYE:
 #ifdef EOS_CARRIES_YE
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].Ye;
                     n++;
@@ -924,7 +1151,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_EOSTEMP:
 #ifdef EOS_CARRIES_TEMPERATURE
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].Temperature;
                     n++;
@@ -935,7 +1162,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_PRESSURE:
 #if defined(EOS_GENERAL)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = SphP[pindex].Pressure;
                     n++;
@@ -946,7 +1173,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
             case IO_EOSCS:
 #if defined(EOS_GENERAL)
             for(n = 0; n < pc; pindex++)
-            if(P[pindex].Type == type)
+            if(IO_WRITE_PARTICLE(pindex, type))
         {
             *fp++ = SphP[pindex].SoundSpeed;
             n++;
@@ -961,7 +1188,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_EOS_STRESS_TENSOR:
 #if defined(EOS_ELASTIC)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < 3; k++)
                     {
@@ -979,7 +1206,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
             case IO_EOSCOMP:
 #ifdef EOS_TILLOTSON
             for(n = 0; n < pc; pindex++)
-            if(P[pindex].Type == type)
+            if(IO_WRITE_PARTICLE(pindex, type))
         {
             *ip_int++ = SphP[pindex].CompositionType;
             n++;
@@ -990,7 +1217,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_PARTVEL:
 #ifdef HYDRO_MESHLESS_FINITE_VOLUME
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < 3; k++)
                             fp[k] = SphP[pindex].ParticleVel[k];
@@ -1005,7 +1232,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_RADGAMMA:
 #ifdef RADTRANSFER
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < N_RT_FREQ_BINS; k++)
                         fp[k] = SphP[pindex].E_gamma[k];
@@ -1019,7 +1246,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_RAD_ACCEL:
 #ifdef RT_RAD_PRESSURE_OUTPUT
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < 3; k++) {fp[k] = SphP[pindex].RadAccel[k];}                    
                     n++;
@@ -1031,7 +1258,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_EDDINGTON_TENSOR:
 #ifdef RADTRANSFER
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     for(k = 0; k < 6; k++)
                     {
@@ -1065,7 +1292,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_AGS_SOFT:		/* Adaptive Gravitational Softening: softening */
 #if defined(ADAPTIVE_GRAVSOFT_FORALL) && defined(AGS_OUTPUTGRAVSOFT)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = PPP[pindex].AGS_Hsml;
                     n++;
@@ -1083,7 +1310,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_AGS_ZETA:		/* Adaptive Gravitational Softening: zeta */
 #if defined(ADAPTIVE_GRAVSOFT_FORALL) && defined(AGS_OUTPUTZETA)
             for(n = 0; n < pc; pindex++)
-                if(P[pindex].Type == type)
+                if(IO_WRITE_PARTICLE(pindex, type))
                 {
                     *fp++ = PPPZ[pindex].AGS_zeta;
                     n++;
@@ -1107,7 +1334,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grHI:
 #if (COOL_GRACKLE_CHEMISTRY >= 1)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grHI;
                     n++;
                 }
@@ -1118,7 +1345,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grHII:
 #if (COOL_GRACKLE_CHEMISTRY >= 1)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grHII;
                     n++;
                 }
@@ -1129,7 +1356,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grHM:
 #if (COOL_GRACKLE_CHEMISTRY >= 1)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grHM;
                     n++;
                 }
@@ -1140,7 +1367,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grHeI:
 #if (COOL_GRACKLE_CHEMISTRY >= 1)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grHeI;
                     n++;
                 }
@@ -1151,7 +1378,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grHeII:
 #if (COOL_GRACKLE_CHEMISTRY >= 1)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grHeII;
                     n++;
                 }
@@ -1162,7 +1389,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grHeIII:
 #if (COOL_GRACKLE_CHEMISTRY >= 1)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grHeIII;
                     n++;
                 }
@@ -1173,7 +1400,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grH2I:
 #if (COOL_GRACKLE_CHEMISTRY >= 2)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grH2I;
                     n++;
                 }
@@ -1184,7 +1411,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grH2II:
 #if (COOL_GRACKLE_CHEMISTRY >= 2)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grH2II;
                     n++;
                 }
@@ -1195,7 +1422,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grDI:
 #if (COOL_GRACKLE_CHEMISTRY >= 3)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grDI;
                     n++;
                 }
@@ -1206,7 +1433,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grDII:
 #if (COOL_GRACKLE_CHEMISTRY >= 3)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grDII;
                     n++;
                 }
@@ -1217,7 +1444,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
         case IO_grHDI:
 #if (COOL_GRACKLE_CHEMISTRY >= 3)
             for(n = 0; n < pc; pindex++){
-                if(P[pindex].Type == type){
+                if(IO_WRITE_PARTICLE(pindex, type)){
                     *fp++ = SphP[pindex].grHDI;
                     n++;
                 }
@@ -1228,7 +1455,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
     case IO_TURB_DIFF_COEFF:
 #ifdef TURB_DIFF_DYNAMIC
         for (n = 0; n < pc; pindex++) {
-            if (P[pindex].Type == type) {
+            if (IO_WRITE_PARTICLE(pindex, type)) {
                 *fp++ = SphP[pindex].TD_DiffCoeff;
                 n++;
             }
@@ -1240,7 +1467,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
     case IO_DYNERROR:
 #ifdef TURB_DIFF_DYNAMIC_ERROR
         for (n = 0; n < pc; pindex++) {
-            if (P[pindex].Type == type) {
+            if (IO_WRITE_PARTICLE(pindex, type)) {
                 *fp++ = SphP[pindex].TD_DynDiffCoeff_error;
                 n++;
             }
@@ -1251,7 +1478,7 @@ void fill_write_buffer(enum iofields blocknr, int *startindex, int pc, int type)
     case IO_DYNERRORDEFAULT:
 #ifdef TURB_DIFF_DYNAMIC_ERROR
         for (n = 0; n < pc; pindex++) {
-            if (P[pindex].Type == type) {
+            if (IO_WRITE_PARTICLE(pindex, type)) {
                 *fp++ = SphP[pindex].TD_DynDiffCoeff_error_default;
                 n++;
             }
@@ -2045,6 +2272,10 @@ long get_particles_in_block(enum iofields blocknr, int *typelist)
  */
 int blockpresent(enum iofields blocknr)
 {
+#ifdef OUTPUT_STREAMS
+    if(IoStreamActive && !IoStreamActive->all_fields && !IoStreamActive->field[blocknr])
+        return 0;       /* block not requested for the output stream currently written */
+#endif
     switch (blocknr)
     {
         case IO_POS:
@@ -3340,6 +3571,41 @@ void get_dataset_name(enum iofields blocknr, char *buf)
 
 
 
+#if defined(HAVE_HDF5) && defined(IO_COMPRESS_HDF5)
+/*! This function returns the HDF5 dataset-creation property list (chunking and filter pipeline) used to
+ *  compress a given block. Integer blocks (IDs, counters) and, by default, all floating-point blocks are
+ *  compressed losslessly with byte-shuffling followed by fast (level 1) deflate. If IO_COMPRESS_HDF5_LOSSY
+ *  is set, positions and velocities are instead quantized with the HDF5 scale-offset filter to a fixed
+ *  absolute tolerance (set in the parameterfile): each chunk stores only the offset from its minimum, so
+ *  since particles are written in Peano-Hilbert order, positions are effectively stored relative to the
+ *  local Peano-Hilbert cell with just the bits needed to reach the desired accuracy.
+ */
+hid_t get_hdf5_compression_plist_for_block(enum iofields blocknr, int rank, hsize_t *dims)
+{
+    hid_t plist_id = H5Pcreate(H5P_DATASET_CREATE);
+    hsize_t cdims[2]; cdims[0] = dims[0]; cdims[1] = dims[1];
+    if(cdims[0] > IO_COMPRESS_HDF5_CHUNKSIZE) {cdims[0] = IO_COMPRESS_HDF5_CHUNKSIZE;}
+    H5Pset_chunk(plist_id, rank, cdims);
+    
+    double tolerance = 0;
+#ifdef IO_COMPRESS_HDF5_LOSSY
+    if(blocknr == IO_POS) {tolerance = All.SnapCompressionPosTolerance;}
+    if(blocknr == IO_VEL) {tolerance = All.SnapCompressionVelTolerance;}
+#endif
+    if(tolerance > 0 && (get_datatype_in_block(blocknr) == 1 || get_datatype_in_block(blocknr) == 3))
+    {
+        int decimal_digits = (int) ceil(log10(0.5 / tolerance)); /* keeps the rounding error <= tolerance */
+        if(decimal_digits < 0) {decimal_digits = 0;}
+        H5Pset_scaleoffset(plist_id, H5Z_SO_FLOAT_DSCALE, decimal_digits);
+    } else {
+        H5Pset_shuffle(plist_id);
+    }
+    H5Pset_deflate(plist_id, 1);
+    return plist_id;
+}
+#endif
+
+
 /*! This function writes a snapshot file containing the data from processors
  *  'writeTask' to 'lastTask'. 'writeTask' is the one that actually writes.
  *  Each snapshot file contains a header first, then particle positions,
@@ -3471,7 +3737,11 @@ void write_file(char *fname, int writeTask, int lastTask)
         {
 #ifdef HAVE_HDF5
             sprintf(buf, "%s.hdf5", fname);
+#ifdef IO_ASYNC_OUTPUT
+            hdf5_file = io_async_hdf5_fcreate(buf);
+#else
             hdf5_file = H5Fcreate(buf, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+#endif
             
             hdf5_headergrp = H5Gcreate(hdf5_file, "/Header", 0);
             
@@ -3489,7 +3759,11 @@ void write_file(char *fname, int writeTask, int lastTask)
         }
         else
         {
+#ifdef IO_ASYNC_OUTPUT
+            if(!(fd = io_async_fopen(fname)))
+#else
             if(!(fd = fopen(fname, "w")))
+#endif
             {
                 printf("can't open file `%s' for writing snapshot.\n", fname);
                 endrun(123);
@@ -3682,11 +3956,9 @@ void write_file(char *fname, int writeTask, int lastTask)
 #else
                             if(dims[0] > 10)
 			    {
-                            	hid_t plist_id = H5Pcreate(H5P_DATASET_CREATE);
-                            	hsize_t cdims[2]; cdims[0] = (hsize_t) (dims[0] / 10); cdims[1] = dims[1];
-                            	hdf5_status = H5Pset_chunk (plist_id, rank, cdims);
-                            	hdf5_status = H5Pset_deflate (plist_id, 4);
+                            	hid_t plist_id = get_hdf5_compression_plist_for_block(blocknr, rank, dims);
                             	hdf5_dataset = H5Dcreate2(hdf5_grp[type], buf, hdf5_datatype, hdf5_dataspace_in_file, H5P_DEFAULT, plist_id, H5P_DEFAULT);
+                            	H5Pclose(plist_id);
 			    } else {
                             	hdf5_dataset = H5Dcreate(hdf5_grp[type], buf, hdf5_datatype, hdf5_dataspace_in_file, H5P_DEFAULT);
 			    }                      
@@ -3803,12 +4075,21 @@ void write_file(char *fname, int writeTask, int lastTask)
                 if(header.npart[type] > 0)
                     H5Gclose(hdf5_grp[type]);
             H5Gclose(hdf5_headergrp);
+#ifdef IO_ASYNC_OUTPUT
+            sprintf(buf, "%s.hdf5", fname);
+            io_async_hdf5_fclose(hdf5_file, buf);
+#else
             H5Fclose(hdf5_file);
+#endif
 #endif
         }
         else
         {
+#ifdef IO_ASYNC_OUTPUT
+            io_async_fclose(fd);
+#else
             fclose(fd);
+#endif
         }
     }
 }
@@ -180,109 +180,56 @@ static inline void kernel_hinv(double h, double *hinv, double *hinv3, double *hi
   return;
 } 
 
-/* Attention: Here we assume that kernel is only called 
-   with range 0..1 for u as done in hydra or density !! 
-   Call with mode 0 to calculate dwk and wk
-   Call with mode -1 to calculate only wk
-   Call with mode +1 to calculate only dwk */
+/* dimensionless kernel shape w(u) and its derivative dw/du (without normalization), written
+   without branches on u: piecewise kernels use truncated powers or selects, so the compiler can
+   if-convert and vectorize loops over u. This is the only place the kernel polynomials are defined:
+   kernel_main, the batched evaluation, and the lookup tables (KERNEL_TABLE) are all built from it. */
 
-static inline void kernel_main(double u, double hinv3, double hinv4, 
-        double *wk, double *dwk, int mode)
+static inline void kernel_shape(double u, double *w, double *dw)
 {
 #if (KERNEL_FUNCTION == 1) /* linear ramp */
-    if(mode >= 0)
-        *dwk = -1;
-    if(mode <= 0)
-        *wk = 1-u;
+    *dw = -1;
+    *w = 1-u;
 #endif
 
 #if (KERNEL_FUNCTION == 2) /* quadratic */
     double t1 = 1-u;
-    if(mode >= 0)
-        *dwk = -2*t1;
-    if(mode <= 0)
-        *wk = t1*t1;
+    *dw = -2*t1;
+    *w = t1*t1;
 #endif
     
 
 #if (KERNEL_FUNCTION == 3) /* cubic spline */
-  if(u < 0.5)
-    {
-      if(mode >= 0) 
-          *dwk = u * (18.0 * u - 12.0);
-      if(mode <= 0) 
-          *wk = (1.0 + 6.0 * (u - 1.0) * u * u);
-    }
-  else
-    {
-      double t1 = (1.0 - u);
-      double t2 = t1 * t1;
-      if(mode >= 0) 
-          *dwk = -6.0 * t2;
-      if(mode <= 0) 
-          *wk = 2.0 * t2 * t1;
-    }
+    double t1 = (1.0 - u);
+    double t2 = t1 * t1;
+    int inner = (u < 0.5);
+    *dw = inner ? u * (18.0 * u - 12.0) : -6.0 * t2;
+    *w = inner ? (1.0 + 6.0 * (u - 1.0) * u * u) : 2.0 * t2 * t1;
 #endif /* cubic spline */
 
 #if (KERNEL_FUNCTION == 4) /* quartic spline */
-  double t1 = (1.0 - u);
-  double t2 = t1 * t1;
-  double t4 = t2 * t2;
-
-  if(mode >= 0) 
-      *dwk = -5.0 * t4;
-  if(mode <= 0) 
-      *wk = t4 * t1;
-
-  if (u < 2.0/3.0)
-    {
-      t1 = (2.0/3.0 - u);
-      t2 = t1 * t1;
-      t4 = t2 * t2;
-      if(mode >= 0) 
-          *dwk += 30.0 * t4;
-      if(mode <= 0) 
-          *wk -= 6.0 * t4 * t1;
-    }
-  if (u < 1.0/3.0)
-    {
-      t1 = (1.0/3.0 - u);
-      t2 = t1 * t1;
-      t4 = t2 * t2;
-      if(mode >= 0) 
-          *dwk -= 75.0 * t4;
-      if(mode <= 0) 
-          *wk += 15.0 * t4 * t1;
-    }
+    double t1 = (1.0 - u);
+    double t2 = t1 * t1;
+    double t4 = t2 * t2;
+    double a1 = (u < 2.0/3.0) ? (2.0/3.0 - u) : 0; /* truncated powers replace the u-branches */
+    double a2 = a1 * a1;
+    double a4 = a2 * a2;
+    double b1 = (u < 1.0/3.0) ? (1.0/3.0 - u) : 0;
+    double b2 = b1 * b1;
+    double b4 = b2 * b2;
+    *dw = -5.0 * t4 + 30.0 * a4 - 75.0 * b4;
+    *w = t4 * t1 - 6.0 * a4 * a1 + 15.0 * b4 * b1;
 #endif /* quartic spline */
 
 #if (KERNEL_FUNCTION == 5) /* quintic spline */
     double t1 = (1.0 - u);
     double t2 = t1 * t1;
-    
-    if(mode >= 0)
-        *dwk = -4.0 * t2 * t1;
-    if(mode <= 0)
-        *wk = t2 * t2;
-    
-    if (u < 0.6)
-    {
-        t1 = (0.6 - u);
-        t2 = t1 * t1;
-        if(mode >= 0)
-            *dwk += 20.0 * t2 * t1;
-        if(mode <= 0)
-            *wk -= 5.0 * t2 * t2;
-    }
-    if (u < 0.2)
-    {
-        t1 = (0.2 - u);
-        t2 = t1 * t1;
-        if(mode >= 0)
-            *dwk -= 40.0 * t2 * t1;
-        if(mode <= 0)
-            *wk += 10.0 * t2 * t2;
-    }
+    double a1 = (u < 0.6) ? (0.6 - u) : 0;
+    double a2 = a1 * a1;
+    double b1 = (u < 0.2) ? (0.2 - u) : 0;
+    double b2 = b1 * b1;
+    *dw = -4.0 * t2 * t1 + 20.0 * a2 * a1 - 40.0 * b2 * b1;
+    *w = t2 * t2 - 5.0 * a2 * a2 + 10.0 * b2 * b2;
 #endif /* quintic spline */
     
 
@@ -290,15 +237,11 @@ static inline void kernel_main(double u, double hinv3, double hinv4,
     double t1 = (1 - u);
     double t3 = t1*t1*t1;
 #if (NUMDIMS == 1)
-    if(mode >= 0)
-        *dwk = -12.0 * u * t1*t1;
-    if(mode <= 0)
-        *wk = t3 * (1.0 + 3.0*u);
+    *dw = -12.0 * u * t1*t1;
+    *w = t3 * (1.0 + 3.0*u);
 #else
-    if(mode >= 0)
-        *dwk = -20.0 * u * t3;
-    if(mode <= 0)
-        *wk = t3 * t1 * (1.0 + 4.0*u);
+    *dw = -20.0 * u * t3;
+    *w = t3 * t1 * (1.0 + 4.0*u);
 #endif
 #endif
 
@@ -307,41 +250,141 @@ static inline void kernel_main(double u, double hinv3, double hinv4,
     double t1 = (1 - u);
     double t5 = t1*t1; t5 *= t5*t1;
 #if (NUMDIMS == 1)
-    if(mode >= 0)
-        *dwk = -14.0 * (t5/t1) * u * (1.0 + 4.0*u);
-    if(mode <= 0)
-        *wk = t5 * (1.0 + 5.0*u + 8.0*u*u);
+    *dw = -14.0 * (t5/t1) * u * (1.0 + 4.0*u);
+    *w = t5 * (1.0 + 5.0*u + 8.0*u*u);
 #else
-    if(mode >= 0)
-        *dwk = -(56.0/3.0) * t5 * u * (1.0 + 5.0*u);
-    if(mode <= 0)
-        *wk = t5 * t1 * (1.0 + 6.0*u + (35.0/3.0)*u*u);
+    *dw = -(56.0/3.0) * t5 * u * (1.0 + 5.0*u);
+    *w = t5 * t1 * (1.0 + 6.0*u + (35.0/3.0)*u*u);
 #endif
 #endif
 
     
 #if (KERNEL_FUNCTION == 8) /* quadratic '2-part' kernel */
-    if(u < KERNEL_U0)
+    int inner = (u < KERNEL_U0);
+    *dw = inner ? -2*u/KERNEL_U0 : -2*(1-u)/(1-KERNEL_U0);
+    *w = inner ? 1-u*u/KERNEL_U0 : (1-u)*(1-u)/(1-KERNEL_U0);
+#endif
+}
+
+
+#ifdef KERNEL_TABLE
+/* linear interpolation in the tables of w(u), dw/du (tabulated at u=i/KERNEL_TABLE_N by kernel_table_init).
+   u=1 is handled by letting the last interval extrapolate to its endpoint, rather than by a branch */
+static inline void kernel_shape_table(double u, double *w, double *dw)
+{
+    double x = u * KERNEL_TABLE_N;
+    int i = (int) x;
+    i = (i < KERNEL_TABLE_N) ? i : KERNEL_TABLE_N-1;
+    double f = x - i;
+    *w  = Kernel_Table[i][0] + f * (Kernel_Table[i+1][0] - Kernel_Table[i][0]);
+    *dw = Kernel_Table[i][1] + f * (Kernel_Table[i+1][1] - Kernel_Table[i][1]);
+}
+#define KERNEL_SHAPE(u,w,dw) kernel_shape_table(u,w,dw)
+#else
+#define KERNEL_SHAPE(u,w,dw) kernel_shape(u,w,dw)
+#endif
+
+
+/* Attention: Here we assume that kernel is only called 
+   with range 0..1 for u as done in hydra or density !! 
+   Call with mode 0 to calculate dwk and wk
+   Call with mode -1 to calculate only wk
+   Call with mode +1 to calculate only dwk */
+
+static inline void kernel_main(double u, double hinv3, double hinv4, 
+        double *wk, double *dwk, int mode)
+{
+    double w, dw;
+    KERNEL_SHAPE(u, &w, &dw); /* mode is a constant at every call site, so the unused half is optimized out */
+    if(mode >= 0)
+        *dwk = dw * (KERNEL_NORM * hinv4);
+    if(mode <= 0)
+        *wk = w * (KERNEL_NORM * hinv3);
+    return;
+}
+
+
+/* batched version of kernel_main (mode 0) for n values of u sharing the same kernel length:
+   the loop body contains no branches, so it is vectorized by the compiler. Neighbor loops call this
+   for blocks of up to KERNEL_BATCH_SIZE neighbors, so the work arrays can live on the stack */
+#define KERNEL_BATCH_SIZE 64
+static inline void kernel_main_batch(int n, double *u, double hinv3, double hinv4, double *wk, double *dwk)
+{
+    int k; double wnorm = KERNEL_NORM * hinv3, dwnorm = KERNEL_NORM * hinv4;
+#if defined(_OPENMP) && (_OPENMP >= 201307)
+#pragma omp simd
+#endif
+    for(k = 0; k < n; k++)
     {
-        if(mode >= 0)
-            *dwk = -2*u/KERNEL_U0;
-        if(mode <= 0)
-            *wk = 1-u*u/KERNEL_U0;
-    } else {
-        if(mode >= 0)
-            *dwk = -2*(1-u)/(1-KERNEL_U0);
-        if(mode <= 0)
-            *wk = (1-u)*(1-u)/(1-KERNEL_U0);
+        double w, dw;
+        KERNEL_SHAPE(u[k], &w, &dw);
+        wk[k] = w * wnorm;
+        dwk[k] = dw * dwnorm;
     }
+}
+
+/* as kernel_main_batch, but each u comes with its own kernel length (e.g. the kernels centered on the neighbors) */
+static inline void kernel_main_batch_varh(int n, double *u, double *hinv3, double *hinv4, double *wk, double *dwk)
+{
+    int k;
+#if defined(_OPENMP) && (_OPENMP >= 201307)
+#pragma omp simd
 #endif
-    
-    
-  if(mode >= 0) 
-      *dwk *= KERNEL_NORM * hinv4;
-  if(mode <= 0) 
-      *wk *= KERNEL_NORM * hinv3;
+    for(k = 0; k < n; k++)
+    {
+        double w, dw;
+        KERNEL_SHAPE(u[k], &w, &dw);
+        wk[k] = w * (KERNEL_NORM * hinv3[k]);
+        dwk[k] = dw * (KERNEL_NORM * hinv4[k]);
+    }
+}
 
-  return;
+/* the kernels centered on both particles, W(r,h_i) and W(r,h_j), for a block of entries n0..n1-1 of a neighbor list,
+   as needed by the gradient and hydro loops (see kernel_pair_block_fill). Entries outside a kernel are evaluated
+   at u=1 and set to zero, so a caller whose own r<h test disagrees in the last bit still never picks up W(0) */
+struct kernel_pair_block
+{
+    int n0, n1;
+    double r[KERNEL_BATCH_SIZE], h_j[KERNEL_BATCH_SIZE];
+    double wk_i[KERNEL_BATCH_SIZE], dwk_i[KERNEL_BATCH_SIZE], wk_j[KERNEL_BATCH_SIZE], dwk_j[KERNEL_BATCH_SIZE];
+};
+
+static inline void kernel_pair_block_eval(struct kernel_pair_block *kb, double h_i, double hinv_i, double hinv3_i, double hinv4_i)
+{
+    int k, n = kb->n1 - kb->n0;
+    double u[KERNEL_BATCH_SIZE], hinv_j, hinv3_j[KERNEL_BATCH_SIZE], hinv4_j[KERNEL_BATCH_SIZE];
+    for(k = 0; k < n; k++) {u[k] = (kb->r[k] < h_i) ? kb->r[k] * hinv_i : 1;}
+    kernel_main_batch(n, u, hinv3_i, hinv4_i, kb->wk_i, kb->dwk_i);
+    for(k = 0; k < n; k++) {if(!(kb->r[k] < h_i)) {kb->wk_i[k] = kb->dwk_i[k] = 0;}}
+    for(k = 0; k < n; k++)
+    {
+        if(kb->r[k] < kb->h_j[k]) {kernel_hinv(kb->h_j[k], &hinv_j, &hinv3_j[k], &hinv4_j[k]); u[k] = kb->r[k] * hinv_j;}
+        else {u[k] = 1; hinv3_j[k] = hinv4_j[k] = 0;} /* zero normalization: W=dW=0 for any kernel shape */
+    }
+    kernel_main_batch_varh(n, u, hinv3_j, hinv4_j, kb->wk_j, kb->dwk_j);
+}
+
+/* set up the block of neighbor-list entries starting at n0: only the separations are needed here, the pairs are
+   selected (and their kernel values picked up) by the caller's loop over the same entries */
+static inline void kernel_pair_block_fill(struct kernel_pair_block *kb, int n0, int numngb, int *ngblist, MyDouble *pos,
+                                          double h_i, double hinv_i, double hinv3_i, double hinv4_i)
+{
+    int j, k; double dp[3];
+    kb->n0 = n0;
+    kb->n1 = (n0 + KERNEL_BATCH_SIZE < numngb) ? (n0 + KERNEL_BATCH_SIZE) : numngb;
+    for(k = 0; k < kb->n1 - n0; k++)
+    {
+        j = ngblist[n0 + k];
+        dp[0] = pos[0] - P[j].Pos[0];
+        dp[1] = pos[1] - P[j].Pos[1];
+        dp[2] = pos[2] - P[j].Pos[2];
+#ifdef BOX_PERIODIC
+        NEAREST_XYZ(dp[0],dp[1],dp[2],1);
+#endif
+        kb->r[k] = sqrt(dp[0] * dp[0] + dp[1] * dp[1] + dp[2] * dp[2]);
+        kb->h_j[k] = PPP[j].Hsml;
+    }
+    kernel_pair_block_eval(kb, h_i, hinv_i, hinv3_i, hinv4_i);
 }
 
 
@@ -353,7 +396,7 @@ static inline void kernel_main(double u, double hinv3, double hinv4,
   Call with mode +1 to calculate only (1/u) * dphi_du */
 
 
-static inline double kernel_gravity(double u, double hinv, double hinv3, int mode)
+static inline double kernel_gravity_exact(double u, double hinv, double hinv3, int mode)
 {
     /* here everything is newtonian, add this as a check just in case */
     if(u >= 1)
@@ -567,3 +610,34 @@ static inline double kernel_gravity(double u, double hinv, double hinv3, int mod
 }
 
 
+#ifdef KERNEL_TABLE
+/* tabulated version of the softened gravity kernel: the tables hold the values of kernel_gravity_exact
+   for hinv=1 in modes +1 (column 0), -1 (column 1), and 0 (column 2), interpolated linearly in u */
+static inline double kernel_gravity(double u, double hinv, double hinv3, int mode)
+{
+    if(u >= 1) {return kernel_gravity_exact(u, hinv, hinv3, mode);}
+    double x = u * KERNEL_TABLE_N;
+    int i = (int) x, col = (mode == 1) ? 0 : ((mode == -1) ? 1 : 2);
+    double f = x - i, wk = Kernel_Table_Grav[i][col] + f * (Kernel_Table_Grav[i+1][col] - Kernel_Table_Grav[i][col]);
+    if(mode == 1) {return wk * hinv3;}
+    if(mode == -1) {return wk * hinv;}
+    return wk * hinv * hinv;
+}
+
+
+/* fills the kernel lookup tables from the exact expressions: called once at startup (begrun) on every task */
+static inline void kernel_table_init(void)
+{
+    int i;
+    for(i = 0; i <= KERNEL_TABLE_N; i++)
+    {
+        double u = ((double) i) / KERNEL_TABLE_N, u_g = (i < KERNEL_TABLE_N) ? u : 1.-1.e-10; /* gravity: take the u->1 limit from inside the kernel */
+        kernel_shape(u, &Kernel_Table[i][0], &Kernel_Table[i][1]);
+        Kernel_Table_Grav[i][0] = kernel_gravity_exact(u_g, 1, 1, 1);
+        Kernel_Table_Grav[i][1] = kernel_gravity_exact(u_g, 1, 1, -1);
+        Kernel_Table_Grav[i][2] = kernel_gravity_exact(u_g, 1, 1, 0);
+    }
+}
+#else
+static inline double kernel_gravity(double u, double hinv, double hinv3, int mode) {return kernel_gravity_exact(u, hinv, hinv3, mode);}
+#endif
@@ -35,6 +35,7 @@ void do_first_halfstep_kick(void)
     }
 #endif
     
+#ifdef HYDRO_MESHLESS_FINITE_VOLUME
     /* collisionless particles only need an update if they are active; however, to 
         maintain manifest conservation in the hydro, need to check -ALL- sph particles every timestep */
     for(i = 0; i < NumPart; i++)
@@ -51,6 +52,24 @@ void do_first_halfstep_kick(void)
             do_the_kick(i, tstart, tend, P[i].Ti_current, 0);
         }
     } // for(i = 0; i < NumPart; i++) // 
+#else
+    /* without mass fluxes only the active particles need to be kicked: each kick is independent, so these can be done in parallel */
+    int n;
+#ifdef _OPENMP
+#pragma omp parallel for private(i, ti_step, tstart, tend) schedule(static)
+#endif
+    for(n = 0; n < NumActiveParticle; n++)
+    {
+        i = ActiveParticleList[n];
+        if(P[i].Mass > 0)
+        {
+            ti_step = P[i].TimeBin ? (((integertime) 1) << P[i].TimeBin) : 0;
+            tstart = P[i].Ti_begstep;	/* beginning of step */
+            tend = P[i].Ti_begstep + ti_step / 2;	/* midpoint of step */
+            do_the_kick(i, tstart, tend, P[i].Ti_current, 0);
+        }
+    } // for(n = 0; n < NumActiveParticle; n++) //
+#endif
 }
 
 
@@ -69,6 +88,7 @@ void do_second_halfstep_kick(void)
     }
 #endif
 
+#ifdef HYDRO_MESHLESS_FINITE_VOLUME
     for(i = 0; i < NumPart; i++)
     {
         if(P[i].Mass > 0)
@@ -85,6 +105,24 @@ void do_second_halfstep_kick(void)
                 set_predicted_sph_quantities_for_extra_physics(i);
         }
     } // for(i = 0; i < NumPart; i++) //
+#else
+    int n;
+#ifdef _OPENMP
+#pragma omp parallel for private(i, ti_step, tstart, tend) schedule(static)
+#endif
+    for(n = 0; n < NumActiveParticle; n++)
+    {
+        i = ActiveParticleList[n];
+        if(P[i].Mass > 0)
+        {
+            ti_step = P[i].TimeBin ? (((integertime) 1) << P[i].TimeBin) : 0;
+            tstart = P[i].Ti_begstep + ti_step / 2;	/* midpoint of step */
+            tend = P[i].Ti_begstep + ti_step;	/* end of step */
+            do_the_kick(i, tstart, tend, P[i].Ti_current, 1);
+            set_predicted_sph_quantities_for_extra_physics(i);
+        }
+    } // for(n = 0; n < NumActiveParticle; n++) //
+#endif
     
 #ifdef TURB_DRIVING
     do_turb_driving_step_second_half();
@@ -132,6 +132,9 @@ int main(int argc, char **argv)
 
   run();			/* main simulation loop */
 
+#ifdef IO_ASYNC_OUTPUT
+  io_async_finalize();		/* make sure the background I/O thread has written everything before we exit */
+#endif
   MPI_Finalize();		/* clean up & finalize MPI */
 
   return 0;
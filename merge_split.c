@@ -321,6 +321,7 @@ void split_particle_i(int i, int n_particles_split, int i_nearest, double r2_nea
     /* the particle needs to be 'born active' and added to the active set */
     NextActiveParticle[j] = FirstActiveParticle;
     FirstActiveParticle = j;
+    ActiveParticleList[NumActiveParticle++] = j;
     NumForceUpdate++;
     /* likewise add it to the counters that register how many particles are in each timebin */
     TimeBinCount[P[j].TimeBin]++;
@@ -544,7 +545,7 @@ void merge_particles_ij(int i, int j)
     if(P[i].TimeBin < P[j].TimeBin)
     {
 #ifdef WAKEUP
-        PPPZ[j].wakeup = 1;
+        PPPZ[j].wakeup = 1; WakeupFlagsPending = 1;
 #endif
     }
     double dm_i=0,dm_j=0,de_i=0,de_j=0,dp_i[3],dp_j[3],dm_ij,de_ij,dp_ij[3];
@@ -191,7 +191,7 @@ int ngb_treefind_pairs_threads_targeted(MyDouble searchcenter[3], MyFloat hsml,
     local requirement, so we can't use our simple routines above. this is a customized version of the "ngb_treefind_variable" routine above. 
     as a result, updates to the core neighbor search routine will not alter this subroutine 
  */
-int ngb_treefind_fof_primary(MyDouble searchcenter[3], MyFloat hsml, int target, int *startnode, int mode, int *nexport, int *nsend_local, int MyFOF_PRIMARY_LINK_TYPES)
+int ngb_treefind_fof_primary(MyDouble searchcenter[3], MyFloat hsml, int target, int *startnode, int mode, int *nexport, int *nsend_local, int MyFOF_PRIMARY_LINK_TYPES, int *ngblist)
 {
     int numngb, no, p, task, nexport_save;
     struct NODE *current;
@@ -241,7 +241,7 @@ int ngb_treefind_fof_primary(MyDouble searchcenter[3], MyFloat hsml, int target,
             if(dz > dist) continue;
             if(dx * dx + dy * dy + dz * dz > dist * dist) continue;
 #endif
-            Ngblist[numngb++] = p;
+            ngblist[numngb++] = p;
         }
         else
         {
@@ -307,7 +307,7 @@ int ngb_treefind_fof_primary(MyDouble searchcenter[3], MyFloat hsml, int target,
 #ifndef REDUCE_TREEWALK_BRANCHING
                     return numngb;
 #else
-                    return ngb_filter_variables(numngb, Ngblist, &vcenter, &box, &hbox, hsml, 0);
+                    return ngb_filter_variables(numngb, ngblist, &vcenter, &box, &hbox, hsml, 0);
 #endif
                 }
             }
@@ -358,7 +358,7 @@ int ngb_treefind_fof_primary(MyDouble searchcenter[3], MyFloat hsml, int target,
                                         dz = NGB_PERIODIC_BOX_LONG_Z(P[p].Pos[0] - searchcenter[0], P[p].Pos[1] - searchcenter[1], P[p].Pos[2] - searchcenter[2],-1);
                                         if(dx * dx + dy * dy + dz * dz > hsml * hsml) break;
 #endif
-                                        Ngblist[numngb++] = p;
+                                        ngblist[numngb++] = p;
                                         break;
                                     }
                                     p = Nextnode[p];
@@ -373,7 +373,11 @@ int ngb_treefind_fof_primary(MyDouble searchcenter[3], MyFloat hsml, int target,
                         else
                         {
                             /* flag it now */
+#ifdef _OPENMP
+                            __atomic_or_fetch(&current->u.d.bitflags, (1 << BITFLAG_INSIDE_LINKINGLENGTH), __ATOMIC_RELAXED); /* local FoF linking is threaded */
+#else
                             current->u.d.bitflags |= (1 << BITFLAG_INSIDE_LINKINGLENGTH);
+#endif
                         }
                     }
             }
@@ -386,7 +390,7 @@ int ngb_treefind_fof_primary(MyDouble searchcenter[3], MyFloat hsml, int target,
 #ifndef REDUCE_TREEWALK_BRANCHING
     return numngb;
 #else
-    return ngb_filter_variables(numngb, Ngblist, &vcenter, &box, &hbox, hsml, 0);
+    return ngb_filter_variables(numngb, ngblist, &vcenter, &box, &hbox, hsml, 0);
 #endif
 }
 
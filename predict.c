@@ -19,7 +19,7 @@
 
 void reconstruct_timebins(void)
 {
-    int i, bin;
+    int i, n, bin;
     long long glob_sum;
     
     for(bin = 0; bin < TIMEBINS; bin++)
@@ -76,12 +76,12 @@ void reconstruct_timebins(void)
     
     make_list_of_active_particles();
     
-    for(i = FirstActiveParticle, NumForceUpdate = 0; i >= 0; i = NextActiveParticle[i])
+    for(n = 0, NumForceUpdate = 0; n < NumActiveParticle; n++)
     {
         NumForceUpdate++;
-        if(i >= NumPart)
+        if(ActiveParticleList[n] >= NumPart)
         {
-            printf("Bummer i=%d\n", i);
+            printf("Bummer i=%d\n", ActiveParticleList[n]);
             terminate("inconsistent list");
         }
     }
@@ -25,9 +25,24 @@ void read_header_attributes_in_hdf5(char *fname);
 void write_parameters_attributes_in_hdf5(hid_t handle);
 void write_units_attributes_in_hdf5(hid_t handle);
 void write_constants_attributes_in_hdf5(hid_t handle);
+#ifdef IO_COMPRESS_HDF5
+hid_t get_hdf5_compression_plist_for_block(enum iofields blocknr, int rank, hsize_t *dims);
+#endif
 #endif
 void output_compile_time_options(void);
 
+#ifdef IO_ASYNC_OUTPUT
+void io_async_submit(char *fname, char *data, size_t nbytes);
+FILE *io_async_fopen(char *fname);
+void io_async_fclose(FILE *fd);
+void io_async_fence(void);
+void io_async_finalize(void);
+#ifdef HAVE_HDF5
+hid_t io_async_hdf5_fcreate(char *fname);
+void io_async_hdf5_fclose(hid_t handle, char *fname);
+#endif
+#endif
+
 void report_pinning(void);
 void pin_to_core_set(void);
 void get_core_set(void);
@@ -150,14 +165,9 @@ void kspace_neutrinos_init(void);
 #ifdef OUTPUT_TWOPOINT_ENABLED
 void twopoint(void);
 void twopoint_save(void);
-int twopoint_ngb_treefind_variable(MyDouble searchcenter[3], MyFloat rsearch, int target, int *startnode, int mode, int *nexport, int *nsend_local);
-int twopoint_count_local(int target, int mode, int *nexport, int *nsend_local);
 #endif
 
-void powerspec(int flag, int *typeflag);
 double PowerSpec_Efstathiou(double k);
-void powerspec_save(void);
-void foldonitself(int *typelist);
 void dump_potential(void);
 
 int snIaheating_evaluate(int target, int mode, int *nexport, int *nSend_local);
@@ -201,7 +211,7 @@ int conduction_evaluate(int target, int mode, double *in, double *out, double *s
 
 void fof_get_group_center(double *cm, int gr);
 void fof_get_group_velocity(double *cmvel, int gr);
-int fof_find_dmparticles_evaluate(int target, int mode, int *nexport, int *nsend_local);
+int fof_find_dmparticles_evaluate(int target, int mode, int *nexport, int *nsend_local, int *ngblist);
 void fof_compute_group_properties(int gr, int start, int len);
 
 #ifdef TURB_DIFF_DYNAMIC
@@ -229,12 +239,12 @@ const char* svn_version(void);
 
 void find_particles_and_save_them(int num);
 void lineofsight_output(void);
-void sum_over_processors_and_normalize(void);
-void absorb_along_lines_of_sight(void);
-void output_lines_of_sight(int num);
+void sum_over_processors_and_normalize(int nlos);
+void absorb_along_lines_of_sight(int nlos);
+void output_lines_of_sight(int nlos);
 integertime find_next_lineofsighttime(integertime time0);
 integertime find_next_gridoutputtime(integertime ti_curr);
-void add_along_lines_of_sight(void);
+void add_along_lines_of_sight(int *rays, int nrays, int mode);
 void do_the_kick(int i, integertime tstart, integertime tend, integertime tcurrent, int mode);
 
 
@@ -267,7 +277,7 @@ int compare_length_values(const void *a, const void *b);
 double rho_dot(double z, void *params);
 double bhgrowth(double z1, double z2);
 
-int fof_find_dmparticles_evaluate(int target, int mode, int *nexport, int *nsend_local);
+int fof_find_dmparticles_evaluate(int target, int mode, int *nexport, int *nsend_local, int *ngblist);
 
 double INLINE_FUNC Get_Particle_Size(int i);
 double INLINE_FUNC Particle_density_for_energy_i(int i);
@@ -331,6 +341,10 @@ int fof_grid_compare(const void *a, const void *b);
 void fof_compile_catalogue(void);
 void fof_save_groups(int num);
 void fof_save_local_catalogue(int num);
+#ifdef FOF_SUBHALOS
+void fof_get_particle_group_numbers(int *grnr);
+void fof_subhalos(int num);
+#endif
 void fof_find_nearest_dmparticle(void);
 int fof_find_nearest_dmparticle_evaluate(int target, int mode, int *nexport, int *nsend_local);
 
@@ -621,9 +635,15 @@ void rearrange_particle_sequence(void);
 void reorder_gas(void);
 void reorder_particles(void);
 void restart(int modus);
+#ifdef IO_RESTART_MPIIO
+void restart_mpiio(int modus);
+#endif
 void run(void);
 void savepositions(int num);
 void savepositions_ioformat1(int num);
+#ifdef OUTPUT_STREAMS
+void output_streams(void);
+#endif
 double my_second(void);
 void set_softenings(void);
 void set_sph_kernel(void);
@@ -657,6 +677,10 @@ double pow(double, double);
 
 
 void long_range_init(void);
+#ifdef USE_FFTW_WISDOM
+void fftw_wisdom_import(void);
+void fftw_wisdom_export(void);
+#endif
 void long_range_force(void);
 void pm_init_periodic(void);
 void pmforce_periodic(int mode, int *typelist);
@@ -749,6 +773,10 @@ void init_sort_ID(MyIDType *data, int ndata);
 #endif
 
 void hydro_gradient_calc(void);
+#ifdef HYDRO_REUSE_GRADIENT_NGBLIST
+void hydro_ngblist_cache_allocate(void);
+void hydro_ngblist_cache_free(void);
+#endif
 int GasGrad_evaluate(int target, int mode, int *exportflag, int *exportnodecount, int *exportindex, int *ngblist, int gradient_iteration);
 void *GasGrad_evaluate_primary(void *p, int gradient_iteration);
 void *GasGrad_evaluate_secondary(void *p, int gradient_iteration);
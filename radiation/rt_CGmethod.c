@@ -42,7 +42,46 @@ extern pthread_mutex_t mutex_partnodedrift;
 /*! global variables to be used */
 #define MAX_ITER 10000
 #define ACCURACY 1.0e-2
-static double **ZVec, **XVec, **QVec, **DVec, **Residue, **Diag, **Diag2;
+static double **ZVec, **XVec, **QVec, **DVec, **Residue, **Diag, **Diag2, **WVec;
+
+/*! multigrid preconditioner: parameters of the aggregation and of the V-cycle */
+#define MG_MAXLEVELS 12         /* maximum number of levels */
+#define MG_COARSEST 64          /* stop coarsening below this many rows */
+#define MG_STRENGTH 0.08        /* couplings weaker than this (relative to the geometric mean of the diagonals) are not aggregated */
+#define MG_SWEEPS 2             /* damped-Jacobi sweeps before and after each coarse-grid correction */
+#define MG_COARSE_SWEEPS 8      /* damped-Jacobi sweeps on the coarsest level */
+#define MG_OMEGA (2./3.)        /* Jacobi damping */
+
+/*! one level of the hierarchy: off-diagonal couplings in CSR form plus the diagonal, per frequency bin */
+static struct rt_cg_mg_level
+{
+    int n;
+    int *rowstart, *col;
+    double *val[N_RT_FREQ_BINS], *diag[N_RT_FREQ_BINS];
+    int *agg;                   /* aggregate (= row on the next level) of each row */
+    double *x, *b, *r;          /* work vectors */
+}
+MGLevel[MG_MAXLEVELS];
+static int MGNLevels, MGLevel0Shared;
+
+/*! rows of the on-task matrix block as collected during the first multiply (padded, RowCount=-1 if not evaluated) */
+static int rt_cg_collect, *RowStart, *RowCount, *RowCol;
+static double *RowVal[N_RT_FREQ_BINS];
+/*! couplings of imported particles to our gas, collected in the same multiply as (row, column, value) triplets; rows are
+ numbered by import slot across all rounds of the multiply (ImportBase is the number of slots of the earlier rounds) */
+static int NTrip, MaxTrip, *TripRow, *TripCol, ImportBase;
+static double *TripVal[N_RT_FREQ_BINS];
+/*! per round of the collecting multiply: export/import counts per task, and the exported particles in send order */
+static int NRounds, NRoundIndex, *RoundExport, *RoundImport, *RoundIndex;
+
+/*! the cached operator: the on-task block in CSR form (SpVal are the off-diagonal matrix elements, the diagonal is the
+ Diag vector of the solve), the rows of the imported particles restricted to our columns (GhostRow*), and the halo
+ schedule: GhostRows from each task, whose partial products we return, and our exported particles, which receive them */
+static int rt_cg_cached, *SpRowStart, *SpCol;
+static double *SpVal[N_RT_FREQ_BINS];
+static int NGhostRows, *GhostRowStart, *GhostCol;
+static double *GhostVal[N_RT_FREQ_BINS];
+static int NHaloExport, *HaloExportIndex, *HaloExportCount, *HaloExportOffset, *HaloImportCount, *HaloImportOffset;
 
 /*! structure for communication. holds data that is sent to other processors  */
 static struct rt_cg_data_in
@@ -67,8 +106,6 @@ struct rt_cg_data_out
 *rt_cg_DataResult, *rt_cg_DataOut;
 
 /*! declare functions */
-double rt_diffusion_cg_vector_multiply(double *a, double *b);
-double rt_diffusion_cg_vector_sum(double *a);
 void rt_diffusion_cg_matrix_multiply(double **matrixmult_in, double **matrixmult_out, double **matrixmult_sum);
 int rt_diffusion_cg_evaluate(int target, int mode, double **matrixmult_in, double **matrixmult_out, double **matrixmult_sum, int *exportflag, int *exportnodecount, int *exportindex, int *ngblist);
 void particle2in_rt_cg(struct rt_cg_data_in *in, int i);
@@ -89,47 +126,512 @@ void particle2in_rt_cg(struct rt_cg_data_in *in, int i)
     //for(k=0; k<N_RT_FREQ_BINS; k++) in->Lambda[k] = SphP[i].Lambda_FluxLim[k];
 }
 
-/* internal product of two vectors (for all gas particles) */
-double rt_diffusion_cg_vector_multiply(double *a, double *b)
+/* define a convenient macro for allocating the required arrays below */
+#define MALLOC_CG(x) {\
+x = (double **) malloc(N_RT_FREQ_BINS * sizeof(double *));\
+for(k=0;k<N_RT_FREQ_BINS;k++) x[k] = (double *) malloc(N_gas * sizeof(double));\
+for(k=0;k<N_RT_FREQ_BINS;k++) memset(x[k], 0, N_gas * sizeof(double));}
+#define FREE_CG(x) {for(k=N_RT_FREQ_BINS-1;k>=0;k--) {free(x[k]);} free(x);}
+
+
+
+/*! the matrix is collected during the first multiply of each solve. Local block: one row per local gas particle,
+ with room for 2*NumNgb+16 couplings (the neighbors inside both kernels are never more than those inside one). If a
+ row overflows, this task simply uses the Jacobi preconditioner for this solve, and no task uses the cached operator */
+static void rt_cg_collect_begin(void)
 {
-    int i; double sum, sumall;
-    for(i = 0, sum = 0; i < N_gas; i++)
-        if(P[i].Type == 0)
-            sum += a[i] * b[i];
-    MPI_Allreduce(&sum, &sumall, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    return sumall;
+    int i, k, n;
+    RowStart = (int *) malloc((N_gas + 1) * sizeof(int));
+    RowCount = (int *) malloc(N_gas * sizeof(int));
+    for(i = 0, n = 0; i < N_gas; i++)
+    {
+        RowStart[i] = n; RowCount[i] = -1;
+        if(P[i].Type == 0) {n += (int) (2 * PPP[i].NumNgb) + 16;}
+    }
+    RowStart[N_gas] = n;
+    RowCol = (int *) malloc(n * sizeof(int));
+    for(k = 0; k < N_RT_FREQ_BINS; k++) {RowVal[k] = (double *) malloc(n * sizeof(double));}
+    NTrip = MaxTrip = ImportBase = 0; TripRow = TripCol = NULL;
+    for(k = 0; k < N_RT_FREQ_BINS; k++) {TripVal[k] = NULL;}
+    NRounds = NRoundIndex = 0; RoundExport = RoundImport = RoundIndex = NULL;
+    rt_cg_collect = 1;
 }
 
 
-/* absolute sum of vector elements (for all gas particles) */
-double rt_diffusion_cg_vector_sum(double *a)
+/*! called in each round of the collecting multiply once the (final) export list is sorted and the import counts are
+ known: records the communication pattern of the round, and makes room for the couplings of the imported particles */
+static void rt_cg_collect_round(void)
 {
-    int i; double sum, sumall;
-    for(i = 0, sum = 0; i < N_gas; i++)
-        if(P[i].Type == 0)
-            sum += fabs(a[i]);
-    MPI_Allreduce(&sum, &sumall, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    return sumall;
+    int j, k;
+    RoundExport = (int *) realloc(RoundExport, (NRounds + 1) * NTask * sizeof(int));
+    RoundImport = (int *) realloc(RoundImport, (NRounds + 1) * NTask * sizeof(int));
+    RoundIndex = (int *) realloc(RoundIndex, (NRoundIndex + Nexport + 1) * sizeof(int));
+    for(j = 0; j < NTask; j++) {RoundExport[NRounds * NTask + j] = Send_count[j]; RoundImport[NRounds * NTask + j] = Recv_count[j];}
+    for(j = 0; j < Nexport; j++) {RoundIndex[NRoundIndex + j] = DataIndexTable[j].Index;}
+    NRoundIndex += Nexport;
+    NRounds++;
+
+    MaxTrip += Nimport * ((int) (2 * (All.DesNumNgb + All.MaxNumNgbDeviation)) + 16);
+    TripRow = (int *) realloc(TripRow, (MaxTrip + 1) * sizeof(int));
+    TripCol = (int *) realloc(TripCol, (MaxTrip + 1) * sizeof(int));
+    for(k = 0; k < N_RT_FREQ_BINS; k++) {TripVal[k] = (double *) realloc(TripVal[k], (MaxTrip + 1) * sizeof(double));}
 }
 
-/* define a convenient macro for allocating the required arrays below */
-#define MALLOC_CG(x) {\
-x = (double **) malloc(N_RT_FREQ_BINS * sizeof(double *));\
-for(k=0;k<N_RT_FREQ_BINS;k++) x[k] = (double *) malloc(N_gas * sizeof(double));\
-for(k=0;k<N_RT_FREQ_BINS;k++) memset(x[k], 0, N_gas * sizeof(double));}
+
+/*! turn the collected couplings into the cached operator: the on-task block in CSR form, the imported rows sorted by
+ sending task (and by round, then slot, within a task - the order in which that task lists its exports), and the halo
+ schedule. The cache is only used if it is complete on every task */
+static void rt_cg_cache_setup(void)
+{
+    int i, j, k, m, n, r, ok = 1, ok_all;
+
+    for(i = 0; i < N_gas; i++) {if(RowCount[i] > RowStart[i + 1] - RowStart[i]) ok = 0;}
+    SpRowStart = NULL;
+    if(ok)
+    {
+        SpRowStart = (int *) malloc((N_gas + 1) * sizeof(int));
+        for(i = 0, n = 0; i < N_gas; i++) {n += DMAX(RowCount[i],0);}
+        SpCol = (int *) malloc(n * sizeof(int));
+        for(k = 0; k < N_RT_FREQ_BINS; k++) {SpVal[k] = (double *) malloc(n * sizeof(double));}
+        for(i = 0, n = 0; i < N_gas; i++)
+        {
+            SpRowStart[i] = n;
+            for(m = RowStart[i]; m < RowStart[i] + DMAX(RowCount[i],0); m++, n++)
+            {
+                SpCol[n] = RowCol[m];
+                for(k = 0; k < N_RT_FREQ_BINS; k++) {SpVal[k][n] = -RowVal[k][m];}
+            }
+        }
+        SpRowStart[N_gas] = n;
+    }
+    if(NTrip > MaxTrip) ok = 0;
+    MPI_Allreduce(&ok, &ok_all, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    rt_cg_cached = ok_all;
+
+    if(rt_cg_cached)
+    {
+        int *newrow, *rowpos;
+        HaloExportCount = (int *) malloc(NTask * sizeof(int));
+        HaloExportOffset = (int *) malloc(NTask * sizeof(int));
+        HaloImportCount = (int *) malloc(NTask * sizeof(int));
+        HaloImportOffset = (int *) malloc(NTask * sizeof(int));
+        for(j = 0; j < NTask; j++)
+        {
+            for(r = 0, HaloExportCount[j] = HaloImportCount[j] = 0; r < NRounds; r++)
+            {
+                HaloExportCount[j] += RoundExport[r * NTask + j];
+                HaloImportCount[j] += RoundImport[r * NTask + j];
+            }
+            HaloExportOffset[j] = (j > 0) ? HaloExportOffset[j - 1] + HaloExportCount[j - 1] : 0;
+            HaloImportOffset[j] = (j > 0) ? HaloImportOffset[j - 1] + HaloImportCount[j - 1] : 0;
+        }
+        NHaloExport = NRoundIndex;
+        NGhostRows = ImportBase;
+
+        /* map the import slots of all rounds to task-major ghost rows, and list the exported particles in the same order */
+        newrow = (int *) malloc((NGhostRows + 1) * sizeof(int));
+        HaloExportIndex = (int *) malloc((NHaloExport + 1) * sizeof(int));
+        int *exp_pos = (int *) malloc(NTask * sizeof(int)), *imp_pos = (int *) malloc(NTask * sizeof(int));
+        for(j = 0; j < NTask; j++) {exp_pos[j] = HaloExportOffset[j]; imp_pos[j] = HaloImportOffset[j];}
+        int exp_base = 0, imp_base = 0;
+        for(r = 0; r < NRounds; r++)
+            for(j = 0; j < NTask; j++)
+            {
+                for(m = 0; m < RoundExport[r * NTask + j]; m++) {HaloExportIndex[exp_pos[j]++] = RoundIndex[exp_base++];}
+                for(m = 0; m < RoundImport[r * NTask + j]; m++) {newrow[imp_base++] = imp_pos[j]++;}
+            }
+        free(imp_pos);
+        free(exp_pos);
+
+        /* counting sort of the triplets into the ghost rows */
+        GhostRowStart = (int *) malloc((NGhostRows + 1) * sizeof(int));
+        GhostCol = (int *) malloc((NTrip + 1) * sizeof(int));
+        for(k = 0; k < N_RT_FREQ_BINS; k++) {GhostVal[k] = (double *) malloc((NTrip + 1) * sizeof(double));}
+        for(j = 0; j <= NGhostRows; j++) {GhostRowStart[j] = 0;}
+        for(m = 0; m < NTrip; m++) {GhostRowStart[newrow[TripRow[m]] + 1]++;}
+        for(j = 0; j < NGhostRows; j++) {GhostRowStart[j + 1] += GhostRowStart[j];}
+        rowpos = (int *) malloc((NGhostRows + 1) * sizeof(int));
+        for(j = 0; j < NGhostRows; j++) {rowpos[j] = GhostRowStart[j];}
+        for(m = 0; m < NTrip; m++)
+        {
+            n = rowpos[newrow[TripRow[m]]]++;
+            GhostCol[n] = TripCol[m];
+            for(k = 0; k < N_RT_FREQ_BINS; k++) {GhostVal[k][n] = -TripVal[k][m];}
+        }
+        free(rowpos);
+        free(newrow);
+    }
+
+    for(k = N_RT_FREQ_BINS - 1; k >= 0; k--) {free(TripVal[k]);}
+    free(TripCol); free(TripRow);
+    free(RoundIndex); free(RoundImport); free(RoundExport);
+}
+
+
+static void rt_cg_cache_free(void)
+{
+    int k;
+    if(rt_cg_cached)
+    {
+        for(k = N_RT_FREQ_BINS - 1; k >= 0; k--) {free(GhostVal[k]);}
+        free(GhostCol); free(GhostRowStart);
+        free(HaloExportIndex);
+        free(HaloImportOffset); free(HaloImportCount); free(HaloExportOffset); free(HaloExportCount);
+    }
+    if(SpRowStart)
+    {
+        for(k = N_RT_FREQ_BINS - 1; k >= 0; k--) {free(SpVal[k]);}
+        free(SpCol); free(SpRowStart);
+        SpRowStart = NULL;
+    }
+    rt_cg_cached = 0;
+}
+
+
+/*! out = A in with the cached operator: the imported rows give partial products over our columns, which go back to the
+ tasks owning those particles (one value per exported particle and frequency bin), while we multiply the local block */
+static void rt_cg_cached_multiply(double **in, double **out, double **Diag)
+{
+    int i, k, ngrp, recvTask;
+    double *partial = (double *) malloc((NGhostRows + 1) * N_RT_FREQ_BINS * sizeof(double));
+    double *halo = (double *) malloc((NHaloExport + 1) * N_RT_FREQ_BINS * sizeof(double));
+
+#ifdef _OPENMP
+#pragma omp parallel for private(k) schedule(static)
+#endif
+    for(i = 0; i < NGhostRows; i++)
+    {
+        int m;
+        for(k = 0; k < N_RT_FREQ_BINS; k++)
+        {
+            double sum = 0;
+            for(m = GhostRowStart[i]; m < GhostRowStart[i + 1]; m++) {sum += GhostVal[k][m] * in[k][GhostCol[m]];}
+            partial[i * N_RT_FREQ_BINS + k] = sum;
+        }
+    }
+    for(ngrp = 1; ngrp < (1 << PTask); ngrp++)
+    {
+        recvTask = ThisTask ^ ngrp;
+        if(recvTask < NTask)
+        {
+            if(HaloImportCount[recvTask] > 0 || HaloExportCount[recvTask] > 0)
+            {
+                MPI_Sendrecv(&partial[HaloImportOffset[recvTask] * N_RT_FREQ_BINS], HaloImportCount[recvTask] * N_RT_FREQ_BINS, MPI_DOUBLE, recvTask, TAG_RT_A,
+                             &halo[HaloExportOffset[recvTask] * N_RT_FREQ_BINS], HaloExportCount[recvTask] * N_RT_FREQ_BINS, MPI_DOUBLE, recvTask, TAG_RT_A, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            }
+        }
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for private(k) schedule(static)
+#endif
+    for(i = 0; i < N_gas; i++)
+    {
+        int m;
+        for(k = 0; k < N_RT_FREQ_BINS; k++)
+        {
+            double sum = Diag[k][i] * in[k][i];
+            for(m = SpRowStart[i]; m < SpRowStart[i + 1]; m++) {sum += SpVal[k][m] * in[k][SpCol[m]];}
+            out[k][i] = sum;
+        }
+    }
+    /* serial: a particle exported several times to the same task appears more than once */
+    for(i = 0; i < NHaloExport; i++)
+        for(k = 0; k < N_RT_FREQ_BINS; k++)
+            out[k][HaloExportIndex[i]] += halo[i * N_RT_FREQ_BINS + k];
+
+    free(halo);
+    free(partial);
+}
+
+
+/*! w = A u for the iterations: the cached sparse product if available, otherwise the full neighbor loop */
+static void rt_cg_apply_operator(double **in, double **out, double **Diag, double **Diag2)
+{
+    if(rt_cg_cached) {rt_cg_cached_multiply(in, out, Diag);} else {rt_diffusion_cg_matrix_multiply(in, out, Diag2);}
+}
+
+
+/*! aggregate the rows of level l (greedy aggregation on the strong couplings of the first frequency bin),
+ and form the Galerkin operator P^T A P of the next level for piecewise-constant prolongation P */
+static int rt_cg_mg_coarsen(int l)
+{
+    struct rt_cg_mg_level *Lf = &MGLevel[l], *Lc = &MGLevel[l + 1];
+    int i, j, k, m, n, nc, *agg = Lf->agg, *members, *mstart, *marker;
+    
+    for(i = 0; i < Lf->n; i++) {agg[i] = -1;}
+#define STRONG(i,m) (fabs(Lf->val[0][m]) >= MG_STRENGTH * sqrt(Lf->diag[0][i] * Lf->diag[0][Lf->col[m]]))
+    /* pass 1: a row whose strong neighbors are all still free seeds an aggregate with them */
+    for(i = 0, nc = 0; i < Lf->n; i++)
+    {
+        if(agg[i] >= 0) continue;
+        for(m = Lf->rowstart[i]; m < Lf->rowstart[i + 1]; m++) {if(STRONG(i,m) && agg[Lf->col[m]] >= 0) break;}
+        if(m < Lf->rowstart[i + 1]) continue;
+        agg[i] = nc;
+        for(m = Lf->rowstart[i]; m < Lf->rowstart[i + 1]; m++) {if(STRONG(i,m)) agg[Lf->col[m]] = nc;}
+        nc++;
+    }
+    /* pass 2: left-over rows join the aggregate of their strongest (strongly-coupled) aggregated neighbor, or stay alone */
+    for(i = 0; i < Lf->n; i++)
+    {
+        if(agg[i] >= 0) continue;
+        double amax = 0; int best = -1;
+        for(m = Lf->rowstart[i]; m < Lf->rowstart[i + 1]; m++)
+            if(agg[Lf->col[m]] >= 0 && STRONG(i,m) && fabs(Lf->val[0][m]) > amax) {amax = fabs(Lf->val[0][m]); best = agg[Lf->col[m]];}
+        if(best >= 0) {agg[i] = best;} else {agg[i] = nc++;}
+    }
+#undef STRONG
+    if(nc >= Lf->n) return 0; /* no coarsening possible */
+    
+    /* list the fine rows of each aggregate */
+    mstart = (int *) malloc((nc + 1) * sizeof(int));
+    members = (int *) malloc(Lf->n * sizeof(int));
+    for(j = 0; j <= nc; j++) {mstart[j] = 0;}
+    for(i = 0; i < Lf->n; i++) {mstart[agg[i] + 1]++;}
+    for(j = 0; j < nc; j++) {mstart[j + 1] += mstart[j];}
+    for(i = 0; i < Lf->n; i++) {members[mstart[agg[i]]++] = i;}
+    for(j = nc; j > 0; j--) {mstart[j] = mstart[j - 1];}
+    mstart[0] = 0;
+    
+    /* Galerkin product: coarse row J sums the fine rows of its members, with columns mapped to aggregates */
+    Lc->n = nc;
+    Lc->rowstart = (int *) malloc((nc + 1) * sizeof(int));
+    marker = (int *) malloc(nc * sizeof(int));
+    for(j = 0; j < nc; j++) {marker[j] = -1;}
+    for(j = 0, n = 0; j < nc; j++) /* count the coarse couplings */
+        for(Lc->rowstart[j] = n, m = mstart[j]; m < mstart[j + 1]; m++)
+        {
+            i = members[m]; int q;
+            for(q = Lf->rowstart[i]; q < Lf->rowstart[i + 1]; q++)
+            {
+                int J = agg[Lf->col[q]];
+                if(J != j && marker[J] != j) {marker[J] = j; n++;}
+            }
+        }
+    Lc->rowstart[nc] = n;
+    Lc->col = (int *) malloc(n * sizeof(int));
+    for(k = 0; k < N_RT_FREQ_BINS; k++)
+    {
+        Lc->val[k] = (double *) malloc(n * sizeof(double));
+        Lc->diag[k] = (double *) malloc(nc * sizeof(double));
+    }
+    for(j = 0; j < nc; j++) {marker[j] = -1;}
+    for(j = 0; j < nc; j++)
+    {
+        int rowend = Lc->rowstart[j];
+        for(k = 0; k < N_RT_FREQ_BINS; k++) {Lc->diag[k][j] = 0;}
+        for(m = mstart[j]; m < mstart[j + 1]; m++)
+        {
+            i = members[m]; int q;
+            for(k = 0; k < N_RT_FREQ_BINS; k++) {Lc->diag[k][j] += Lf->diag[k][i];}
+            for(q = Lf->rowstart[i]; q < Lf->rowstart[i + 1]; q++)
+            {
+                int J = agg[Lf->col[q]];
+                if(J == j) {for(k = 0; k < N_RT_FREQ_BINS; k++) {Lc->diag[k][j] += Lf->val[k][q];} continue;}
+                if(marker[J] < Lc->rowstart[j]) {marker[J] = rowend; Lc->col[rowend] = J; for(k = 0; k < N_RT_FREQ_BINS; k++) {Lc->val[k][rowend] = 0;} rowend++;}
+                for(k = 0; k < N_RT_FREQ_BINS; k++) {Lc->val[k][marker[J]] += Lf->val[k][q];}
+            }
+        }
+    }
+    free(marker);
+    free(members);
+    free(mstart);
+    return 1;
+}
+
+
+/*! turn the on-task block of the cached operator into the first level of the multigrid hierarchy and coarsen it */
+static void rt_cg_mg_setup(double **Diag)
+{
+    int i, j, k, m, n, nall;
+    struct rt_cg_mg_level *L = &MGLevel[0];
+    MGNLevels = 0;
+    MGLevel0Shared = 0;
+
+    if(SpRowStart)
+    {
+        /* level 0: the on-task block of the operator; couplings to rows not evaluated in this multiply are dropped to keep
+         it symmetric. If there are none (the usual case) the level simply shares the arrays of the cached operator */
+        L->n = N_gas;
+        for(i = 0, n = 0, nall = SpRowStart[N_gas]; i < N_gas; i++) {for(m = SpRowStart[i]; m < SpRowStart[i + 1]; m++) {if(RowCount[SpCol[m]] >= 0) n++;}}
+        if(n == nall)
+        {
+            L->rowstart = SpRowStart; L->col = SpCol;
+            for(k = 0; k < N_RT_FREQ_BINS; k++) {L->val[k] = SpVal[k];}
+            MGLevel0Shared = 1;
+        }
+        else
+        {
+            L->rowstart = (int *) malloc((N_gas + 1) * sizeof(int));
+            L->col = (int *) malloc(n * sizeof(int));
+            for(k = 0; k < N_RT_FREQ_BINS; k++) {L->val[k] = (double *) malloc(n * sizeof(double));}
+            for(i = 0, n = 0; i < N_gas; i++)
+            {
+                L->rowstart[i] = n;
+                for(m = SpRowStart[i]; m < SpRowStart[i + 1]; m++)
+                {
+                    j = SpCol[m];
+                    if(RowCount[j] < 0) continue;
+                    L->col[n] = j;
+                    for(k = 0; k < N_RT_FREQ_BINS; k++) {L->val[k][n] = SpVal[k][m];}
+                    n++;
+                }
+            }
+            L->rowstart[N_gas] = n;
+        }
+        for(k = 0; k < N_RT_FREQ_BINS; k++)
+        {
+            L->diag[k] = (double *) malloc(N_gas * sizeof(double));
+            for(i = 0; i < N_gas; i++) {L->diag[k][i] = (Diag[k][i] > 0) ? Diag[k][i] : 1;}
+        }
+        MGNLevels = 1;
+    }
+    if(MGNLevels == 0) return; /* fall back to the Jacobi preconditioner on this task */
+    
+    while(MGNLevels < MG_MAXLEVELS && MGLevel[MGNLevels - 1].n > MG_COARSEST)
+    {
+        MGLevel[MGNLevels - 1].agg = (int *) malloc(MGLevel[MGNLevels - 1].n * sizeof(int));
+        if(!rt_cg_mg_coarsen(MGNLevels - 1)) {free(MGLevel[MGNLevels - 1].agg); break;}
+        MGNLevels++;
+    }
+    for(j = 0; j < MGNLevels; j++)
+    {
+        MGLevel[j].x = (double *) malloc(MGLevel[j].n * sizeof(double));
+        MGLevel[j].b = (double *) malloc(MGLevel[j].n * sizeof(double));
+        MGLevel[j].r = (double *) malloc(MGLevel[j].n * sizeof(double));
+    }
+}
+
+
+static void rt_cg_mg_free(void)
+{
+    int j, k;
+    for(j = MGNLevels - 1; j >= 0; j--)
+    {
+        free(MGLevel[j].r); free(MGLevel[j].b); free(MGLevel[j].x);
+        if(j < MGNLevels - 1) {free(MGLevel[j].agg);}
+        for(k = N_RT_FREQ_BINS - 1; k >= 0; k--) {free(MGLevel[j].diag[k]);}
+        if(j == 0 && MGLevel0Shared) continue; /* these belong to the cached operator */
+        for(k = N_RT_FREQ_BINS - 1; k >= 0; k--) {free(MGLevel[j].val[k]);}
+        free(MGLevel[j].col); free(MGLevel[j].rowstart);
+    }
+    MGNLevels = 0;
+    MGLevel0Shared = 0;
+}
+
+
+/*! end of the collecting multiply: build the cached operator and the preconditioner, and release the collected rows */
+static void rt_cg_collect_end(double **Diag)
+{
+    int k;
+    rt_cg_collect = 0;
+    rt_cg_cache_setup();
+    rt_cg_mg_setup(Diag);
+    for(k = N_RT_FREQ_BINS - 1; k >= 0; k--) {free(RowVal[k]);}
+    free(RowCol);
+    free(RowCount);
+    free(RowStart);
+}
+
+
+/*! r = b - A x on one level */
+static void rt_cg_mg_residual(struct rt_cg_mg_level *L, int k, double *x, double *b, double *r)
+{
+    int i;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(i = 0; i < L->n; i++)
+    {
+        int m; double sum = b[i] - L->diag[k][i] * x[i];
+        for(m = L->rowstart[i]; m < L->rowstart[i + 1]; m++) {sum -= L->val[k][m] * x[L->col[m]];}
+        r[i] = sum;
+    }
+}
+
+
+/*! one V-cycle for A x = b (frequency bin k) starting from x=0, with damped-Jacobi smoothing: the same number of
+ sweeps before and after the coarse-grid correction keeps the preconditioner symmetric, as CG requires */
+static void rt_cg_mg_vcycle(int l, int k, double *x, double *b)
+{
+    struct rt_cg_mg_level *L = &MGLevel[l], *Lc = &MGLevel[l + 1];
+    int i, s, nsweeps = (l == MGNLevels - 1) ? MG_COARSE_SWEEPS : MG_SWEEPS;
+    
+    for(i = 0; i < L->n; i++) {x[i] = MG_OMEGA * b[i] / L->diag[k][i];}
+    for(s = 1; s < nsweeps; s++)
+    {
+        rt_cg_mg_residual(L, k, x, b, L->r);
+        for(i = 0; i < L->n; i++) {x[i] += MG_OMEGA * L->r[i] / L->diag[k][i];}
+    }
+    if(l == MGNLevels - 1) return;
+    
+    rt_cg_mg_residual(L, k, x, b, L->r);
+    for(i = 0; i < Lc->n; i++) {Lc->b[i] = 0;}
+    for(i = 0; i < L->n; i++) {Lc->b[L->agg[i]] += L->r[i];}
+    rt_cg_mg_vcycle(l + 1, k, Lc->x, Lc->b);
+    for(i = 0; i < L->n; i++) {x[i] += Lc->x[L->agg[i]];}
+    
+    for(s = 0; s < nsweeps; s++)
+    {
+        rt_cg_mg_residual(L, k, x, b, L->r);
+        for(i = 0; i < L->n; i++) {x[i] += MG_OMEGA * L->r[i] / L->diag[k][i];}
+    }
+}
+
+
+/*! z = M^-1 r for all frequency bins still iterating */
+static void rt_cg_precondition(double **r, double **z, double **Diag, int *done_key)
+{
+    int i, k;
+    for(k = 0; k < N_RT_FREQ_BINS; k++)
+    {
+        if(done_key[k]) continue;
+        if(MGNLevels > 0) {rt_cg_mg_vcycle(0, k, z[k], r[k]);}
+        else {for(i = 0; i < N_gas; i++) {z[k][i] = (Diag[k][i] > 0) ? r[k][i] / Diag[k][i] : r[k][i];}}
+    }
+}
+
+
+/*! local contributions to the four inner products of one CG iteration, per frequency bin: (r,u), (w,u), |x|, |r| */
+static void rt_cg_local_sums(double **r, double **u, double **w, double **x, double *sums)
+{
+    int i, k;
+    for(k = 0; k < N_RT_FREQ_BINS; k++)
+    {
+        double ru = 0, wu = 0, xs = 0, rs = 0;
+        for(i = 0; i < N_gas; i++)
+            if(P[i].Type == 0)
+            {
+                ru += r[k][i] * u[k][i];
+                wu += w[k][i] * u[k][i];
+                xs += fabs(x[k][i]);
+                rs += fabs(r[k][i]);
+            }
+        sums[4*k+0] = ru; sums[4*k+1] = wu; sums[4*k+2] = xs; sums[4*k+3] = rs;
+    }
+}
 
 
 /*! routine to do the master loop for the CG iteration - this is the actual solver; it calls various subroutines
- to do the weights/matrix calculation on all particles */
+ to do the weights/matrix calculation on all particles. We use the single-reduction variant of preconditioned CG
+ (Chronopoulos & Gear 1989): the recurrences are rearranged so the two inner products each iteration needs (and the
+ norms for the convergence test) are formed from the same vectors, and go into one MPI_Allreduce for all frequency
+ bins together, instead of several blocking reductions per bin. The preconditioner is one V-cycle of aggregation
+ multigrid on the on-task block of the matrix (block-Jacobi across tasks, so it needs no communication). The matrix
+ does not change within a solve, so the first multiply records it, and all later ones are sparse matrix-vector
+ products with one exchange of partial sums, instead of neighbor searches */
 void rt_diffusion_cg_solve(void)
 {
     int k, j;
-    double alpha_cg, beta, sum;
-    double rel, res, maxrel, glob_maxrel, DQ;
+#ifndef IO_REDUCED_MODE
+    double rel, maxrel, glob_maxrel; /* largest relative update of the solution, only reported */
+#endif
     double dt = (All.Radiation_Ti_endstep - All.Radiation_Ti_begstep) * All.Timebase_interval / All.cf_hubble_a;
+    double sums[4*N_RT_FREQ_BINS], sums_all[4*N_RT_FREQ_BINS];
+    double alpha_cg[N_RT_FREQ_BINS], beta[N_RT_FREQ_BINS], gamma_cg[N_RT_FREQ_BINS];
     
     /* initialization for the CG method */
-    MALLOC_CG(ZVec); MALLOC_CG(XVec); MALLOC_CG(QVec); MALLOC_CG(DVec); MALLOC_CG(Residue); MALLOC_CG(Diag); MALLOC_CG(Diag2); // allocate and zero all the arrays
+    MALLOC_CG(ZVec); MALLOC_CG(XVec); MALLOC_CG(QVec); MALLOC_CG(DVec); MALLOC_CG(Residue); MALLOC_CG(Diag); MALLOC_CG(Diag2); MALLOC_CG(WVec); // allocate and zero all the arrays
     for(j = 0; j < N_gas; j++)
         if(P[j].Type == 0)
             for(k = 0; k < N_RT_FREQ_BINS; k++)
@@ -137,61 +639,81 @@ void rt_diffusion_cg_solve(void)
                 XVec[k][j] = SphP[j].E_gamma[k] * SphP[j].Density / (1.e-37+P[j].Mass); /* define the coefficients: note we need energy densities for this operation */
                 SphP[j].E_gamma[k] += dt * SphP[j].Je[k]; /* -then- add the source terms */
             }
- 
-    /* do a first pass of our 'workhorse' routine, which lets us pre-condition to improve convergence */
+    
+    /* do a first pass of our 'workhorse' routine, which also records the matrix for the later multiplies and the preconditioner */
+    rt_cg_collect_begin();
     rt_diffusion_cg_matrix_multiply(XVec, Residue, Diag);
-    /* take the diagonal matrix elements as a Jacobi preconditioner */
-    double delta_new_initial[N_RT_FREQ_BINS];
+    rt_cg_collect_end(Diag);
+    
+    int iter=0, ndone=0, done_key[N_RT_FREQ_BINS];
     for(k = 0; k < N_RT_FREQ_BINS; k++)
     {
+        done_key[k] = 0;
         for(j = 0; j < N_gas; j++)
             if(P[j].Type == 0)
-            {                
                 Residue[k][j] = SphP[j].E_gamma[k] * SphP[j].Density / (1.e-37+P[j].Mass) - Residue[k][j]; // note: source terms have been added here to E_gamma //
-                /* note: in principle we would have to substract the w_ii term, but this is zero by definition */
-                ZVec[k][j] = Residue[k][j] / Diag[k][j];
-                DVec[k][j] = ZVec[k][j];
-            }
-        delta_new_initial[k] = rt_diffusion_cg_vector_multiply(ZVec[k], Residue[k]);
+    }
+    /* u = M^-1 r, w = A u: ZVec holds u, WVec holds w, DVec and QVec the search direction p and s = A p */
+    rt_cg_precondition(Residue, ZVec, Diag, done_key);
+    rt_cg_apply_operator(ZVec, WVec, Diag, Diag2);
+    rt_cg_local_sums(Residue, ZVec, WVec, XVec, sums);
+    MPI_Allreduce(sums, sums_all, 4*N_RT_FREQ_BINS, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    for(k = 0; k < N_RT_FREQ_BINS; k++)
+    {
+        gamma_cg[k] = sums_all[4*k+0];
+        if(sums_all[4*k+1] != 0) {alpha_cg[k] = gamma_cg[k] / sums_all[4*k+1];} else {alpha_cg[k] = 0;}
+        for(j = 0; j < N_gas; j++) {DVec[k][j] = ZVec[k][j]; QVec[k][j] = WVec[k][j];}
     }
     
     /* begin the CG method iteration */
-    int iter=0, ndone=0, done_key[N_RT_FREQ_BINS]; 
-    double delta_new[N_RT_FREQ_BINS], delta_old[N_RT_FREQ_BINS];
-    for(k = 0; k < N_RT_FREQ_BINS; k++) {done_key[k]=0; delta_new[k]=delta_new_initial[k]; delta_old[k]=delta_new_initial[k];}
     do
     {
-        /* this is the 'workhorse' routine with the neighbor communication and actual calculation */
-        rt_diffusion_cg_matrix_multiply(DVec, QVec, Diag2);
-        ndone = 0; 
+#ifndef IO_REDUCED_MODE
+        maxrel = 0;
+#endif
         for(k = 0; k < N_RT_FREQ_BINS; k++)
         {
-            /* define residues */
-            DQ = rt_diffusion_cg_vector_multiply(DVec[k], QVec[k]);
-            if(DQ == 0) {alpha_cg = 0;} else {alpha_cg = delta_new[k] / DQ;}
-            for(j = 0, maxrel = 0; j < N_gas; j++)
+            if(done_key[k]) continue;
+            for(j = 0; j < N_gas; j++)
             {
-                XVec[k][j] += alpha_cg * DVec[k][j];
-                Residue[k][j] -= alpha_cg * QVec[k][j];
-                ZVec[k][j] = Residue[k][j] / Diag[k][j];
-                rel = fabs(alpha_cg * DVec[k][j]) / (XVec[k][j] + 1.0e-10);
+                XVec[k][j] += alpha_cg[k] * DVec[k][j];
+                Residue[k][j] -= alpha_cg[k] * QVec[k][j];
+#ifndef IO_REDUCED_MODE
+                rel = fabs(alpha_cg[k] * DVec[k][j]) / (XVec[k][j] + 1.0e-10);
                 if(rel > maxrel) {maxrel = rel;}
+#endif
             }
-            delta_old[k] = delta_new[k];
-            delta_new[k] = rt_diffusion_cg_vector_multiply(ZVec[k], Residue[k]);
-            
-            /* sum up residues to define next step */
-            sum = rt_diffusion_cg_vector_sum(XVec[k]);
-            res = rt_diffusion_cg_vector_sum(Residue[k]);
-            if(delta_old[k]) {beta = delta_new[k] / delta_old[k];} else {beta = 0;}
-            for(j = 0; j < N_gas; j++) {DVec[k][j] = ZVec[k][j] + beta * DVec[k][j];}
-            
-            /* broadcast and decide if we need to keep iterating */
-            MPI_Allreduce(&maxrel, &glob_maxrel, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+        }
+        rt_cg_precondition(Residue, ZVec, Diag, done_key);
+        /* this is the 'workhorse' routine with the neighbor communication and actual calculation */
+        rt_cg_apply_operator(ZVec, WVec, Diag, Diag2);
+        
+        /* one reduction for all inner products and norms of this iteration */
+        rt_cg_local_sums(Residue, ZVec, WVec, XVec, sums);
+        MPI_Allreduce(sums, sums_all, 4*N_RT_FREQ_BINS, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
 #ifndef IO_REDUCED_MODE
-            if(ThisTask == 0) {printf("CG iteration: iter=%3d  |res|/|x|=%12.6g  maxrel=%12.6g  |x|=%12.6g |res|=%12.6g\n", iter, res / sum, glob_maxrel, sum, res); //fflush(stdout);}
+        MPI_Allreduce(&maxrel, &glob_maxrel, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
 #endif
-            if(iter >= 1 && (res <= ACCURACY * sum || iter >= MAX_ITER)) {done_key[k]=1; ndone++;}
+        ndone = 0;
+        for(k = 0; k < N_RT_FREQ_BINS; k++)
+        {
+            if(done_key[k]) {ndone++; continue;}
+            double gamma_new = sums_all[4*k+0], delta = sums_all[4*k+1], sum = sums_all[4*k+2], res = sums_all[4*k+3];
+#ifndef IO_REDUCED_MODE
+            if(ThisTask == 0) {printf("CG iteration: iter=%3d  |res|/|x|=%12.6g  maxrel=%12.6g  |x|=%12.6g |res|=%12.6g\n", iter, res / sum, glob_maxrel, sum, res);}
+#endif
+            if(iter >= 1 && (res <= ACCURACY * sum || iter >= MAX_ITER)) {done_key[k]=1; ndone++; continue;}
+            
+            /* next search direction */
+            if(gamma_cg[k] != 0) {beta[k] = gamma_new / gamma_cg[k];} else {beta[k] = 0;}
+            double denom = (alpha_cg[k] != 0) ? delta - beta[k] * gamma_new / alpha_cg[k] : delta;
+            if(denom != 0) {alpha_cg[k] = gamma_new / denom;} else {alpha_cg[k] = 0;}
+            gamma_cg[k] = gamma_new;
+            for(j = 0; j < N_gas; j++)
+            {
+                DVec[k][j] = ZVec[k][j] + beta[k] * DVec[k][j];
+                QVec[k][j] = WVec[k][j] + beta[k] * QVec[k][j];
+            }
         }
         iter++;
         if(iter > MAX_ITER) {terminate("failed to converge in CG iteration \n");}
@@ -200,7 +722,7 @@ void rt_diffusion_cg_solve(void)
     
     /* success! */
 #ifndef IO_REDUCED_MODE
-    if(ThisTask == 0) {printf("%d iterations performed\n", iter); //fflush(stdout);}
+    if(ThisTask == 0) {printf("%d iterations performed\n", iter);}
 #endif
     /* update the intensity */
     for(j = 0; j < N_gas; j++)
@@ -209,13 +731,16 @@ void rt_diffusion_cg_solve(void)
                 SphP[j].E_gamma[k] = DMAX(XVec[k][j],0) * P[j].Mass / SphP[j].Density; // convert back to an absolute energy, instead of a density //
     
     /* free memory */
-    free(Diag2);
-    free(Diag);
-    free(Residue);
-    free(DVec);
-    free(QVec);
-    free(XVec);
-    free(ZVec);
+    rt_cg_mg_free();
+    rt_cg_cache_free();
+    FREE_CG(WVec);
+    FREE_CG(Diag2);
+    FREE_CG(Diag);
+    FREE_CG(Residue);
+    FREE_CG(DVec);
+    FREE_CG(QVec);
+    FREE_CG(XVec);
+    FREE_CG(ZVec);
 }
 
 
@@ -332,6 +857,7 @@ void rt_diffusion_cg_matrix_multiply(double **matrixmult_in, double **matrixmult
                 Recv_offset[j] = Recv_offset[j - 1] + Recv_count[j - 1];
             }
         }
+        if(rt_cg_collect) {rt_cg_collect_round();}
         rt_cg_DataGet = (struct rt_cg_data_in *) mymalloc("rt_cg_DataGet", Nimport * sizeof(struct rt_cg_data_in));
         rt_cg_DataIn = (struct rt_cg_data_in *) mymalloc("rt_cg_DataIn", Nexport * sizeof(struct rt_cg_data_in));
         /* prepare particle data for export */
@@ -383,6 +909,7 @@ void rt_diffusion_cg_matrix_multiply(double **matrixmult_in, double **matrixmult
         pthread_mutex_destroy(&mutex_nexport);
         pthread_attr_destroy(&attr);
 #endif
+        if(rt_cg_collect) {ImportBase += Nimport;}
         if(NextParticle < 0) {ndone_flag = 1;} else {ndone_flag = 0;}
         MPI_Allreduce(&ndone_flag, &ndone, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
         /* get the result */
@@ -474,6 +1001,8 @@ int rt_diffusion_cg_evaluate(int target, int mode, double **matrixmult_in, doubl
     }
 #endif
     
+    if(rt_cg_collect && mode == 0) {RowCount[target] = 0;} /* (re-)start this row: an evaluation interrupted by a full export buffer is redone from scratch */
+    
     /* Now start the actual operations for this particle */
     if(mode == 0) {startnode = All.MaxPart; /* root node */} else {startnode = rt_cg_DataGet[target].NodeList[0]; startnode = Nodes[startnode].u.d.nextnode;/* open it */}
     while(startnode >= 0)
@@ -509,6 +1038,18 @@ int rt_diffusion_cg_evaluate(int target, int mode, double **matrixmult_in, doubl
                 double tensor_norm = -dt * (dwk_i*local.Mass/local.Density + dwk_j*P[j].Mass/SphP[j].Density) / r;
                 if(tensor_norm > 0)
                 {
+                    int rowslot = -1, tripslot = -1;
+                    if(rt_cg_collect && mode == 0) {if(RowCount[target] < RowStart[target+1]-RowStart[target]) {rowslot = RowStart[target] + RowCount[target]; RowCol[rowslot] = j;} RowCount[target]++;}
+                    if(rt_cg_collect && mode == 1)
+                    {
+                        LOCK_NEXPORT;
+#ifdef _OPENMP
+#pragma omp atomic capture
+#endif
+                        tripslot = NTrip++;
+                        UNLOCK_NEXPORT;
+                        if(tripslot < MaxTrip) {TripRow[tripslot] = ImportBase + target; TripCol[tripslot] = j;} else {tripslot = -1;}
+                    }
                     for(k=0;k<N_RT_FREQ_BINS;k++)
                     {
                 
@@ -530,6 +1071,8 @@ int rt_diffusion_cg_evaluate(int target, int mode, double **matrixmult_in, doubl
                         double fac = tensor_norm * tensor * kappa_ij;
                         out.matrixmult_out[k] -= fac * matrixmult_in[k][j];
                         out.matrixmult_sum[k] += fac;
+                        if(rowslot >= 0) {RowVal[k][rowslot] = fac;}
+                        if(tripslot >= 0) {TripVal[k][tripslot] = fac;}
                     }
                 }
             } // for(n = 0; n < numngb; n++)
@@ -225,14 +225,14 @@ double c_light = RT_SPEEDOFLIGHT_REDUCTION * (C/All.UnitVelocity_in_cm_per_s);
     
     // assign the actual fluxes //
     for(k=0;k<N_RT_FREQ_BINS;k++) {out.Dt_E_gamma[k] += Fluxes_E_gamma[k];}
-    if(j_is_active_for_fluxes) {for(k=0;k<N_RT_FREQ_BINS;k++) {SphP[j].Dt_E_gamma[k] -= Fluxes_E_gamma[k];}}
+    if(j_is_active_for_fluxes) {for(k=0;k<N_RT_FREQ_BINS;k++) {HYDRO_PAIR_ADD(SphP[j].Dt_E_gamma[k], -Fluxes_E_gamma[k]);}}
 #if defined(RT_INFRARED)
     out.Dt_E_gamma_T_weighted_IR += Fluxes_E_gamma_T_weighted_IR;
-    if(j_is_active_for_fluxes) {SphP[j].Dt_E_gamma_T_weighted_IR -= Fluxes_E_gamma_T_weighted_IR;}
+    if(j_is_active_for_fluxes) {HYDRO_PAIR_ADD(SphP[j].Dt_E_gamma_T_weighted_IR, -Fluxes_E_gamma_T_weighted_IR);}
 #endif
 #ifdef RT_EVOLVE_FLUX
     for(k=0;k<N_RT_FREQ_BINS;k++) {int k_dir; for(k_dir=0;k_dir<3;k_dir++) {out.Dt_Flux[k][k_dir] += Fluxes_Flux[k][k_dir];}}
-    if(j_is_active_for_fluxes) {for(k=0;k<N_RT_FREQ_BINS;k++) {int k_dir; for(k_dir=0;k_dir<3;k_dir++) {SphP[j].Dt_Flux[k][k_dir] -= Fluxes_Flux[k][k_dir];}}}
+    if(j_is_active_for_fluxes) {for(k=0;k<N_RT_FREQ_BINS;k++) {int k_dir; for(k_dir=0;k_dir<3;k_dir++) {HYDRO_PAIR_ADD(SphP[j].Dt_Flux[k][k_dir], -Fluxes_Flux[k][k_dir]);}}}
 #endif
     
 }
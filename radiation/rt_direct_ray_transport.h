@@ -85,14 +85,14 @@ if(local.Mass>0 && P[j].Mass>0 && dt_hydrostep>0 && Face_Area_Norm>0)
                     if(fabs(cmag)>thold_hll) {cmag *= thold_hll/fabs(cmag);}
                     cmag /= dt_hydrostep;
                     out.Dt_Intensity[k_freq][k_angle] += cmag;
-                    if(j_is_active_for_fluxes) {SphP[j].Dt_Intensity[k_freq][k_angle] -= cmag;}
+                    if(j_is_active_for_fluxes) {HYDRO_PAIR_ADD(SphP[j].Dt_Intensity[k_freq][k_angle], -cmag);}
 #ifdef RT_INFRARED
                     if(k_freq==RT_FREQ_BIN_INFRARED) // define advected radiation temperature based on direction of net radiation flow //
                     {
                         double Fluxes_E_gamma_T_weighted_IR=0;
                         if(cmag > 0) {Fluxes_E_gamma_T_weighted_IR = cmag/(MIN_REAL_NUMBER+SphP[j].Radiation_Temperature);} else {Fluxes_E_gamma_T_weighted_IR = cmag/(MIN_REAL_NUMBER+local.Radiation_Temperature);}
                         out.Dt_E_gamma_T_weighted_IR += Fluxes_E_gamma_T_weighted_IR;
-                        if(j_is_active_for_fluxes) {SphP[j].Dt_E_gamma_T_weighted_IR -= Fluxes_E_gamma_T_weighted_IR;}
+                        if(j_is_active_for_fluxes) {HYDRO_PAIR_ADD(SphP[j].Dt_E_gamma_T_weighted_IR, -Fluxes_E_gamma_T_weighted_IR);}
                     }
 #endif
                 } // cmag != 0
@@ -655,6 +655,10 @@ void read_file(char *fname, int readTask, int lastTask)
     hid_t hdf5_datatype = 0, hdf5_dataspace_in_memory, hdf5_dataset;
     hsize_t dims[2], count[2], start[2];
 #endif
+    int direct_read = 0; /* if set, every task reads its own share (hyperslab) of the file directly */
+#if defined(IO_PARALLEL_IC_READ) && defined(HAVE_HDF5)
+    if(All.ICFormat == 3) {direct_read = 1;}
+#endif
     
 #define SKIP  {my_fread(&blksize1,sizeof(int),1,fd);}
 #define SKIP2  {my_fread(&blksize2,sizeof(int),1,fd);}
@@ -721,6 +725,26 @@ void read_file(char *fname, int readTask, int lastTask)
         MPI_Recv(&header, sizeof(header), MPI_BYTE, readTask, TAG_HEADER, MPI_COMM_WORLD, &status);
     }
     
+#ifdef HAVE_HDF5
+    if(direct_read && ThisTask != readTask)
+    {
+        hdf5_file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+        if(hdf5_file < 0)
+        {
+            printf("can't open file `%s' on task=%d for direct reading of initial conditions.\n", fname, ThisTask);
+            endrun(124);
+        }
+        for(type = 0; type < 6; type++)
+        {
+            if(header.npart[type] > 0)
+            {
+                sprintf(buf, "/PartType%d", type);
+                hdf5_grp[type] = H5Gopen(hdf5_file, buf);
+            }
+        }
+    }
+#endif
+    
 #ifdef INPUT_IN_DOUBLEPRECISION
     if(header.flag_doubleprecision == 0)
     {
@@ -793,13 +817,14 @@ void read_file(char *fname, int readTask, int lastTask)
             n_in_file += header.npart[i];
         
         printf("\nreading file `%s' on task=%d (contains %lld particles.)\n"
-               "distributing this file to tasks %d-%d\n"
+               "%s tasks %d-%d\n"
                "Type 0 (gas):   %8d  (tot=%6d%09d) masstab=%g\n"
                "Type 1 (halo):  %8d  (tot=%6d%09d) masstab=%g\n"
                "Type 2 (disk):  %8d  (tot=%6d%09d) masstab=%g\n"
                "Type 3 (bulge): %8d  (tot=%6d%09d) masstab=%g\n"
                "Type 4 (stars): %8d  (tot=%6d%09d) masstab=%g\n"
-               "Type 5 (bndry): %8d  (tot=%6d%09d) masstab=%g\n\n", fname, ThisTask, n_in_file, readTask,
+               "Type 5 (bndry): %8d  (tot=%6d%09d) masstab=%g\n\n", fname, ThisTask, n_in_file,
+               direct_read ? "reading hyperslabs of this file directly on" : "distributing this file to", readTask,
                lastTask, header.npart[0], (int) (header.npartTotal[0] / 1000000000),
                (int) (header.npartTotal[0] % 1000000000), All.MassTable[0], header.npart[1],
                (int) (header.npartTotal[1] / 1000000000), (int) (header.npartTotal[1] % 1000000000),
@@ -989,6 +1014,14 @@ void read_file(char *fname, int readTask, int lastTask)
                             if((task - readTask) < (n_in_file % ntask))
                                 n_for_this_task++;
                             
+#ifdef HAVE_HDF5
+                            if(direct_read && task != ThisTask)
+                            {
+                                pcsum += n_for_this_task; /* that task reads this part of the file itself: skip ahead to our own hyperslab */
+                                continue;
+                            }
+#endif
+                            
                             if(task == ThisTask)
                                 if(NumPart + n_for_this_task > All.MaxPart)
                                 {
@@ -1004,7 +1037,7 @@ void read_file(char *fname, int readTask, int lastTask)
                                 if(pc > (int)blockmaxlen)
                                     pc = blockmaxlen;
                                 
-                                if(ThisTask == readTask)
+                                if(ThisTask == readTask || direct_read)
                                 {
                                     if(All.ICFormat == 1 || All.ICFormat == 2)
                                     {
@@ -1089,11 +1122,11 @@ void read_file(char *fname, int readTask, int lastTask)
 #endif
                                 }
                                 
-                                if(ThisTask == readTask && task != readTask && pc > 0)
+                                if(ThisTask == readTask && task != readTask && pc > 0 && !direct_read)
                                     MPI_Ssend(CommBuffer, bytes_per_blockelement * pc, MPI_BYTE, task,
                                               TAG_PDATA, MPI_COMM_WORLD);
                                 
-                                if(ThisTask != readTask && task == ThisTask && pc > 0)
+                                if(ThisTask != readTask && task == ThisTask && pc > 0 && !direct_read)
                                     MPI_Recv(CommBuffer, bytes_per_blockelement * pc, MPI_BYTE, readTask,
                                              TAG_PDATA, MPI_COMM_WORLD, &status);
                                 
@@ -1155,9 +1188,9 @@ void read_file(char *fname, int readTask, int lastTask)
             N_gas += n_for_this_task;
     }
     
-    if(ThisTask == readTask)
+    if(ThisTask == readTask || direct_read)
     {
-        if(All.ICFormat == 1 || All.ICFormat == 2)
+        if((All.ICFormat == 1 || All.ICFormat == 2) && ThisTask == readTask)
             fclose(fd);
 #ifdef HAVE_HDF5
         if(All.ICFormat == 3)
@@ -50,7 +50,13 @@ void restart(int modus)
     struct global_data_all_processes all_task0;
     int nmulti = MULTIPLEDOMAINS, regular_restarts_are_valid = 1, backup_restarts_are_valid = 1;
     
-
+#ifdef IO_RESTART_MPIIO
+    restart_mpiio(modus); /* single shared restart file written/read with MPI-IO instead of one file per task */
+    return;
+#endif
+#ifdef IO_ASYNC_OUTPUT
+    if(modus == 0) {io_async_fence();} /* previous restart files must be complete before they are moved to .bak */
+#endif
     
     if(ThisTask == 0 && modus == 0) // writing re-start files: move old files to .bak
     {
@@ -130,7 +136,11 @@ void restart(int modus)
 	    }
 	  else
 	    {
+#ifdef IO_ASYNC_OUTPUT
+	      if(!(fd = io_async_fopen(buf)))
+#else
 	      if(!(fd = fopen(buf, "w")))
+#endif
 		{
 		  printf("Restart file '%s' cannot be opened.\n", buf);
 		  endrun(7878);
@@ -307,7 +317,11 @@ void restart(int modus)
 	      byten(&DomainFac, sizeof(double), modus);
 	    }
 
+#ifdef IO_ASYNC_OUTPUT
+	  if(modus == 0) {io_async_fclose(fd);} else {fclose(fd);}
+#else
 	  fclose(fd);
+#endif
 	}
       else			/* wait inside the group */
 	{
@@ -332,6 +346,336 @@ void restart(int modus)
 
 
 
+#ifdef IO_RESTART_MPIIO
+/* The MPI-IO restart format is a single file with the following layout:
+ *   [restart_mpiio_header] [global block: All, random number state, timebin flags, driving state, ...]
+ *   [one restart_mpiio_taskentry per writing task] [P data of all tasks] [SphP data of all tasks]
+ * The particle data of each writing task is stored gas-first, so the file can be read back onto any
+ * number of tasks: each reading task simply takes an equal share of the gas and non-gas particles, and
+ * the subsequent domain decomposition (and tree construction) redistributes them properly. Each section
+ * carries a checksum which is additive over particles, so it can be verified even when a section is
+ * read back in pieces by several tasks.
+ */
+#define RESTART_MPIIO_MAGIC   0x475a5253
+#define RESTART_MPIIO_VERSION 1
+
+struct restart_mpiio_header
+{
+    int magic, version, NTask_written;
+    int size_All, size_P, size_SphP, size_global;
+    long long TotNumPart_written, TotN_gas_written;
+    unsigned long long checksum_global;
+};
+
+struct restart_mpiio_taskentry
+{
+    long long NumPart, N_gas;
+    long long offset_P, offset_SphP;     /* byte offsets in the file */
+    unsigned long long checksum_P, checksum_SphP;
+};
+
+static char *restart_mpiio_blob;
+static size_t restart_mpiio_blob_pos;
+
+
+/* hash of a single record (particle) combined with its index in the section, so the
+    sum over records is sensitive to both the data and its position, but can be accumulated in pieces */
+static unsigned long long restart_mpiio_record_hash(char *rec, size_t size, long long index)
+{
+    unsigned long long h = 0x9E3779B97F4A7C15ULL * (unsigned long long) (index + 1), w;
+    size_t k;
+    for(k = 0; k < size; k += sizeof(w))
+    {
+        w = 0; memcpy(&w, rec + k, (size - k < sizeof(w)) ? (size - k) : sizeof(w));
+        h ^= w; h *= 0xBF58476D1CE4E5B9ULL; h ^= h >> 31; /* splitmix-type mixing */
+    }
+    h *= 0x94D049BB133111EBULL; h ^= h >> 29;
+    return h;
+}
+
+static unsigned long long restart_mpiio_checksum(void *data, size_t size, long long n, long long first_index)
+{
+    unsigned long long sum = 0;
+    long long i;
+    for(i = 0; i < n; i++) {sum += restart_mpiio_record_hash((char *) data + i * size, size, first_index + i);}
+    return sum;
+}
+
+
+/* packs (modus==0) or unpacks (modus>0) the global state into the global block, in the same way byten() does for files */
+static void restart_mpiio_pack(void *x, size_t n, int modus)
+{
+    if(restart_mpiio_blob)
+    {
+        if(modus) {memcpy(x, restart_mpiio_blob + restart_mpiio_blob_pos, n);} else {memcpy(restart_mpiio_blob + restart_mpiio_blob_pos, x, n);}
+    }
+    restart_mpiio_blob_pos += n; /* with no blob allocated, this just measures the block size */
+}
+
+static void restart_mpiio_global_block(int modus)
+{
+    restart_mpiio_blob_pos = 0;
+    restart_mpiio_pack(&All, sizeof(struct global_data_all_processes), modus);
+    restart_mpiio_pack(gsl_rng_state(random_generator), gsl_rng_size(random_generator), modus);
+    restart_mpiio_pack(&SelRnd, sizeof(SelRnd), modus);
+    restart_mpiio_pack(TimeBinActive, TIMEBINS * sizeof(int), modus);
+#ifdef TURB_DRIVING
+    restart_mpiio_pack(gsl_rng_state(StRng), gsl_rng_size(StRng), modus);
+    restart_mpiio_pack(&StNModes, sizeof(StNModes), modus);
+    restart_mpiio_pack(&StOUVar, sizeof(StOUVar), modus);
+    restart_mpiio_pack(StOUPhases, StNModes*6*sizeof(double), modus);
+    restart_mpiio_pack(StAmpl, StNModes*3*sizeof(double), modus);
+    restart_mpiio_pack(StAka, StNModes*3*sizeof(double), modus);
+    restart_mpiio_pack(StAkb, StNModes*3*sizeof(double), modus);
+    restart_mpiio_pack(StMode, StNModes*3*sizeof(double), modus);
+    restart_mpiio_pack(&StTPrev, sizeof(StTPrev), modus);
+    restart_mpiio_pack(&StSolWeightNorm, sizeof(StSolWeightNorm), modus);
+#endif
+}
+
+
+/* reads 'n' records of size 'size' at byte offset 'offset' (independent I/O, chunked to keep counts in int range) */
+static void restart_mpiio_read_records(MPI_File fh, long long offset, void *buf, int size, long long n)
+{
+    MPI_Status status;
+    long long nchunk, maxchunk = (1LL << 30) / size + 1;
+    while(n > 0)
+    {
+        nchunk = (n < maxchunk) ? n : maxchunk;
+        MPI_File_read_at(fh, (MPI_Offset) offset, buf, (int) (nchunk * size), MPI_BYTE, &status);
+        offset += nchunk * size; buf = (char *) buf + nchunk * size; n -= nchunk;
+    }
+}
+
+
+static void restart_mpiio_write(char *fname)
+{
+    struct restart_mpiio_header head;
+    struct restart_mpiio_taskentry entry, *table = NULL;
+    long long mybytes[2], offsets[2], totbytes[2], base;
+    MPI_Datatype rec_P, rec_SphP;
+    MPI_Status status;
+    MPI_File fh;
+
+    /* same as for snapshots: bring the gas block in order (this forces a new domain decomposition before the next step) */
+    rearrange_particle_sequence();
+    All.NumForcesSinceLastDomainDecomp = (long long) (1 + All.TreeDomainUpdateFrequency * All.TotNumPart);
+
+    memset(&head, 0, sizeof(head));
+    head.magic = RESTART_MPIIO_MAGIC; head.version = RESTART_MPIIO_VERSION; head.NTask_written = NTask;
+    head.size_All = sizeof(struct global_data_all_processes); head.size_P = sizeof(struct particle_data); head.size_SphP = sizeof(struct sph_particle_data);
+    restart_mpiio_blob = NULL; restart_mpiio_global_block(0); head.size_global = (int) restart_mpiio_blob_pos;
+    entry.NumPart = NumPart; entry.N_gas = N_gas;
+    MPI_Allreduce(&entry.NumPart, &head.TotNumPart_written, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&entry.N_gas, &head.TotN_gas_written, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+    /* section offsets: all P data first (in task order), followed by all SphP data */
+    mybytes[0] = (long long) NumPart * head.size_P; mybytes[1] = (long long) N_gas * head.size_SphP;
+    MPI_Exscan(mybytes, offsets, 2, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    if(ThisTask == 0) {offsets[0] = offsets[1] = 0;}
+    MPI_Allreduce(mybytes, totbytes, 2, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    base = sizeof(head) + head.size_global + (long long) NTask * sizeof(struct restart_mpiio_taskentry);
+    entry.offset_P = base + offsets[0];
+    entry.offset_SphP = base + totbytes[0] + offsets[1];
+    entry.checksum_P = restart_mpiio_checksum(P, head.size_P, NumPart, 0);
+    entry.checksum_SphP = restart_mpiio_checksum(SphP, head.size_SphP, N_gas, 0);
+
+    if(ThisTask == 0) {table = (struct restart_mpiio_taskentry *) mymalloc("restart_table", NTask * sizeof(struct restart_mpiio_taskentry));}
+    MPI_Gather(&entry, sizeof(entry), MPI_BYTE, table, sizeof(entry), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    if(MPI_File_open(MPI_COMM_WORLD, fname, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    {
+        if(ThisTask == 0) {printf("Restart file '%s' cannot be opened.\n", fname);}
+        endrun(7878);
+    }
+    MPI_File_set_size(fh, 0);
+
+    if(ThisTask == 0)
+    {
+        restart_mpiio_blob = (char *) mymalloc("restart_blob", head.size_global);
+        restart_mpiio_global_block(0);
+        head.checksum_global = restart_mpiio_checksum(restart_mpiio_blob, head.size_global, 1, 0);
+        MPI_File_write_at(fh, 0, &head, sizeof(head), MPI_BYTE, &status);
+        MPI_File_write_at(fh, sizeof(head), restart_mpiio_blob, head.size_global, MPI_BYTE, &status);
+        MPI_File_write_at(fh, sizeof(head) + head.size_global, table, NTask * sizeof(struct restart_mpiio_taskentry), MPI_BYTE, &status);
+        myfree(restart_mpiio_blob);
+        restart_mpiio_blob = NULL;
+    }
+
+    /* collective writes of the particle data, one record type per section */
+    MPI_Type_contiguous(head.size_P, MPI_BYTE, &rec_P); MPI_Type_commit(&rec_P);
+    MPI_Type_contiguous(head.size_SphP, MPI_BYTE, &rec_SphP); MPI_Type_commit(&rec_SphP);
+    MPI_File_write_at_all(fh, (MPI_Offset) entry.offset_P, P, NumPart, rec_P, &status);
+    MPI_File_write_at_all(fh, (MPI_Offset) entry.offset_SphP, SphP, N_gas, rec_SphP, &status);
+    MPI_Type_free(&rec_SphP); MPI_Type_free(&rec_P);
+    MPI_File_close(&fh);
+
+    if(ThisTask == 0)
+    {
+        myfree(table);
+        printf("wrote restart file '%s' (%g MB) from %d tasks\n", fname, (base + totbytes[0] + totbytes[1]) / (1024.0 * 1024.0), NTask);
+        fflush(stdout);
+    }
+}
+
+
+/* reads the restart file onto the current set of tasks (which need not be the number that wrote it).
+    returns 0 on success, or a non-zero value if the file is missing or its header/global block fails the
+    consistency checks (in which case nothing has been changed yet, and we can try the backup instead). */
+static int restart_mpiio_read(char *fname)
+{
+    struct restart_mpiio_header head;
+    struct restart_mpiio_taskentry *table;
+    long long g0, g1, s0, s1, gfirst, sfirst, lo, hi, n, nw;
+    unsigned long long *sums, *sums_all;
+    double save_PartAllocFactor = All.PartAllocFactor;
+    MPI_Status status;
+    MPI_File fh;
+    int w, ok = 1;
+
+    if(MPI_File_open(MPI_COMM_WORLD, fname, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS) {return 1;}
+
+    if(ThisTask == 0)
+    {
+        MPI_File_read_at(fh, 0, &head, sizeof(head), MPI_BYTE, &status);
+        if(head.magic != RESTART_MPIIO_MAGIC || head.version != RESTART_MPIIO_VERSION) {ok = 0; printf("Restart file '%s' has an unknown format.\n", fname);}
+        if(ok && (head.size_All != (int) sizeof(struct global_data_all_processes) || head.size_P != (int) sizeof(struct particle_data) || head.size_SphP != (int) sizeof(struct sph_particle_data)))
+            {ok = 0; printf("Restart file '%s' was written by a code compiled with different options (structure sizes do not match).\n", fname);}
+    }
+    MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if(!ok) {MPI_File_close(&fh); return 2;}
+    MPI_Bcast(&head, sizeof(head), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    /* global state: read by task 0, verified, and broadcast */
+    restart_mpiio_blob = (char *) mymalloc("restart_blob", head.size_global);
+    if(ThisTask == 0)
+    {
+        MPI_File_read_at(fh, sizeof(head), restart_mpiio_blob, head.size_global, MPI_BYTE, &status);
+        if(restart_mpiio_checksum(restart_mpiio_blob, head.size_global, 1, 0) != head.checksum_global) {ok = 0; printf("Checksum of global block in restart file '%s' does not match.\n", fname);}
+    }
+    MPI_Bcast(&ok, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if(!ok) {myfree(restart_mpiio_blob); restart_mpiio_blob = NULL; MPI_File_close(&fh); return 3;}
+    MPI_Bcast(restart_mpiio_blob, head.size_global, MPI_BYTE, 0, MPI_COMM_WORLD);
+    restart_mpiio_global_block(1);
+    myfree(restart_mpiio_blob);
+    restart_mpiio_blob = NULL;
+
+    if(ThisTask == 0 && head.NTask_written != NTask) {printf("Restart file was written by %d tasks: redistributing its particles onto %d tasks.\n", head.NTask_written, NTask);}
+
+    /* the particle load is set for the current number of tasks (the old tree is not used, so no need to keep old_MaxPart) */
+    All.PartAllocFactor = save_PartAllocFactor;
+    All.TotNumPart = head.TotNumPart_written;
+    All.TotN_gas = head.TotN_gas_written;
+    All.MaxPart = (int) (All.PartAllocFactor * (All.TotNumPart / NTask));
+    All.MaxPartSph = (int) (All.PartAllocFactor * (All.TotN_gas / NTask));
+#ifdef ALLOW_IMBALANCED_GASPARTICLELOAD
+    All.MaxPartSph = All.MaxPart;
+#endif
+    allocate_memory();
+
+    table = (struct restart_mpiio_taskentry *) mymalloc("restart_table", head.NTask_written * sizeof(struct restart_mpiio_taskentry));
+    if(ThisTask == 0) {MPI_File_read_at(fh, sizeof(head) + head.size_global, table, head.NTask_written * sizeof(struct restart_mpiio_taskentry), MPI_BYTE, &status);}
+    MPI_Bcast(table, head.NTask_written * sizeof(struct restart_mpiio_taskentry), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    /* this task takes an equal share [g0,g1) of all gas particles, and [s0,s1) of all other particles */
+    g0 = (head.TotN_gas_written * ThisTask) / NTask; g1 = (head.TotN_gas_written * (ThisTask + 1)) / NTask;
+    s0 = ((head.TotNumPart_written - head.TotN_gas_written) * ThisTask) / NTask; s1 = ((head.TotNumPart_written - head.TotN_gas_written) * (ThisTask + 1)) / NTask;
+    N_gas = (int) (g1 - g0);
+    NumPart = (int) (N_gas + s1 - s0);
+    if(NumPart > All.MaxPart || N_gas > All.MaxPartSph)
+    {
+        printf("task %d: not enough space to load the restart file (NumPart=%d MaxPart=%d N_gas=%d MaxPartSph=%d): increase 'PartAllocFactor'\n", ThisTask, NumPart, All.MaxPart, N_gas, All.MaxPartSph);
+        endrun(22);
+    }
+
+    sums = (unsigned long long *) mymalloc("restart_sums", 2 * head.NTask_written * sizeof(unsigned long long));
+    sums_all = (unsigned long long *) mymalloc("restart_sums_all", 2 * head.NTask_written * sizeof(unsigned long long));
+    memset(sums, 0, 2 * head.NTask_written * sizeof(unsigned long long));
+    for(w = 0, gfirst = 0, sfirst = 0; w < head.NTask_written; w++)
+    {
+        nw = table[w].NumPart - table[w].N_gas;
+        /* gas: global gas indices [gfirst, gfirst+N_gas) live at the start of this writer's P and SphP sections */
+        lo = (g0 > gfirst) ? g0 : gfirst; hi = (g1 < gfirst + table[w].N_gas) ? g1 : (gfirst + table[w].N_gas);
+        if(hi > lo)
+        {
+            n = hi - lo;
+            restart_mpiio_read_records(fh, table[w].offset_P + (lo - gfirst) * head.size_P, &P[lo - g0], head.size_P, n);
+            restart_mpiio_read_records(fh, table[w].offset_SphP + (lo - gfirst) * head.size_SphP, &SphP[lo - g0], head.size_SphP, n);
+            sums[2*w] += restart_mpiio_checksum(&P[lo - g0], head.size_P, n, lo - gfirst);
+            sums[2*w+1] += restart_mpiio_checksum(&SphP[lo - g0], head.size_SphP, n, lo - gfirst);
+        }
+        /* non-gas: these follow the gas in the writer's P section */
+        lo = (s0 > sfirst) ? s0 : sfirst; hi = (s1 < sfirst + nw) ? s1 : (sfirst + nw);
+        if(hi > lo)
+        {
+            n = hi - lo;
+            restart_mpiio_read_records(fh, table[w].offset_P + (table[w].N_gas + lo - sfirst) * head.size_P, &P[N_gas + lo - s0], head.size_P, n);
+            sums[2*w] += restart_mpiio_checksum(&P[N_gas + lo - s0], head.size_P, n, table[w].N_gas + lo - sfirst);
+        }
+        gfirst += table[w].N_gas;
+        sfirst += nw;
+    }
+    MPI_File_close(&fh);
+
+    MPI_Allreduce(sums, sums_all, 2 * head.NTask_written, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    for(w = 0; w < head.NTask_written; w++)
+        if(sums_all[2*w] != table[w].checksum_P || sums_all[2*w+1] != table[w].checksum_SphP)
+        {
+            if(ThisTask == 0) {printf("Checksum of particle data written by task %d in restart file '%s' does not match.\n", w, fname);}
+            ok = 0;
+        }
+    myfree(sums_all);
+    myfree(sums);
+    myfree(table);
+    if(!ok)
+    {
+        /* the particle data is already loaded into (and overwrote) the memory at this point, so we cannot fall back here */
+        if(ThisTask == 0) {printf("Fatal error. Restart file '%s' is corrupted: if a valid backup exists, move it in place of this file and restart.\n", fname);}
+        endrun(7872);
+    }
+
+    Gas_split = 0;
+#ifdef GALSF
+    Stars_converted = 0;
+#endif
+    return 0;
+}
+
+
+/* driver for the MPI-IO restart format: keeps one backup, and falls back to it on reading if
+    the regular file is missing or corrupted. The tree is not stored: a new domain decomposition
+    is done after reading, which also redistributes the particles if the number of tasks changed. */
+void restart_mpiio(int modus)
+{
+    char buf[200], buf_bak[200];
+
+    sprintf(buf, "%s/restartfiles", All.OutputDir);
+    if(ThisTask == 0 && modus == 0) {mkdir(buf, 02755);}
+    sprintf(buf, "%s/restartfiles/%s.mpiio", All.OutputDir, All.RestartFile);
+    sprintf(buf_bak, "%s/restartfiles/%s.mpiio.bak", All.OutputDir, All.RestartFile);
+
+    if(modus == 0)
+    {
+        if(ThisTask == 0) {rename(buf, buf_bak);} /* move the old restart file to the backup */
+        MPI_Barrier(MPI_COMM_WORLD);
+        restart_mpiio_write(buf);
+        return;
+    }
+
+    if(restart_mpiio_read(buf))
+    {
+        if(ThisTask == 0) {printf("Restart file '%s' missing or invalid: attempting to use backup '%s'.\n", buf, buf_bak);}
+        if(restart_mpiio_read(buf_bak))
+        {
+            if(ThisTask == 0) {printf("Fatal error. Neither restart file '%s' nor '%s' could be read.\n", buf, buf_bak);}
+            endrun(7871);
+        }
+    }
+    domain_Decomposition(0, 0, 0);
+}
+#endif
+
+
 /* reads/writes n bytes 
  */
 void byten(void *x, size_t n, int modus)
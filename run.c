@@ -74,6 +74,10 @@ void run(void)
                                              * at the desired time.
                                              */
         
+#ifdef OUTPUT_STREAMS
+        output_streams();       /* write any lightweight output streams due at this step */
+#endif
+        
         output_log_messages();	/* write some info to log-files */
         
         set_non_standard_physics_for_current_time();	/* update auxiliary physics for current time */
@@ -122,6 +126,14 @@ void run(void)
         
         compute_hydro_densities_and_forces();	/* densities, gradients, & hydro-accels for synchronous particles */
         
+#ifdef OUTPUT_LINEOFSIGHT
+        if(All.Ti_Current >= All.Ti_nextlineofsight && All.Ti_nextlineofsight >= 0)
+        {
+            lineofsight_output();	/* sightlines through the gas (tree and hmax are current here) */
+            All.Ti_nextlineofsight = find_next_lineofsighttime(All.Ti_nextlineofsight);
+        }
+#endif
+        
         do_second_halfstep_kick();	/* this does the half-step kick at the end of the timestep */
         
         calculate_non_standard_physics();	/* source terms are here treated in a strang-split fashion */
@@ -155,6 +167,9 @@ void run(void)
         if(stopflag)
         {
             restart(0);		/* write restart file */
+#ifdef IO_ASYNC_OUTPUT
+            io_async_fence();	/* restart files must be on disk before the job is continued/resubmitted */
+#endif
             MPI_Barrier(MPI_COMM_WORLD);
             
             if(stopflag == 2 && ThisTask == 0)
@@ -503,32 +518,40 @@ void find_next_sync_point_and_drift(void)
 }
 
 
+static int compare_active_particle_index(const void *a, const void *b)
+{
+    return (*(int *) a > *(int *) b) - (*(int *) a < *(int *) b);
+}
+
 void make_list_of_active_particles(void)
 {
-    int i, n, prev;
-    /* make a link list with the particles in the active time bins */
-    FirstActiveParticle = -1;
-    
-    for(n = 0, prev = -1; n < TIMEBINS; n++)
+    int i, n, prev, N_in_active_bins = 0;
+    /* gather the particles in the active time bins into a compact index array, sorted by index: the particles are stored in 
+        Peano-Hilbert order after each domain decomposition, but the time-bin lists lose that order as particles change bins,
+        so this restores a spatially-coherent order for all the loops over active particles. if many particles are active,
+        flagging them and scanning the particle list is cheaper than sorting */
+    for(n = 0; n < TIMEBINS; n++) {if(TimeBinActive[n]) {N_in_active_bins += TimeBinCount[n];}}
+    NumActiveParticle = 0;
+    if(N_in_active_bins > NumPart / 8)
     {
-        if(TimeBinActive[n])
-        {
-            for(i = FirstInTimeBin[n]; i >= 0; i = NextInTimeBin[i])
-            {
-                if(P[i].Mass <= 0)
-                    continue;
-                
-                if(prev == -1)
-                    FirstActiveParticle = i;
-                
-                if(prev >= 0)
-                    NextActiveParticle[prev] = i;
-                
-                prev = i;
-            }
-        }
+        unsigned char *is_active = (unsigned char *) mymalloc("is_active", NumPart * sizeof(unsigned char));
+        memset(is_active, 0, NumPart * sizeof(unsigned char));
+        for(n = 0; n < TIMEBINS; n++) {if(TimeBinActive[n]) {for(i = FirstInTimeBin[n]; i >= 0; i = NextInTimeBin[i]) {is_active[i] = 1;}}}
+        for(i = 0; i < NumPart; i++) {if(is_active[i] && P[i].Mass > 0) {ActiveParticleList[NumActiveParticle++] = i;}}
+        myfree(is_active);
+    } else {
+        for(n = 0; n < TIMEBINS; n++) {if(TimeBinActive[n]) {for(i = FirstInTimeBin[n]; i >= 0; i = NextInTimeBin[i]) {if(P[i].Mass > 0) {ActiveParticleList[NumActiveParticle++] = i;}}}}
+        qsort(ActiveParticleList, NumActiveParticle, sizeof(int), compare_active_particle_index);
     }
     
+    /* the link list of active particles is kept, in the same order, for the routines which walk it */
+    FirstActiveParticle = -1;
+    for(n = 0, prev = -1; n < NumActiveParticle; n++)
+    {
+        i = ActiveParticleList[n];
+        if(prev == -1) {FirstActiveParticle = i;} else {NextActiveParticle[prev] = i;}
+        prev = i;
+    }
     if(prev >= 0)
         NextActiveParticle[prev] = -1;
 }
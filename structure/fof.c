@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <math.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -72,7 +73,7 @@ static int MyFOF_PRIMARY_LINK_TYPES;
 static int MyFOF_SECONDARY_LINK_TYPES;
 static int MyFOF_GROUP_MIN_LEN;
 
-static MyIDType *Head, *Len, *Next, *Tail, *MinID, *MinIDTask;
+static MyIDType *Head, *Next, *Tail, *MinID, *MinIDTask;
 static char *NonlocalFlag;
 
 
@@ -82,9 +83,8 @@ static float *fof_nearest_hsml;
 
 void fof_fof(int num)
 {
-  int i, ndm, start, lenloc, largestgroup, n;
+  int i, ndm, start, lenloc, largestgroup, no, rebuild;
   double mass, masstot, rhodm, t0, t1;
-  struct unbind_data *d;
   long long ndmtot;
 
 
@@ -106,9 +106,36 @@ void fof_fof(int num)
 
   CPU_Step[CPU_MISC] += measure_time();
 
-  domain_Decomposition(1, 0, 0);
+  /* the group finding runs on the live domains and tree. they are only rebuilt if there is no valid
+     tree, or if rearrange_particle_sequence has work pending (newly spawned particles not yet in the
+     particle block, or eliminated particles still in it), since that would re-order the particles */
+  rebuild = TreeReconstructFlag || Gas_split > 0;
+  for(i = 0; i < NumPart; i++)
+    if(P[i].Mass <= 0)
+      rebuild = 1;
+  MPI_Allreduce(MPI_IN_PLACE, &rebuild, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+  if(rebuild)
+    {
+      domain_Decomposition(1, 0, 0);
+
+      if(ThisTask == 0)
+        printf("Tree construction.\n");
+      force_treebuild(NumPart, NULL);
+
+      TreeReconstructFlag = 0;
+    }
+
+  /* bring particles and tree nodes to the current time, and clear the node flags used by the linking */
+  for(i = 0; i < NumPart; i++)
+    if(P[i].Ti_current != All.Ti_Current)
+      drift_particle(i, All.Ti_Current);
 
-  force_treefree();
+  for(no = All.MaxPart; no < All.MaxPart + Numnodestree; no++)
+    {
+      force_drift_node(no, All.Ti_Current);
+      Nodes[no].u.d.bitflags &= (~(1 << BITFLAG_INSIDE_LINKINGLENGTH));
+    }
 
 
   for(i = 0, ndm = 0, mass = 0; i < NumPart; i++)
@@ -143,30 +170,14 @@ void fof_fof(int num)
   MinID = (MyIDType *) FOF_PList;
   MinIDTask = MinID + NumPart;
   Head = MinIDTask + NumPart;
-  Len = (MyIDType *) mymalloc("Len", NumPart * sizeof(MyIDType));
   Next = (MyIDType *) mymalloc("Next", NumPart * sizeof(MyIDType));
   Tail = (MyIDType *) mymalloc("Tail", NumPart * sizeof(MyIDType));
 
   CPU_Step[CPU_FOF] += measure_time();
 
-  if(ThisTask == 0)
-    printf("Tree construction.\n");
-
-  /* build index list of particles of selected primary species */
-  d = (struct unbind_data *) mymalloc("d", NumPart * sizeof(struct unbind_data));
-  for(i = 0, n = 0; i < NumPart; i++)
-    if(((1 << P[i].Type) & (MyFOF_PRIMARY_LINK_TYPES)))
-      d[n++].index = i;
-
-  force_treeallocate((int) (All.TreeAllocFactor * All.MaxPart) + NTopnodes, All.MaxPart);
-    
-  force_treebuild(n, d);
-
   for(i = 0; i < NumPart; i++)
     {
-      Head[i] = Tail[i] = i;
-      Len[i] = 1;
-      Next[i] = -1;
+      Head[i] = i;
       MinID[i] = P[i].ID;
       MinIDTask[i] = ThisTask;
     }
@@ -216,13 +227,8 @@ void fof_fof(int num)
       FOF_PList[i].Pindex = i;
     }
 
-  force_treefree();
-
-  myfree(d);
-  
   myfree(Tail);
   myfree(Next);
-  myfree(Len);
 
   FOF_GList = (fof_group_list *) mymalloc("FOF_GList", sizeof(fof_group_list) * NumPart);
 
@@ -326,6 +332,9 @@ void fof_fof(int num)
   if(num >= 0)
     {
       fof_save_groups(num);
+#ifdef FOF_SUBHALOS
+      fof_subhalos(num);
+#endif
     }
 
   myfree(Group);
@@ -343,27 +352,162 @@ void fof_fof(int num)
 #endif
 
   CPU_Step[CPU_FOF] += measure_time();
+}
 
-  force_treeallocate((int) (All.TreeAllocFactor * All.MaxPart) + NTopnodes, All.MaxPart);
 
-  if(ThisTask == 0)
-    printf("Tree construction.\n");
-  force_treebuild(NumPart, NULL);
 
-  TreeReconstructFlag = 0;
+/* union-find on the Head[] array of the primary link types: Head[i] points towards the root of the local group
+    of particle i. roots are always linked below the root with the lower index, so Head[i] <= i throughout, and
+    the finds use path-halving. with OpenMP the local linking is done by all threads at once: links are then set
+    with a compare-and-swap on the (still unlinked) root, and the path-halving stores are harmless races since
+    they only ever replace a pointer to an ancestor by a pointer to a higher ancestor */
+#ifdef _OPENMP
+#define FOF_HEAD_LOAD(i)              __atomic_load_n(&Head[i], __ATOMIC_RELAXED)
+#define FOF_HEAD_STORE(i,v)           __atomic_store_n(&Head[i], (v), __ATOMIC_RELAXED)
+#define FOF_HEAD_LINK(i,v)            __atomic_compare_exchange_n(&Head[i], &(i), (v), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define FOF_HEAD_LOAD(i)              (Head[i])
+#define FOF_HEAD_STORE(i,v)           (Head[i] = (v))
+#define FOF_HEAD_LINK(i,v)            (Head[i] == (i) ? (Head[i] = (v), 1) : 0)
+#endif
+
+static MyIDType fof_find_root(MyIDType i)
+{
+  MyIDType p, gp;
+  while((p = FOF_HEAD_LOAD(i)) != i)
+    {
+      gp = FOF_HEAD_LOAD(p);
+      if(gp != p)
+        FOF_HEAD_STORE(i, gp);
+      i = gp;
+    }
+  return i;
+}
+
+static void fof_union(MyIDType a, MyIDType b)
+{
+  MyIDType tmp;
+  while(1)
+    {
+      a = fof_find_root(a);
+      b = fof_find_root(b);
+      if(a == b)
+        return;
+      if(a < b)
+        {
+          tmp = a;
+          a = b;
+          b = tmp;
+        }
+      if(FOF_HEAD_LINK(a, b))	/* fails (and we retry) if another thread linked root 'a' in the meantime */
+        return;
+    }
+}
+
+
+/* links across task boundaries are recorded as pairs of group labels: a label is the (MinID,MinIDTask) of a
+    local group, which is unique since the particle IDs are. the pairs are resolved in fof_link_pairs_to_star. */
+struct fof_link_label
+{
+  MyIDType MinID;
+  MyIDType MinIDTask;
+};
+
+struct fof_link_pair
+{
+  struct fof_link_label a, b;
+};
+
+static struct fof_link_pair *FoFLinkPairs;
+static int NFoFLinkPairs, MaxFoFLinkPairs;
+
+
+static int fof_compare_link_label(const void *a, const void *b)
+{
+  if(((struct fof_link_label *) a)->MinID < ((struct fof_link_label *) b)->MinID)
+    return -1;
+  if(((struct fof_link_label *) a)->MinID > ((struct fof_link_label *) b)->MinID)
+    return +1;
+  return 0;
 }
 
 
+/* replaces the list of label pairs by an equivalent 'star' list: one pair (label, root label) for every label
+    which is not the root of its connected set, where the root is the smallest label of the set. the result is
+    sorted by the first label, and never longer than the input list. */
+static long long fof_link_pairs_to_star(struct fof_link_pair *pairs, long long npairs)
+{
+  long long i, n, nlabels, ia, ib, *parent;
+  struct fof_link_label *labels, *hit;
+
+  if(npairs <= 0)
+    return 0;
 
+  labels = (struct fof_link_label *) mymalloc("labels", 2 * npairs * sizeof(struct fof_link_label));
+  parent = (long long *) mymalloc("parent", 2 * npairs * sizeof(long long));
+
+  for(i = 0; i < npairs; i++)
+    {
+      labels[2 * i] = pairs[i].a;
+      labels[2 * i + 1] = pairs[i].b;
+    }
+  qsort(labels, 2 * npairs, sizeof(struct fof_link_label), fof_compare_link_label);
+  for(i = 1, nlabels = 1; i < 2 * npairs; i++)
+    if(labels[i].MinID != labels[nlabels - 1].MinID)
+      labels[nlabels++] = labels[i];
+
+  for(i = 0; i < nlabels; i++)
+    parent[i] = i;
+
+  for(i = 0; i < npairs; i++)
+    {
+      hit = (struct fof_link_label *) bsearch(&pairs[i].a, labels, nlabels, sizeof(struct fof_link_label), fof_compare_link_label);
+      ia = hit - labels;
+      hit = (struct fof_link_label *) bsearch(&pairs[i].b, labels, nlabels, sizeof(struct fof_link_label), fof_compare_link_label);
+      ib = hit - labels;
+      while(parent[ia] != ia)
+        ia = parent[ia] = parent[parent[ia]];
+      while(parent[ib] != ib)
+        ib = parent[ib] = parent[parent[ib]];
+      if(ia < ib)
+        parent[ib] = ia;
+      if(ib < ia)
+        parent[ia] = ib;
+    }
+
+  /* labels are sorted, so parent[i] < i for all non-roots and a single forward pass finds all roots */
+  for(i = 0, n = 0; i < nlabels; i++)
+    if(parent[i] != i)
+      {
+        parent[i] = parent[parent[i]];
+        pairs[n].a = labels[i];
+        pairs[n].b = labels[parent[i]];
+        n++;
+      }
+
+  myfree(parent);
+  myfree(labels);
+
+  return n;
+}
+
+
+/* FoF linking of the primary link types: (1) all links among local particles are made with a (threaded)
+    union-find over the Peano-ordered local particles, flagging particles whose search reaches into other
+    domains; (2) these boundary particles are exported once, and the tasks receiving them record the
+    pairs of local groups they link; (3) the pairs are reduced locally, gathered on all tasks, and merged
+    with a union-find over the group labels, which gives every local group its global MinID/MinIDTask.
+    so the number of communication rounds does not depend on how many domains a group spans. */
 void fof_find_groups(void)
 {
-  int i, j, ndone_flag, link_count, dummy, nprocessed;
+  int i, j, ndone_flag, dummy, nprocessed;
   int ndone, ngrp, recvTask, place, nexport, nimport, link_across;
-  int npart, marked;
-  long long totmarked, totnpart;
+  int npart, marked, *npairs_task, *offset_task;
+  long long totmarked, totnpart, NTaskTimesNumPart, npairs_loc, npairs_tot, *npairs_task_ll;
+  MPI_Datatype fof_pair_type;
   long long link_across_tot, ntot;
-  MyIDType *MinIDOld;
-  char *FoFDataOut, *FoFDataResult, *MarkedFlag, *ChangedFlag;
+  struct fof_link_pair *pairs_all, *hit;
+  struct fof_link_label label;
   double t0, t1;
 
 #ifndef IO_REDUCED_MODE
@@ -376,7 +520,8 @@ void fof_find_groups(void)
 
   /* allocate buffers to arrange communication */
 
-  Ngblist = (int *) mymalloc("Ngblist", NumPart * sizeof(int));
+  NTaskTimesNumPart = maxThreads * NumPart;
+  Ngblist = (int *) mymalloc("Ngblist", NTaskTimesNumPart * sizeof(int));
 
     size_t MyBufferSize = All.BufferSize;
     All.BunchSize = (int) ((MyBufferSize * 1024 * 1024) / (sizeof(struct data_index) + sizeof(struct data_nodelist) +
@@ -385,26 +530,51 @@ void fof_find_groups(void)
     DataNodeList = (struct data_nodelist *) mymalloc("DataNodeList", All.BunchSize * sizeof(struct data_nodelist));
 
   NonlocalFlag = (char *) mymalloc("NonlocalFlag", NumPart * sizeof(char));
-  MarkedFlag = (char *) mymalloc("MarkedFlag", NumPart * sizeof(char));
-  ChangedFlag = (char *) mymalloc("ChangedFlag", NumPart * sizeof(char));
-  MinIDOld = (MyIDType *) mymalloc("MinIDOld", NumPart * sizeof(MyIDType));
+  MaxFoFLinkPairs = IMAX(NumPart, 1000);
+  FoFLinkPairs = (struct fof_link_pair *) mymalloc("FoFLinkPairs", MaxFoFLinkPairs * sizeof(struct fof_link_pair));
+  NFoFLinkPairs = 0;
 
   t0 = my_second();
 
   /* first, link only among local particles */
-  for(i = 0, marked = 0, npart = 0; i < NumPart; i++)
-    {
-      if(((1 << P[i].Type) & (MyFOF_PRIMARY_LINK_TYPES)))
-	{
-	  fof_find_dmparticles_evaluate(i, -1, &dummy, &dummy);
+  marked = npart = 0;
+#ifdef _OPENMP
+#pragma omp parallel private(i)
+#endif
+  {
+#ifdef _OPENMP
+    int *ngblist = Ngblist + omp_get_thread_num() * NumPart;
+#else
+    int *ngblist = Ngblist;
+#endif
+    int mydummy;
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic, 1024) reduction(+:marked,npart)
+#endif
+    for(i = 0; i < NumPart; i++)
+      {
+        if(((1 << P[i].Type) & (MyFOF_PRIMARY_LINK_TYPES)))
+          {
+            fof_find_dmparticles_evaluate(i, -1, &mydummy, &mydummy, ngblist);
 
-	  npart++;
+            npart++;
 
-	  if(NonlocalFlag[i])
-	    marked++;
-	}
-    }
+            if(NonlocalFlag[i])
+              marked++;
+          }
+      }
+  }
+
+  /* compress all paths, and give every local group the smallest ID of its members as label */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+  for(i = 0; i < NumPart; i++)
+    FOF_HEAD_STORE(i, fof_find_root(i));
 
+  for(i = 0; i < NumPart; i++)
+    if(MinID[i] < MinID[Head[i]])
+      MinID[Head[i]] = MinID[i];
 
   sumup_large_ints(1, &marked, &totmarked);
   sumup_large_ints(1, &npart, &totnpart);
@@ -426,193 +596,170 @@ void fof_find_groups(void)
       fflush(stdout);
     }
 #endif
-    
-  for(i = 0; i < NumPart; i++)
-    {
-      MinIDOld[i] = MinID[Head[i]];
-      MarkedFlag[i] = 1;
-    }
+
+  t0 = my_second();
+
+  /* single pass over the boundary particles: export them, and record the group pairs they link */
+  i = 0;			/* begin with this index */
+  link_across = 0;
+  nprocessed = 0;
 
   do
     {
-      t0 = my_second();
-
-      for(i = 0; i < NumPart; i++)
+      for(j = 0; j < NTask; j++)
 	{
-	  ChangedFlag[i] = MarkedFlag[i];
-	  MarkedFlag[i] = 0;
+	  Send_count[j] = 0;
+	  Exportflag[j] = -1;
 	}
 
-      i = 0;			/* begin with this index */
-      link_across = 0;
-      nprocessed = 0;
-
-      do
+      /* prepare export list */
+      for(nexport = 0; i < NumPart; i++)
 	{
-	  for(j = 0; j < NTask; j++)
+	  if(((1 << P[i].Type) & (MyFOF_PRIMARY_LINK_TYPES)))
 	    {
-	      Send_count[j] = 0;
-	      Exportflag[j] = -1;
-	    }
-
-	  /* do local particles and prepare export list */
-	  for(nexport = 0; i < NumPart; i++)
-	    {
-	      if(((1 << P[i].Type) & (MyFOF_PRIMARY_LINK_TYPES)))
+	      if(NonlocalFlag[i])
 		{
-		  if(NonlocalFlag[i] && ChangedFlag[i])
-		    {
-		      if(fof_find_dmparticles_evaluate(i, 0, &nexport, Send_count) < 0)
-			break;
+		  if(fof_find_dmparticles_evaluate(i, 0, &nexport, Send_count, Ngblist) < 0)
+		    break;
 
-		      nprocessed++;
-		    }
+		  nprocessed++;
 		}
 	    }
+	}
 
-	  MYSORT_DATAINDEX(DataIndexTable, nexport, sizeof(struct data_index), data_index_compare);
+      MYSORT_DATAINDEX(DataIndexTable, nexport, sizeof(struct data_index), data_index_compare);
 
-	  MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+      MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, MPI_COMM_WORLD);
 
-	  for(j = 0, nimport = 0, Recv_offset[0] = 0, Send_offset[0] = 0; j < NTask; j++)
-	    {
-	      nimport += Recv_count[j];
+      for(j = 0, nimport = 0, Recv_offset[0] = 0, Send_offset[0] = 0; j < NTask; j++)
+	{
+	  nimport += Recv_count[j];
 
-	      if(j > 0)
-		{
-		  Send_offset[j] = Send_offset[j - 1] + Send_count[j - 1];
-		  Recv_offset[j] = Recv_offset[j - 1] + Recv_count[j - 1];
-		}
+	  if(j > 0)
+	    {
+	      Send_offset[j] = Send_offset[j - 1] + Send_count[j - 1];
+	      Recv_offset[j] = Recv_offset[j - 1] + Recv_count[j - 1];
 	    }
+	}
 
-	  FoFDataGet = (struct fofdata_in *) mymalloc("FoFDataGet", nimport * sizeof(struct fofdata_in));
-	  FoFDataIn = (struct fofdata_in *) mymalloc("FoFDataIn", nexport * sizeof(struct fofdata_in));
+      FoFDataGet = (struct fofdata_in *) mymalloc("FoFDataGet", nimport * sizeof(struct fofdata_in));
+      FoFDataIn = (struct fofdata_in *) mymalloc("FoFDataIn", nexport * sizeof(struct fofdata_in));
 
 
-	  /* prepare particle data for export */
-	  for(j = 0; j < nexport; j++)
-	    {
-	      place = DataIndexTable[j].Index;
+      /* prepare particle data for export */
+      for(j = 0; j < nexport; j++)
+	{
+	  place = DataIndexTable[j].Index;
 
-	      FoFDataIn[j].Pos[0] = P[place].Pos[0];
-	      FoFDataIn[j].Pos[1] = P[place].Pos[1];
-	      FoFDataIn[j].Pos[2] = P[place].Pos[2];
-	      FoFDataIn[j].MinID = MinID[Head[place]];
-	      FoFDataIn[j].MinIDTask = MinIDTask[Head[place]];
+	  FoFDataIn[j].Pos[0] = P[place].Pos[0];
+	  FoFDataIn[j].Pos[1] = P[place].Pos[1];
+	  FoFDataIn[j].Pos[2] = P[place].Pos[2];
+	  FoFDataIn[j].MinID = MinID[Head[place]];
+	  FoFDataIn[j].MinIDTask = MinIDTask[Head[place]];
 
-	      memcpy(FoFDataIn[j].NodeList,
-		     DataNodeList[DataIndexTable[j].IndexGet].NodeList, NODELISTLENGTH * sizeof(int));
-	    }
+	  memcpy(FoFDataIn[j].NodeList,
+		 DataNodeList[DataIndexTable[j].IndexGet].NodeList, NODELISTLENGTH * sizeof(int));
+	}
 
-	  /* exchange particle data */
-	  for(ngrp = 1; ngrp < (1 << PTask); ngrp++)
-	    {
-	      recvTask = ThisTask ^ ngrp;
+      /* exchange particle data */
+      for(ngrp = 1; ngrp < (1 << PTask); ngrp++)
+	{
+	  recvTask = ThisTask ^ ngrp;
 
-	      if(recvTask < NTask)
+	  if(recvTask < NTask)
+	    {
+	      if(Send_count[recvTask] > 0 || Recv_count[recvTask] > 0)
 		{
-		  if(Send_count[recvTask] > 0 || Recv_count[recvTask] > 0)
-		    {
-		      /* get the particles */
-		      MPI_Sendrecv(&FoFDataIn[Send_offset[recvTask]],
-				   Send_count[recvTask] * sizeof(struct fofdata_in), MPI_BYTE,
-				   recvTask, TAG_FOF_A,
-				   &FoFDataGet[Recv_offset[recvTask]],
-				   Recv_count[recvTask] * sizeof(struct fofdata_in), MPI_BYTE,
-				   recvTask, TAG_FOF_A, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-		    }
+		  /* get the particles */
+		  MPI_Sendrecv(&FoFDataIn[Send_offset[recvTask]],
+			       Send_count[recvTask] * sizeof(struct fofdata_in), MPI_BYTE,
+			       recvTask, TAG_FOF_A,
+			       &FoFDataGet[Recv_offset[recvTask]],
+			       Recv_count[recvTask] * sizeof(struct fofdata_in), MPI_BYTE,
+			       recvTask, TAG_FOF_A, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
 		}
 	    }
+	}
 
-	  myfree(FoFDataIn);
-	  FoFDataResult = (char *) mymalloc("FoFDataResult", nimport * sizeof(char));
-	  FoFDataOut = (char *) mymalloc("FoFDataOut", nexport * sizeof(char));
-
-	  /* now do the particles that were sent to us */
-
-	  for(j = 0; j < nimport; j++)
-	    {
-	      link_count = fof_find_dmparticles_evaluate(j, 1, &dummy, &dummy);
-	      link_across += link_count;
-	      if(link_count)
-		FoFDataResult[j] = 1;
-	      else
-		FoFDataResult[j] = 0;
-	    }
+      myfree(FoFDataIn);
 
-	  /* exchange data */
-	  for(ngrp = 1; ngrp < (1 << PTask); ngrp++)
-	    {
-	      recvTask = ThisTask ^ ngrp;
+      /* now do the particles that were sent to us: nothing needs to be sent back */
+      for(j = 0; j < nimport; j++)
+	link_across += fof_find_dmparticles_evaluate(j, 1, &dummy, &dummy, Ngblist);
 
-	      if(recvTask < NTask)
-		{
-		  if(Send_count[recvTask] > 0 || Recv_count[recvTask] > 0)
-		    {
-		      /* get the particles */
-		      MPI_Sendrecv(&FoFDataResult[Recv_offset[recvTask]],
-				   Recv_count[recvTask] * sizeof(char),
-				   MPI_BYTE, recvTask, TAG_FOF_B,
-				   &FoFDataOut[Send_offset[recvTask]],
-				   Send_count[recvTask] * sizeof(char),
-				   MPI_BYTE, recvTask, TAG_FOF_B, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-		    }
-		}
-	    }
+      myfree(FoFDataGet);
 
-	  /* need to mark the particle if it induced a link */
-	  for(j = 0; j < nexport; j++)
-	    {
-	      place = DataIndexTable[j].Index;
-	      if(FoFDataOut[j])
-		MarkedFlag[place] = 1;
-	    }
+      if(i >= NumPart)
+	ndone_flag = 1;
+      else
+	ndone_flag = 0;
 
-	  myfree(FoFDataOut);
-	  myfree(FoFDataResult);
-	  myfree(FoFDataGet);
+      MPI_Allreduce(&ndone_flag, &ndone, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    }
+  while(ndone < NTask);
 
-	  if(i >= NumPart)
-	    ndone_flag = 1;
-	  else
-	    ndone_flag = 0;
+  /* merge: reduce the local pairs, gather them everywhere, and resolve the global connectivity of the labels */
+  NFoFLinkPairs = fof_link_pairs_to_star(FoFLinkPairs, NFoFLinkPairs);
 
-	  MPI_Allreduce(&ndone_flag, &ndone, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
-	}
-      while(ndone < NTask);
+  npairs_task_ll = (long long *) mymalloc("npairs_task_ll", NTask * sizeof(long long));
+  npairs_task = (int *) mymalloc("npairs_task", NTask * sizeof(int));
+  offset_task = (int *) mymalloc("offset_task", NTask * sizeof(int));
 
+  /* counts and offsets are in units of pairs (not bytes), so they stay far below 2^31 */
+  npairs_loc = NFoFLinkPairs;
+  MPI_Allgather(&npairs_loc, 1, MPI_LONG_LONG, npairs_task_ll, 1, MPI_LONG_LONG, MPI_COMM_WORLD);
+  for(j = 0, npairs_tot = 0; j < NTask; j++)
+    npairs_tot += npairs_task_ll[j];
+  if(npairs_tot > INT_MAX)
+    terminate("too many FoF link pairs to gather");
+  for(j = 0, npairs_tot = 0; j < NTask; j++)
+    {
+      npairs_task[j] = (int) npairs_task_ll[j];
+      offset_task[j] = (int) npairs_tot;
+      npairs_tot += npairs_task_ll[j];
+    }
 
-      sumup_large_ints(1, &link_across, &link_across_tot);
-      sumup_large_ints(1, &nprocessed, &ntot);
+  MPI_Type_contiguous(sizeof(struct fof_link_pair), MPI_BYTE, &fof_pair_type);
+  MPI_Type_commit(&fof_pair_type);
+  pairs_all = (struct fof_link_pair *) mymalloc("pairs_all", npairs_tot * sizeof(struct fof_link_pair));
+  MPI_Allgatherv(FoFLinkPairs, NFoFLinkPairs, fof_pair_type,
+		 pairs_all, npairs_task, offset_task, fof_pair_type, MPI_COMM_WORLD);
+  MPI_Type_free(&fof_pair_type);
+  npairs_tot = fof_link_pairs_to_star(pairs_all, npairs_tot);
 
-      t1 = my_second();
+  for(i = 0; i < NumPart; i++)
+    if(Head[i] == (MyIDType) i && ((1 << P[i].Type) & (MyFOF_PRIMARY_LINK_TYPES)))
+      {
+	label.MinID = MinID[i];
+	hit = (struct fof_link_pair *) bsearch(&label, pairs_all, npairs_tot, sizeof(struct fof_link_pair), fof_compare_link_label);
+	if(hit)
+	  {
+	    MinID[i] = hit->b.MinID;
+	    MinIDTask[i] = hit->b.MinIDTask;
+	  }
+      }
 
-#ifndef IO_REDUCED_MODE
-      if(ThisTask == 0)
-	{
-	  printf("have done %d%09d cross links (processed %d%09d, took %g sec)\n",
-		 (int) (link_across_tot / 1000000000), (int) (link_across_tot % 1000000000),
-		 (int) (ntot / 1000000000), (int) (ntot % 1000000000), timediff(t0, t1));
-	  fflush(stdout);
-	}
-#endif
+  myfree(pairs_all);
+  myfree(offset_task);
+  myfree(npairs_task);
+  myfree(npairs_task_ll);
 
-      /* let's check out which particles have changed their MinID */
-      for(i = 0; i < NumPart; i++)
-	if(NonlocalFlag[i])
-	  {
-	    if(MinID[Head[i]] != MinIDOld[i])
-	      MarkedFlag[i] = 1;
+  sumup_large_ints(1, &link_across, &link_across_tot);
+  sumup_large_ints(1, &nprocessed, &ntot);
 
-	    MinIDOld[i] = MinID[Head[i]];
-	  }
+  t1 = my_second();
 
+#ifndef IO_REDUCED_MODE
+  if(ThisTask == 0)
+    {
+      printf("have done %d%09d cross links (processed %d%09d, %lld merged group labels, took %g sec)\n",
+	     (int) (link_across_tot / 1000000000), (int) (link_across_tot % 1000000000),
+	     (int) (ntot / 1000000000), (int) (ntot % 1000000000), npairs_tot, timediff(t0, t1));
+      fflush(stdout);
     }
-  while(link_across_tot > 0);
+#endif
 
-  myfree(MinIDOld);
-  myfree(ChangedFlag);
-  myfree(MarkedFlag);
+  myfree(FoFLinkPairs);
   myfree(NonlocalFlag);
 
   myfree(DataNodeList);
@@ -629,13 +776,15 @@ void fof_find_groups(void)
 }
 
 
-int fof_find_dmparticles_evaluate(int target, int mode, int *nexport, int *nsend_local)
+int fof_find_dmparticles_evaluate(int target, int mode, int *nexport, int *nsend_local, int *ngblist)
 {
-  int j, n, links, p, s, ss, listindex = 0;
+  int j, n, links, listindex = 0;
   int startnode, numngb_inbox;
+  MyIDType last_head;
   MyDouble *pos;
 
   links = 0;
+  last_head = -1;
 
   if(mode == 0 || mode == -1)
     pos = P[target].Pos;
@@ -659,7 +808,7 @@ int fof_find_dmparticles_evaluate(int target, int mode, int *nexport, int *nsend
 	  if(mode == -1)
 	    *nexport = 0;
 
-	  numngb_inbox = ngb_treefind_fof_primary(pos, LinkL, target, &startnode, mode, nexport, nsend_local, MyFOF_PRIMARY_LINK_TYPES);
+	  numngb_inbox = ngb_treefind_fof_primary(pos, LinkL, target, &startnode, mode, nexport, nsend_local, MyFOF_PRIMARY_LINK_TYPES, ngblist);
 
 	  if(numngb_inbox < 0)
 	    return -1;
@@ -674,52 +823,34 @@ int fof_find_dmparticles_evaluate(int target, int mode, int *nexport, int *nsend
 
 	  for(n = 0; n < numngb_inbox; n++)
 	    {
-	      j = Ngblist[n];
-
-	      if(mode == 0 || mode == -1)
-		{
-		  if(Head[target] != Head[j])	/* only if not yet linked */
-		    {
-
-		      if(mode == 0)
-			endrun(87654);
-
-		      if(Len[Head[target]] > Len[Head[j]])	/* p group is longer */
-			{
-			  p = target;
-			  s = j;
-			}
-		      else
-			{
-			  p = j;
-			  s = target;
-			}
-		      Next[Tail[Head[p]]] = Head[s];
-
-		      Tail[Head[p]] = Tail[Head[s]];
+	      j = ngblist[n];
 
-		      Len[Head[p]] += Len[Head[s]];
+	      if(mode == 0)
+		endrun(87654);
 
-		      ss = Head[s];
-		      do
-			Head[ss] = Head[p];
-		      while((ss = Next[ss]) >= 0);
+	      if(mode == -1)
+		fof_union(target, j);
+	      else		/* mode is 1: record the link between the imported group and the local group of j */
+		{
+		  if(Head[j] == last_head)
+		    continue;
+		  last_head = Head[j];
 
-		      if(MinID[Head[s]] < MinID[Head[p]])
+		  if(NFoFLinkPairs >= MaxFoFLinkPairs)
+		    {
+		      NFoFLinkPairs = fof_link_pairs_to_star(FoFLinkPairs, NFoFLinkPairs);
+		      if(NFoFLinkPairs >= MaxFoFLinkPairs)
 			{
-			  MinID[Head[p]] = MinID[Head[s]];
-			  MinIDTask[Head[p]] = MinIDTask[Head[s]];
+			  printf("Task=%d: too many links between groups across domain boundaries (%d)\n", ThisTask, NFoFLinkPairs);
+			  endrun(87655);
 			}
 		    }
-		}
-	      else		/* mode is 1 */
-		{
-		  if(MinID[Head[j]] > FoFDataGet[target].MinID)
-		    {
-		      MinID[Head[j]] = FoFDataGet[target].MinID;
-		      MinIDTask[Head[j]] = FoFDataGet[target].MinIDTask;
-		      links++;
-		    }
+		  FoFLinkPairs[NFoFLinkPairs].a.MinID = FoFDataGet[target].MinID;
+		  FoFLinkPairs[NFoFLinkPairs].a.MinIDTask = FoFDataGet[target].MinIDTask;
+		  FoFLinkPairs[NFoFLinkPairs].b.MinID = MinID[last_head];
+		  FoFLinkPairs[NFoFLinkPairs].b.MinIDTask = MinIDTask[last_head];
+		  NFoFLinkPairs++;
+		  links++;
 		}
 	    }
 	}
@@ -1385,6 +1516,34 @@ void fof_save_groups(int num)
 
 
 
+#ifdef FOF_SUBHALOS
+/* group number of every local particle (-1 if it is in no group); valid after fof_save_groups */
+void fof_get_particle_group_numbers(int *grnr)
+{
+  int i, start, lenloc;
+
+  for(i = 0; i < NumPart; i++)
+    grnr[i] = -1;
+
+  for(i = 0, start = 0; i < NgroupsExt; i++)
+    {
+      while(FOF_PList[start].MinID < FOF_GList[i].MinID)
+	{
+	  start++;
+	  if(start > NumPart)
+	    endrun(78);
+	}
+
+      for(lenloc = 0; start + lenloc < NumPart && FOF_PList[start + lenloc].MinID == FOF_GList[i].MinID; lenloc++)
+	grnr[FOF_PList[start + lenloc].Pindex] = FOF_GList[i].GrNr;
+
+      start += lenloc;
+    }
+}
+#endif
+
+
+
 void fof_save_local_catalogue(int num)
 {
   FILE *fd;
@@ -1999,6 +2158,11 @@ void fof_make_black_holes(void)
 
   All.TotN_gas -= ntot;
 
+  /* the FoF step kept the live tree, but its node softenings (and BH node data) now include particles
+     that changed type: make sure it is rebuilt before the next force computation (ntot is global) */
+  if(ntot > 0)
+    TreeReconstructFlag = 1;
+
   myfree(export_indices);
   myfree(import_indices);
 }
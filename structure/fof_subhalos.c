@@ -0,0 +1,871 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../allvars.h"
+#include "../proto.h"
+#include "../kernel.h"
+
+/*! \file fof_subhalos.c
+ *  \brief in-situ subhalo finder, run on the FoF groups when a group catalogue is written
+ */
+/*
+ * This file was written for GIZMO. When FOF_SUBHALOS is set, every FoF group is split
+ * into gravitationally self-bound subhalos right after the group catalogue is written, in
+ * the spirit of SUBFIND (Springel et al. 2001, MNRAS, 328, 726): the particles of each group
+ * are collected on one task (groups are dealt out round-robin by group number); there, a
+ * SPH-kernel density is estimated from the nearest neighbours, and the particles are added in
+ * order of decreasing density to growing structures. A particle whose two nearest denser
+ * neighbours belong to different structures is a saddle point, at which both structures
+ * are recorded as subhalo candidates before they are joined. The candidates are then
+ * unbound (smallest first, each particle going to the smallest subhalo it is bound to),
+ * and the survivors are written to subhalo_tab files next to the group_tab files.
+ */
+
+#ifdef FOF_SUBHALOS
+#include "fof.h"
+
+#ifndef FOF_SUBHALOS_MIN_LEN
+#define FOF_SUBHALOS_MIN_LEN 20         /* minimum number of bound particles of a subhalo */
+#endif
+#define SUBHALO_DENS_NGB 20             /* neighbours used for the density estimate and the saddle-point search */
+#define SUBHALO_DIRECT_POT_MAX 1000     /* candidates up to this size get a direct-summation potential, larger ones a spherical one */
+#define SUBHALO_KD_LEAF 8               /* maximum number of particles in a leaf of the neighbour-search tree */
+
+
+static struct subhalo_particle
+{
+  MyDouble Pos[3];
+  MyFloat Vel[3];
+  MyFloat Mass;
+  MyFloat U;                    /* specific internal energy (gas only) */
+  MyIDType ID;
+  int GrNr;
+  int Type;
+}
+ *SubP;
+
+static struct subhalo_data
+{
+  int Len;
+  int GrNr;
+  int IdStart;                  /* where the member IDs of this subhalo start in SubIDs */
+  MyIDType IDMostBound;
+  float Mass;
+  float Pos[3];                 /* position of the most bound particle */
+  float CM[3];
+  float Vel[3];                 /* mass-weighted velocity (same units as the group velocity) */
+  float VelDisp;                /* 1D velocity dispersion (physical, including Hubble flow) */
+  float Vmax;                   /* maximum circular velocity (physical) */
+  float VmaxRad;                /* comoving radius of Vmax */
+  float HalfmassRad;            /* comoving radius containing half of the bound mass */
+}
+ *Subhalo;
+
+static MyIDType *SubIDs;
+static int NSubP, Nsubhalos, TotNsubhalos, MaxNsubhalos, NSubIDs;
+static long long TotNSubIDs;
+
+/* the particles of the group currently being processed (a section of SubP) */
+static struct subhalo_particle *GrP;
+
+/* per-group work space: positions relative to the first particle of the group (box-unwrapped),
+    densities, and the structures grown from the density peaks (linked lists with head, tail, and length) */
+static double *Xg, *Dens, *Pot, *Energy, *Rad;
+static int *Order, *Head, *Next, *Tail, *Len, *Work;
+static char *Claimed;
+
+/* tree used for the nearest-neighbour searches within one group */
+static struct subhalo_kdnode
+{
+  double lo[3], hi[3];
+  int start, count;
+  int left, right;              /* children (-1 for a leaf) */
+}
+ *KdNodes;
+static int *KdIndex, NKdNodes;
+
+
+static int subhalo_compare_particle_GrNr(const void *a, const void *b)
+{
+  if(((struct subhalo_particle *) a)->GrNr < ((struct subhalo_particle *) b)->GrNr)
+    return -1;
+  if(((struct subhalo_particle *) a)->GrNr > ((struct subhalo_particle *) b)->GrNr)
+    return +1;
+  if(((struct subhalo_particle *) a)->ID < ((struct subhalo_particle *) b)->ID)
+    return -1;
+  if(((struct subhalo_particle *) a)->ID > ((struct subhalo_particle *) b)->ID)
+    return +1;
+  return 0;
+}
+
+static int subhalo_compare_density(const void *a, const void *b)
+{
+  if(Dens[*(int *) a] > Dens[*(int *) b])
+    return -1;
+  if(Dens[*(int *) a] < Dens[*(int *) b])
+    return +1;
+  return *(int *) a - *(int *) b;
+}
+
+static int subhalo_compare_energy(const void *a, const void *b)
+{
+  if(Energy[*(int *) a] < Energy[*(int *) b])
+    return -1;
+  if(Energy[*(int *) a] > Energy[*(int *) b])
+    return +1;
+  return *(int *) a - *(int *) b;
+}
+
+static int subhalo_compare_radius(const void *a, const void *b)
+{
+  if(Rad[*(int *) a] < Rad[*(int *) b])
+    return -1;
+  if(Rad[*(int *) a] > Rad[*(int *) b])
+    return +1;
+  return 0;
+}
+
+/* candidates are (head, length) pairs: sorted by increasing length */
+static int subhalo_compare_candidate(const void *a, const void *b)
+{
+  if(((int *) a)[1] != ((int *) b)[1])
+    return ((int *) a)[1] - ((int *) b)[1];
+  return ((int *) a)[0] - ((int *) b)[0];
+}
+
+static int subhalo_compare_subhalo_len(const void *a, const void *b)
+{
+  if(((struct subhalo_data *) a)->Len > ((struct subhalo_data *) b)->Len)
+    return -1;
+  if(((struct subhalo_data *) a)->Len < ((struct subhalo_data *) b)->Len)
+    return +1;
+  return ((struct subhalo_data *) a)->IdStart - ((struct subhalo_data *) b)->IdStart;
+}
+
+
+/* partially sorts KdIndex[start..start+count) so that the element of rank 'nth' along 'dim' is in place */
+static void subhalo_kd_select(int start, int count, int nth, int dim)
+{
+  int lo = start, hi = start + count - 1, i, j, tmp;
+  double pivot;
+  nth += start;
+  while(hi > lo)
+    {
+      pivot = Xg[3 * KdIndex[(lo + hi) / 2] + dim];
+      i = lo;
+      j = hi;
+      while(i <= j)
+        {
+          while(Xg[3 * KdIndex[i] + dim] < pivot) i++;
+          while(Xg[3 * KdIndex[j] + dim] > pivot) j--;
+          if(i <= j)
+            {
+              tmp = KdIndex[i];
+              KdIndex[i] = KdIndex[j];
+              KdIndex[j] = tmp;
+              i++;
+              j--;
+            }
+        }
+      if(nth <= j)
+        hi = j;
+      else if(nth >= i)
+        lo = i;
+      else
+        break;
+    }
+}
+
+static int subhalo_kd_build(int start, int count)
+{
+  int no = NKdNodes++, i, k, dim, left;
+  double *x;
+
+  for(k = 0; k < 3; k++)
+    {
+      KdNodes[no].lo[k] = MAX_REAL_NUMBER;
+      KdNodes[no].hi[k] = -MAX_REAL_NUMBER;
+    }
+  for(i = start; i < start + count; i++)
+    for(k = 0, x = &Xg[3 * KdIndex[i]]; k < 3; k++)
+      {
+        if(x[k] < KdNodes[no].lo[k]) KdNodes[no].lo[k] = x[k];
+        if(x[k] > KdNodes[no].hi[k]) KdNodes[no].hi[k] = x[k];
+      }
+  KdNodes[no].start = start;
+  KdNodes[no].count = count;
+  KdNodes[no].left = KdNodes[no].right = -1;
+
+  if(count > SUBHALO_KD_LEAF)
+    {
+      for(k = 1, dim = 0; k < 3; k++)
+        if(KdNodes[no].hi[k] - KdNodes[no].lo[k] > KdNodes[no].hi[dim] - KdNodes[no].lo[dim])
+          dim = k;
+      subhalo_kd_select(start, count, count / 2, dim);
+      left = subhalo_kd_build(start, count / 2);
+      KdNodes[no].left = left;
+      KdNodes[no].right = subhalo_kd_build(start + count / 2, count - count / 2);
+    }
+  return no;
+}
+
+static double subhalo_kd_dist2(int no, double *x)
+{
+  int k;
+  double d, r2 = 0;
+  for(k = 0; k < 3; k++)
+    {
+      if(x[k] < KdNodes[no].lo[k]) d = KdNodes[no].lo[k] - x[k];
+      else if(x[k] > KdNodes[no].hi[k]) d = x[k] - KdNodes[no].hi[k];
+      else d = 0;
+      r2 += d * d;
+    }
+  return r2;
+}
+
+/* finds the (up to) k nearest group members of position x, sorted by increasing distance */
+static int subhalo_knn(double *x, int k, int *ngb, double *r2)
+{
+  int stack[128], nstack = 0, no, n = 0, i, j, p, l, r;
+  double dx, dy, dz, d2;
+
+  stack[nstack++] = 0;
+  while(nstack > 0)
+    {
+      no = stack[--nstack];
+      if(n == k && subhalo_kd_dist2(no, x) >= r2[n - 1])
+        continue;
+      if(KdNodes[no].left < 0)
+        {
+          for(i = KdNodes[no].start; i < KdNodes[no].start + KdNodes[no].count; i++)
+            {
+              p = KdIndex[i];
+              dx = Xg[3 * p] - x[0];
+              dy = Xg[3 * p + 1] - x[1];
+              dz = Xg[3 * p + 2] - x[2];
+              d2 = dx * dx + dy * dy + dz * dz;
+              if(n < k || d2 < r2[n - 1])
+                {
+                  if(n < k) n++;
+                  for(j = n - 1; j > 0 && r2[j - 1] > d2; j--)
+                    {
+                      r2[j] = r2[j - 1];
+                      ngb[j] = ngb[j - 1];
+                    }
+                  r2[j] = d2;
+                  ngb[j] = p;
+                }
+            }
+        }
+      else
+        {
+          l = KdNodes[no].left;
+          r = KdNodes[no].right;
+          if(subhalo_kd_dist2(l, x) < subhalo_kd_dist2(r, x))
+            {
+              stack[nstack++] = r;
+              stack[nstack++] = l;
+            }
+          else
+            {
+              stack[nstack++] = l;
+              stack[nstack++] = r;
+            }
+        }
+    }
+  return n;
+}
+
+
+/* physical velocity of member p relative to the bulk velocity vb, including the Hubble flow relative to member c */
+static void subhalo_rel_velocity(int p, int c, double *vb, double *dv)
+{
+  int k;
+  double hubble_a = 0;
+  if(All.ComovingIntegrationOn)
+    hubble_a = hubble_function(All.Time);
+  for(k = 0; k < 3; k++)
+    dv[k] = (GrP[p].Vel[k] - vb[k]) / All.cf_atime + hubble_a * All.cf_atime * (Xg[3 * p + k] - Xg[3 * c + k]);
+}
+
+
+/* gravitational potential of the members idx[0..n) due to each other only (physical units) */
+static void subhalo_potential(int *idx, int n)
+{
+  int a, b, p, q, c;
+  double fac = All.G / All.cf_atime, dx, dy, dz, r2, h, m_in, m_out;
+
+  for(a = 0; a < n; a++)
+    Pot[idx[a]] = 0;
+
+  if(n <= SUBHALO_DIRECT_POT_MAX)
+    {
+      for(a = 0; a < n; a++)
+        for(b = a + 1, p = idx[a]; b < n; b++)
+          {
+            q = idx[b];
+            dx = Xg[3 * p] - Xg[3 * q];
+            dy = Xg[3 * p + 1] - Xg[3 * q + 1];
+            dz = Xg[3 * p + 2] - Xg[3 * q + 2];
+            h = DMAX(All.ForceSoftening[GrP[p].Type], All.ForceSoftening[GrP[q].Type]) / 2.8;	/* Plummer-equivalent */
+            r2 = 1 / sqrt(dx * dx + dy * dy + dz * dz + h * h);
+            Pot[p] -= GrP[q].Mass * r2;
+            Pot[q] -= GrP[p].Mass * r2;
+          }
+    }
+  else
+    {
+      /* spherical potential about the densest member: M(<r)/r plus the shells outside */
+      for(a = 1, c = idx[0]; a < n; a++)
+        if(Dens[idx[a]] > Dens[c])
+          c = idx[a];
+      for(a = 0; a < n; a++)
+        {
+          p = idx[a];
+          dx = Xg[3 * p] - Xg[3 * c];
+          dy = Xg[3 * p + 1] - Xg[3 * c + 1];
+          dz = Xg[3 * p + 2] - Xg[3 * c + 2];
+          h = All.ForceSoftening[GrP[p].Type] / 2.8;
+          Rad[p] = sqrt(dx * dx + dy * dy + dz * dz + h * h);
+          Work[a] = p;
+        }
+      qsort(Work, n, sizeof(int), subhalo_compare_radius);
+      for(a = n - 1, m_out = 0; a >= 0; a--)
+        {
+          Pot[Work[a]] = -m_out;
+          m_out += GrP[Work[a]].Mass / Rad[Work[a]];
+        }
+      for(a = 0, m_in = 0; a < n; a++)
+        {
+          p = Work[a];
+          m_in += GrP[p].Mass;
+          Pot[p] -= (m_in - GrP[p].Mass) / Rad[p];
+        }
+    }
+
+  for(a = 0; a < n; a++)
+    Pot[idx[a]] *= fac;
+}
+
+
+/* iteratively removes unbound members (at most a quarter per iteration, most unbound first). returns the
+    number of bound members, which are left in idx[] sorted by increasing binding energy, or 0 if too few */
+static int subhalo_unbind(int *idx, int n)
+{
+  int a, k, p, c, nunbound;
+  double vb[3], dv[3], mass;
+
+  while(n >= FOF_SUBHALOS_MIN_LEN)
+    {
+      subhalo_potential(idx, n);
+
+      for(k = 0; k < 3; k++)
+        vb[k] = 0;
+      for(a = 0, mass = 0, c = idx[0]; a < n; a++)
+        {
+          p = idx[a];
+          mass += GrP[p].Mass;
+          for(k = 0; k < 3; k++)
+            vb[k] += GrP[p].Mass * GrP[p].Vel[k];
+          if(Pot[p] < Pot[c])
+            c = p;
+        }
+      for(k = 0; k < 3; k++)
+        vb[k] /= mass;
+
+      for(a = 0, nunbound = 0; a < n; a++)
+        {
+          p = idx[a];
+          subhalo_rel_velocity(p, c, vb, dv);
+          Energy[p] = Pot[p] + 0.5 * (dv[0] * dv[0] + dv[1] * dv[1] + dv[2] * dv[2]) + GrP[p].U;
+          if(Energy[p] > 0)
+            nunbound++;
+        }
+
+      qsort(idx, n, sizeof(int), subhalo_compare_energy);
+
+      if(nunbound == 0)
+        return n;
+
+      n -= IMIN(nunbound, IMAX(n / 4, 1));
+    }
+
+  return 0;
+}
+
+
+static void subhalo_wrap_position(double *pos)
+{
+#ifdef BOX_PERIODIC
+  while(pos[0] >= boxSize_X) pos[0] -= boxSize_X;
+  while(pos[0] < 0) pos[0] += boxSize_X;
+  while(pos[1] >= boxSize_Y) pos[1] -= boxSize_Y;
+  while(pos[1] < 0) pos[1] += boxSize_Y;
+  while(pos[2] >= boxSize_Z) pos[2] -= boxSize_Z;
+  while(pos[2] < 0) pos[2] += boxSize_Z;
+#endif
+}
+
+
+/* computes the properties of the subhalo made of the (bound, energy-sorted) members idx[0..n) of the current group */
+static void subhalo_store(int *idx, int n)
+{
+  int a, k, p, c = idx[0];
+  double mass, m_in, cm[3], vb[3], dv[3], pos[3], disp, vc, dx, dy, dz;
+  struct subhalo_data *s;
+
+  if(Nsubhalos >= MaxNsubhalos)
+    {
+      printf("Task=%d: subhalo catalogue overflow (%d)\n", ThisTask, Nsubhalos);
+      endrun(4381);
+    }
+  s = &Subhalo[Nsubhalos++];
+
+  s->Len = n;
+  s->GrNr = GrP[0].GrNr;
+  s->IdStart = NSubIDs;
+  s->IDMostBound = GrP[c].ID;
+
+  for(k = 0; k < 3; k++)
+    cm[k] = vb[k] = 0;
+  for(a = 0, mass = 0; a < n; a++)
+    {
+      p = idx[a];
+      SubIDs[NSubIDs++] = GrP[p].ID;
+      mass += GrP[p].Mass;
+      for(k = 0; k < 3; k++)
+        {
+          cm[k] += GrP[p].Mass * Xg[3 * p + k];
+          vb[k] += GrP[p].Mass * GrP[p].Vel[k];
+        }
+    }
+  s->Mass = mass;
+  for(k = 0; k < 3; k++)
+    {
+      vb[k] /= mass;
+      s->Vel[k] = vb[k];
+      cm[k] = cm[k] / mass + GrP[0].Pos[k];
+      pos[k] = Xg[3 * c + k] + GrP[0].Pos[k];
+    }
+  subhalo_wrap_position(cm);
+  subhalo_wrap_position(pos);
+  for(k = 0; k < 3; k++)
+    {
+      s->CM[k] = cm[k];
+      s->Pos[k] = pos[k];
+    }
+
+  for(a = 0, disp = 0; a < n; a++)
+    {
+      p = idx[a];
+      subhalo_rel_velocity(p, c, vb, dv);
+      disp += GrP[p].Mass * (dv[0] * dv[0] + dv[1] * dv[1] + dv[2] * dv[2]);
+      dx = Xg[3 * p] - Xg[3 * c];
+      dy = Xg[3 * p + 1] - Xg[3 * c + 1];
+      dz = Xg[3 * p + 2] - Xg[3 * c + 2];
+      Rad[p] = sqrt(dx * dx + dy * dy + dz * dz);
+      Work[a] = p;
+    }
+  s->VelDisp = sqrt(disp / (3 * mass));
+
+  /* circular velocity curve and half-mass radius about the most bound particle */
+  qsort(Work, n, sizeof(int), subhalo_compare_radius);
+  s->Vmax = s->VmaxRad = s->HalfmassRad = 0;
+  for(a = 0, m_in = 0; a < n; a++)
+    {
+      p = Work[a];
+      m_in += GrP[p].Mass;
+      if(m_in >= 0.5 * mass && s->HalfmassRad == 0)
+        s->HalfmassRad = Rad[p];
+      if(Rad[p] > 0)
+        if((vc = sqrt(All.G * m_in / (All.cf_atime * Rad[p]))) > s->Vmax)
+          {
+            s->Vmax = vc;
+            s->VmaxRad = Rad[p];
+          }
+    }
+}
+
+
+/* finds the subhalos of the group made of the particles GrP[first..first+len) */
+static void subhalo_process_group(int first, int len)
+{
+  int i, k, p, rank, n, na, nb, ha, hb, ncand, nngb, *cand, ngb[SUBHALO_DENS_NGB], first_subhalo;
+  double r2[SUBHALO_DENS_NGB], rho, h, hinv, hinv3, hinv4, wk, dwk;
+
+  GrP = SubP + first;
+
+  Xg = (double *) mymalloc("Xg", 3 * len * sizeof(double));
+  Dens = (double *) mymalloc("Dens", len * sizeof(double));
+  Pot = (double *) mymalloc("Pot", len * sizeof(double));
+  Energy = (double *) mymalloc("Energy", len * sizeof(double));
+  Rad = (double *) mymalloc("Rad", len * sizeof(double));
+  Order = (int *) mymalloc("Order", len * sizeof(int));
+  Head = (int *) mymalloc("Head", len * sizeof(int));
+  Next = (int *) mymalloc("Next", len * sizeof(int));
+  Tail = (int *) mymalloc("Tail", len * sizeof(int));
+  Len = (int *) mymalloc("Len", len * sizeof(int));
+  Work = (int *) mymalloc("Work", len * sizeof(int));
+  Claimed = (char *) mymalloc("Claimed", len * sizeof(char));
+  cand = (int *) mymalloc("cand", 2 * (2 * len + 1) * sizeof(int));
+  KdIndex = (int *) mymalloc("KdIndex", len * sizeof(int));
+  KdNodes = (struct subhalo_kdnode *) mymalloc("KdNodes", (len / 2 + 2) * sizeof(struct subhalo_kdnode));
+
+  /* positions relative to the first member, unwrapped across the box boundaries */
+  for(i = 0; i < len; i++)
+    {
+      double dx = GrP[i].Pos[0] - GrP[0].Pos[0], dy = GrP[i].Pos[1] - GrP[0].Pos[1], dz = GrP[i].Pos[2] - GrP[0].Pos[2];
+      NEAREST_XYZ(dx, dy, dz, -1);
+      Xg[3 * i] = dx;
+      Xg[3 * i + 1] = dy;
+      Xg[3 * i + 2] = dz;
+    }
+
+  NKdNodes = 0;
+  for(i = 0; i < len; i++)
+    KdIndex[i] = i;
+  subhalo_kd_build(0, len);
+
+  /* SPH-kernel density, with the kernel length set by the distance to the k-th nearest member */
+  for(i = 0; i < len; i++)
+    {
+      nngb = subhalo_knn(&Xg[3 * i], IMIN(SUBHALO_DENS_NGB, len), ngb, r2);
+      h = sqrt(r2[nngb - 1]);
+      if(h > 0)
+        {
+          kernel_hinv(h, &hinv, &hinv3, &hinv4);
+          for(k = 0, rho = 0; k < nngb; k++)
+            {
+              kernel_main(DMIN(sqrt(r2[k]) * hinv, 1), hinv3, hinv4, &wk, &dwk, -1);
+              rho += GrP[ngb[k]].Mass * wk;
+            }
+          Dens[i] = rho;
+        }
+      else
+        Dens[i] = MAX_REAL_NUMBER;
+      Order[i] = i;
+      Head[i] = -1;
+      Claimed[i] = 0;
+    }
+  qsort(Order, len, sizeof(int), subhalo_compare_density);
+
+  /* grow structures from the density peaks down, recording both sides at every saddle point */
+  for(rank = 0, ncand = 0; rank < len; rank++)
+    {
+      i = Order[rank];
+      nngb = subhalo_knn(&Xg[3 * i], IMIN(SUBHALO_DENS_NGB, len), ngb, r2);
+      for(k = 0, na = nb = -1; k < nngb; k++)
+        if(ngb[k] != i && Head[ngb[k]] >= 0)	/* already added, hence denser */
+          {
+            if(na < 0)
+              na = ngb[k];
+            else
+              {
+                nb = ngb[k];
+                break;
+              }
+          }
+
+      if(na < 0)		/* a new density peak */
+        {
+          Head[i] = Tail[i] = i;
+          Next[i] = -1;
+          Len[i] = 1;
+          continue;
+        }
+
+      ha = Head[na];
+      if(nb >= 0 && (hb = Head[nb]) != ha)	/* saddle point: record both structures, join the smaller to the larger */
+        {
+          if(Len[ha] >= FOF_SUBHALOS_MIN_LEN)
+            {
+              cand[2 * ncand] = ha;
+              cand[2 * ncand++ + 1] = Len[ha];
+            }
+          if(Len[hb] >= FOF_SUBHALOS_MIN_LEN)
+            {
+              cand[2 * ncand] = hb;
+              cand[2 * ncand++ + 1] = Len[hb];
+            }
+          if(Len[hb] > Len[ha])
+            {
+              k = ha;
+              ha = hb;
+              hb = k;
+            }
+          Next[Tail[ha]] = hb;
+          Tail[ha] = Tail[hb];
+          Len[ha] += Len[hb];
+          for(p = hb; p >= 0; p = Next[p])
+            Head[p] = ha;
+        }
+
+      Head[i] = ha;
+      Next[i] = -1;
+      Next[Tail[ha]] = i;
+      Tail[ha] = i;
+      Len[ha]++;
+    }
+
+  /* whatever is left at the end (normally the group itself) is a candidate as well */
+  for(i = 0; i < len; i++)
+    if(Head[i] == i && Len[i] >= FOF_SUBHALOS_MIN_LEN)
+      {
+        cand[2 * ncand] = i;
+        cand[2 * ncand++ + 1] = Len[i];
+      }
+
+  /* unbind the candidates, smallest first: every particle goes to the smallest subhalo it is bound to */
+  qsort(cand, ncand, 2 * sizeof(int), subhalo_compare_candidate);
+  first_subhalo = Nsubhalos;
+  for(k = 0; k < ncand; k++)
+    {
+      if(k > 0 && cand[2 * k] == cand[2 * k - 2] && cand[2 * k + 1] == cand[2 * k - 1])
+        continue;
+      for(i = 0, n = 0, p = cand[2 * k]; i < cand[2 * k + 1]; i++, p = Next[p])
+        if(!Claimed[p])
+          Order[n++] = p;
+      if(n < FOF_SUBHALOS_MIN_LEN)
+        continue;
+      if((n = subhalo_unbind(Order, n)) == 0)
+        continue;
+      for(i = 0; i < n; i++)
+        Claimed[Order[i]] = 1;
+      subhalo_store(Order, n);
+    }
+
+  /* list the subhalos of a group by decreasing size (the main subhalo first) */
+  qsort(&Subhalo[first_subhalo], Nsubhalos - first_subhalo, sizeof(struct subhalo_data), subhalo_compare_subhalo_len);
+
+  myfree(KdNodes);
+  myfree(KdIndex);
+  myfree(cand);
+  myfree(Claimed);
+  myfree(Work);
+  myfree(Len);
+  myfree(Tail);
+  myfree(Next);
+  myfree(Head);
+  myfree(Order);
+  myfree(Rad);
+  myfree(Energy);
+  myfree(Pot);
+  myfree(Dens);
+  myfree(Xg);
+}
+
+
+static void subhalo_save_local_catalogue(int num)
+{
+  FILE *fd;
+  char fname[500];
+  int i, j, k, *ibuf;
+  float *fbuf;
+  MyIDType *ids;
+
+  sprintf(fname, "%s/groups_%03d/%s_%03d.%d", All.OutputDir, num, "subhalo_tab", num, ThisTask);
+  if(!(fd = fopen(fname, "w")))
+    {
+      printf("can't open file `%s`\n", fname);
+      endrun(4382);
+    }
+
+  my_fwrite(&Nsubhalos, sizeof(int), 1, fd);
+  my_fwrite(&TotNsubhalos, sizeof(int), 1, fd);
+  my_fwrite(&NSubIDs, sizeof(int), 1, fd);
+  my_fwrite(&TotNSubIDs, sizeof(long long), 1, fd);
+  my_fwrite(&NTask, sizeof(int), 1, fd);
+
+  ibuf = (int *) mymalloc("ibuf", (Nsubhalos + 1) * sizeof(int));
+  for(i = 0; i < Nsubhalos; i++)
+    ibuf[i] = Subhalo[i].Len;
+  my_fwrite(ibuf, Nsubhalos, sizeof(int), fd);
+  for(i = 0, k = 0; i < Nsubhalos; k += Subhalo[i].Len, i++)
+    ibuf[i] = k;		/* offset into the id-list of this file */
+  my_fwrite(ibuf, Nsubhalos, sizeof(int), fd);
+  for(i = 0; i < Nsubhalos; i++)
+    ibuf[i] = Subhalo[i].GrNr;
+  my_fwrite(ibuf, Nsubhalos, sizeof(int), fd);
+  myfree(ibuf);
+
+  fbuf = (float *) mymalloc("fbuf", 3 * (Nsubhalos + 1) * sizeof(float));
+  for(i = 0; i < Nsubhalos; i++)
+    fbuf[i] = Subhalo[i].Mass;
+  my_fwrite(fbuf, Nsubhalos, sizeof(float), fd);
+  for(i = 0; i < Nsubhalos; i++)
+    for(j = 0; j < 3; j++)
+      fbuf[3 * i + j] = Subhalo[i].Pos[j];
+  my_fwrite(fbuf, Nsubhalos, 3 * sizeof(float), fd);
+  for(i = 0; i < Nsubhalos; i++)
+    for(j = 0; j < 3; j++)
+      fbuf[3 * i + j] = Subhalo[i].CM[j];
+  my_fwrite(fbuf, Nsubhalos, 3 * sizeof(float), fd);
+  for(i = 0; i < Nsubhalos; i++)
+    for(j = 0; j < 3; j++)
+      fbuf[3 * i + j] = Subhalo[i].Vel[j];
+  my_fwrite(fbuf, Nsubhalos, 3 * sizeof(float), fd);
+  for(i = 0; i < Nsubhalos; i++)
+    fbuf[i] = Subhalo[i].VelDisp;
+  my_fwrite(fbuf, Nsubhalos, sizeof(float), fd);
+  for(i = 0; i < Nsubhalos; i++)
+    fbuf[i] = Subhalo[i].Vmax;
+  my_fwrite(fbuf, Nsubhalos, sizeof(float), fd);
+  for(i = 0; i < Nsubhalos; i++)
+    fbuf[i] = Subhalo[i].VmaxRad;
+  my_fwrite(fbuf, Nsubhalos, sizeof(float), fd);
+  for(i = 0; i < Nsubhalos; i++)
+    fbuf[i] = Subhalo[i].HalfmassRad;
+  my_fwrite(fbuf, Nsubhalos, sizeof(float), fd);
+  myfree(fbuf);
+
+  ids = (MyIDType *) mymalloc("ids", (NSubIDs + Nsubhalos + 1) * sizeof(MyIDType));
+  for(i = 0; i < Nsubhalos; i++)
+    ids[i] = Subhalo[i].IDMostBound;
+  my_fwrite(ids, Nsubhalos, sizeof(MyIDType), fd);
+  for(i = 0, k = 0; i < Nsubhalos; i++)	/* member IDs of each subhalo, most bound first */
+    for(j = 0; j < Subhalo[i].Len; j++)
+      ids[k++] = SubIDs[Subhalo[i].IdStart + j];
+  my_fwrite(ids, NSubIDs, sizeof(MyIDType), fd);
+  myfree(ids);
+
+  fclose(fd);
+}
+
+
+/*! finds the subhalos of all FoF groups and writes the subhalo catalogue of output 'num'. to be called
+ *  after fof_save_groups (which assigns the group numbers and creates the output directory).
+ */
+void fof_subhalos(int num)
+{
+  int i, j, ngrp, recvTask, nexport, nimport, start, nprocgroup, masterTask, groupTask, *grnr;
+  struct subhalo_particle *SubPsend;
+  double t0, t1;
+
+  t0 = my_second();
+
+#ifndef IO_REDUCED_MODE
+  if(ThisTask == 0)
+    {
+      printf("\nStart finding subhalos (presently allocated=%g MB)\n", AllocatedBytes / (1024.0 * 1024.0));
+      fflush(stdout);
+    }
+#endif
+
+  grnr = (int *) mymalloc("grnr", NumPart * sizeof(int));
+  fof_get_particle_group_numbers(grnr);
+
+  /* collect the particles of every group on task GrNr % NTask */
+  for(j = 0; j < NTask; j++)
+    Send_count[j] = 0;
+  for(i = 0; i < NumPart; i++)
+    if(grnr[i] >= 0)
+      Send_count[grnr[i] % NTask]++;
+
+  MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+
+  for(j = 0, nimport = 0, nexport = 0, Recv_offset[0] = 0, Send_offset[0] = 0; j < NTask; j++)
+    {
+      nimport += Recv_count[j];
+      nexport += Send_count[j];
+
+      if(j > 0)
+	{
+	  Send_offset[j] = Send_offset[j - 1] + Send_count[j - 1];
+	  Recv_offset[j] = Recv_offset[j - 1] + Recv_count[j - 1];
+	}
+    }
+
+  NSubP = nimport;
+  SubP = (struct subhalo_particle *) mymalloc("SubP", NSubP * sizeof(struct subhalo_particle));
+  SubPsend = (struct subhalo_particle *) mymalloc("SubPsend", nexport * sizeof(struct subhalo_particle));
+
+  for(j = 0; j < NTask; j++)
+    Send_count[j] = 0;
+  for(i = 0; i < NumPart; i++)
+    if(grnr[i] >= 0)
+      {
+        struct subhalo_particle *sp = &SubPsend[Send_offset[grnr[i] % NTask] + Send_count[grnr[i] % NTask]++];
+        for(j = 0; j < 3; j++)
+          {
+            sp->Pos[j] = P[i].Pos[j];
+            sp->Vel[j] = P[i].Vel[j];
+          }
+        sp->Mass = P[i].Mass;
+        sp->U = (P[i].Type == 0) ? SphP[i].InternalEnergy : 0;
+        sp->ID = P[i].ID;
+        sp->GrNr = grnr[i];
+        sp->Type = P[i].Type;
+      }
+
+  for(ngrp = 0; ngrp < (1 << PTask); ngrp++)
+    {
+      recvTask = ThisTask ^ ngrp;
+
+      if(recvTask < NTask)
+	{
+	  if(Send_count[recvTask] > 0 || Recv_count[recvTask] > 0)
+	    {
+	      MPI_Sendrecv(&SubPsend[Send_offset[recvTask]],
+			   Send_count[recvTask] * sizeof(struct subhalo_particle), MPI_BYTE,
+			   recvTask, TAG_FOF_K,
+			   &SubP[Recv_offset[recvTask]],
+			   Recv_count[recvTask] * sizeof(struct subhalo_particle), MPI_BYTE,
+			   recvTask, TAG_FOF_K, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	    }
+	}
+    }
+
+  myfree(SubPsend);
+
+  qsort(SubP, NSubP, sizeof(struct subhalo_particle), subhalo_compare_particle_GrNr);
+
+  /* the subhalos are disjoint and each has at least FOF_SUBHALOS_MIN_LEN members */
+  MaxNsubhalos = NSubP / FOF_SUBHALOS_MIN_LEN + 1;
+  Subhalo = (struct subhalo_data *) mymalloc("Subhalo", MaxNsubhalos * sizeof(struct subhalo_data));
+  SubIDs = (MyIDType *) mymalloc("SubIDs", (NSubP + 1) * sizeof(MyIDType));
+  Nsubhalos = NSubIDs = 0;
+
+  for(start = 0; start < NSubP; start = i)
+    {
+      for(i = start + 1; i < NSubP; i++)
+        if(SubP[i].GrNr != SubP[start].GrNr)
+          break;
+      subhalo_process_group(start, i - start);
+    }
+
+  MPI_Allreduce(&Nsubhalos, &TotNsubhalos, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+  sumup_large_ints(1, &NSubIDs, &TotNSubIDs);
+
+  t1 = my_second();
+
+  if(ThisTask == 0)
+    printf("found %d subhalos with at least %d bound particles (took %g sec)\n", TotNsubhalos, FOF_SUBHALOS_MIN_LEN, timediff(t0, t1));
+
+  nprocgroup = NTask / All.NumFilesWrittenInParallel;
+  if((NTask % All.NumFilesWrittenInParallel))
+    nprocgroup++;
+  masterTask = (ThisTask / nprocgroup) * nprocgroup;
+  for(groupTask = 0; groupTask < nprocgroup; groupTask++)
+    {
+      if(ThisTask == (masterTask + groupTask))	/* ok, it's this processor's turn */
+	subhalo_save_local_catalogue(num);
+      MPI_Barrier(MPI_COMM_WORLD);	/* wait inside the group */
+    }
+
+  myfree(SubIDs);
+  myfree(Subhalo);
+  myfree(SubP);
+  myfree(grnr);
+
+#ifndef IO_REDUCED_MODE
+  if(ThisTask == 0)
+    {
+      printf("Subhalo catalogues saved. took = %g sec\n", timediff(t1, my_second()));
+      fflush(stdout);
+    }
+#endif
+}
+
+#endif
@@ -3,19 +3,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
 #include <gsl/gsl_math.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #include "../allvars.h"
 #include "../proto.h"
+#include "../kernel.h"
 
 /* compute line-of-sight integrated quantities (for e.g. Lyman-alpha forest studies) */
 
 /*
  * This file was originally part of the GADGET3 code developed by
- * Volker Springel (volker.springel@h-its.org). It is here in GIZMO
- * as legacy code at the moment, and needs to be re-written or removed.
+ * Volker Springel (volker.springel@h-its.org). In GIZMO, the sightlines are
+ * processed in batches: the rays of a batch are sorted into spatially-coherent
+ * bundles of up to LOS_BUNDLE rays along the same axis, and every bundle walks the
+ * (local part of the) existing tree once, carrying a bit-mask of the rays which still
+ * intersect the current node (node extent padded by the maximum gas kernel length
+ * hmax). Bundles are independent and are distributed over the threads; the spectra of
+ * a batch are then summed over the tasks with a single reduction.
  */
 
 
@@ -27,7 +34,13 @@
 #define  PIXELS 1
 #endif
 
-#define  N_LOS  10		/* number of lines of sight selected  */
+#ifndef OUTPUT_LINEOFSIGHT_NLOS
+#define OUTPUT_LINEOFSIGHT_NLOS 10
+#endif
+#define  N_LOS  OUTPUT_LINEOFSIGHT_NLOS	/* number of lines of sight selected  */
+#define  LOS_BUNDLE  32		/* maximum number of rays walking the tree together (<=64) */
+#define  LOS_BATCH  256		/* rays whose spectra are held in memory (and reduced) at the same time */
+#define  LOS_STACK  256		/* maximum nesting of node bit-masks during the tree walk */
 
 static double H_a, Wmax;
 
@@ -35,8 +48,11 @@ struct line_of_sight
 {
   int xaxis, yaxis, zaxis;
   double Xpos, Ypos;		/* relative position of line-of-sight on face of box */
-  double BoxSize, Wmax, Time;
+}
+ *Los;
 
+struct line_of_sight_spectrum
+{
   /* total gas density */
   double Rho[PIXELS];
   double Vpec[PIXELS];
@@ -57,7 +73,7 @@ struct line_of_sight
   double TempHeII[PIXELS];
   double TauHeII[PIXELS];
 }
- *Los, *LosGlobal;
+ *LosSpec, *LosSpecGlobal;
 
 
 struct line_of_sight_particles
@@ -71,6 +87,29 @@ struct line_of_sight_particles
 }
  *particles;
 
+static int LosFirst;		/* index of the first ray of the current batch */
+static int Nparticles;		/* number of particles collected for the current ray (particle output) */
+#ifdef OUTPUT_LINEOFSIGHT_SPECTRUM
+static FILE *FdLos;
+#endif
+
+
+#ifdef OUTPUT_LINEOFSIGHT_SPECTRUM
+static int los_compare_rays(const void *a, const void *b)
+{
+  const struct line_of_sight *la = &Los[*(const int *) a], *lb = &Los[*(const int *) b];
+  int ca = (int) (8 * la->Xpos / All.BoxSize), cb = (int) (8 * lb->Xpos / All.BoxSize);
+
+  if(la->zaxis != lb->zaxis)
+    return (la->zaxis < lb->zaxis) ? -1 : +1;
+  if(ca != cb)
+    return (ca < cb) ? -1 : +1;
+  if(la->Ypos != lb->Ypos)
+    return (la->Ypos < lb->Ypos) ? -1 : +1;
+  return (*(const int *) a < *(const int *) b) ? -1 : +1;
+}
+#endif
+
 
 
 void lineofsight_output(void)
@@ -78,6 +117,9 @@ void lineofsight_output(void)
   char buf[500];
   int n, s, next;
   double ti;
+#ifdef OUTPUT_LINEOFSIGHT_SPECTRUM
+  int first, nlos, i, k, nbundle, *order, *bundle_start;
+#endif
 
   next = find_next_lineofsighttime(All.Ti_nextlineofsight);
 
@@ -99,357 +141,419 @@ void lineofsight_output(void)
       mkdir(buf, 02755);
     }
 
-  Los = mymalloc("Los", sizeof(struct line_of_sight));
-  LosGlobal = mymalloc("LosGlobal", sizeof(struct line_of_sight));
+  /* the tree nodes are drifted lazily: bring all of them (in particular their extent and hmax) to the current time */
+  for(n = All.MaxPart; n < All.MaxPart + Numnodestree; n++)
+    if(Nodes[n].Ti_current != All.Ti_Current)
+      force_drift_node(n, All.Ti_Current);
 
-  for(n = 0, s = 0; n < N_LOS; n++)
-    {
+  /* select the sightlines on task 0, so that all tasks use the same ones */
+  Los = (struct line_of_sight *) mymalloc("Los", N_LOS * sizeof(struct line_of_sight));
+  if(ThisTask == 0)
+    for(n = 0, s = 0; n < N_LOS; n++)
+      {
 #ifdef USE_PREGENERATED_RANDOM_NUMBER_TABLE
-      if(s + 3 >= RNDTABLE)
-	{
-	  set_random_numbers();
-	  s = 0;
-	}
+	if(s + 3 >= RNDTABLE)
+	  {
+	    set_random_numbers();
+	    s = 0;
+	  }
 #endif
 
-      Los->zaxis = (int) (3.0 * get_random_number(s++));
-      switch (Los->zaxis)
+	Los[n].zaxis = (int) (3.0 * get_random_number(s++));
+	switch (Los[n].zaxis)
+	  {
+	  case 2:
+	    Los[n].xaxis = 0;
+	    Los[n].yaxis = 1;
+	    break;
+	  case 0:
+	    Los[n].xaxis = 1;
+	    Los[n].yaxis = 2;
+	    break;
+	  case 1:
+	    Los[n].xaxis = 2;
+	    Los[n].yaxis = 0;
+	    break;
+	  }
+
+	Los[n].Xpos = All.BoxSize * get_random_number(s++);
+	Los[n].Ypos = All.BoxSize * get_random_number(s++);
+      }
+  MPI_Bcast(Los, N_LOS * sizeof(struct line_of_sight), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+#ifdef OUTPUT_LINEOFSIGHT_SPECTRUM
+  LosSpec = (struct line_of_sight_spectrum *) mymalloc("LosSpec", LOS_BATCH * sizeof(struct line_of_sight_spectrum));
+  LosSpecGlobal = (struct line_of_sight_spectrum *) mymalloc("LosSpecGlobal", LOS_BATCH * sizeof(struct line_of_sight_spectrum));
+  order = (int *) mymalloc("order", LOS_BATCH * sizeof(int));
+  bundle_start = (int *) mymalloc("bundle_start", (LOS_BATCH + 1) * sizeof(int));
+
+  if(ThisTask == 0)
+    {
+      sprintf(buf, "%s/los/spec_los_z%05.3f.dat", All.OutputDir, 1 / All.Time - 1);
+      if(!(FdLos = fopen(buf, "w")))
 	{
-	case 2:
-	  Los->xaxis = 0;
-	  Los->yaxis = 1;
-	  break;
-	case 0:
-	  Los->xaxis = 1;
-	  Los->yaxis = 2;
-	  break;
-	case 1:
-	  Los->xaxis = 2;
-	  Los->yaxis = 0;
-	  break;
+	  printf("can't open file `%s`\n", buf);
+	  endrun(111);
 	}
+      n = N_LOS;
+      fwrite(&n, sizeof(int), 1, FdLos);
+    }
 
-      Los->Xpos = All.BoxSize * get_random_number(s++);
-      Los->Ypos = All.BoxSize * get_random_number(s++);
+  for(first = 0; first < N_LOS; first += LOS_BATCH)
+    {
+      LosFirst = first;
+      nlos = IMIN(LOS_BATCH, N_LOS - first);
+
+      /* sort the rays of the batch by axis and position, and cut them into bundles along the same axis */
+      for(i = 0; i < nlos; i++)
+	order[i] = first + i;
+      qsort(order, nlos, sizeof(int), los_compare_rays);
+      for(i = 0, nbundle = 0; i < nlos; i++)
+	if(i == 0 || Los[order[i]].zaxis != Los[order[i - 1]].zaxis || i - bundle_start[nbundle - 1] >= LOS_BUNDLE)
+	  bundle_start[nbundle++] = i;
+      bundle_start[nbundle] = nlos;
+
+      memset(LosSpec, 0, nlos * sizeof(struct line_of_sight_spectrum));
+
+#ifdef _OPENMP
+#pragma omp parallel for private(k) schedule(dynamic, 1)
+#endif
+      for(k = 0; k < nbundle; k++)
+	add_along_lines_of_sight(order + bundle_start[k], bundle_start[k + 1] - bundle_start[k], 0);
 
-#ifdef OUTPUT_LINEOFSIGHT_SPECTRUM
-      add_along_lines_of_sight();
-      sum_over_processors_and_normalize();
-      absorb_along_lines_of_sight();
-      output_lines_of_sight(n);
+      sum_over_processors_and_normalize(nlos);
+      absorb_along_lines_of_sight(nlos);
+      output_lines_of_sight(nlos);
+    }
+
+  if(ThisTask == 0)
+    fclose(FdLos);
+
+  myfree(bundle_start);
+  myfree(order);
+  myfree(LosSpecGlobal);
+  myfree(LosSpec);
 #endif
 
 #ifdef OUTPUT_LINEOFSIGHT_PARTICLES
-      find_particles_and_save_them(n);
+  for(n = 0; n < N_LOS; n++)
+    find_particles_and_save_them(n);
 #endif
-    }
 
-  myfree(LosGlobal);
   myfree(Los);
 }
 
 
-void find_particles_and_save_them(int num)
+/*! deposits particle p onto ray r (or, in mode 1, appends it to the particle list);
+ *  dx, dy are its (nearest-image) offsets from the ray in the plane of the sky
+ */
+static void los_add_particle(int r, int p, double dx, double dy, int mode)
 {
-  int n, k, count_local, *countlist, counttot, rep;
-  MyFloat dx, dy, dz, r2;
-  char fname[1000];
-  MPI_Status status;
-  FILE *fd = 0;
+  struct line_of_sight *los = &Los[r];
+  int k;
 
-  countlist = mymalloc("countlist", sizeof(int) * NTask);
-  particles = mymalloc("particles", sizeof(struct line_of_sight_particles) * N_gas);
-
-  for(n = 0, count_local = 0; n < N_gas; n++)
+  if(mode == 1)
     {
-      if(P[n].Type == 0)
-	{
-        dx = P[n].Pos[Los->xaxis] - Los->Xpos;
-        dy = P[n].Pos[Los->yaxis] - Los->Ypos;
-        dz = 0;
-        NEAREST_XYZ(dx,dy,dz,-1);
-
-	  r2 = dx * dx + dy * dy;
-
-	  if(r2 < PPP[n].Hsml * PPP[n].Hsml)
-	    {
-	      for(k = 0; k < 3; k++)
-		particles[count_local].Pos[k] = P[n].Pos[k];
-
-	      particles[count_local].Hsml = PPP[n].Hsml;
-	      particles[count_local].Vz = P[n].Vel[Los->zaxis];
-	      particles[count_local].Utherm = SphP[n].InternalEnergyPred;
-	      particles[count_local].Mass = P[n].Mass;
-	      particles[count_local].Metallicity = P[n].Metallicity[0];
+      for(k = 0; k < 3; k++)
+	particles[Nparticles].Pos[k] = P[p].Pos[k];
+
+      particles[Nparticles].Hsml = PPP[p].Hsml;
+      particles[Nparticles].Vz = SphP[p].VelPred[los->zaxis];
+      particles[Nparticles].Utherm = SphP[p].InternalEnergyPred;
+      particles[Nparticles].Mass = P[p].Mass;
+#ifdef METALS
+      particles[Nparticles].Metallicity = P[p].Metallicity[0];
+#else
+      particles[Nparticles].Metallicity = 0;
+#endif
 
-	      count_local++;
-	    }
-	}
+      Nparticles++;
+      return;
     }
 
-  MPI_Gather(&count_local, 1, MPI_INT, countlist, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-  if(ThisTask == 0)
+#ifdef OUTPUT_LINEOFSIGHT_SPECTRUM
+  struct line_of_sight_spectrum *spec = &LosSpec[r - LosFirst];
+  int bin, iz0, iz1, iz, have_thermo = 0;
+  double r2 = dx * dx + dy * dy, dz, rr, u, wk, dwk, weight, h3inv, z0, z1, d[3];
+  double ne = 0, nh0 = 0, nHeII = 0, utherm, temp = 0;
+
+  z0 = (P[p].Pos[los->zaxis] - PPP[p].Hsml) / All.BoxSize * PIXELS;
+  z1 = (P[p].Pos[los->zaxis] + PPP[p].Hsml) / All.BoxSize * PIXELS;
+  iz0 = (int) z0;
+  iz1 = (int) z1;
+  if(z0 < 0)
+    iz0 -= 1;
+
+  if(PPP[p].Hsml > All.BoxSize)
     {
-      sprintf(fname, "%s/los/part_los_z%05.3f_%03d.dat", All.OutputDir, 1 / All.Time - 1, num);
-
-      if(!(fd = fopen(fname, "w")))
-	{
-	  printf("can't open file `%s`\n", fname);
-	  endrun(112);
-	}
-
-      fwrite(&count_local, sizeof(int), 1, fd);	/* will be overwritten later */
-      fwrite(&LosGlobal->xaxis, sizeof(int), 1, fd);
-      fwrite(&LosGlobal->yaxis, sizeof(int), 1, fd);
-      fwrite(&LosGlobal->zaxis, sizeof(int), 1, fd);
-      fwrite(&LosGlobal->Xpos, sizeof(double), 1, fd);
-      fwrite(&LosGlobal->Ypos, sizeof(double), 1, fd);
-      fwrite(&LosGlobal->BoxSize, sizeof(double), 1, fd);
-      fwrite(&LosGlobal->Wmax, sizeof(double), 1, fd);
-      fwrite(&LosGlobal->Time, sizeof(double), 1, fd);
+      printf("Here:%d  n=%d %g\n", ThisTask, p, PPP[p].Hsml);
+      endrun(89);
     }
 
+  h3inv = 1.0 / (PPP[p].Hsml * PPP[p].Hsml * PPP[p].Hsml);
 
-  for(rep = 0, counttot = 0; rep < NTask; rep++)
+  for(iz = iz0; iz <= iz1; iz++)
     {
-      if(ThisTask != 0 && rep == ThisTask && count_local > 0)
-	MPI_Ssend(particles, sizeof(struct line_of_sight_particles) * count_local, MPI_BYTE, 0,
-		  TAG_PDATA, MPI_COMM_WORLD);
+      d[los->xaxis] = d[los->yaxis] = 0;
+      d[los->zaxis] = (iz + 0.5) / PIXELS * All.BoxSize - P[p].Pos[los->zaxis];
+      NEAREST_XYZ(d[0], d[1], d[2], -1);
+      dz = d[los->zaxis];
+      rr = sqrt(r2 + dz * dz);
 
-      if(ThisTask == 0)
+      if(rr < PPP[p].Hsml)
 	{
-	  if(rep > 0 && countlist[rep] > 0)
-	    MPI_Recv(particles, sizeof(struct line_of_sight_particles) * countlist[rep],
-		     MPI_BYTE, rep, TAG_PDATA, MPI_COMM_WORLD, &status);
+	  u = rr / PPP[p].Hsml;
+	  kernel_main(u, h3inv, 1, &wk, &dwk, -1);
 
-	  fwrite(particles, sizeof(struct line_of_sight_particles), countlist[rep], fd);
+	  bin = iz;
+	  while(bin >= PIXELS)
+	    bin -= PIXELS;
+	  while(bin < 0)
+	    bin += PIXELS;
 
-	  counttot += countlist[rep];
-	}
-    }
+	  if(!have_thermo)
+	    {
+	      double mu_in = 1, nHe0, nHepp, nhp;
+	      ne = SphP[p].Ne;
+	      utherm = DMAX(All.MinEgySpec, SphP[p].InternalEnergyPred);
+	      temp = ThermalProperties(utherm, SphP[p].Density * All.cf_a3inv, p, &mu_in, &ne, &nh0, &nhp, &nHe0, &nHeII, &nHepp);
+	      have_thermo = 1;
+	    }
 
-  if(ThisTask == 0)
-    {
-      fclose(fd);
-      if(!(fd = fopen(fname, "r+")))
-	{
-	  printf("can't open file `%s'\n", fname);
-	  endrun(113);
+	  /* do total gas */
+	  weight = P[p].Mass * wk;
+	  spec->Rho[bin] += weight;
+#ifdef METALS
+	  spec->Metallicity[bin] += P[p].Metallicity[0] * weight;
+#endif
+	  spec->Temp[bin] += temp * weight;
+	  spec->Vpec[bin] += SphP[p].VelPred[los->zaxis] * weight;
+
+	  /* do neutral hydrogen */
+	  weight = nh0 * HYDROGEN_MASSFRAC * P[p].Mass * wk;
+	  spec->RhoHI[bin] += weight;
+	  spec->TempHI[bin] += temp * weight;
+	  spec->VpecHI[bin] += SphP[p].VelPred[los->zaxis] * weight;
+
+	  /* do HeII */
+	  weight = 4 * nHeII * HYDROGEN_MASSFRAC * P[p].Mass * wk;
+	  spec->RhoHeII[bin] += weight;
+	  spec->TempHeII[bin] += temp * weight;
+	  spec->VpecHeII[bin] += SphP[p].VelPred[los->zaxis] * weight;
 	}
-
-      fseek(fd, 0, SEEK_CUR);
-      fwrite(&counttot, sizeof(int), 1, fd);
-      fclose(fd);
     }
-
-  myfree(particles);
-  myfree(countlist);
+#endif
 }
 
 
-
-
-
-
-void add_along_lines_of_sight(void)
+/*! walks the local tree once for the bundle of nrays (<=64) rays rays[0..nrays-1], which must all
+ *  run along the same axis, and adds every gas particle whose kernel intersects a ray to that ray.
+ *  mode 0 deposits onto the spectra, mode 1 collects the particles (see los_add_particle)
+ */
+void add_along_lines_of_sight(int *rays, int nrays, int mode)
 {
-  int n, bin, i, iz0, iz1, iz;
-  double dx, dy, dz, r, r2, ne, nh0, nHeII, utherm, temp, meanWeight;
-  double u, wk, dwk, weight, h3inv;
-  double z0, z1;
+  int no, p, j, nstack = 0, stack_node[LOS_STACK];
+  uint64_t mask, newmask, stack_mask[LOS_STACK];
+  int xaxis = Los[rays[0]].xaxis, yaxis = Los[rays[0]].yaxis;
+  double d[3], dx, dy, h, hsml;
+  struct NODE *current;
 
-  for(i = 0; i < PIXELS; i++)
+  mask = (nrays >= 64) ? ~((uint64_t) 0) : ((((uint64_t) 1) << nrays) - 1);
+  no = All.MaxPart;		/* root node */
+
+  while(no >= 0)
     {
-      Los->Rho[i] = 0;
-      Los->Vpec[i] = 0;
-      Los->Temp[i] = 0;
-      Los->Metallicity[i] = 0;
-
-      Los->RhoHI[i] = 0;
-      Los->NHI[i] = 0;
-      Los->VpecHI[i] = 0;
-      Los->TempHI[i] = 0;
-      Los->TauHI[i] = 0;
-
-      Los->RhoHeII[i] = 0;
-      Los->NHeII[i] = 0;
-      Los->VpecHeII[i] = 0;
-      Los->TempHeII[i] = 0;
-      Los->TauHeII[i] = 0;
-    }
+      /* leaving a branch for which the set of rays was narrowed: restore the set of the enclosing node */
+      while(nstack > 0 && no == stack_node[nstack - 1])
+	mask = stack_mask[--nstack];
 
+      if(no < All.MaxPart)	/* single particle */
+	{
+	  p = no;
+	  no = Nextnode[no];
+
+	  if(P[p].Type != 0 || P[p].Mass <= 0)
+	    continue;
+
+	  hsml = PPP[p].Hsml;
+	  for(j = 0; j < nrays; j++)
+	    if(mask & (((uint64_t) 1) << j))
+	      {
+		d[0] = d[1] = d[2] = 0;
+		d[xaxis] = P[p].Pos[xaxis] - Los[rays[j]].Xpos;
+		d[yaxis] = P[p].Pos[yaxis] - Los[rays[j]].Ypos;
+		NEAREST_XYZ(d[0], d[1], d[2], -1);
+		dx = d[xaxis];
+		dy = d[yaxis];
+		if(dx * dx + dy * dy < hsml * hsml)
+		  los_add_particle(rays[j], p, dx, dy, mode);
+	      }
+	  continue;
+	}
 
-  for(n = 0; n < N_gas; n++)
-    {
-      if(P[n].Type == 0)
+      if(no >= All.MaxPart + MaxNodes)	/* pseudo particle: the rest of this branch lives on another task */
 	{
-        dx = P[n].Pos[Los->xaxis] - Los->Xpos;
-        dy = P[n].Pos[Los->yaxis] - Los->Ypos;
-        dz = 0;
-        NEAREST_XYZ(dx,dy,dz,-1);
+	  no = Nextnode[no - MaxNodes];
+	  continue;
+	}
 
-	  r2 = dx * dx + dy * dy;
+      current = &Nodes[no];
+      h = 0.5 * current->len + Extnodes[no].hmax;
+
+      for(j = 0, newmask = 0; j < nrays; j++)
+	if(mask & (((uint64_t) 1) << j))
+	  {
+	    d[0] = d[1] = d[2] = 0;
+	    d[xaxis] = current->center[xaxis] - Los[rays[j]].Xpos;
+	    d[yaxis] = current->center[yaxis] - Los[rays[j]].Ypos;
+	    NEAREST_XYZ(d[0], d[1], d[2], -1);
+	    if(fabs(d[xaxis]) <= h && fabs(d[yaxis]) <= h)
+	      newmask |= (((uint64_t) 1) << j);
+	  }
+
+      if(!newmask)
+	{
+	  no = current->u.d.sibling;	/* no ray hits this node: skip the branch */
+	  continue;
+	}
 
-	  if(r2 < PPP[n].Hsml * PPP[n].Hsml)
+      if(newmask != mask)
+	{
+	  if(nstack >= LOS_STACK)
 	    {
-	      z0 = (P[n].Pos[Los->zaxis] - PPP[n].Hsml) / All.BoxSize * PIXELS;
-	      z1 = (P[n].Pos[Los->zaxis] + PPP[n].Hsml) / All.BoxSize * PIXELS;
-	      iz0 = (int) z0;
-	      iz1 = (int) z1;
-	      if(z0 < 0)
-		iz0 -= 1;
-
-	      for(iz = iz0; iz <= iz1; iz++)
-		{
-            dx = P[n].Pos[Los->xaxis] - Los->Xpos;
-            dy = P[n].Pos[Los->yaxis] - Los->Ypos;
-            dz = (iz + 0.5) / PIXELS * All.BoxSize - P[n].Pos[Los->zaxis];
-            NEAREST_XYZ(dx,dy,dz,-1);
-		  r = sqrt(r2 + dz * dz);
-
-		  if(PPP[n].Hsml > All.BoxSize)
-		    {
-		      printf("Here:%d  n=%d %g\n", ThisTask, n, PPP[n].Hsml);
-		      endrun(89);
-		    }
-
-		  if(r < PPP[n].Hsml)
-		    {
-		      u = r / PPP[n].Hsml;
-		      h3inv = 1.0 / (PPP[n].Hsml * PPP[n].Hsml * PPP[n].Hsml);
-              kernel_main(u, h3inv, 1, &wk, &dwk, -1);
-                
-		      bin = iz;
-		      while(bin >= PIXELS)
-                  bin -= PIXELS;
-		      while(bin < 0)
-                  bin += PIXELS;
-
-		      ne = SphP[n].Ne;
-                utherm = DMAX(All.MinEgySpec, SphP[i].InternalEnergyPred);
-
-              double mu_in = 1, nHe0, nHepp, nhp;
-              temp = ThermalProperties(utherm, SphP[n].Density * All.cf_a3inv, n, &mu_in, &ne, &nh0, &nhp, &nHe0, &nHeII, &nHepp);
-
-		      /* do total gas */
-		      weight = P[n].Mass * wk;
-		      Los->Rho[bin] += weight;
-		      Los->Metallicity[bin] += P[n].Metallicity[0] * weight;
-		      Los->Temp[bin] += temp * weight;
-		      Los->Vpec[bin] += P[n].Vel[Los->zaxis] * weight;
-
-		      /* do neutral hydrogen */
-		      weight = nh0 * HYDROGEN_MASSFRAC * P[n].Mass * wk;
-		      Los->RhoHI[bin] += weight;
-		      Los->TempHI[bin] += temp * weight;
-		      Los->VpecHI[bin] += P[n].Vel[Los->zaxis] * weight;
-
-		      /* do HeII */
-		      weight = 4 * nHeII * HYDROGEN_MASSFRAC * P[n].Mass * wk;
-		      Los->RhoHeII[bin] += weight;
-		      Los->TempHeII[bin] += temp * weight;
-		      Los->VpecHeII[bin] += P[n].Vel[Los->zaxis] * weight;
-		    }
-		}
+	      printf("task %d: nesting of the line-of-sight tree walk exceeds LOS_STACK=%d\n", ThisTask, LOS_STACK);
+	      endrun(115);
 	    }
+	  stack_node[nstack] = current->u.d.sibling;
+	  stack_mask[nstack++] = mask;
+	  mask = newmask;
 	}
+
+      no = current->u.d.nextnode;	/* open the node */
     }
 }
 
 
-void sum_over_processors_and_normalize(void)
+void find_particles_and_save_them(int num)
 {
-  int bin;
-
-  MPI_Reduce(Los->Rho, LosGlobal->Rho, PIXELS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-  MPI_Reduce(Los->Metallicity, LosGlobal->Metallicity, PIXELS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-  MPI_Reduce(Los->Temp, LosGlobal->Temp, PIXELS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-  MPI_Reduce(Los->Vpec, LosGlobal->Vpec, PIXELS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  int *countlist, counttot, rep;
+  char fname[1000];
+  MPI_Status status;
+  FILE *fd = 0;
 
-  MPI_Reduce(Los->RhoHI, LosGlobal->RhoHI, PIXELS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-  MPI_Reduce(Los->TempHI, LosGlobal->TempHI, PIXELS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-  MPI_Reduce(Los->VpecHI, LosGlobal->VpecHI, PIXELS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  countlist = mymalloc("countlist", sizeof(int) * NTask);
+  particles = mymalloc("particles", sizeof(struct line_of_sight_particles) * IMAX(N_gas, 1));
 
-  MPI_Reduce(Los->RhoHeII, LosGlobal->RhoHeII, PIXELS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-  MPI_Reduce(Los->TempHeII, LosGlobal->TempHeII, PIXELS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-  MPI_Reduce(Los->VpecHeII, LosGlobal->VpecHeII, PIXELS, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  Nparticles = 0;
+  add_along_lines_of_sight(&num, 1, 1);
 
+  MPI_Gather(&Nparticles, 1, MPI_INT, countlist, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
   if(ThisTask == 0)
     {
-      /* normalize results by the weights */
-      for(bin = 0; bin < PIXELS; bin++)
+      sprintf(fname, "%s/los/part_los_z%05.3f_%03d.dat", All.OutputDir, 1 / All.Time - 1, num);
+
+      if(!(fd = fopen(fname, "w")))
 	{
-	  /* total gas density */
-	  LosGlobal->Metallicity[bin] /= LosGlobal->Rho[bin];
-	  LosGlobal->Temp[bin] /= LosGlobal->Rho[bin];
-	  LosGlobal->Vpec[bin] /= (All.Time * LosGlobal->Rho[bin]);
-
-	  /* neutral hydrogen quantities */
-	  LosGlobal->VpecHI[bin] /= LosGlobal->RhoHI[bin];
-	  LosGlobal->TempHI[bin] /= LosGlobal->RhoHI[bin];
-	  LosGlobal->NHI[bin] = LosGlobal->RhoHI[bin] * (All.UnitMass_in_g / PROTONMASS);
-
-	  /* HeII quantities */
-	  LosGlobal->VpecHeII[bin] /= (All.Time * LosGlobal->RhoHeII[bin]);
-	  LosGlobal->TempHeII[bin] /= LosGlobal->RhoHeII[bin];
-	  LosGlobal->NHeII[bin] = LosGlobal->RhoHeII[bin] * (All.UnitMass_in_g / (4 * PROTONMASS));
+	  printf("can't open file `%s`\n", fname);
+	  endrun(112);
 	}
-    }
-}
-
 
+      for(rep = 0, counttot = 0; rep < NTask; rep++)
+	counttot += countlist[rep];
 
-void absorb_along_lines_of_sight(void)
-{
-  double dz, dv, b, fac, fac_HeII;
-  int bin, k;
+      fwrite(&counttot, sizeof(int), 1, fd);
+      fwrite(&Los[num].xaxis, sizeof(int), 1, fd);
+      fwrite(&Los[num].yaxis, sizeof(int), 1, fd);
+      fwrite(&Los[num].zaxis, sizeof(int), 1, fd);
+      fwrite(&Los[num].Xpos, sizeof(double), 1, fd);
+      fwrite(&Los[num].Ypos, sizeof(double), 1, fd);
+      fwrite(&All.BoxSize, sizeof(double), 1, fd);
+      fwrite(&Wmax, sizeof(double), 1, fd);
+      fwrite(&All.Time, sizeof(double), 1, fd);
+    }
 
 
-  if(ThisTask == 0)
+  for(rep = 0; rep < NTask; rep++)
     {
-      dz = All.BoxSize / PIXELS;
+      if(ThisTask != 0 && rep == ThisTask && Nparticles > 0)
+	MPI_Ssend(particles, sizeof(struct line_of_sight_particles) * Nparticles, MPI_BYTE, 0,
+		  TAG_PDATA, MPI_COMM_WORLD);
 
-      for(bin = 0; bin < PIXELS; bin++)
+      if(ThisTask == 0)
 	{
-	  LosGlobal->TauHI[bin] = 0;
-	  LosGlobal->TauHeII[bin] = 0;
-
-	  for(k = 0; k < PIXELS; k++)
-	    {
-	      dv = (k - bin);
+	  if(rep > 0 && countlist[rep] > 0)
+	    MPI_Recv(particles, sizeof(struct line_of_sight_particles) * countlist[rep],
+		     MPI_BYTE, rep, TAG_PDATA, MPI_COMM_WORLD, &status);
 
-	      while(dv < -PIXELS / 2)
-		dv += PIXELS;
-	      while(dv > PIXELS / 2)
-		dv -= PIXELS;
+	  fwrite(particles, sizeof(struct line_of_sight_particles), countlist[rep], fd);
+	}
+    }
 
-	      dv = (dv * Wmax / PIXELS + LosGlobal->VpecHI[k]) * All.UnitVelocity_in_cm_per_s;
+  if(ThisTask == 0)
+    fclose(fd);
 
-	      b = sqrt(2 * BOLTZMANN * LosGlobal->TempHI[k] / PROTONMASS);
+  myfree(particles);
+  myfree(countlist);
+}
 
-	      LosGlobal->TauHI[bin] += LosGlobal->NHI[k] * exp(-dv * dv / (b * b)) / b * dz;
 
+#ifdef OUTPUT_LINEOFSIGHT_SPECTRUM
+void sum_over_processors_and_normalize(int nlos)
+{
+  int bin, r;
+  struct line_of_sight_spectrum *spec;
 
-	      /* now HeII */
-	      dv = (k - bin);
+  /* the spectrum structure holds only doubles, so the whole batch is reduced at once */
+  MPI_Reduce(LosSpec, LosSpecGlobal, nlos * (int) (sizeof(struct line_of_sight_spectrum) / sizeof(double)), MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
 
-	      while(dv < -PIXELS / 2)
-		dv += PIXELS;
-	      while(dv > PIXELS / 2)
-		dv -= PIXELS;
+  if(ThisTask == 0)
+    for(r = 0; r < nlos; r++)
+      {
+	spec = &LosSpecGlobal[r];
+
+	/* normalize results by the weights */
+	for(bin = 0; bin < PIXELS; bin++)
+	  {
+	    /* total gas density */
+	    if(spec->Rho[bin] > 0)
+	      {
+		spec->Metallicity[bin] /= spec->Rho[bin];
+		spec->Temp[bin] /= spec->Rho[bin];
+		spec->Vpec[bin] /= (All.Time * spec->Rho[bin]);
+	      }
+
+	    /* neutral hydrogen quantities */
+	    if(spec->RhoHI[bin] > 0)
+	      {
+		spec->VpecHI[bin] /= (All.Time * spec->RhoHI[bin]);
+		spec->TempHI[bin] /= spec->RhoHI[bin];
+	      }
+	    spec->NHI[bin] = spec->RhoHI[bin] * (All.UnitMass_in_g / PROTONMASS);
+
+	    /* HeII quantities */
+	    if(spec->RhoHeII[bin] > 0)
+	      {
+		spec->VpecHeII[bin] /= (All.Time * spec->RhoHeII[bin]);
+		spec->TempHeII[bin] /= spec->RhoHeII[bin];
+	      }
+	    spec->NHeII[bin] = spec->RhoHeII[bin] * (All.UnitMass_in_g / (4 * PROTONMASS));
+	  }
+      }
+}
 
-	      dv = (dv * Wmax / PIXELS + LosGlobal->VpecHeII[k]) * All.UnitVelocity_in_cm_per_s;
 
-	      b = sqrt(2 * BOLTZMANN * LosGlobal->TempHeII[k] / (4 * PROTONMASS));
 
-	      LosGlobal->TauHeII[bin] += LosGlobal->NHeII[k] * exp(-dv * dv / (b * b)) / b * dz;
-	    }
-	}
+void absorb_along_lines_of_sight(int nlos)
+{
+  double dz, dv, b, fac, fac_HeII;
+  int bin, k, r;
+  struct line_of_sight_spectrum *spec;
 
 
-      /* multiply with correct prefactors */
+  if(ThisTask == 0)
+    {
+      dz = All.BoxSize / PIXELS;
 
       /*  to get things into cgs units */
       fac = 1 / pow(All.UnitLength_in_cm, 2);
@@ -465,66 +569,96 @@ void absorb_along_lines_of_sight(void)
 
       fac_HeII = fac * (OSCILLATOR_STRENGTH_HeII / OSCILLATOR_STRENGTH) * (LYMAN_ALPHA_HeII / LYMAN_ALPHA);
 
-      for(bin = 0; bin < PIXELS; bin++)
+#ifdef _OPENMP
+#pragma omp parallel for private(bin, k, dv, b, spec) schedule(dynamic, 1)
+#endif
+      for(r = 0; r < nlos; r++)
 	{
-	  LosGlobal->TauHI[bin] *= fac;
-	  LosGlobal->TauHeII[bin] *= fac_HeII;
-	}
+	  spec = &LosSpecGlobal[r];
+
+	  for(bin = 0; bin < PIXELS; bin++)
+	    {
+	      spec->TauHI[bin] = 0;
+	      spec->TauHeII[bin] = 0;
+
+	      for(k = 0; k < PIXELS; k++)
+		{
+		  dv = (k - bin);
+
+		  while(dv < -PIXELS / 2)
+		    dv += PIXELS;
+		  while(dv > PIXELS / 2)
+		    dv -= PIXELS;
+
+		  if(spec->NHI[k] > 0)
+		    {
+		      b = sqrt(2 * BOLTZMANN * spec->TempHI[k] / PROTONMASS);
+		      spec->TauHI[bin] += spec->NHI[k] * exp(-pow((dv * Wmax / PIXELS + spec->VpecHI[k]) * All.UnitVelocity_in_cm_per_s / b, 2)) / b * dz;
+		    }
 
-      LosGlobal->BoxSize = All.BoxSize;
-      LosGlobal->Wmax = Wmax;
-      LosGlobal->Time = All.Time;
+		  /* now HeII */
+		  if(spec->NHeII[k] > 0)
+		    {
+		      b = sqrt(2 * BOLTZMANN * spec->TempHeII[k] / (4 * PROTONMASS));
+		      spec->TauHeII[bin] += spec->NHeII[k] * exp(-pow((dv * Wmax / PIXELS + spec->VpecHeII[k]) * All.UnitVelocity_in_cm_per_s / b, 2)) / b * dz;
+		    }
+		}
+
+	      /* multiply with correct prefactors */
+	      spec->TauHI[bin] *= fac;
+	      spec->TauHeII[bin] *= fac_HeII;
+	    }
+	}
     }
 
 }
 
 
 
-void output_lines_of_sight(int num)
+/*! appends the spectra of the current batch to the file opened in lineofsight_output
+ */
+void output_lines_of_sight(int nlos)
 {
-  FILE *fd;
-  int dummy;
-  char fname[400];
+  int dummy, r;
+  struct line_of_sight *los;
+  struct line_of_sight_spectrum *spec;
 
   if(ThisTask != 0)
     return;
 
-  sprintf(fname, "%s/los/spec_los_z%05.3f_%03d.dat", All.OutputDir, 1 / All.Time - 1, num);
-
-  if(!(fd = fopen(fname, "w")))
+  for(r = 0; r < nlos; r++)
     {
-      printf("can't open file `%s`\n", fname);
-      exit(1);
+      los = &Los[LosFirst + r];
+      spec = &LosSpecGlobal[r];
+
+      dummy = PIXELS;
+      fwrite(&dummy, sizeof(int), 1, FdLos);
+      fwrite(&All.BoxSize, sizeof(double), 1, FdLos);
+      fwrite(&Wmax, sizeof(double), 1, FdLos);
+      fwrite(&All.Time, sizeof(double), 1, FdLos);
+      fwrite(&los->Xpos, sizeof(double), 1, FdLos);
+      fwrite(&los->Ypos, sizeof(double), 1, FdLos);
+      fwrite(&los->xaxis, sizeof(int), 1, FdLos);
+      fwrite(&los->yaxis, sizeof(int), 1, FdLos);
+      fwrite(&los->zaxis, sizeof(int), 1, FdLos);
+
+      fwrite(spec->TauHI, sizeof(double), PIXELS, FdLos);
+      fwrite(spec->TempHI, sizeof(double), PIXELS, FdLos);
+      fwrite(spec->VpecHI, sizeof(double), PIXELS, FdLos);
+      fwrite(spec->NHI, sizeof(double), PIXELS, FdLos);
+
+      fwrite(spec->TauHeII, sizeof(double), PIXELS, FdLos);
+      fwrite(spec->TempHeII, sizeof(double), PIXELS, FdLos);
+      fwrite(spec->VpecHeII, sizeof(double), PIXELS, FdLos);
+      fwrite(spec->NHeII, sizeof(double), PIXELS, FdLos);
+
+      fwrite(spec->Rho, sizeof(double), PIXELS, FdLos);
+      fwrite(spec->Vpec, sizeof(double), PIXELS, FdLos);
+      fwrite(spec->Temp, sizeof(double), PIXELS, FdLos);
+      fwrite(spec->Metallicity, sizeof(double), PIXELS, FdLos);
     }
-
-  dummy = PIXELS;
-  fwrite(&dummy, sizeof(int), 1, fd);
-  fwrite(&Los->BoxSize, sizeof(double), 1, fd);
-  fwrite(&Los->Wmax, sizeof(double), 1, fd);
-  fwrite(&Los->Time, sizeof(double), 1, fd);
-  fwrite(&Los->Xpos, sizeof(double), 1, fd);
-  fwrite(&Los->Ypos, sizeof(double), 1, fd);
-  fwrite(&Los->xaxis, sizeof(int), 1, fd);
-  fwrite(&Los->yaxis, sizeof(int), 1, fd);
-  fwrite(&Los->zaxis, sizeof(int), 1, fd);
-
-  fwrite(LosGlobal->TauHI, sizeof(double), PIXELS, fd);
-  fwrite(LosGlobal->TempHI, sizeof(double), PIXELS, fd);
-  fwrite(LosGlobal->VpecHI, sizeof(double), PIXELS, fd);
-  fwrite(LosGlobal->NHI, sizeof(double), PIXELS, fd);
-
-  fwrite(LosGlobal->TauHeII, sizeof(double), PIXELS, fd);
-  fwrite(LosGlobal->TempHeII, sizeof(double), PIXELS, fd);
-  fwrite(LosGlobal->VpecHeII, sizeof(double), PIXELS, fd);
-  fwrite(LosGlobal->NHeII, sizeof(double), PIXELS, fd);
-
-  fwrite(LosGlobal->Rho, sizeof(double), PIXELS, fd);
-  fwrite(LosGlobal->Vpec, sizeof(double), PIXELS, fd);
-  fwrite(LosGlobal->Temp, sizeof(double), PIXELS, fd);
-  fwrite(LosGlobal->Metallicity, sizeof(double), PIXELS, fd);
-
-  fclose(fd);
 }
+#endif
 
 
 integertime find_next_lineofsighttime(integertime time0)
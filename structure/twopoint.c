@@ -3,7 +3,6 @@
 #include <string.h>
 #include <math.h>
 #include <mpi.h>
-#include <gsl/gsl_rng.h>
 
 #include "../allvars.h"
 #include "../proto.h"
@@ -13,8 +12,13 @@
  */
 /*
  * This file was originally part of the GADGET3 code developed by
- * Volker Springel (volker.springel@h-its.org). It is here in GIZMO
- * as legacy code at the moment, and needs to be re-written or removed.
+ * Volker Springel (volker.springel@h-its.org). The sampled sphere-counting estimator
+ * has been replaced for GIZMO by an exact dual-tree pair count: each task builds a
+ * kd-tree over its own particles, and node pairs whose minimum and maximum separation
+ * fall in the same logarithmic bin are counted in one go. Pairs between two tasks are
+ * counted by one of them, after the other has sent it its particle positions. With
+ * OUTPUT_TWOPOINT_MULTIPOLES the redshift-space monopole/quadrupole/hexadecapole
+ * (plane-parallel, line-of-sight along z) are computed in the same pass.
  */
 
 /* Note: This routine will only work correctly for particles of equal mass ! */
@@ -23,37 +27,52 @@
 #ifdef OUTPUT_TWOPOINT_ENABLED
 
 #define BINS_TP  40		/* number of bins used */
-#define ALPHA  -1.0		/* slope used in randomly selecting radii around target particles */
-
-#ifndef FRACTION_TP
-#define FRACTION_TP  0.2
+#define LEAF_TP  16		/* maximum number of particles in a kd-tree leaf */
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+#define MUBINS_TP 20		/* number of bins in mu=|cos(angle to the line-of-sight)| for the redshift-space multipoles */
 #endif
-/* above sets fraction of particles selected for sphere placement. Will be scaled with total particle number so that a fixed value should give roughly the same noise level in the meaurement, indpendent of simulation size */
 
-struct twopointdata_in
+
+struct twopoint_kdnode
 {
-  MyDouble Pos[3];
-  MyFloat Rs;
-  int NodeList[NODELISTLENGTH];
-}
- *TwoPointDataIn, *TwoPointDataGet;
+  double lo[3], hi[3];		/* tight bounding box of the particles in the node */
+  int start, count;		/* particles [start, start+count) of the tree's position array */
+  int left, right;		/* children (-1 for leaves) */
+};
 
+struct twopoint_tree
+{
+  double (*Pos)[3];
+  struct twopoint_kdnode *Nodes;
+  int N, NNodes;
+};
 
-#define SQUARE_IT(x) ((x)*(x))
+struct twopoint_job
+{
+  int a, b, autopair;
+};
 
 
-static long long Count[BINS_TP], Count_bak[BINS_TP];
-static long long CountSpheres[BINS_TP];
+static long long Count[BINS_TP];
 static double Xi[BINS_TP];
 static double Rbin[BINS_TP];
+static double RR[BINS_TP];	/* expected number of pairs in each bin for a uniform distribution */
 
 static double R0, R1;		/* inner and outer radius for correlation function determination */
 
 static double logR0;
 static double binfac;
-static double PartMass;
+static double BoxLen[3];
+
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+static long long CountMu[BINS_TP * MUBINS_TP];
+static double XiMultipole[3][BINS_TP];
+static int RedshiftSpace_Ok;
+#endif
 
-static MyFloat *RsList;
+
+static void twopoint_count_trees(struct twopoint_tree *ta, struct twopoint_tree *tb, int autopair, int rsd, long long *count);
+static void twopoint_build_tree(struct twopoint_tree *t, double (*pos)[3], int n, struct twopoint_kdnode *nodes);
 
 
 
@@ -61,14 +80,17 @@ static MyFloat *RsList;
  */
 void twopoint(void)
 {
-  int i, j, k, bin, n;
-  double p, rs, vol, scaled_frac;
-  int ndone, ndone_flag, dummy, nexport, nimport, place;
-  long long *countbuf;
-  int recvTask, ngrp;
-  double tstart, tend;
-  double mass, masstot;
-  void *state_buffer;
+  int i, j, k, n, nloc, nrem, recvTask, ngrp, compute;
+  double vol, tstart, tend;
+  long long ntot, npairs_tot;
+  double (*pos_loc)[3], (*pos_rem)[3];
+  struct twopoint_kdnode *nodes_loc, *nodes_rem;
+  struct twopoint_tree tree_loc, tree_rem;
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+  double (*rsd_loc)[3], (*rsd_rem)[3], dz_fac = 0, mu, xi_mu, p_l[3];
+  struct twopoint_kdnode *rsd_nodes_loc, *rsd_nodes_rem;
+  struct twopoint_tree rsd_tree_loc, rsd_tree_rem;
+#endif
 
 #ifndef IO_REDUCED_MODE
   if(ThisTask == 0)
@@ -84,207 +106,169 @@ void twopoint(void)
   /* set inner and outer radius for the bins that are used for the correlation function estimate */
   R0 = All.SofteningTable[1];	/* we assume that type=1 is the primary type */
   R1 = All.BoxSize / 2;
-
-
-  scaled_frac = FRACTION_TP * 1.0e7 / All.TotNumPart;
+  if(R0 <= 0 || R0 >= R1)
+    R0 = 1.0e-4 * R1;
 
   logR0 = log(R0);
   binfac = BINS_TP / (log(R1) - log(R0));
 
+#ifdef BOX_PERIODIC
+  BoxLen[0] = boxSize_X;
+  BoxLen[1] = boxSize_Y;
+  BoxLen[2] = boxSize_Z;
+#else
+  BoxLen[0] = BoxLen[1] = BoxLen[2] = All.BoxSize;
+#endif
 
-  for(i = 0, mass = 0; i < NumPart; i++)
-    mass += P[i].Mass;
-
-  MPI_Allreduce(&mass, &masstot, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-  PartMass = masstot / All.TotNumPart;
-
-
-  for(i = 0; i < BINS_TP; i++)
-    {
-      Count[i] = 0;
-      CountSpheres[i] = 0;
-    }
-
-  /* allocate buffers to arrange communication */
-
-  RsList = (MyFloat *) mymalloc("RsList", NumPart * sizeof(MyFloat));
-
-    size_t MyBufferSize = All.BufferSize;
-    All.BunchSize = (int) ((MyBufferSize * 1024 * 1024) / (sizeof(struct data_index) + sizeof(struct data_nodelist) +
-					     2 * sizeof(struct twopointdata_in)));
-    DataIndexTable = (struct data_index *) mymalloc("DataIndexTable", All.BunchSize * sizeof(struct data_index));
-    DataNodeList = (struct data_nodelist *) mymalloc("DataNodeList", All.BunchSize * sizeof(struct data_nodelist));
-
-
-
-
-  state_buffer = mymalloc("state_buffer", gsl_rng_size(random_generator));
-
-  memcpy(state_buffer, gsl_rng_state(random_generator), gsl_rng_size(random_generator));
-
-  gsl_rng_set(random_generator, P[0].ID + ThisTask);	/* seed things with first particle ID to make sure we are
-							   different on each CPU */
-
-
-  i = 0;			/* beginn with this index */
-
-
-  do
-    {
-      for(j = 0; j < NTask; j++)
-	{
-	  Send_count[j] = 0;
-	  Exportflag[j] = -1;
-	}
-
-      /* do local particles and prepare export list */
-
-      for(nexport = 0; i < NumPart; i++)
-	if(gsl_rng_uniform(random_generator) < scaled_frac)
-	  {
-	    p = gsl_rng_uniform(random_generator);
-
-	    rs = pow(pow(R0, ALPHA) + p * (pow(R1, ALPHA) - pow(R0, ALPHA)), 1 / ALPHA);
-
-	    bin = (int) ((log(rs) - logR0) * binfac);
-
-	    rs = exp((bin + 1) / binfac + logR0);
-
-	    RsList[i] = rs;
-
-	    if(twopoint_count_local(i, 0, &nexport, Send_count) < 0)
-	      break;
-
-	    for(j = 0; j <= bin; j++)
-	      CountSpheres[j]++;
-	  }
-
-
-      MYSORT_DATAINDEX(DataIndexTable, nexport, sizeof(struct data_index), data_index_compare);
+  memset(Count, 0, BINS_TP * sizeof(long long));
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+  memset(CountMu, 0, BINS_TP * MUBINS_TP * sizeof(long long));
+  /* comoving redshift-space displacement along z is v_pec,z / (a H(a)), with v_pec = Vel / a */
+  RedshiftSpace_Ok = All.ComovingIntegrationOn;
+  if(RedshiftSpace_Ok)
+    dz_fac = 1 / (All.Time * All.Time * hubble_function(All.Time));
+  else if(ThisTask == 0)
+    printf("two-point: redshift-space multipoles need ComovingIntegrationOn=1; skipping them\n");
+#endif
 
-      MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, MPI_COMM_WORLD);
 
-      for(j = 0, nimport = 0, Recv_offset[0] = 0, Send_offset[0] = 0; j < NTask; j++)
+  /* copy the positions of the local particles and build the local tree */
+  pos_loc = (double (*)[3]) mymalloc("pos_loc", IMAX(NumPart, 1) * sizeof(double[3]));
+  for(i = 0, nloc = 0; i < NumPart; i++)
+    if(P[i].Mass > 0)
+      {
+	for(k = 0; k < 3; k++)
+	  pos_loc[nloc][k] = P[i].Pos[k];
+	nloc++;
+      }
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+  rsd_loc = (double (*)[3]) mymalloc("rsd_loc", IMAX(nloc, 1) * sizeof(double[3]));
+  if(RedshiftSpace_Ok)
+    for(i = 0, n = 0; i < NumPart; i++)
+      if(P[i].Mass > 0)
 	{
-	  nimport += Recv_count[j];
-
-	  if(j > 0)
-	    {
-	      Send_offset[j] = Send_offset[j - 1] + Send_count[j - 1];
-	      Recv_offset[j] = Recv_offset[j - 1] + Recv_count[j - 1];
-	    }
+	  rsd_loc[n][0] = P[i].Pos[0];
+	  rsd_loc[n][1] = P[i].Pos[1];
+	  rsd_loc[n][2] = P[i].Pos[2] + dz_fac * P[i].Vel[2];
+#ifdef BOX_PERIODIC
+	  rsd_loc[n][2] -= BoxLen[2] * floor(rsd_loc[n][2] / BoxLen[2]);
+#endif
+	  n++;
 	}
+#endif
 
-      TwoPointDataGet =
-	(struct twopointdata_in *) mymalloc("TwoPointDataGet", nimport * sizeof(struct twopointdata_in));
-      TwoPointDataIn =
-	(struct twopointdata_in *) mymalloc("TwoPointDataIn", nexport * sizeof(struct twopointdata_in));
-
-      for(j = 0; j < nexport; j++)
-	{
-	  place = DataIndexTable[j].Index;
-
-	  for(k = 0; k < 3; k++)
-	    TwoPointDataIn[j].Pos[k] = P[place].Pos[k];
-
-	  TwoPointDataIn[j].Rs = RsList[place];
-
-	  memcpy(TwoPointDataIn[j].NodeList,
-		 DataNodeList[DataIndexTable[j].IndexGet].NodeList, NODELISTLENGTH * sizeof(int));
+  nodes_loc = (struct twopoint_kdnode *) mymalloc("nodes_loc", (4 * nloc / LEAF_TP + 2) * sizeof(struct twopoint_kdnode));
+  twopoint_build_tree(&tree_loc, pos_loc, nloc, nodes_loc);
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+  rsd_nodes_loc = (struct twopoint_kdnode *) mymalloc("rsd_nodes_loc", (4 * nloc / LEAF_TP + 2) * sizeof(struct twopoint_kdnode));
+  twopoint_build_tree(&rsd_tree_loc, rsd_loc, RedshiftSpace_Ok ? nloc : 0, rsd_nodes_loc);
+#endif
 
-	}
+  /* pairs within this task */
+  twopoint_count_trees(&tree_loc, &tree_loc, 1, 0, Count);
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+  twopoint_count_trees(&rsd_tree_loc, &rsd_tree_loc, 1, 1, CountMu);
+#endif
 
+  /* pairs between two tasks: for every pair of tasks, one of them receives the positions of the
+     other and counts. the lower task counts if the sum of the two is even, so the work is balanced */
+  for(ngrp = 1; ngrp < (1 << PTask); ngrp++)
+    {
+      recvTask = ThisTask ^ ngrp;
 
-      /* exchange particle data */
-      for(ngrp = 1; ngrp < (1 << PTask); ngrp++)
+      if(recvTask < NTask)
 	{
-	  recvTask = ThisTask ^ ngrp;
+	  compute = (ThisTask < recvTask) == (((ThisTask + recvTask) & 1) == 0);
+
+	  MPI_Sendrecv(&nloc, 1, MPI_INT, recvTask, TAG_HYDRO_B,
+		       &nrem, 1, MPI_INT, recvTask, TAG_HYDRO_B, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	  if(!compute)
+	    nrem = 0;
+
+	  pos_rem = (double (*)[3]) mymalloc("pos_rem", IMAX(nrem, 1) * sizeof(double[3]));
+	  MPI_Sendrecv(pos_loc, compute ? 0 : 3 * nloc, MPI_DOUBLE, recvTask, TAG_HYDRO_A,
+		       pos_rem, 3 * nrem, MPI_DOUBLE, recvTask, TAG_HYDRO_A, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+	  rsd_rem = (double (*)[3]) mymalloc("rsd_rem", IMAX(nrem, 1) * sizeof(double[3]));
+	  if(RedshiftSpace_Ok)
+	    MPI_Sendrecv(rsd_loc, compute ? 0 : 3 * nloc, MPI_DOUBLE, recvTask, TAG_HYDRO_A,
+			 rsd_rem, 3 * nrem, MPI_DOUBLE, recvTask, TAG_HYDRO_A, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+#endif
 
-	  if(recvTask < NTask)
-	    {
-	      if(Send_count[recvTask] > 0 || Recv_count[recvTask] > 0)
-		{
-		  /* get the particles */
-		  MPI_Sendrecv(&TwoPointDataIn[Send_offset[recvTask]],
-			       Send_count[recvTask] * sizeof(struct twopointdata_in), MPI_BYTE,
-			       recvTask, TAG_HYDRO_A,
-			       &TwoPointDataGet[Recv_offset[recvTask]],
-			       Recv_count[recvTask] * sizeof(struct twopointdata_in), MPI_BYTE,
-			       recvTask, TAG_HYDRO_A, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-		}
-	    }
+	  /* (the positions received are in the tree order of the sending task, which is harmless) */
+	  nodes_rem = (struct twopoint_kdnode *) mymalloc("nodes_rem", (4 * nrem / LEAF_TP + 2) * sizeof(struct twopoint_kdnode));
+	  twopoint_build_tree(&tree_rem, pos_rem, nrem, nodes_rem);
+	  twopoint_count_trees(&tree_loc, &tree_rem, 0, 0, Count);
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+	  rsd_nodes_rem = (struct twopoint_kdnode *) mymalloc("rsd_nodes_rem", (4 * nrem / LEAF_TP + 2) * sizeof(struct twopoint_kdnode));
+	  twopoint_build_tree(&rsd_tree_rem, rsd_rem, RedshiftSpace_Ok ? nrem : 0, rsd_nodes_rem);
+	  twopoint_count_trees(&rsd_tree_loc, &rsd_tree_rem, 0, 1, CountMu);
+	  myfree(rsd_nodes_rem);
+#endif
+	  myfree(nodes_rem);
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+	  myfree(rsd_rem);
+#endif
+	  myfree(pos_rem);
 	}
-
-      myfree(TwoPointDataIn);
-
-
-      for(j = 0; j < nimport; j++)
-	twopoint_count_local(j, 1, &dummy, &dummy);
-
-      if(i >= NumPart)
-	ndone_flag = 1;
-      else
-	ndone_flag = 0;
-
-      MPI_Allreduce(&ndone_flag, &ndone, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
-
-      myfree(TwoPointDataGet);
     }
-  while(ndone < NTask);
-
-  memcpy(gsl_rng_state(random_generator), state_buffer, gsl_rng_size(random_generator));
-  myfree(state_buffer);
-
-  myfree(DataNodeList);
-  myfree(DataIndexTable);
 
-  myfree(RsList);
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+  myfree(rsd_nodes_loc);
+#endif
+  myfree(nodes_loc);
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+  myfree(rsd_loc);
+#endif
+  myfree(pos_loc);
 
 
   /* Now compute the actual correlation function */
 
-  countbuf = (long long int *) mymalloc("countbuf", NTask * BINS_TP * sizeof(long long));
-
-  MPI_Allgather(Count, BINS_TP * sizeof(long long), MPI_BYTE,
-		countbuf, BINS_TP * sizeof(long long), MPI_BYTE, MPI_COMM_WORLD);
-
-  for(i = 0; i < BINS_TP; i++)
-    {
-      Count[i] = 0;
-      for(n = 0; n < NTask; n++)
-	Count[i] += countbuf[n * BINS_TP + i];
-    }
-
-  MPI_Allgather(CountSpheres, BINS_TP * sizeof(long long), MPI_BYTE,
-		countbuf, BINS_TP * sizeof(long long), MPI_BYTE, MPI_COMM_WORLD);
-
-  for(i = 0; i < BINS_TP; i++)
-    {
-      CountSpheres[i] = 0;
-      for(n = 0; n < NTask; n++)
-	CountSpheres[i] += countbuf[n * BINS_TP + i];
-    }
-
-  myfree(countbuf);
-
+  MPI_Allreduce(MPI_IN_PLACE, Count, BINS_TP, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+  MPI_Allreduce(MPI_IN_PLACE, CountMu, BINS_TP * MUBINS_TP, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+#endif
+  ntot = nloc;
+  MPI_Allreduce(MPI_IN_PLACE, &ntot, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+  npairs_tot = ntot * (ntot - 1) / 2;
 
   for(i = 0; i < BINS_TP; i++)
     {
       vol = 4 * M_PI / 3.0 * (pow(exp((i + 1.0) / binfac + logR0), 3)
 			      - pow(exp((i + 0.0) / binfac + logR0), 3));
 
-      if(CountSpheres[i] > 0)
-	Xi[i] = -1 + Count[i] / ((double) CountSpheres[i]) / (All.TotNumPart / pow(All.BoxSize, 3)) / vol;
+      RR[i] = npairs_tot * vol / (BoxLen[0] * BoxLen[1] * BoxLen[2]);
+
+      if(RR[i] > 0)
+	Xi[i] = -1 + Count[i] / RR[i];
       else
 	Xi[i] = 0;
 
       Rbin[i] = exp((i + 0.5) / binfac + logR0);
+
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+      /* xi_l(s) = (2l+1) * int_0^1 xi(s,mu) P_l(mu) dmu, with uniform randoms in mu */
+      for(n = 0; n < 3; n++)
+	XiMultipole[n][i] = 0;
+      if(RR[i] > 0)
+	for(j = 0; j < MUBINS_TP; j++)
+	  {
+	    mu = (j + 0.5) / MUBINS_TP;
+	    xi_mu = -1 + CountMu[i * MUBINS_TP + j] / (RR[i] / MUBINS_TP);
+	    p_l[0] = 1;
+	    p_l[1] = 0.5 * (3 * mu * mu - 1);
+	    p_l[2] = (35 * mu * mu * mu * mu - 30 * mu * mu + 3) / 8.;
+	    for(n = 0; n < 3; n++)
+	      XiMultipole[n][i] += (4 * n + 1) * xi_mu * p_l[n] / MUBINS_TP;
+	  }
+#endif
     }
 
 #ifndef IO_REDUCED_MODE
   twopoint_save();
 #endif
-    
+
   tend = my_second();
 
 #ifndef IO_REDUCED_MODE
@@ -320,226 +304,353 @@ void twopoint_save(void)
       fprintf(fd, "%d\n", i);
 
       for(i = 0; i < BINS_TP; i++)
-	fprintf(fd, "%g %g %g %g\n", Rbin[i], Xi[i], (double) Count[i], (double) CountSpheres[i]);
+	fprintf(fd, "%g %g %g %g\n", Rbin[i], Xi[i], (double) Count[i], RR[i]);
 
       fclose(fd);
+
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+      if(RedshiftSpace_Ok)
+	{
+	  sprintf(buf, "%s/correl_rsd_%03d.txt", All.OutputDir, RestartSnapNum);
+
+	  if(!(fd = fopen(buf, "w")))
+	    {
+	      printf("can't open file `%s`\n", buf);
+	      endrun(1324);
+	    }
+
+	  fprintf(fd, "%g\n", All.Time);
+	  i = BINS_TP;
+	  fprintf(fd, "%d\n", i);
+
+	  for(i = 0; i < BINS_TP; i++)
+	    fprintf(fd, "%g %g %g %g\n", Rbin[i], XiMultipole[0][i], XiMultipole[1][i], XiMultipole[2][i]);
+
+	  fclose(fd);
+	}
+#endif
     }
 }
 
 
 
 
-/*! This function counts the pairs in a sphere
+/*! bin of a pair separation (squared), -1 if outside [R0,R1)
  */
-int twopoint_count_local(int target, int mode, int *nexport, int *nsend_local)
+static inline int twopoint_bin(double r2)
 {
-  int startnode, listindex = 0;
-  MyDouble *pos;
-  MyFloat rs;
+  int bin;
 
-  if(mode == 0)
-    {
-      pos = P[target].Pos;
-      rs = RsList[target];
-      memcpy(Count_bak, Count, sizeof(long long) * BINS_TP);
-    }
-  else
-    {
-      pos = TwoPointDataGet[target].Pos;
-      rs = TwoPointDataGet[target].Rs;
-    }
+  if(r2 < R0 * R0 || r2 >= R1 * R1)
+    return -1;
 
+  bin = (int) ((0.5 * log(r2) - logR0) * binfac);
 
-  /* Now start the actual tree-walk for this particle */
+  return (bin < BINS_TP) ? bin : BINS_TP - 1;
+}
 
-  if(mode == 0)
-    {
-      startnode = All.MaxPart;	/* root node */
-    }
-  else
+
+/*! range [*dmin,*dmax] of the (nearest-image) distance |d| along one axis, for all d in [a,b]
+ */
+static inline void twopoint_axis_range(double a, double b, double len, double *dmin, double *dmax)
+{
+#ifdef BOX_PERIODIC
+  double fa, fb;
+
+  if(b - a >= len)
     {
-      startnode = TwoPointDataGet[target].NodeList[0];
-      startnode = Nodes[startnode].u.d.nextnode;	/* open it */
+      *dmin = 0;
+      *dmax = 0.5 * len;
+      return;
     }
+  fa = fabs(a - len * floor(a / len + 0.5));
+  fb = fabs(b - len * floor(b / len + 0.5));
+  /* the interval contains a multiple of len -> minimum 0; an odd multiple of len/2 -> maximum len/2 */
+  *dmin = (floor(b / len) * len >= a) ? 0 : DMIN(fa, fb);
+  *dmax = ((floor(b / len - 0.5) + 0.5) * len >= a) ? 0.5 * len : DMAX(fa, fb);
+#else
+  *dmin = (a <= 0 && b >= 0) ? 0 : DMIN(fabs(a), fabs(b));
+  *dmax = DMAX(fabs(a), fabs(b));
+#endif
+}
+
+
+static inline double twopoint_nearest(double d, double len)
+{
+#ifdef BOX_PERIODIC
+  if(d > 0.5 * len)
+    d -= len;
+  else if(d < -0.5 * len)
+    d += len;
+#endif
+  return d;
+}
 
-  while(startnode >= 0)
+
+/*! puts the k-th smallest (along axis dim) of n positions into place k
+ */
+static void twopoint_select(double (*x)[3], int n, int k, int dim)
+{
+  int lo = 0, hi = n - 1, i, j, m;
+  double pivot, tmp[3];
+
+  while(hi > lo)
     {
-      while(startnode >= 0)
+      m = lo + (hi - lo) / 2;
+      pivot = x[m][dim];
+      i = lo;
+      j = hi;
+      while(i <= j)
 	{
-	  if(twopoint_ngb_treefind_variable(pos, rs, target, &startnode, mode, nexport, nsend_local) < 0)
+	  while(x[i][dim] < pivot)
+	    i++;
+	  while(x[j][dim] > pivot)
+	    j--;
+	  if(i <= j)
 	    {
-	      /* in this case restore the count-table */
-	      memcpy(Count, Count_bak, sizeof(long long) * BINS_TP);
-	      return -1;
+	      memcpy(tmp, x[i], sizeof(tmp));
+	      memcpy(x[i], x[j], sizeof(tmp));
+	      memcpy(x[j], tmp, sizeof(tmp));
+	      i++;
+	      j--;
 	    }
 	}
+      if(k <= j)
+	hi = j;
+      else if(k >= i)
+	lo = i;
+      else
+	break;
+    }
+}
 
-      if(mode == 1)
-	{
-	  listindex++;
-	  if(listindex < NODELISTLENGTH)
-	    {
-	      startnode = TwoPointDataGet[target].NodeList[listindex];
-	      if(startnode >= 0)
-		startnode = Nodes[startnode].u.d.nextnode;	/* open it */
-	    }
-	}
+
+static int twopoint_build_node(struct twopoint_tree *t, int start, int count)
+{
+  int no = t->NNodes++, i, k, dim, left = -1, right = -1;
+  double lo[3], hi[3];
+
+  for(k = 0; k < 3; k++)
+    lo[k] = hi[k] = t->Pos[start][k];
+  for(i = start + 1; i < start + count; i++)
+    for(k = 0; k < 3; k++)
+      {
+	lo[k] = DMIN(lo[k], t->Pos[i][k]);
+	hi[k] = DMAX(hi[k], t->Pos[i][k]);
+      }
+
+  if(count > LEAF_TP)
+    {
+      /* median split along the longest axis */
+      for(k = 1, dim = 0; k < 3; k++)
+	if(hi[k] - lo[k] > hi[dim] - lo[dim])
+	  dim = k;
+      twopoint_select(t->Pos + start, count, count / 2, dim);
+      left = twopoint_build_node(t, start, count / 2);
+      right = twopoint_build_node(t, start + count / 2, count - count / 2);
     }
 
-  return 0;
-}
+  for(k = 0; k < 3; k++)
+    {
+      t->Nodes[no].lo[k] = lo[k];
+      t->Nodes[no].hi[k] = hi[k];
+    }
+  t->Nodes[no].start = start;
+  t->Nodes[no].count = count;
+  t->Nodes[no].left = left;
+  t->Nodes[no].right = right;
 
+  return no;
+}
 
 
+/*! builds a kd-tree over n positions (which are re-ordered); 'nodes' must hold 4*n/LEAF_TP+2 entries
+ */
+static void twopoint_build_tree(struct twopoint_tree *t, double (*pos)[3], int n, struct twopoint_kdnode *nodes)
+{
+  t->Pos = pos;
+  t->Nodes = nodes;
+  t->N = n;
+  t->NNodes = 0;
+  if(n > 0)
+    twopoint_build_node(t, 0, n);
+}
 
 
-/*! This function finds all particles within the radius "rsearch", and counts them in the bins used for the two-point correlation function.
- *    this is a custom version of "ngb_treefind_variable", hard-coded for a square box (no shearing!) and variable search threshold radii, 
- *    bin-dumping, etc. as a result, updates to the core neighbor search routine will not alter this subroutine
+/*! adds the pairs between node a of tree ta and node b of tree tb (autopair: a==b in the same tree,
+ *  each pair counted once). for rsd, pairs are binned in (s,mu) and 'count' is a BINS_TP*MUBINS_TP table
  */
-int twopoint_ngb_treefind_variable(MyDouble searchcenter[3], MyFloat rsearch, int target, int *startnode, int mode, int *nexport, int *nsend_local)
+static void twopoint_dualtree(struct twopoint_tree *ta, int a, struct twopoint_tree *tb, int b, int autopair, int rsd, long long *count)
 {
-  double r2, r, ri, ro;
-  int no, p, bin, task, bin2, nexport_save;
-  struct NODE *current;
-  MyDouble dx, dy, dz, dist;
+  struct twopoint_kdnode *na = &ta->Nodes[a], *nb = &tb->Nodes[b];
+  double dmin[3], dmax[3], rmin2 = 0, rmax2 = 0, dx, dy, dz, r2;
+  int i, j, k, bin, bin2;
 
-#ifdef BOX_PERIODIC
-  MyDouble xtmp;
-#endif
+  for(k = 0; k < 3; k++)
+    {
+      twopoint_axis_range(nb->lo[k] - na->hi[k], nb->hi[k] - na->lo[k], BoxLen[k], &dmin[k], &dmax[k]);
+      rmin2 += dmin[k] * dmin[k];
+      rmax2 += dmax[k] * dmax[k];
+    }
+
+  if(rmin2 >= R1 * R1 || rmax2 < R0 * R0)
+    return;
 
-  nexport_save = *nexport;
+  /* accept the whole node pair if all separations fall in the same bin */
+  if((bin = twopoint_bin(rmin2)) >= 0 && rmax2 < R1 * R1)
+    if((bin2 = twopoint_bin(rmax2)) == bin)
+      {
+	long long npairs = autopair ? (long long) na->count * (na->count - 1) / 2 : (long long) na->count * nb->count;
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+	if(rsd)
+	  {
+	    int mubin = (int) (MUBINS_TP * dmin[2] / sqrt(rmax2)), mubin2 = (int) (MUBINS_TP * DMIN(1.0, dmax[2] / sqrt(rmin2)));
+	    mubin = IMIN(mubin, MUBINS_TP - 1);
+	    mubin2 = IMIN(mubin2, MUBINS_TP - 1);
+	    if(mubin == mubin2)
+	      {
+		count[bin * MUBINS_TP + mubin] += npairs;
+		return;
+	      }
+	  }
+	else
+#endif
+	  {
+	    count[bin] += npairs;
+	    return;
+	  }
+      }
 
-  no = *startnode;
+  if(na->left < 0 && nb->left < 0)
+    {
+      /* direct pair count between two leaves */
+      for(i = na->start; i < na->start + na->count; i++)
+	for(j = autopair ? i + 1 : nb->start; j < nb->start + nb->count; j++)
+	  {
+	    dx = twopoint_nearest(tb->Pos[j][0] - ta->Pos[i][0], BoxLen[0]);
+	    dy = twopoint_nearest(tb->Pos[j][1] - ta->Pos[i][1], BoxLen[1]);
+	    dz = twopoint_nearest(tb->Pos[j][2] - ta->Pos[i][2], BoxLen[2]);
+	    r2 = dx * dx + dy * dy + dz * dz;
+	    if((bin = twopoint_bin(r2)) < 0)
+	      continue;
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+	    if(rsd)
+	      {
+		int mubin = (int) (MUBINS_TP * fabs(dz) / sqrt(r2));
+		count[bin * MUBINS_TP + IMIN(mubin, MUBINS_TP - 1)]++;
+		continue;
+	      }
+#endif
+	    count[bin]++;
+	  }
+      return;
+    }
 
-  while(no >= 0)
+  if(autopair)
     {
-      if(no < All.MaxPart)	/* single particle */
-	{
-	  p = no;
-	  no = Nextnode[no];
+      twopoint_dualtree(ta, na->left, tb, na->left, 1, rsd, count);
+      twopoint_dualtree(ta, na->left, tb, na->right, 0, rsd, count);
+      twopoint_dualtree(ta, na->right, tb, na->right, 1, rsd, count);
+    }
+  else if(nb->left < 0 || (na->left >= 0 && na->count >= nb->count))
+    {
+      twopoint_dualtree(ta, na->left, tb, b, 0, rsd, count);
+      twopoint_dualtree(ta, na->right, tb, b, 0, rsd, count);
+    }
+  else
+    {
+      twopoint_dualtree(ta, a, tb, nb->left, 0, rsd, count);
+      twopoint_dualtree(ta, a, tb, nb->right, 0, rsd, count);
+    }
+}
 
-	  dx = NGB_PERIODIC_BOX_LONG_X(P[p].Pos[0] - searchcenter[0], P[p].Pos[1] - searchcenter[1], P[p].Pos[2] - searchcenter[2],-1);
-	  dy = NGB_PERIODIC_BOX_LONG_Y(P[p].Pos[0] - searchcenter[0], P[p].Pos[1] - searchcenter[1], P[p].Pos[2] - searchcenter[2],-1);
-	  dz = NGB_PERIODIC_BOX_LONG_Z(P[p].Pos[0] - searchcenter[0], P[p].Pos[1] - searchcenter[1], P[p].Pos[2] - searchcenter[2],-1);
 
-	  r2 = dx * dx + dy * dy + dz * dz;
+/*! counts all pairs between trees ta and tb (autopair: ta==tb). the root node pair is first split
+ *  into a list of sub-pairs, which are then distributed over the threads
+ */
+static void twopoint_count_trees(struct twopoint_tree *ta, struct twopoint_tree *tb, int autopair, int rsd, long long *count)
+{
+  int i, j, nbins, njobs, njobs_new, maxjobs, expanded;
+  long long *threadcount;
+  struct twopoint_job *jobs, *jobs_new, *job;
+  struct twopoint_kdnode *na, *nb;
+
+  if(ta->N <= 0 || tb->N <= 0)
+    return;
+
+#ifdef OUTPUT_TWOPOINT_MULTIPOLES
+  nbins = rsd ? BINS_TP * MUBINS_TP : BINS_TP;
+#else
+  nbins = BINS_TP;
+#endif
 
-	  if(r2 >= R0 * R0 && r2 < R1 * R1)
-	    {
-	      if(r2 < rsearch * rsearch)
-		{
-		  bin = (int) ((log(sqrt(r2)) - logR0) * binfac);
-		  if(bin < BINS_TP)
-		    Count[bin]++;
-		}
-	    }
-	}
-      else
+  maxjobs = 64 * maxThreads + 3;
+  jobs = (struct twopoint_job *) mymalloc("jobs", maxjobs * sizeof(struct twopoint_job));
+  jobs_new = (struct twopoint_job *) mymalloc("jobs_new", maxjobs * sizeof(struct twopoint_job));
+  jobs[0].a = jobs[0].b = 0;
+  jobs[0].autopair = autopair;
+  njobs = 1;
+
+  do
+    {
+      for(i = 0, njobs_new = 0, expanded = 0; i < njobs; i++)
 	{
-	  if(no >= All.MaxPart + MaxNodes)	/* pseudo particle */
+	  job = &jobs[i];
+	  na = &ta->Nodes[job->a];
+	  nb = &tb->Nodes[job->b];
+	  if(job->autopair && na->left >= 0)
 	    {
-	      if(mode == 1)
-		endrun(123127);
-
-	      if(target >= 0)	/* if no target is given, export will not occur */
-		{
-		  if(Exportflag[task = DomainTask[no - (All.MaxPart + MaxNodes)]] != target)
-		    {
-		      Exportflag[task] = target;
-		      Exportnodecount[task] = NODELISTLENGTH;
-		    }
-
-		  if(Exportnodecount[task] == NODELISTLENGTH)
-		    {
-		      if(*nexport >= All.BunchSize)
-			{
-			  *nexport = nexport_save;
-			  if(nexport_save == 0)
-			    endrun(13004);	/* in this case, the buffer is too small to process even a single particle */
-			  for(task = 0; task < NTask; task++)
-			    nsend_local[task] = 0;
-			  for(no = 0; no < nexport_save; no++)
-			    nsend_local[DataIndexTable[no].Task]++;
-			  return -1;
-			}
-		      Exportnodecount[task] = 0;
-		      Exportindex[task] = *nexport;
-		      DataIndexTable[*nexport].Task = task;
-		      DataIndexTable[*nexport].Index = target;
-		      DataIndexTable[*nexport].IndexGet = *nexport;
-		      *nexport = *nexport + 1;
-		      nsend_local[task]++;
-		    }
-
-		  DataNodeList[Exportindex[task]].NodeList[Exportnodecount[task]++] =
-		    DomainNodeIndex[no - (All.MaxPart + MaxNodes)];
-
-		  if(Exportnodecount[task] < NODELISTLENGTH)
-		    DataNodeList[Exportindex[task]].NodeList[Exportnodecount[task]] = -1;
-		}
-
-	      no = Nextnode[no - MaxNodes];
-	      continue;
+	      jobs_new[njobs_new++] = (struct twopoint_job) {na->left, na->left, 1};
+	      jobs_new[njobs_new++] = (struct twopoint_job) {na->left, na->right, 0};
+	      jobs_new[njobs_new++] = (struct twopoint_job) {na->right, na->right, 1};
+	      expanded = 1;
 	    }
-
-	  current = &Nodes[no];
-
-	  if(mode == 1)
+	  else if(!job->autopair && (na->left >= 0 || nb->left >= 0))
 	    {
-	      if(current->u.d.bitflags & (1 << BITFLAG_TOPLEVEL))	/* we reached a top-level node again, which means that we are done with the branch */
+	      if(nb->left < 0 || (na->left >= 0 && na->count >= nb->count))
 		{
-		  *startnode = -1;
-		  return 0;
+		  jobs_new[njobs_new++] = (struct twopoint_job) {na->left, job->b, 0};
+		  jobs_new[njobs_new++] = (struct twopoint_job) {na->right, job->b, 0};
 		}
-	    }
-
-	  no = current->u.d.sibling;	/* make skipping the branch the default */
-
-	  dist = rsearch + 0.5 * current->len;
-	  dx = NGB_PERIODIC_BOX_LONG_X(current->center[0]-searchcenter[0],current->center[1]-searchcenter[1],current->center[2]-searchcenter[2],-1);
-	  if(dx > dist) continue;
-	  dy = NGB_PERIODIC_BOX_LONG_Y(current->center[0]-searchcenter[0],current->center[1]-searchcenter[1],current->center[2]-searchcenter[2],-1);
-	  if(dy > dist) continue;
-	  dz = NGB_PERIODIC_BOX_LONG_Z(current->center[0]-searchcenter[0],current->center[1]-searchcenter[1],current->center[2]-searchcenter[2],-1);
-	  if(dz > dist) continue;
-	  /* now test against the minimal sphere enclosing everything */
-	  dist += FACT1 * current->len;
-	  if((r2 = dx * dx + dy * dy + dz * dz) > dist * dist) continue;
-
-	  r = sqrt(r2);
-
-	  ri = r - FACT2 * current->len;
-	  ro = r + FACT2 * current->len;
-
-	  if(ri >= R0 && ro < R1)
-	    {
-	      if(ro < rsearch)
+	      else
 		{
-		  bin = (int) ((log(ri) - logR0) * binfac);
-		  bin2 = (int) ((log(ro) - logR0) * binfac);
-		  if(bin == bin2)
-		    {
-		      if(mode == 1)
-			{
-			  if((current->u.d.bitflags & (1 << BITFLAG_TOPLEVEL)))
-			    continue;
-			}
-		      Count[bin] += (long long)(current->u.d.mass / PartMass);
-		      continue;
-		    }
+		  jobs_new[njobs_new++] = (struct twopoint_job) {job->a, nb->left, 0};
+		  jobs_new[njobs_new++] = (struct twopoint_job) {job->a, nb->right, 0};
 		}
+	      expanded = 1;
 	    }
-
-	  no = current->u.d.nextnode;	/* ok, we need to open the node */
+	  else
+	    jobs_new[njobs_new++] = *job;
 	}
+      memcpy(jobs, jobs_new, njobs_new * sizeof(struct twopoint_job));
+      njobs = njobs_new;
     }
+  while(expanded && njobs < 16 * maxThreads && 3 * njobs <= maxjobs);
 
-  *startnode = -1;
-  return 0;
-}
+  threadcount = (long long *) mymalloc("threadcount", maxThreads * nbins * sizeof(long long));
+  memset(threadcount, 0, maxThreads * nbins * sizeof(long long));
 
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for(i = 0; i < njobs; i++)
+    {
+#ifdef _OPENMP
+      int thread = omp_get_thread_num();
+#else
+      int thread = 0;
+#endif
+      twopoint_dualtree(ta, jobs[i].a, tb, jobs[i].b, jobs[i].autopair, rsd, threadcount + thread * nbins);
+    }
+
+  for(i = 0; i < maxThreads; i++)
+    for(j = 0; j < nbins; j++)
+      count[j] += threadcount[i * nbins + j];
 
+  myfree(threadcount);
+  myfree(jobs_new);
+  myfree(jobs);
+}
 
 
 #endif
@@ -0,0 +1,214 @@
+/** \file
+    Asynchronous (background) writing of snapshot and restart files.
+*/
+/*
+ * This file was written for GIZMO. When IO_ASYNC_OUTPUT is set, snapshot and
+ * restart files are not written to disk directly: each writing task instead
+ * stages the complete file image in memory (an in-memory stream for the binary
+ * formats and restart files, an in-memory 'core' file for HDF5), and hands it to
+ * a dedicated I/O thread which drains it to disk while the main loop continues
+ * to integrate. The thread performs no MPI or HDF5 calls, only plain file I/O.
+ * A fence (io_async_fence) blocks until all staged files are on disk: this is
+ * called before the next snapshot or restart write, and at the end of the run.
+ */
+
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../allvars.h"
+#include "../proto.h"
+
+#ifdef IO_ASYNC_OUTPUT
+
+struct io_async_file
+{
+    char fname[500];
+    char *data;
+    size_t nbytes;
+    struct io_async_file *next;
+};
+
+static struct io_async_file *io_async_queue_first = NULL, *io_async_queue_last = NULL;
+static int io_async_thread_started = 0, io_async_pending = 0, io_async_errors = 0;
+static char io_async_error_fname[500];
+static pthread_t io_async_thread;
+static pthread_mutex_t io_async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_async_cond_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_async_cond_done = PTHREAD_COND_INITIALIZER;
+
+/* staging stream currently open on this task (only one file is staged at a time) */
+static FILE *io_async_stream = NULL;
+static char *io_async_stream_data = NULL;
+static size_t io_async_stream_size = 0;
+static char io_async_stream_fname[500];
+
+
+/* background thread: pops staged file images off the queue and writes them to disk */
+static void *io_async_writer(void *arg)
+{
+    struct io_async_file *f;
+    FILE *fd;
+    size_t nwritten;
+    while(1)
+    {
+        pthread_mutex_lock(&io_async_mutex);
+        while(!io_async_queue_first) {pthread_cond_wait(&io_async_cond_work, &io_async_mutex);}
+        f = io_async_queue_first;
+        io_async_queue_first = f->next;
+        if(!io_async_queue_first) {io_async_queue_last = NULL;}
+        pthread_mutex_unlock(&io_async_mutex);
+
+        nwritten = 0;
+        if((fd = fopen(f->fname, "w")))
+        {
+            if(f->nbytes > 0) {nwritten = fwrite(f->data, 1, f->nbytes, fd);}
+            if(fclose(fd) != 0) {nwritten = 0;}
+        }
+
+        pthread_mutex_lock(&io_async_mutex);
+        if(nwritten != f->nbytes || !fd) {io_async_errors++; strncpy(io_async_error_fname, f->fname, 499);}
+        io_async_pending--;
+        pthread_cond_broadcast(&io_async_cond_done);
+        pthread_mutex_unlock(&io_async_mutex);
+
+        free(f->data);
+        free(f);
+    }
+    return NULL;
+}
+
+
+/* hand over a complete file image (allocated with malloc: ownership passes to the I/O thread) */
+void io_async_submit(char *fname, char *data, size_t nbytes)
+{
+    struct io_async_file *f;
+    if(!(f = (struct io_async_file *) malloc(sizeof(struct io_async_file))))
+    {
+        printf("task %d: failed to allocate memory for asynchronous output queue entry\n", ThisTask);
+        endrun(3471);
+    }
+    strncpy(f->fname, fname, 499); f->fname[499] = 0;
+    f->data = data;
+    f->nbytes = nbytes;
+    f->next = NULL;
+
+    pthread_mutex_lock(&io_async_mutex);
+    if(!io_async_thread_started)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if(pthread_create(&io_async_thread, &attr, io_async_writer, NULL) != 0)
+        {
+            printf("task %d: failed to start asynchronous I/O thread\n", ThisTask);
+            endrun(3472);
+        }
+        pthread_attr_destroy(&attr);
+        io_async_thread_started = 1;
+    }
+    if(io_async_queue_last) {io_async_queue_last->next = f;} else {io_async_queue_first = f;}
+    io_async_queue_last = f;
+    io_async_pending++;
+    pthread_cond_signal(&io_async_cond_work);
+    pthread_mutex_unlock(&io_async_mutex);
+}
+
+
+/* opens an in-memory staging stream standing in for the file 'fname'; the contents are
+    queued for the I/O thread when the stream is closed with io_async_fclose */
+FILE *io_async_fopen(char *fname)
+{
+    if(io_async_stream)
+    {
+        printf("task %d: asynchronous output stream for '%s' is still open while opening '%s'\n", ThisTask, io_async_stream_fname, fname);
+        endrun(3473);
+    }
+    strncpy(io_async_stream_fname, fname, 499); io_async_stream_fname[499] = 0;
+    io_async_stream_data = NULL; io_async_stream_size = 0;
+    io_async_stream = open_memstream(&io_async_stream_data, &io_async_stream_size);
+    return io_async_stream;
+}
+
+
+void io_async_fclose(FILE *fd)
+{
+    if(fd != io_async_stream || !fd)
+    {
+        printf("task %d: io_async_fclose called for a stream which is not the open staging stream\n", ThisTask);
+        endrun(3474);
+    }
+    fclose(fd); /* finalizes io_async_stream_data and io_async_stream_size */
+    io_async_submit(io_async_stream_fname, io_async_stream_data, io_async_stream_size);
+    io_async_stream = NULL; io_async_stream_data = NULL; io_async_stream_size = 0;
+}
+
+
+/* waits (locally) until the I/O thread has drained the queue; returns the number of failed files */
+static int io_async_wait(void)
+{
+    int nerr;
+    pthread_mutex_lock(&io_async_mutex);
+    while(io_async_pending > 0) {pthread_cond_wait(&io_async_cond_done, &io_async_mutex);}
+    nerr = io_async_errors;
+    if(io_async_errors) {printf("task %d: asynchronous writing of file '%s' failed (%d failed files)\n", ThisTask, io_async_error_fname, io_async_errors);}
+    io_async_errors = 0;
+    pthread_mutex_unlock(&io_async_mutex);
+    return nerr;
+}
+
+
+/* blocks until all staged files on this task are on disk, then synchronizes all tasks (so
+    e.g. files are complete everywhere before restart files are rotated). collective. */
+void io_async_fence(void)
+{
+    int nerr_local, nerr_all;
+    double t0 = my_second(), dt;
+    nerr_local = io_async_wait();
+    dt = my_second() - t0;
+    MPI_Allreduce(&nerr_local, &nerr_all, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if(nerr_all > 0) {endrun(3475);}
+    MPI_Allreduce(MPI_IN_PLACE, &dt, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    if(ThisTask == 0 && dt > 1.0) {printf("waited %g sec for background output to complete\n", dt);}
+}
+
+
+/* non-collective version of the fence, for use at shutdown (called from endrun) */
+void io_async_finalize(void)
+{
+    if(io_async_thread_started) {io_async_wait();}
+}
+
+
+#ifdef HAVE_HDF5
+/* creates an HDF5 file held entirely in memory (core driver without backing store), standing in for 'fname' */
+hid_t io_async_hdf5_fcreate(char *fname)
+{
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS), handle;
+    H5Pset_fapl_core(fapl, (size_t) 64 * 1024 * 1024, 0);
+    handle = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    H5Pclose(fapl);
+    return handle;
+}
+
+
+/* copies the in-memory image of the HDF5 file out, closes it, and queues the image for the I/O thread */
+void io_async_hdf5_fclose(hid_t handle, char *fname)
+{
+    ssize_t nbytes;
+    char *image;
+    H5Fflush(handle, H5F_SCOPE_LOCAL);
+    nbytes = H5Fget_file_image(handle, NULL, 0);
+    if(nbytes < 0 || !(image = (char *) malloc(nbytes > 0 ? (size_t) nbytes : 1)))
+    {
+        printf("task %d: failed to obtain/allocate memory image (%g MB) of HDF5 file '%s'\n", ThisTask, nbytes / (1024.0 * 1024.0), fname);
+        endrun(3476);
+    }
+    H5Fget_file_image(handle, image, (size_t) nbytes);
+    H5Fclose(handle);
+    io_async_submit(fname, image, (size_t) nbytes);
+}
+#endif
+
+#endif
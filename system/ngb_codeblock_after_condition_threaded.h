@@ -47,6 +47,9 @@ else
             {
                 exportflag[task] = target;
                 exportnodecount[task] = NODELISTLENGTH;
+#ifdef HYDRO_REUSE_GRADIENT_NGBLIST
+                if(HydroNgbCache_Num && target < N_gas) {HydroNgbCache_Num[target] = -2;} /* search is not local, so the list can't be re-used */
+#endif
             }
             
             if(exportnodecount[task] == NODELISTLENGTH)
@@ -43,6 +43,9 @@ void endrun(int ierr)
         exit(0);
     }
     
+#ifdef IO_ASYNC_OUTPUT
+    io_async_finalize(); /* make sure the background I/O thread has written everything before we exit */
+#endif
     MPI_Finalize();
     exit(0);
 }
@@ -57,6 +57,7 @@
 #define TAG_FOF_H         54
 #define TAG_FOF_I         55
 #define TAG_FOF_J         56
+#define TAG_FOF_K         68
 
 #define TAG_SWAP          57
 #define TAG_PM_FOLD       58
@@ -1066,6 +1066,11 @@ void process_wake_ups(void)
     }
     n = 0;
     
+    /* inactive particles are otherwise only touched (and drifted) when they are found as neighbors or their tree nodes are
+        opened, so don't sweep over all local particles on small steps unless some particle was flagged since the last sweep
+        which found no flags (flags which can't be acted on yet stay pending, and keep the sweep going) */
+    int n_pending = 0;
+    if(WakeupFlagsPending)
     for(i = 0; i < NumPart; i++)
     {
 #if !defined(ADAPTIVE_GRAVSOFT_FORALL)
@@ -1078,6 +1083,7 @@ void process_wake_ups(void)
         if(!PPPZ[i].wakeup)
             continue;
         
+        n_pending++;
         binold = P[i].TimeBin;
         if(TimeBinActive[binold])
             continue;
@@ -1127,7 +1133,12 @@ void process_wake_ups(void)
             P[i].TimeBin = bin;
             
             if(TimeBinActive[bin])
+            {
                 NumForceUpdate++;
+                /* the particle is now in an active bin, so it belongs to the active set (e.g. for the kick that follows) */
+                NextActiveParticle[i] = FirstActiveParticle; FirstActiveParticle = i;
+                ActiveParticleList[NumActiveParticle++] = i;
+            }
                         
             n++;
 
@@ -1144,6 +1155,7 @@ void process_wake_ups(void)
             
         }
     }
+    WakeupFlagsPending = (n_pending > 0);
     
     sumup_large_ints(1, &n, &ntot);
     if(ThisTask == 0)
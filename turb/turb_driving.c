@@ -324,58 +324,101 @@ void set_turb_ampl(void)
 
 
 
+/* every driving mode lies on the box lattice, k = 2pi (ikx/Lx, iky/Ly, ikz/Lz), so exp(i k.x) factorizes into
+   exp(i 2pi ikx x/Lx) * exp(i 2pi iky y/Ly) * exp(i 2pi ikz z/Lz). Per particle we build the three 1D tables of
+   exp(i 2pi n x/L), n=0..ikmax, by complex recurrence (re-seeded with an exact sincos every ST_RESEED steps to
+   bound the round-off), after which each mode costs two complex products instead of a cos() and a sin() */
+#define ST_RESEED 16
+
 void add_turb_accel()
 {
-    int i, j, m;
-    double acc[3];
+    int i, j, m, n, ikmax = 0, *ik;
+    double *table;
     
     set_turb_ampl();
     
-    for(i = FirstActiveParticle; i >= 0; i = NextActiveParticle[i])
+    /* lattice indices of the modes (recovered from StMode, which is what the restart files carry) */
+    ik = (int *) mymalloc("ik", 3 * StNModes * sizeof(int));
+    double boxlen[3] = {boxSize_X, boxSize_Y, boxSize_Z};
+    for(m = 0; m < StNModes; m++)
+        for(j = 0; j < 3; j++)
+        {
+            ik[3*m+j] = (int) floor(StMode[3*m+j] * boxlen[j] / (2.*M_PI) + 0.5);
+            if(abs(ik[3*m+j]) > ikmax) {ikmax = abs(ik[3*m+j]);}
+        }
+    
+    /* one set of tables (3 axes x (ikmax+1) complex numbers) per thread */
+    table = (double *) mymalloc("table", maxThreads * 6 * (ikmax + 1) * sizeof(double));
+    
+#ifdef _OPENMP
+#pragma omp parallel for private(i, j, m) schedule(static)
+#endif
+    for(n = 0; n < NumActiveParticle; n++)
     {
-        if(P[i].Type == 0)
+        i = ActiveParticleList[n];
+        if(P[i].Type != 0) continue;
+        
+        if(P[i].Mass <= 0.)
         {
-            double fx = 0;
-            double fy = 0;
-            double fz = 0;
-            
-            for(m = 0;m<StNModes;m++) //calc force
+            SphP[i].TurbAccel[0]=SphP[i].TurbAccel[1]=SphP[i].TurbAccel[2]=0;
+            continue;
+        }
+        
+#ifdef _OPENMP
+        double *tab = table + omp_get_thread_num() * 6 * (ikmax + 1);
+#else
+        double *tab = table;
+#endif
+        for(j = 0; j < 3; j++)
+        {
+            double *e = tab + 2 * (ikmax + 1) * j, theta = 2.*M_PI * P[i].Pos[j] / boxlen[j];
+            double c1 = cos(theta), s1 = sin(theta);
+            e[0] = 1; e[1] = 0;
+            for(m = 1; m <= ikmax; m++)
             {
-                double kxx = StMode[3*m+0]*P[i].Pos[0];
-                double kyy = StMode[3*m+1]*P[i].Pos[1];
-                double kzz = StMode[3*m+2]*P[i].Pos[2];
-                double kdotx = kxx+kyy+kzz;
-                double ampl = StAmpl[m];
-                
-                double realt = cos(kdotx);
-                double imagt = sin(kdotx);
-                
-                fx += ampl*(StAka[3*m+0]*realt - StAkb[3*m+0]*imagt);
-                fy += ampl*(StAka[3*m+1]*realt - StAkb[3*m+1]*imagt);
-                fz += ampl*(StAka[3*m+2]*realt - StAkb[3*m+2]*imagt);
+                if(m % ST_RESEED == 0)
+                {
+                    e[2*m] = cos(m * theta); e[2*m+1] = sin(m * theta);
+                } else {
+                    e[2*m] = e[2*m-2] * c1 - e[2*m-1] * s1;
+                    e[2*m+1] = e[2*m-2] * s1 + e[2*m-1] * c1;
+                }
             }
+        }
+        
+        double fx = 0;
+        double fy = 0;
+        double fz = 0;
+        
+        for(m = 0;m<StNModes;m++) //calc force
+        {
+            double *ex = tab + 2 * ik[3*m+0];
+            double *ey = tab + 2 * (ikmax + 1) + 2 * abs(ik[3*m+1]);
+            double *ez = tab + 4 * (ikmax + 1) + 2 * abs(ik[3*m+2]);
+            double eyi = (ik[3*m+1] < 0) ? -ey[1] : ey[1]; /* exp(-i a) is the conjugate of exp(i a) */
+            double ezi = (ik[3*m+2] < 0) ? -ez[1] : ez[1];
+            double ampl = StAmpl[m];
             
-            fx *= 2.*All.StAmplFac*StSolWeightNorm;
-            fy *= 2.*All.StAmplFac*StSolWeightNorm;
-            fz *= 2.*All.StAmplFac*StSolWeightNorm;
+            double re = ex[0] * ey[0] - ex[1] * eyi;
+            double im = ex[0] * eyi + ex[1] * ey[0];
+            double realt = re * ez[0] - im * ezi;
+            double imagt = re * ezi + im * ez[0];
             
-            if(P[i].Mass > 0.)
-            {
-                acc[0] = fx;
-                acc[1] = fy;
-                acc[2] = 0;
+            fx += ampl*(StAka[3*m+0]*realt - StAkb[3*m+0]*imagt);
+            fy += ampl*(StAka[3*m+1]*realt - StAkb[3*m+1]*imagt);
+            fz += ampl*(StAka[3*m+2]*realt - StAkb[3*m+2]*imagt);
+        }
+        
+        SphP[i].TurbAccel[0] = fx * 2.*All.StAmplFac*StSolWeightNorm;
+        SphP[i].TurbAccel[1] = fy * 2.*All.StAmplFac*StSolWeightNorm;
+        SphP[i].TurbAccel[2] = 0;
 #if (NUMDIMS > 2)
-                acc[2] = fz;
+        SphP[i].TurbAccel[2] = fz * 2.*All.StAmplFac*StSolWeightNorm;
 #endif
-                for(j = 0; j < 3; j++)
-                {
-                    SphP[i].TurbAccel[j] = acc[j];
-                }
-            } else {
-                SphP[i].TurbAccel[0]=SphP[i].TurbAccel[1]=SphP[i].TurbAccel[2]=0;
-            }
-        }
     }
+    
+    myfree(table);
+    myfree(ik);
 #ifndef IO_REDUCED_MODE
     if(ThisTask == 0)
     {